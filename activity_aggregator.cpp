@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "activity_aggregator.h"
+#include "pprof_writer.h"
+#include "smprofiler_config.h"
+
+struct ActivityStats {
+  uint64_t count;
+  uint64_t total_ns;
+};
+
+static bool enabled = false;
+static std::mutex mutex;
+// "phase;op;name" -> stats of the current window
+static std::unordered_map<std::string, ActivityStats> window_stats;
+static FILE* folded_file = NULL;
+static PprofWriter pprof;
+
+static void activity_aggregator_close()
+{
+  activity_aggregator_flush();
+  std::lock_guard<std::mutex> guard(mutex);
+  if (folded_file != NULL) {
+    fclose(folded_file);
+    folded_file = NULL;
+  }
+  pprof.Close();
+}
+
+void activity_aggregator_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_GPU_PROFILE", false);
+  if (!enabled)
+    return;
+
+  std::string prefix = smprofiler_config_string("SMPROFILER_GPU_PROFILE_PREFIX",
+                                                smprofiler_output_path("gpu_time"));
+  smprofiler_create_parent_dirs(prefix);
+  folded_file = fopen((prefix + ".folded").c_str(), "w");
+  if (folded_file == NULL || !pprof.Open(prefix + ".pb", {{"count", "count"}, {"gpu_time", "nanoseconds"}})) {
+    printf("Error: could not open GPU profile files %s.*\n", prefix.c_str());
+    enabled = false;
+    return;
+  }
+  smprofiler_atexit(activity_aggregator_close);
+}
+
+bool activity_aggregator_enabled()
+{
+  return enabled;
+}
+
+// ';' separates frames and ' ' the value in folded stacks
+static void append_frame(std::string& key, const char* frame)
+{
+  size_t start = key.size();
+  key += frame;
+  std::replace(key.begin() + start, key.end(), ';', ':');
+}
+
+void activity_aggregator_record(const char* phase, const char* op, const char* name, uint64_t duration_ns)
+{
+  if (!enabled)
+    return;
+
+  std::string key;
+  append_frame(key, phase);
+  key += ';';
+  append_frame(key, op);
+  key += ';';
+  append_frame(key, name);
+
+  std::lock_guard<std::mutex> guard(mutex);
+  ActivityStats& stats = window_stats[key];
+  stats.count++;
+  stats.total_ns += duration_ns;
+}
+
+void activity_aggregator_flush()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (!enabled || window_stats.empty())
+    return;
+
+  std::vector<std::string> frames;
+  for (auto& entry : window_stats) {
+    const std::string& key = entry.first;
+    fprintf(folded_file, "%s %llu\n", key.c_str(), (unsigned long long) entry.second.total_ns);
+
+    frames.clear();
+    size_t start = 0, sep;
+    while ((sep = key.find(';', start)) != std::string::npos) {
+      frames.push_back(key.substr(start, sep - start));
+      start = sep + 1;
+    }
+    frames.push_back(key.substr(start));
+    // pprof wants the leaf first
+    std::reverse(frames.begin(), frames.end());
+    pprof.AddSample(frames, {(int64_t) entry.second.count, (int64_t) entry.second.total_ns});
+  }
+  fflush(folded_file);
+  pprof.Flush();
+  window_stats.clear();
+}
@@ -0,0 +1,328 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <cupti.h>
+
+#include "activity_dump.h"
+#include "activity_dump_writer.h"
+#include "profiler_thread.h"
+#include "smprofiler_config.h"
+
+// O_DIRECT needs block aligned offsets, sizes and memory
+#define DUMP_DIRECT_ALIGN (4096)
+#define DUMP_STAGING_SIZE (4 * 1024 * 1024)
+// buffers waiting for the writer thread before bufferCompleted blocks
+#define DUMP_QUEUE_LIMIT (64)
+
+static bool enabled = false;
+static std::mutex mutex;
+static int fd = -1;
+static std::string dump_path;
+// bytes of dump content, the file may be longer while preallocated
+static uint64_t dump_size = 0;
+
+// with O_DIRECT entries are staged and written out in whole blocks
+static bool direct = false;
+static uint8_t* staging = NULL;
+static size_t staging_used = 0;
+
+// CUPTI owned strings already in the dump, by address
+static std::unordered_set<const char*> written_strings;
+// stride of every record kind in the dump, 0 until a buffer held one
+static uint32_t record_sizes[CUPTI_ACTIVITY_KIND_COUNT];
+
+static const uint8_t padding[ACTIVITY_DUMP_ALIGN] = {};
+
+// Entries are written by a thread of their own, in the order they were
+// queued, so the CUPTI completion thread only hands buffers over.
+struct QueuedEntry {
+  uint32_t type;
+  uint64_t context;
+  uint32_t stream_id;
+  // activity buffer, handed back through release once written
+  uint8_t* buffer;
+  size_t valid_size;
+  void (*release)(uint8_t*);
+  // payload of any other entry
+  std::string payload;
+};
+
+static std::thread writer;
+static std::mutex queue_mutex;
+static std::condition_variable queue_changed;
+static std::deque<QueuedEntry> queue;
+static bool stopping = false;
+
+static void writer_loop();
+
+// A forked child shares the dump's file description and has the writer
+// thread object but not the thread. Both are left to the parent, the child
+// does not dump. The queue's lock and condition variable are made anew, as
+// the writer may have held the one and been waiting on the other, which
+// would block the child destroying them at exit.
+static void after_fork_child()
+{
+  profiler_thread_forget(writer);
+  new (&queue_mutex) std::mutex();
+  new (&queue_changed) std::condition_variable();
+  fd = -1;
+  enabled = false;
+}
+
+void activity_dump_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_RAW_DUMP", false);
+  if (!enabled)
+    return;
+  dump_path = smprofiler_config_string("SMPROFILER_RAW_DUMP_FILE", smprofiler_output_path("activity.dump"));
+  direct = smprofiler_config_flag("SMPROFILER_RAW_DUMP_DIRECT", false);
+  long preallocate_mb = smprofiler_config_int("SMPROFILER_RAW_DUMP_PREALLOCATE_MB", 256);
+
+  smprofiler_create_parent_dirs(dump_path);
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+  if (direct) {
+    fd = open(dump_path.c_str(), flags | O_DIRECT, 0644);
+    // not every file system supports O_DIRECT, fall back to plain appends
+    if (fd < 0 || posix_memalign((void**) &staging, DUMP_DIRECT_ALIGN, DUMP_STAGING_SIZE) != 0) {
+      printf("smprofiler: O_DIRECT not available for %s, using buffered writes\n", dump_path.c_str());
+      if (fd >= 0)
+        close(fd);
+      fd = -1;
+      direct = false;
+    }
+  }
+  if (fd < 0)
+    fd = open(dump_path.c_str(), flags, 0644);
+  if (fd < 0) {
+    printf("smprofiler: could not open raw activity dump %s: %s\n", dump_path.c_str(), strerror(errno));
+    enabled = false;
+    return;
+  }
+
+  // reserve the blocks up front without changing the file size, so appends
+  // do not allocate on the CUPTI thread
+  if (preallocate_mb > 0)
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t) preallocate_mb * 1024 * 1024);
+  writer = std::thread(writer_loop);
+  pthread_atfork(NULL, NULL, after_fork_child);
+  smprofiler_atexit(activity_dump_close);
+}
+
+bool activity_dump_enabled()
+{
+  return enabled;
+}
+
+static bool write_fully(const uint8_t* data, size_t size)
+{
+  while (size > 0) {
+    ssize_t written = write(fd, data, size);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    data += written;
+    size -= written;
+  }
+  return true;
+}
+
+// writes all parts, resuming after short writes
+static bool writev_fully(struct iovec* parts, int count)
+{
+  while (count > 0) {
+    ssize_t written = writev(fd, parts, count);
+    if (written < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    while (count > 0 && (size_t) written >= parts->iov_len) {
+      written -= parts->iov_len;
+      parts++;
+      count--;
+    }
+    if (count > 0) {
+      parts->iov_base = (uint8_t*) parts->iov_base + written;
+      parts->iov_len -= written;
+    }
+  }
+  return true;
+}
+
+// copies into the staging area, writing every full one out, called with mutex held
+static bool stage(const uint8_t* data, size_t size)
+{
+  while (size > 0) {
+    size_t chunk = std::min(size, (size_t) DUMP_STAGING_SIZE - staging_used);
+    memcpy(staging + staging_used, data, chunk);
+    staging_used += chunk;
+    data += chunk;
+    size -= chunk;
+    if (staging_used == DUMP_STAGING_SIZE) {
+      if (!write_fully(staging, DUMP_STAGING_SIZE))
+        return false;
+      staging_used = 0;
+    }
+  }
+  return true;
+}
+
+// called with mutex held
+static void write_entry(uint32_t type, uint64_t context, uint32_t stream_id,
+                        const uint8_t* payload, size_t size)
+{
+  ActivityDumpHeader header;
+  header.magic = ACTIVITY_DUMP_MAGIC;
+  header.cupti_version = CUPTI_API_VERSION;
+  header.valid_size = size;
+  header.context = context;
+  header.stream_id = stream_id;
+  header.type = type;
+  size_t pad = activity_dump_padded_size(size) - size;
+
+  if (fd < 0)
+    return;
+
+  bool ok;
+  if (direct) {
+    ok = stage((const uint8_t*) &header, sizeof(header)) && stage(payload, size) && stage(padding, pad);
+  } else {
+    struct iovec parts[3] = {{&header, sizeof(header)}, {(void*) payload, size}, {(void*) padding, pad}};
+    ok = writev_fully(parts, 3);
+  }
+
+  if (!ok) {
+    printf("smprofiler: writing raw activity dump %s failed: %s\n", dump_path.c_str(), strerror(errno));
+    close(fd);
+    fd = -1;
+    return;
+  }
+  dump_size += sizeof(header) + size + pad;
+}
+
+static void enqueue(QueuedEntry&& entry)
+{
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  queue_changed.wait(lock, [] { return queue.size() < DUMP_QUEUE_LIMIT || stopping; });
+  queue.push_back(std::move(entry));
+  queue_changed.notify_all();
+}
+
+void activity_dump_write(uint32_t type, uint64_t context, uint32_t stream_id,
+                         const uint8_t* payload, size_t size)
+{
+  enqueue({type, context, stream_id, NULL, 0, NULL, std::string((const char*) payload, size)});
+}
+
+// notes the size of a record kind not seen before, called with mutex held
+static void learn_record_size(CUpti_ActivityKind kind, uint64_t size, ActivityDumpRecordSize* sizes, int& count)
+{
+  if ((uint32_t) kind >= CUPTI_ACTIVITY_KIND_COUNT || record_sizes[kind] != 0 || count == CUPTI_ACTIVITY_KIND_COUNT)
+    return;
+  record_sizes[kind] = (uint32_t) size;
+  sizes[count++] = {(uint32_t) kind, (uint32_t) size};
+}
+
+// called on the writer thread with mutex held
+static void write_buffer(uint64_t context, uint32_t stream_id, uint8_t* buffer, size_t valid_size)
+{
+  ActivityDumpRecordSize new_sizes[CUPTI_ACTIVITY_KIND_COUNT];
+  int new_size_count = 0;
+  CUpti_Activity* previous = NULL;
+  CUpti_Activity* record = NULL;
+  while (cuptiActivityGetNextRecord(buffer, valid_size, &record) == CUPTI_SUCCESS) {
+    if (previous != NULL)
+      learn_record_size(previous->kind, (uint8_t*) record - (uint8_t*) previous, new_sizes, new_size_count);
+    previous = record;
+    const char** fields[ACTIVITY_DUMP_MAX_STRING_FIELDS];
+    int count = activity_dump_string_fields(record, fields);
+    for (int i = 0; i < count; i++) {
+      const char* string = *fields[i];
+      if (string != NULL && written_strings.insert(string).second)
+        write_entry(ACTIVITY_DUMP_STRING, (uint64_t) (uintptr_t) string, 0, (const uint8_t*) string, strlen(string));
+    }
+  }
+  // the last record ends the buffer, records are 8 byte aligned
+  if (previous != NULL)
+    learn_record_size(previous->kind, activity_dump_padded_size(buffer + valid_size - (uint8_t*) previous),
+                      new_sizes, new_size_count);
+  if (new_size_count > 0)
+    write_entry(ACTIVITY_DUMP_RECORD_SIZES, 0, 0, (const uint8_t*) new_sizes,
+                new_size_count * sizeof(ActivityDumpRecordSize));
+  write_entry(ACTIVITY_DUMP_BUFFER, context, stream_id, buffer, valid_size);
+}
+
+void activity_dump_write_buffer(uint64_t context, uint32_t stream_id, uint8_t* buffer, size_t valid_size,
+                                void (*release)(uint8_t*))
+{
+  enqueue({ACTIVITY_DUMP_BUFFER, context, stream_id, buffer, valid_size, release, std::string()});
+}
+
+static void writer_loop()
+{
+  std::unique_lock<std::mutex> lock(queue_mutex);
+  while (true) {
+    queue_changed.wait(lock, [] { return !queue.empty() || stopping; });
+    if (queue.empty())
+      return;
+    QueuedEntry entry = std::move(queue.front());
+    queue.pop_front();
+    queue_changed.notify_all();
+    lock.unlock();
+    {
+      std::lock_guard<std::mutex> guard(mutex);
+      if (entry.buffer != NULL)
+        write_buffer(entry.context, entry.stream_id, entry.buffer, entry.valid_size);
+      else
+        write_entry(entry.type, entry.context, entry.stream_id, (const uint8_t*) entry.payload.data(),
+                    entry.payload.size());
+    }
+    if (entry.buffer != NULL)
+      entry.release(entry.buffer);
+    lock.lock();
+  }
+}
+
+void activity_dump_close()
+{
+  // everything queued is written before the file is closed
+  {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    stopping = true;
+    queue_changed.notify_all();
+  }
+  if (writer.joinable())
+    writer.join();
+
+  std::lock_guard<std::mutex> guard(mutex);
+  if (fd < 0)
+    return;
+  if (direct && staging_used > 0) {
+    // the last block is written whole and cut back to the content below
+    size_t block = (staging_used + DUMP_DIRECT_ALIGN - 1) & ~((size_t) DUMP_DIRECT_ALIGN - 1);
+    memset(staging + staging_used, 0, block - staging_used);
+    write_fully(staging, block);
+    staging_used = 0;
+  }
+  // releases the unused preallocated blocks
+  if (ftruncate(fd, dump_size) != 0)
+    printf("smprofiler: could not trim raw activity dump %s\n", dump_path.c_str());
+  close(fd);
+  fd = -1;
+  free(staging);
+  staging = NULL;
+}
@@ -0,0 +1,246 @@
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "anomaly_detector.h"
+#include "smprofiler_config.h"
+#include "smprofiler_timeline.h"
+#include "tsc_clock.h"
+
+#define SKETCH_GAMMA (1.02)
+// about 1000 s
+#define SKETCH_MAX_BUCKET (1400)
+
+static const double log_gamma = log(SKETCH_GAMMA);
+
+void QuantileSketch::Add(uint64_t ns)
+{
+  size_t bucket = ns > 1 ? std::min((size_t) ceil(log((double) ns) / log_gamma), (size_t) SKETCH_MAX_BUCKET) : 0;
+  if (bucket >= buckets_.size())
+    buckets_.resize(bucket + 1, 0);
+  buckets_[bucket]++;
+  count_++;
+}
+
+uint64_t QuantileSketch::Quantile(double q) const
+{
+  if (count_ == 0)
+    return 0;
+  uint64_t rank = (uint64_t) (q * (count_ - 1));
+  uint64_t seen = 0;
+  for (size_t bucket = 0; bucket < buckets_.size(); bucket++) {
+    seen += buckets_[bucket];
+    if (seen > rank) {
+      // the value within 1% of every duration of the bucket
+      return (uint64_t) (2 * pow(SKETCH_GAMMA, bucket) / (SKETCH_GAMMA + 1));
+    }
+  }
+  return 0;
+}
+
+AnomalyVerdict StepAnomalyDetector::Add(const std::string& phase, uint64_t duration_ns)
+{
+  PhaseDistribution& distribution = phases_[phase];
+  AnomalyVerdict verdict = {};
+  verdict.steps = distribution.steps;
+  verdict.ewma_ns = distribution.ewma_ns;
+  verdict.quantile_ns = distribution.sketch.Quantile(config_.quantile);
+  if (config_.threshold_ns > 0) {
+    verdict.threshold_ns = config_.threshold_ns;
+    verdict.anomalous = duration_ns > verdict.threshold_ns;
+  } else if (distribution.steps >= config_.warmup) {
+    verdict.threshold_ns = (uint64_t) (config_.factor * std::max(verdict.ewma_ns, (double) verdict.quantile_ns));
+    verdict.anomalous = duration_ns > verdict.threshold_ns;
+  }
+
+  // anomalous steps count too, a lasting slowdown becomes the new normal
+  if (verdict.anomalous)
+    distribution.anomalies++;
+  if (distribution.steps == 0)
+    distribution.ewma_ns = duration_ns;
+  else
+    distribution.ewma_ns = config_.ewma_alpha * duration_ns + (1 - config_.ewma_alpha) * distribution.ewma_ns;
+  distribution.steps++;
+  distribution.max_ns = std::max(distribution.max_ns, duration_ns);
+  distribution.sketch.Add(duration_ns);
+  return verdict;
+}
+
+struct Anomaly {
+  std::string phase;
+  uint64_t duration_ns;
+  AnomalyVerdict verdict;
+  // it started a capture, rather than happening during one
+  bool captured;
+};
+
+static const char* ANOMALY_TRACK = "anomaly";
+
+static bool enabled = false;
+static std::mutex mutex;
+static std::string report_path;
+static StepAnomalyDetector* detector = NULL;
+static uint32_t capture_steps = 0;
+// a capture also ends after this many phase starts of any name, or this long
+static uint32_t capture_max_phases = 0;
+static uint64_t capture_max_ns = 0;
+static std::vector<Anomaly> anomalies;
+
+// the running phase
+static std::string current_phase;
+static bool current_traced = false;
+static uint64_t begin_ticks = 0;
+
+// steps of capture_phase, and phases of any name, started since the
+// capture began
+static bool capturing = false;
+static std::string capture_phase;
+static uint32_t captured_steps = 0;
+static uint32_t captured_phases = 0;
+static uint64_t capture_begin_ticks = 0;
+
+void anomaly_detector_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_ANOMALY", false);
+  if (!enabled)
+    return;
+  AnomalyConfig config;
+  config.warmup = smprofiler_config_int("SMPROFILER_ANOMALY_WARMUP", 20);
+  config.quantile = smprofiler_config_int("SMPROFILER_ANOMALY_QUANTILE_PERMILLE", 990) / 1000.0;
+  config.factor = smprofiler_config_int("SMPROFILER_ANOMALY_FACTOR_PERCENT", 150) / 100.0;
+  config.threshold_ns = smprofiler_config_int("SMPROFILER_ANOMALY_THRESHOLD_MS", 0) * 1000000;
+  config.ewma_alpha = smprofiler_config_int("SMPROFILER_ANOMALY_EWMA_PERMILLE", 100) / 1000.0;
+  capture_steps = std::max(1L, smprofiler_config_int("SMPROFILER_ANOMALY_CAPTURE_STEPS", 5));
+  capture_max_phases = std::max(1L, smprofiler_config_int("SMPROFILER_ANOMALY_CAPTURE_MAX_PHASES", 100));
+  capture_max_ns = std::max(1L, smprofiler_config_int("SMPROFILER_ANOMALY_CAPTURE_MAX_MS", 60000)) * 1000000;
+  report_path = smprofiler_config_string("SMPROFILER_ANOMALY_FILE", smprofiler_output_path("anomalies.txt"));
+  detector = new StepAnomalyDetector(config);
+  smprofiler_atexit(anomaly_detector_report);
+}
+
+bool anomaly_detector_enabled()
+{
+  return enabled;
+}
+
+// what ends the capture at this phase start, NULL if it goes on; called with
+// mutex held
+static const char* capture_ends_by(uint64_t now_ticks)
+{
+  if (current_phase == capture_phase && captured_steps == capture_steps)
+    return "steps";
+  // the trigger phase may not come again, or only after a long time
+  if (captured_phases == capture_max_phases)
+    return "phases";
+  uint64_t begin_ns = tsc_clock_to_ns(capture_begin_ticks);
+  if (tsc_clock_to_ns(now_ticks) >= begin_ns + capture_max_ns)
+    return "time";
+  return NULL;
+}
+
+bool anomaly_detector_trace_phase(const char* phase)
+{
+  if (!enabled)
+    return true;
+  std::lock_guard<std::mutex> guard(mutex);
+  current_phase = phase;
+  if (!capturing)
+    return false;
+  uint64_t now_ticks = tsc_clock_now();
+  const char* ended_by = capture_ends_by(now_ticks);
+  if (ended_by != NULL) {
+    capturing = false;
+    Timeline::getInstance().SMRecordCpuEvent(ANOMALY_TRACK, "capture", capture_begin_ticks, now_ticks,
+                                             ", \"trigger_phase\": \"" + capture_phase + "\"" +
+                                             ", \"steps\": " + std::to_string(captured_steps) +
+                                             ", \"phases\": " + std::to_string(captured_phases) +
+                                             ", \"ended_by\": \"" + ended_by + "\"");
+    printf("Phase %s ANOMALY capture of %u steps of %s done, ended by %s\n", phase, captured_steps,
+           capture_phase.c_str(), ended_by);
+    return false;
+  }
+  captured_phases++;
+  if (current_phase == capture_phase)
+    captured_steps++;
+  return true;
+}
+
+void anomaly_detector_begin_phase(bool traced)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  current_traced = traced;
+  begin_ticks = tsc_clock_now();
+}
+
+void anomaly_detector_end_phase()
+{
+  if (!enabled)
+    return;
+  uint64_t end_ticks = tsc_clock_now();
+  std::lock_guard<std::mutex> guard(mutex);
+  // traced steps carry the cost of tracing, they would skew the distribution
+  if (current_traced)
+    return;
+  uint64_t begin_ns = tsc_clock_to_ns(begin_ticks);
+  uint64_t end_ns = tsc_clock_to_ns(end_ticks);
+  uint64_t duration_ns = end_ns > begin_ns ? end_ns - begin_ns : 0;
+  AnomalyVerdict verdict = detector->Add(current_phase, duration_ns);
+  if (!verdict.anomalous)
+    return;
+
+  anomalies.push_back({current_phase, duration_ns, verdict, !capturing});
+  char args[256];
+  snprintf(args, sizeof(args),
+           ", \"phase\": \"%s\", \"step\": %" PRIu64 ", \"threshold_us\": %.1f, \"ewma_us\": %.1f, \"quantile_us\": %.1f",
+           current_phase.c_str(), verdict.steps, verdict.threshold_ns / 1e3, verdict.ewma_ns / 1e3,
+           verdict.quantile_ns / 1e3);
+  Timeline::getInstance().SMRecordCpuEvent(ANOMALY_TRACK, "slow_step", begin_ticks, end_ticks, args);
+  printf("Phase %s ANOMALY step %" PRIu64 " took %.3f ms, threshold %.3f ms%s\n", current_phase.c_str(),
+         verdict.steps, duration_ns / 1e6, verdict.threshold_ns / 1e6,
+         capturing ? "" : ", tracing the next steps");
+  if (!capturing) {
+    capturing = true;
+    capture_phase = current_phase;
+    captured_steps = 0;
+    captured_phases = 0;
+    capture_begin_ticks = end_ticks;
+  }
+}
+
+void anomaly_detector_report()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (!enabled)
+    return;
+  smprofiler_create_parent_dirs(report_path);
+  FILE* file = fopen(report_path.c_str(), "w");
+  if (file == NULL) {
+    printf("Error: could not open anomaly report %s\n", report_path.c_str());
+    return;
+  }
+  fprintf(file, "# untraced step durations by phase, in ms\n");
+  fprintf(file, "%-32s %8s %10s %10s %10s %10s %10s %9s\n", "phase", "steps", "ewma", "p50", "p90", "p99", "max",
+          "anomalies");
+  for (auto& entry : detector->Phases()) {
+    const PhaseDistribution& distribution = entry.second;
+    fprintf(file, "%-32s %8" PRIu64 " %10.3f %10.3f %10.3f %10.3f %10.3f %9" PRIu64 "\n", entry.first.c_str(),
+            distribution.steps, distribution.ewma_ns / 1e6, distribution.sketch.Quantile(0.5) / 1e6,
+            distribution.sketch.Quantile(0.9) / 1e6, distribution.sketch.Quantile(0.99) / 1e6,
+            distribution.max_ns / 1e6, distribution.anomalies);
+  }
+  fprintf(file, "\n# anomalies, captured ones started a capture of the next %u steps\n", capture_steps);
+  for (const Anomaly& anomaly : anomalies) {
+    fprintf(file, "%-32s step %8" PRIu64 " %10.3f ms threshold %10.3f ms ewma %10.3f ms quantile %10.3f ms%s\n",
+            anomaly.phase.c_str(), anomaly.verdict.steps, anomaly.duration_ns / 1e6,
+            anomaly.verdict.threshold_ns / 1e6, anomaly.verdict.ewma_ns / 1e6, anomaly.verdict.quantile_ns / 1e6,
+            anomaly.captured ? " captured" : "");
+  }
+  fclose(file);
+}
@@ -0,0 +1,281 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <algorithm>
+
+#include "async_trace_file.h"
+
+#define TRACE_FILE_PAGE (4096)
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params)
+{
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+  return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+AsyncTraceFile::AsyncTraceFile(size_t buffer_size, int num_buffers, bool allow_io_uring)
+{
+  buffer_size_ = (buffer_size + TRACE_FILE_PAGE - 1) & ~((size_t) TRACE_FILE_PAGE - 1);
+  if (buffer_size_ == 0)
+    buffer_size_ = TRACE_FILE_PAGE;
+  if (num_buffers < 2)
+    num_buffers = 2;
+  for (int i = 0; i < num_buffers; i++) {
+    Buffer buffer = {};
+    if (posix_memalign((void**) &buffer.data, TRACE_FILE_PAGE, buffer_size_) != 0) {
+      failed_ = true;
+      break;
+    }
+    buffers_.push_back(buffer);
+  }
+  if (allow_io_uring && !SetupRing(num_buffers))
+    TeardownRing();
+}
+
+AsyncTraceFile::~AsyncTraceFile()
+{
+  Close();
+  TeardownRing();
+  for (Buffer& buffer : buffers_) {
+    free(buffer.data);
+  }
+}
+
+bool AsyncTraceFile::SetupRing(unsigned entries)
+{
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring_fd_ = io_uring_setup(entries, &params);
+  if (ring_fd_ < 0)
+    return false;
+
+  sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+    cq_ring_size_ = sq_ring_size_;
+  }
+  sq_ring_ = mmap(NULL, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ == MAP_FAILED) {
+    sq_ring_ = NULL;
+    return false;
+  }
+  if (single_mmap) {
+    cq_ring_ = sq_ring_;
+  } else {
+    cq_ring_ = mmap(NULL, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ == MAP_FAILED) {
+      cq_ring_ = NULL;
+      return false;
+    }
+  }
+  sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = mmap(NULL, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    sqes_ = NULL;
+    return false;
+  }
+
+  uint8_t* sq = (uint8_t*) sq_ring_;
+  sq_head_ = (unsigned*) (sq + params.sq_off.head);
+  sq_tail_ = (unsigned*) (sq + params.sq_off.tail);
+  sq_mask_ = (unsigned*) (sq + params.sq_off.ring_mask);
+  sq_array_ = (unsigned*) (sq + params.sq_off.array);
+  uint8_t* cq = (uint8_t*) cq_ring_;
+  cq_head_ = (unsigned*) (cq + params.cq_off.head);
+  cq_tail_ = (unsigned*) (cq + params.cq_off.tail);
+  cq_mask_ = (unsigned*) (cq + params.cq_off.ring_mask);
+  cqes_ = cq + params.cq_off.cqes;
+  return true;
+}
+
+void AsyncTraceFile::TeardownRing()
+{
+  if (sqes_ != NULL)
+    munmap(sqes_, sqes_size_);
+  if (cq_ring_ != NULL && cq_ring_ != sq_ring_)
+    munmap(cq_ring_, cq_ring_size_);
+  if (sq_ring_ != NULL)
+    munmap(sq_ring_, sq_ring_size_);
+  if (ring_fd_ >= 0)
+    close(ring_fd_);
+  sqes_ = cq_ring_ = sq_ring_ = NULL;
+  ring_fd_ = -1;
+}
+
+bool AsyncTraceFile::Open(const std::string& path)
+{
+  Close();
+  fd_ = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ < 0)
+    return false;
+  path_ = path;
+  file_size_ = 0;
+  block_ends_.clear();
+  current_ = 0;
+  for (Buffer& buffer : buffers_) {
+    buffer.used = buffer.submitted = 0;
+  }
+  failed_ = buffers_.empty();
+  return true;
+}
+
+void AsyncTraceFile::Append(const char* data, size_t size)
+{
+  if (fd_ < 0 || failed_)
+    return;
+  while (size > 0) {
+    Buffer& buffer = buffers_[current_];
+    size_t chunk = std::min(size, buffer_size_ - buffer.used);
+    memcpy(buffer.data + buffer.used, data, chunk);
+    buffer.used += chunk;
+    file_size_ += chunk;
+    data += chunk;
+    size -= chunk;
+    if (buffer.used == buffer_size_)
+      Rotate();
+  }
+}
+
+void AsyncTraceFile::Submit()
+{
+  if (fd_ < 0 || failed_ || buffers_[current_].used == buffers_[current_].submitted)
+    return;
+  // the buffer keeps filling after a partial write, one write of it at a time
+  WaitForBuffer(current_);
+  SubmitBuffer(current_);
+}
+
+void AsyncTraceFile::Rotate()
+{
+  WaitForBuffer(current_);
+  SubmitBuffer(current_);
+  current_ = (current_ + 1) % buffers_.size();
+  WaitForBuffer(current_);
+  buffers_[current_].used = buffers_[current_].submitted = 0;
+}
+
+void AsyncTraceFile::SubmitBuffer(int index)
+{
+  Buffer& buffer = buffers_[index];
+  buffer.offset = file_size_ - buffer.used + buffer.submitted;
+  buffer.iov.iov_base = buffer.data + buffer.submitted;
+  buffer.iov.iov_len = buffer.used - buffer.submitted;
+  buffer.submitted = buffer.used;
+  if (ring_fd_ < 0) {
+    Finish(buffer, pwritev(fd_, &buffer.iov, 1, buffer.offset));
+    return;
+  }
+
+  buffer.pending = true;
+  unsigned tail = *sq_tail_;
+  unsigned slot = tail & *sq_mask_;
+  struct io_uring_sqe* sqe = (struct io_uring_sqe*) sqes_ + slot;
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fd_;
+  sqe->addr = (uint64_t) (uintptr_t) &buffer.iov;
+  sqe->len = 1;
+  sqe->off = buffer.offset;
+  sqe->user_data = index;
+  sq_array_[slot] = slot;
+  // the kernel must see the entry before the new tail
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  in_flight_++;
+
+  int submitted;
+  do {
+    submitted = io_uring_enter(ring_fd_, 1, 0, 0);
+  } while (submitted < 0 && errno == EINTR);
+  if (submitted < 0) {
+    // nothing went out, write this one directly
+    in_flight_--;
+    __atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+    Finish(buffer, pwritev(fd_, &buffer.iov, 1, buffer.offset));
+  }
+}
+
+void AsyncTraceFile::WaitForBuffer(int index)
+{
+  while (buffers_[index].pending && in_flight_ > 0) {
+    Reap(1);
+  }
+}
+
+void AsyncTraceFile::Reap(unsigned min_complete)
+{
+  unsigned head = *cq_head_;
+  if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) && min_complete > 0) {
+    int result;
+    do {
+      result = io_uring_enter(ring_fd_, 0, min_complete, IORING_ENTER_GETEVENTS);
+    } while (result < 0 && errno == EINTR);
+  }
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    struct io_uring_cqe* cqe = (struct io_uring_cqe*) cqes_ + (head & *cq_mask_);
+    Buffer& buffer = buffers_[cqe->user_data];
+    in_flight_--;
+    if (cqe->res < 0)
+      errno = -cqe->res;
+    Finish(buffer, cqe->res < 0 ? -1 : cqe->res);
+    head++;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+}
+
+// completes the write of a buffer, writing out the remainder of a short one
+// directly; a pwrite that writes nothing is an error, retrying it would spin
+void AsyncTraceFile::Finish(Buffer& buffer, ssize_t written)
+{
+  size_t done = written < 0 ? 0 : written;
+  const char* error = written < 0 ? strerror(errno) : NULL;
+  while (error == NULL && done < buffer.iov.iov_len) {
+    written = pwrite(fd_, (uint8_t*) buffer.iov.iov_base + done, buffer.iov.iov_len - done, buffer.offset + done);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written < 0)
+      error = strerror(errno);
+    else if (written == 0)
+      error = "no bytes written";
+    done += written > 0 ? written : 0;
+  }
+  if (error != NULL) {
+    if (!failed_)
+      fprintf(stderr, "smprofiler: writing %s failed: %s\n", path_.c_str(), error);
+    failed_ = true;
+  }
+  buffer.pending = false;
+}
+
+void AsyncTraceFile::Flush()
+{
+  if (fd_ < 0)
+    return;
+  Submit();
+  while (in_flight_ > 0) {
+    Reap(1);
+  }
+}
+
+void AsyncTraceFile::Close()
+{
+  if (fd_ < 0)
+    return;
+  Flush();
+  close(fd_);
+  fd_ = -1;
+}
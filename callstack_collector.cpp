@@ -0,0 +1,184 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <cxxabi.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//libunwind MACRO for local unwind optimization
+#define UNW_LOCAL_ONLY
+#include "libunwind.h"
+
+#include <cupti.h>
+
+#include "callstack_collector.h"
+#include "smprofiler_config.h"
+#include "stack_table.h"
+
+#define CALLSTACK_MAX_FRAMES (32)
+// at most this many frames of the profiler and CUPTI are dropped from the
+// top of a stack
+#define CALLSTACK_MAX_INTERNAL_FRAMES (16)
+#define CALLSTACK_MAX_INTERNAL_RANGES (8)
+
+struct CodeRange {
+  uintptr_t start;
+  uintptr_t end;
+};
+
+static bool enabled = false;
+// executable segments of smprofiler and CUPTI, whose callback frames sit on
+// top of every captured stack
+static CodeRange internal_ranges[CALLSTACK_MAX_INTERNAL_RANGES];
+static int num_internal_ranges = 0;
+static StackTable stacks;
+static StackCorrelationMap correlations;
+
+// symbol cache, only touched from callstack_dump
+static std::unordered_map<uintptr_t, std::string> symbols;
+static uint32_t dumped_stacks = 0;
+static std::string dump_path;
+
+// adds the executable segments of the shared object containing the address
+// passed as data
+static int add_internal_object(struct dl_phdr_info* info, size_t size, void* data)
+{
+  uintptr_t address = (uintptr_t) data;
+  bool contains = false;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+    if (phdr.p_type == PT_LOAD && address >= start && address < start + phdr.p_memsz)
+      contains = true;
+  }
+  // linked into the main program, its code is the application's as well
+  if (!contains || info->dlpi_name[0] == '\0')
+    return contains;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_LOAD || !(phdr.p_flags & PF_X) || num_internal_ranges == CALLSTACK_MAX_INTERNAL_RANGES)
+      continue;
+    uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+    internal_ranges[num_internal_ranges++] = {start, start + phdr.p_memsz};
+  }
+  return 1;
+}
+
+static bool is_internal(uintptr_t ip)
+{
+  for (int i = 0; i < num_internal_ranges; i++) {
+    if (ip >= internal_ranges[i].start && ip < internal_ranges[i].end)
+      return true;
+  }
+  return false;
+}
+
+void callstack_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_CALLSTACK", false);
+  dump_path = smprofiler_config_string("SMPROFILER_CALLSTACK_FILE",
+                                       smprofiler_output_path("callstacks.txt"));
+  if (enabled && num_internal_ranges == 0) {
+    dl_iterate_phdr(add_internal_object, (void*) (uintptr_t) &callstack_capture);
+    dl_iterate_phdr(add_internal_object, (void*) (uintptr_t) &cuptiSubscribe);
+  }
+}
+
+bool callstack_enabled()
+{
+  return enabled;
+}
+
+void callstack_capture(uint32_t correlation_id)
+{
+  void* ips[CALLSTACK_MAX_FRAMES + CALLSTACK_MAX_INTERNAL_FRAMES];
+  int total = unw_backtrace(ips, CALLSTACK_MAX_FRAMES + CALLSTACK_MAX_INTERNAL_FRAMES);
+  // frame 0 is callstack_capture itself, then come the profiler's callback
+  // and the CUPTI frames that called it; return addresses are looked up one
+  // byte back, inside the call
+  int skip = 1;
+  while (skip < total && skip < CALLSTACK_MAX_INTERNAL_FRAMES && is_internal((uintptr_t) ips[skip] - 1))
+    skip++;
+  int depth = std::min(total - skip, CALLSTACK_MAX_FRAMES);
+  if (depth <= 0)
+    return;
+
+  uint32_t stack_id = stacks.Intern((const uintptr_t*) (ips + skip), depth);
+  if (stack_id == StackTable::INVALID_ID)
+    return;
+
+  correlations.Set(correlation_id, stack_id);
+}
+
+uint32_t callstack_lookup(uint32_t correlation_id)
+{
+  return correlations.Lookup(correlation_id);
+}
+
+static const std::string& symbolize(uintptr_t ip)
+{
+  auto it = symbols.find(ip);
+  if (it != symbols.end())
+    return it->second;
+
+  std::string name;
+  Dl_info info;
+  // ip is a return address, look up the call instruction instead
+  int found = dladdr((void*) (ip - 1), &info);
+  if (found && info.dli_sname != NULL) {
+    int status;
+    char* demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+    name = (status == 0) ? demangled : info.dli_sname;
+    free(demangled);
+  } else if (found && info.dli_fname != NULL) {
+    char offset[32];
+    snprintf(offset, sizeof(offset), "+0x%lx", (unsigned long) (ip - (uintptr_t) info.dli_fbase));
+    std::string module = info.dli_fname;
+    name = module.substr(module.find_last_of('/') + 1) + offset;
+  } else {
+    char address[32];
+    snprintf(address, sizeof(address), "0x%lx", (unsigned long) ip);
+    name = address;
+  }
+  // ';' separates frames in the dump
+  for (char& c : name) {
+    if (c == ';')
+      c = ':';
+  }
+  return symbols.emplace(ip, name).first->second;
+}
+
+// Appends all stacks interned since the last dump as
+// "<stack id> <outermost frame>;...;<innermost frame>" lines.
+void callstack_dump()
+{
+  if (!enabled)
+    return;
+
+  size_t num_stacks = stacks.Size();
+  if (dumped_stacks >= num_stacks)
+    return;
+
+  smprofiler_create_parent_dirs(dump_path);
+  FILE* file = fopen(dump_path.c_str(), "a");
+  if (file == NULL) {
+    printf("Error: could not open callstack file %s\n", dump_path.c_str());
+    return;
+  }
+
+  std::vector<uintptr_t> frames;
+  for (uint32_t stack_id = dumped_stacks; stack_id < num_stacks; stack_id++) {
+    if (!stacks.GetFrames(stack_id, frames))
+      break;
+    fprintf(file, "%u ", stack_id);
+    for (size_t i = frames.size(); i-- > 0;) {
+      fprintf(file, "%s%s", symbolize(frames[i]).c_str(), i > 0 ? ";" : "\n");
+    }
+  }
+  fclose(file);
+  dumped_stacks = num_stacks;
+}
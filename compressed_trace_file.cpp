@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <functional>
+#ifdef SMPROFILER_WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef SMPROFILER_WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+#include "compressed_trace_file.h"
+#include "profiler_thread.h"
+
+#define ZSTD_FRAME_MAGIC (0xFD2FB528)
+#define LZ4_FRAME_MAGIC (0x184D2204)
+// LZ4F_compressUpdate needs room for the worst case, so input is fed in chunks
+#define LZ4_CHUNK_SIZE (64 * 1024)
+
+TraceCompression CompressedTraceFile::ParseCodec(const std::string& name)
+{
+#ifdef SMPROFILER_WITH_ZSTD
+  if (name == "zstd")
+    return TRACE_COMPRESSION_ZSTD;
+#endif
+#ifdef SMPROFILER_WITH_LZ4
+  if (name == "lz4")
+    return TRACE_COMPRESSION_LZ4;
+#endif
+  if (name != "none" && name != "")
+    printf("smprofiler: timeline compression %s is not available, writing uncompressed\n", name.c_str());
+  return TRACE_COMPRESSION_NONE;
+}
+
+const char* CompressedTraceFile::Suffix(TraceCompression codec)
+{
+  switch (codec) {
+  case TRACE_COMPRESSION_ZSTD:
+    return ".zst";
+  case TRACE_COMPRESSION_LZ4:
+    return ".lz4";
+  default:
+    return "";
+  }
+}
+
+CompressedTraceFile::CompressedTraceFile(TraceCompression codec, int level, size_t buffer_size,
+                                         std::unique_ptr<TraceFile> out)
+  : codec_(codec), compression_level_(level), out_(std::move(out)), buffer_size_(buffer_size)
+{
+  for (int i = 0; i < 2; i++) {
+    buffers_[i] = (uint8_t*) malloc(buffer_size_);
+    if (buffers_[i] == NULL)
+      failed_ = true;
+  }
+
+#ifdef SMPROFILER_WITH_ZSTD
+  if (codec_ == TRACE_COMPRESSION_ZSTD) {
+    ZSTD_CCtx* context = ZSTD_createCCtx();
+    ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, level);
+    context_ = context;
+    out_buffer_size_ = ZSTD_CStreamOutSize();
+  }
+#endif
+#ifdef SMPROFILER_WITH_LZ4
+  if (codec_ == TRACE_COMPRESSION_LZ4) {
+    LZ4F_cctx* context = NULL;
+    if (LZ4F_isError(LZ4F_createCompressionContext(&context, LZ4F_VERSION)))
+      context = NULL;
+    context_ = context;
+    out_buffer_size_ = LZ4F_compressBound(LZ4_CHUNK_SIZE, NULL);
+  }
+#endif
+  if (context_ == NULL)
+    failed_ = true;
+  out_buffer_ = (uint8_t*) malloc(out_buffer_size_);
+
+  thread_ = std::thread(&CompressedTraceFile::CompressLoop, this);
+}
+
+CompressedTraceFile::~CompressedTraceFile()
+{
+  Close();
+  {
+    std::lock_guard<std::mutex> guard(mutex_);
+    stopping_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+
+#ifdef SMPROFILER_WITH_ZSTD
+  if (codec_ == TRACE_COMPRESSION_ZSTD)
+    ZSTD_freeCCtx((ZSTD_CCtx*) context_);
+#endif
+#ifdef SMPROFILER_WITH_LZ4
+  if (codec_ == TRACE_COMPRESSION_LZ4 && context_ != NULL)
+    LZ4F_freeCompressionContext((LZ4F_cctx*) context_);
+#endif
+  free(out_buffer_);
+  free(buffers_[0]);
+  free(buffers_[1]);
+}
+
+bool CompressedTraceFile::Open(const std::string& path)
+{
+  Close();
+  if (!out_->Open(path))
+    return false;
+  path_ = path;
+  raw_bytes_ = 0;
+  compressed_bytes_ = 0;
+  block_ends_.clear();
+  compress_ns_ = 0;
+  return true;
+}
+
+void CompressedTraceFile::Append(const char* data, size_t size)
+{
+  if (failed_ || !out_->IsOpen())
+    return;
+  raw_bytes_ += size;
+  if (size > 0)
+    frame_open_ = true;
+  while (size > 0) {
+    size_t chunk = std::min(size, buffer_size_ - used_);
+    memcpy(buffers_[filling_] + used_, data, chunk);
+    used_ += chunk;
+    data += chunk;
+    size -= chunk;
+    if (used_ == buffer_size_)
+      HandOff(COMPRESS_CONTINUE);
+  }
+}
+
+void CompressedTraceFile::HandOff(Directive directive)
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  // the compression thread is done with the other buffer once it is idle
+  cv_.wait(lock, [this]() { return !job_ready_; });
+  job_data_ = buffers_[filling_];
+  job_size_ = used_;
+  job_directive_ = directive;
+  job_ready_ = true;
+  lock.unlock();
+  cv_.notify_all();
+
+  filling_ ^= 1;
+  used_ = 0;
+  if (directive == COMPRESS_END)
+    frame_open_ = false;
+}
+
+void CompressedTraceFile::WaitIdle()
+{
+  std::unique_lock<std::mutex> lock(mutex_);
+  cv_.wait(lock, [this]() { return !job_ready_; });
+}
+
+void CompressedTraceFile::Submit()
+{
+  if (failed_ || !out_->IsOpen() || used_ == 0)
+    return;
+  HandOff(COMPRESS_FLUSH);
+}
+
+void CompressedTraceFile::EndBlock()
+{
+  if (failed_ || !out_->IsOpen() || !frame_open_)
+    return;
+  HandOff(COMPRESS_END);
+}
+
+const std::vector<uint64_t>& CompressedTraceFile::BlockEnds()
+{
+  WaitIdle();
+  return block_ends_;
+}
+
+void CompressedTraceFile::AppendFooter(const std::string& data)
+{
+  if (failed_ || !out_->IsOpen())
+    return;
+  EndBlock();
+  WaitIdle();
+  out_->Append(data);
+  compressed_bytes_ = out_->Size();
+}
+
+void CompressedTraceFile::Close()
+{
+  if (!out_->IsOpen())
+    return;
+  if (!failed_) {
+    if (frame_open_)
+      HandOff(COMPRESS_END);
+    WaitIdle();
+  }
+  out_->Close();
+
+  if (raw_bytes_ > 0) {
+    double ratio = out_->Size() > 0 ? (double) raw_bytes_ / out_->Size() : 0;
+    double throughput = compress_ns_ > 0 ? raw_bytes_ * 1e3 / compress_ns_ : 0;
+    printf("smprofiler: timeline compressed with %s, %.1f MB to %.1f MB (ratio %.1f) at %.0f MB/s\n",
+           codec_ == TRACE_COMPRESSION_ZSTD ? "zstd" : "lz4", raw_bytes_ / 1e6, out_->Size() / 1e6, ratio, throughput);
+  }
+}
+
+void CompressedTraceFile::CompressLoop()
+{
+  profiler_thread_setup("compress");
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    cv_.wait(lock, [this]() { return job_ready_ || stopping_; });
+    if (!job_ready_)
+      return;
+    lock.unlock();
+
+    auto start = std::chrono::steady_clock::now();
+    Compress(job_data_, job_size_, job_directive_);
+    compress_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count();
+
+    compressed_bytes_ = out_->Size();
+    if (job_directive_ == COMPRESS_END)
+      block_ends_.push_back(out_->Size());
+    lock.lock();
+    job_ready_ = false;
+    cv_.notify_all();
+  }
+}
+
+void CompressedTraceFile::Compress(const uint8_t* data, size_t size, Directive directive)
+{
+  if (codec_ == TRACE_COMPRESSION_ZSTD)
+    CompressZstd(data, size, directive);
+  else if (codec_ == TRACE_COMPRESSION_LZ4)
+    CompressLz4(data, size, directive);
+  // flushed blocks go on to the disk right away
+  if (directive == COMPRESS_FLUSH)
+    out_->Submit();
+}
+
+void CompressedTraceFile::CompressZstd(const uint8_t* data, size_t size, Directive directive)
+{
+#ifdef SMPROFILER_WITH_ZSTD
+  ZSTD_EndDirective mode = directive == COMPRESS_END ? ZSTD_e_end
+                           : directive == COMPRESS_FLUSH ? ZSTD_e_flush : ZSTD_e_continue;
+  ZSTD_inBuffer input = {data, size, 0};
+  while (true) {
+    ZSTD_outBuffer output = {out_buffer_, out_buffer_size_, 0};
+    size_t remaining = ZSTD_compressStream2((ZSTD_CCtx*) context_, &output, &input, mode);
+    if (ZSTD_isError(remaining)) {
+      printf("smprofiler: zstd compression of %s failed: %s\n", path_.c_str(), ZSTD_getErrorName(remaining));
+      failed_ = true;
+      return;
+    }
+    out_->Append((const char*) out_buffer_, output.pos);
+    // done once all input is consumed and, for flush and end, written out
+    if (mode == ZSTD_e_continue ? input.pos == input.size : remaining == 0)
+      break;
+  }
+#endif
+}
+
+void CompressedTraceFile::CompressLz4(const uint8_t* data, size_t size, Directive directive)
+{
+#ifdef SMPROFILER_WITH_LZ4
+  LZ4F_cctx* context = (LZ4F_cctx*) context_;
+  size_t written;
+  if (!frame_started_) {
+    LZ4F_preferences_t preferences;
+    memset(&preferences, 0, sizeof(preferences));
+    preferences.compressionLevel = compression_level_;
+    written = LZ4F_compressBegin(context, out_buffer_, out_buffer_size_, &preferences);
+    if (LZ4F_isError(written))
+      goto error;
+    out_->Append((const char*) out_buffer_, written);
+    frame_started_ = true;
+  }
+  while (size > 0) {
+    size_t chunk = std::min(size, (size_t) LZ4_CHUNK_SIZE);
+    written = LZ4F_compressUpdate(context, out_buffer_, out_buffer_size_, data, chunk, NULL);
+    if (LZ4F_isError(written))
+      goto error;
+    out_->Append((const char*) out_buffer_, written);
+    data += chunk;
+    size -= chunk;
+  }
+  if (directive == COMPRESS_CONTINUE)
+    return;
+  if (directive == COMPRESS_END) {
+    written = LZ4F_compressEnd(context, out_buffer_, out_buffer_size_, NULL);
+    frame_started_ = false;
+  } else {
+    written = LZ4F_flush(context, out_buffer_, out_buffer_size_, NULL);
+  }
+  if (LZ4F_isError(written))
+    goto error;
+  out_->Append((const char*) out_buffer_, written);
+  return;
+
+error:
+  printf("smprofiler: lz4 compression of %s failed: %s\n", path_.c_str(), LZ4F_getErrorName(written));
+  failed_ = true;
+#endif
+}
+
+// Decodes a trace file fed to it a chunk at a time and passes the output
+// on as it goes: zstd and LZ4 frames, one after the other, are decompressed
+// and other files passed through.
+class TraceDecoder {
+public:
+  explicit TraceDecoder(const std::function<void(const char* data, size_t size)>& output) : output_(output) {}
+  ~TraceDecoder();
+  TraceDecoder(const TraceDecoder&) = delete;
+  void operator=(const TraceDecoder&) = delete;
+  bool Decode(const char* data, size_t size);
+  // false when the last frame was cut short, e.g. a file still being written
+  bool Finish();
+
+private:
+  bool DecodeZstd(const char* data, size_t size);
+  bool DecodeLz4(const char* data, size_t size);
+
+  const std::function<void(const char* data, size_t size)>& output_;
+  bool started_ = false;
+  uint32_t magic_ = 0;
+  std::string chunk_;
+  // of the last call, 0 at the end of a frame
+  size_t result_ = 0;
+#ifdef SMPROFILER_WITH_ZSTD
+  ZSTD_DCtx* zstd_ = NULL;
+#endif
+#ifdef SMPROFILER_WITH_LZ4
+  LZ4F_dctx* lz4_ = NULL;
+#endif
+};
+
+TraceDecoder::~TraceDecoder()
+{
+#ifdef SMPROFILER_WITH_ZSTD
+  if (zstd_ != NULL)
+    ZSTD_freeDCtx(zstd_);
+#endif
+#ifdef SMPROFILER_WITH_LZ4
+  if (lz4_ != NULL)
+    LZ4F_freeDecompressionContext(lz4_);
+#endif
+}
+
+bool TraceDecoder::Decode(const char* data, size_t size)
+{
+  if (!started_) {
+    // the magic number is in the first chunk, unless the file is shorter
+    started_ = true;
+    if (size >= sizeof(magic_))
+      memcpy(&magic_, data, sizeof(magic_));
+  }
+  if (magic_ == ZSTD_FRAME_MAGIC)
+    return DecodeZstd(data, size);
+  if (magic_ == LZ4_FRAME_MAGIC)
+    return DecodeLz4(data, size);
+  output_(data, size);
+  return true;
+}
+
+bool TraceDecoder::DecodeZstd(const char* data, size_t size)
+{
+#ifdef SMPROFILER_WITH_ZSTD
+  if (zstd_ == NULL) {
+    zstd_ = ZSTD_createDCtx();
+    chunk_.resize(ZSTD_DStreamOutSize());
+  }
+  ZSTD_inBuffer in = {data, size, 0};
+  // a full chunk may leave output behind once all input is consumed
+  bool chunk_full = false;
+  while (in.pos < in.size || chunk_full) {
+    ZSTD_outBuffer out = {&chunk_[0], chunk_.size(), 0};
+    result_ = ZSTD_decompressStream(zstd_, &out, &in);
+    if (ZSTD_isError(result_)) {
+      fprintf(stderr, "zstd: %s\n", ZSTD_getErrorName(result_));
+      return false;
+    }
+    output_(chunk_.data(), out.pos);
+    chunk_full = out.pos == out.size;
+  }
+  return true;
+#else
+  fprintf(stderr, "built without zstd support\n");
+  return false;
+#endif
+}
+
+bool TraceDecoder::DecodeLz4(const char* data, size_t size)
+{
+#ifdef SMPROFILER_WITH_LZ4
+  if (lz4_ == NULL) {
+    if (LZ4F_isError(LZ4F_createDecompressionContext(&lz4_, LZ4F_VERSION))) {
+      lz4_ = NULL;
+      return false;
+    }
+    chunk_.resize(LZ4_CHUNK_SIZE * 4);
+  }
+  size_t pos = 0;
+  bool chunk_full = false;
+  while (pos < size || chunk_full) {
+    size_t out_size = chunk_.size();
+    size_t in_size = size - pos;
+    result_ = LZ4F_decompress(lz4_, &chunk_[0], &out_size, data + pos, &in_size, NULL);
+    if (LZ4F_isError(result_)) {
+      fprintf(stderr, "lz4: %s\n", LZ4F_getErrorName(result_));
+      return false;
+    }
+    output_(chunk_.data(), out_size);
+    pos += in_size;
+    chunk_full = out_size == chunk_.size();
+  }
+  return true;
+#else
+  fprintf(stderr, "built without lz4 support\n");
+  return false;
+#endif
+}
+
+bool TraceDecoder::Finish()
+{
+  if (result_ != 0) {
+    fprintf(stderr, "%s: truncated frame\n", magic_ == ZSTD_FRAME_MAGIC ? "zstd" : "lz4");
+    return false;
+  }
+  return true;
+}
+
+bool trace_file_scan(const std::string& path, size_t chunk_size,
+                     const std::function<void(const char* data, size_t size)>& output)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open())
+    return false;
+  TraceDecoder decoder(output);
+  std::string chunk(chunk_size, '\0');
+  while (file.read(&chunk[0], chunk.size()) || file.gcount() > 0) {
+    if (!decoder.Decode(chunk.data(), file.gcount()))
+      return false;
+  }
+  return !file.bad() && decoder.Finish();
+}
+
+bool trace_file_read(const std::string& path, std::string& contents)
+{
+  contents.clear();
+  return trace_file_scan(path, TRACE_FILE_CHUNK_SIZE,
+                         [&](const char* data, size_t size) { contents.append(data, size); });
+}
+
+bool trace_file_decode(const std::string& input, std::string& contents)
+{
+  contents.clear();
+  std::function<void(const char* data, size_t size)> output = [&](const char* data, size_t size) {
+    contents.append(data, size);
+  };
+  TraceDecoder decoder(output);
+  return decoder.Decode(input.data(), input.size()) && decoder.Finish();
+}
@@ -0,0 +1,61 @@
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#include "control_channel.h"
+#include "file_watcher.h"
+#include "smprofiler_config.h"
+
+static std::atomic_bool collection_enabled{true};
+static std::string control_file;
+static std::unique_ptr<FileWatcher> control_watcher;
+
+static void control_signal_handler(int signal)
+{
+  // only lock free atomics are safe here; the swap is atomic so a toggle
+  // racing with the control file is not lost
+  bool enabled = collection_enabled.load();
+  while (!collection_enabled.compare_exchange_weak(enabled, !enabled)) {
+  }
+}
+
+static void read_control_file()
+{
+  std::ifstream file(control_file);
+  std::string word;
+  bool enabled = true;
+  if (file >> word)
+    enabled = !(word == "off" || word == "disable" || word == "0");
+  if (enabled != collection_enabled.exchange(enabled))
+    printf("smprofiler: collection %s by %s\n", enabled ? "enabled" : "disabled", control_file.c_str());
+}
+
+void control_channel_init()
+{
+  if (control_watcher)
+    return;
+  control_file = smprofiler_config_string("SMPROFILER_CONTROL_FILE", smprofiler_output_path("control"));
+  control_watcher = std::make_unique<FileWatcher>(std::vector<std::string>{control_file},
+                                                  smprofiler_config_int("SMPROFILER_CONTROL_POLL_MS", 1000),
+                                                  read_control_file);
+
+  int signal_number = smprofiler_config_int("SMPROFILER_CONTROL_SIGNAL", 0);
+  if (signal_number > 0) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = control_signal_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(signal_number, &action, NULL) != 0)
+      perror("smprofiler: control signal");
+  }
+}
+
+bool control_channel_enabled()
+{
+  return collection_enabled;
+}
@@ -0,0 +1,825 @@
+// Stand-in for libcupti so the tracer -> timeline -> file pipeline can run,
+// be regression tested and load tested on a machine without a GPU. Link
+// smprofiler.so against libcupti_replay.so instead of -lcupti -lcuda.
+//
+// Activity buffers are requested from and handed back to the callbacks
+// registered with cuptiActivityRegisterCallbacks, either filled by a
+// synthetic workload generator (default) or replayed from a raw buffer dump
+// (SMPROFILER_SHIM_REPLAY=<dump file>, see activity_dump.h). Synthetic
+// records are laid out with the structs of the cupti.h the shim is built
+// against. Replayed ones are walked with the record sizes stored in the
+// dump, as long as they are no smaller than the structs the tracer reads.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <set>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <cuda.h>
+#include <cupti.h>
+
+#include "activity_dump.h"
+#include "smprofiler_config.h"
+
+#define SHIM_ALIGN (8)
+#define SHIM_ALIGN_SIZE(size) (((size) + SHIM_ALIGN - 1) & ~((size_t) SHIM_ALIGN - 1))
+#define SHIM_TICK_NS (1000000)
+#define SHIM_NUM_KERNEL_NAMES (16)
+#define SHIM_NUM_SOURCE_LINES (8)
+
+struct ShimSubscriber {
+  CUpti_CallbackFunc callback;
+  void* userdata;
+};
+
+static std::mutex mutex;
+static CUpti_BuffersCallbackRequestFunc request_buffer = NULL;
+static CUpti_BuffersCallbackCompleteFunc complete_buffer = NULL;
+static bool enabled_kinds[CUPTI_ACTIVITY_KIND_COUNT] = {};
+static size_t device_buffer_size = 3 * 1024 * 1024;
+static size_t device_buffer_pool_limit = 250;
+
+// buffer currently being filled, guarded by mutex
+static uint8_t* buffer = NULL;
+static size_t buffer_size = 0;
+static size_t buffer_used = 0;
+
+static ShimSubscriber subscriber_state = {NULL, NULL};
+// callbacks enabled with cuptiEnableDomain and cuptiEnableCallback
+static std::mutex callback_mutex;
+static std::set<uint32_t> enabled_domains;
+static std::set<std::pair<uint32_t, uint32_t>> enabled_callbacks;
+// stride of replayed records by kind, from the dump, 0 for the own structs
+static uint32_t replay_record_sizes[CUPTI_ACTIVITY_KIND_COUNT];
+
+static std::thread generator_thread;
+static std::atomic_bool generator_running{false};
+
+// synthetic workload, operations per second by type
+static long kernel_rate;
+static long memcpy_rate;
+static long memset_rate;
+static long sync_rate;
+static long nvtx_rate;
+static long alloc_rate;
+// outer NVTX ranges, ended on the next tick so that start and end markers
+// sometimes land in different buffers
+static std::vector<std::pair<uint32_t, uint64_t>> open_ranges;
+static uint32_t next_marker_id = 1;
+static uint32_t next_correlation_id = 1;
+// live synthetic allocations, (address, bytes)
+static std::vector<std::pair<uint64_t, uint64_t>> live_allocations;
+static uint64_t next_address = 0x7f0000000000ULL;
+static bool pool_created = false;
+// end of the last synthetic GPU operation, keeps the device timeline serial
+static uint64_t gpu_cursor = 0;
+static char kernel_names[SHIM_NUM_KERNEL_NAMES][32];
+// records that did not fit a buffer since the last
+// cuptiActivityGetNumDroppedRecords, which is called from bufferCompleted
+// with mutex held
+static std::atomic<size_t> dropped_records{0};
+// FUNCTION and SOURCE_LOCATOR records are sent once, like CUPTI does
+static bool functions_sent[SHIM_NUM_KERNEL_NAMES] = {};
+static bool source_lines_sent = false;
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t record_size(CUpti_ActivityKind kind)
+{
+  switch (kind) {
+  case CUPTI_ACTIVITY_KIND_MEMCPY:
+    return sizeof(CUpti_ActivityMemcpy);
+  case CUPTI_ACTIVITY_KIND_MEMCPY2:
+    return sizeof(CUpti_ActivityMemcpy2);
+  case CUPTI_ACTIVITY_KIND_MEMSET:
+    return sizeof(CUpti_ActivityMemset);
+  case CUPTI_ACTIVITY_KIND_KERNEL:
+  case CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL:
+    return sizeof(CUpti_ActivityKernel3);
+  case CUPTI_ACTIVITY_KIND_DRIVER:
+  case CUPTI_ACTIVITY_KIND_RUNTIME:
+    return sizeof(CUpti_ActivityAPI);
+  case CUPTI_ACTIVITY_KIND_DEVICE:
+    return sizeof(CUpti_ActivityDevice2);
+  case CUPTI_ACTIVITY_KIND_DEVICE_ATTRIBUTE:
+    return sizeof(CUpti_ActivityDeviceAttribute);
+  case CUPTI_ACTIVITY_KIND_CONTEXT:
+    return sizeof(CUpti_ActivityContext);
+  case CUPTI_ACTIVITY_KIND_NAME:
+    return sizeof(CUpti_ActivityName);
+  case CUPTI_ACTIVITY_KIND_MARKER:
+    return sizeof(CUpti_ActivityMarker2);
+  case CUPTI_ACTIVITY_KIND_MARKER_DATA:
+    return sizeof(CUpti_ActivityMarkerData);
+  case CUPTI_ACTIVITY_KIND_SYNCHRONIZATION:
+    return sizeof(CUpti_ActivitySynchronization);
+  case CUPTI_ACTIVITY_KIND_MEMORY2:
+    return sizeof(CUpti_ActivityMemory2);
+  case CUPTI_ACTIVITY_KIND_MEMORY_POOL:
+    return sizeof(CUpti_ActivityMemoryPool);
+  case CUPTI_ACTIVITY_KIND_OVERHEAD:
+    return sizeof(CUpti_ActivityOverhead);
+  case CUPTI_ACTIVITY_KIND_PC_SAMPLING:
+    return sizeof(CUpti_ActivityPCSampling2);
+  case CUPTI_ACTIVITY_KIND_PC_SAMPLING_RECORD_INFO:
+    return sizeof(CUpti_ActivityPCSamplingRecordInfo);
+  case CUPTI_ACTIVITY_KIND_FUNCTION:
+    return sizeof(CUpti_ActivityFunction);
+  case CUPTI_ACTIVITY_KIND_SOURCE_LOCATOR:
+    return sizeof(CUpti_ActivitySourceLocator);
+  default:
+    return 0;
+  }
+}
+
+// distance to the record after one of the kind
+static size_t record_stride(CUpti_ActivityKind kind)
+{
+  if ((uint32_t) kind < CUPTI_ACTIVITY_KIND_COUNT && replay_record_sizes[kind] != 0)
+    return replay_record_sizes[kind];
+  return SHIM_ALIGN_SIZE(record_size(kind));
+}
+
+int cupti_shim_set_record_size(uint32_t kind, uint32_t size)
+{
+  if (kind >= CUPTI_ACTIVITY_KIND_COUNT || size < record_size((CUpti_ActivityKind) kind))
+    return -1;
+  replay_record_sizes[kind] = size;
+  return 0;
+}
+
+static bool callback_enabled(CUpti_CallbackDomain domain, uint32_t cbid)
+{
+  std::lock_guard<std::mutex> guard(callback_mutex);
+  return enabled_domains.count(domain) || enabled_callbacks.count(std::make_pair((uint32_t) domain, cbid));
+}
+
+// hands the current buffer back to the tracer, called with mutex held
+static void complete_current_buffer()
+{
+  if (buffer == NULL)
+    return;
+  uint8_t* completed = buffer;
+  size_t size = buffer_size;
+  size_t used = buffer_used;
+  buffer = NULL;
+  buffer_used = 0;
+  complete_buffer(NULL, 0, completed, size, used);
+}
+
+// returns space for one record of the given kind, called with mutex held
+static void* append_record(CUpti_ActivityKind kind)
+{
+  size_t size = record_stride(kind);
+  if (buffer != NULL && buffer_used + size > buffer_size)
+    complete_current_buffer();
+  if (buffer == NULL) {
+    size_t max_records;
+    request_buffer(&buffer, &buffer_size, &max_records);
+    buffer_used = 0;
+    if (buffer == NULL || buffer_size < size) {
+      buffer = NULL;
+      dropped_records++;
+      return NULL;
+    }
+  }
+  void* record = buffer + buffer_used;
+  memset(record, 0, size);
+  buffer_used += size;
+  ((CUpti_Activity*) record)->kind = kind;
+  return record;
+}
+
+static void invoke_runtime_callback(CUpti_runtime_api_trace_cbid cbid, CUpti_ApiCallbackSite site, uint32_t correlation_id)
+{
+  if (subscriber_state.callback == NULL || !callback_enabled(CUPTI_CB_DOMAIN_RUNTIME_API, cbid))
+    return;
+  CUpti_CallbackData data;
+  memset(&data, 0, sizeof(data));
+  data.callbackSite = site;
+  data.functionName = "synthetic";
+  data.correlationId = correlation_id;
+  subscriber_state.callback(subscriber_state.userdata, CUPTI_CB_DOMAIN_RUNTIME_API, cbid, &data);
+}
+
+// PC samples of one kernel, a few PCs per kernel each stalled for a reason
+// depending on the kernel. Called with mutex held.
+static void generate_pc_samples(uint32_t function_id, uint32_t correlation_id, uint64_t duration)
+{
+  if (!enabled_kinds[CUPTI_ACTIVITY_KIND_PC_SAMPLING])
+    return;
+  if (!source_lines_sent && enabled_kinds[CUPTI_ACTIVITY_KIND_SOURCE_LOCATOR]) {
+    for (uint32_t line = 0; line < SHIM_NUM_SOURCE_LINES; line++) {
+      CUpti_ActivitySourceLocator* locator = (CUpti_ActivitySourceLocator*) append_record(CUPTI_ACTIVITY_KIND_SOURCE_LOCATOR);
+      if (locator == NULL)
+        return;
+      locator->id = line + 1;
+      locator->lineNumber = 100 + 10 * line;
+      locator->fileName = "synthetic_kernels.cu";
+    }
+    source_lines_sent = true;
+  }
+  if (!functions_sent[function_id] && enabled_kinds[CUPTI_ACTIVITY_KIND_FUNCTION]) {
+    CUpti_ActivityFunction* function = (CUpti_ActivityFunction*) append_record(CUPTI_ACTIVITY_KIND_FUNCTION);
+    if (function == NULL)
+      return;
+    function->id = function_id;
+    function->contextId = 1;
+    function->moduleId = 1;
+    function->functionIndex = function_id;
+    function->name = kernel_names[function_id];
+    functions_sent[function_id] = true;
+  }
+  uint64_t total = 0;
+  for (uint32_t pc = 0; pc < 4; pc++) {
+    CUpti_ActivityPCSampling2* sample = (CUpti_ActivityPCSampling2*) append_record(CUPTI_ACTIVITY_KIND_PC_SAMPLING);
+    if (sample == NULL)
+      return;
+    sample->correlationId = correlation_id;
+    sample->functionId = function_id;
+    sample->pcOffset = 0x10 * (pc + 1) + 0x100 * (function_id % 4);
+    // the last PC has no source line, as for code without line info
+    sample->sourceLocatorId = pc < 3 ? 1 + (function_id + pc) % SHIM_NUM_SOURCE_LINES : 0;
+    sample->stallReason = (CUpti_ActivityPCSamplingStallReason)
+      (CUPTI_ACTIVITY_PC_SAMPLING_STALL_INST_FETCH + (function_id + pc) % 10);
+    sample->samples = 1 + (uint32_t) (duration / 1000) / (pc + 1);
+    sample->latencySamples = sample->samples / 2;
+    total += sample->samples;
+  }
+  if (enabled_kinds[CUPTI_ACTIVITY_KIND_PC_SAMPLING_RECORD_INFO]) {
+    CUpti_ActivityPCSamplingRecordInfo* info =
+      (CUpti_ActivityPCSamplingRecordInfo*) append_record(CUPTI_ACTIVITY_KIND_PC_SAMPLING_RECORD_INFO);
+    if (info == NULL)
+      return;
+    info->correlationId = correlation_id;
+    info->totalSamples = total;
+    info->droppedSamples = 0;
+    info->samplingPeriodInCycles = 1 << 17;
+  }
+}
+
+// one API call and the GPU operation it launches, called with mutex held
+static void generate_operation(CUpti_ActivityKind kind, CUpti_runtime_api_trace_cbid cbid, uint64_t now)
+{
+  uint32_t correlation_id = next_correlation_id++;
+  invoke_runtime_callback(cbid, CUPTI_API_ENTER, correlation_id);
+  invoke_runtime_callback(cbid, CUPTI_API_EXIT, correlation_id);
+
+  uint64_t api_end = now + 2000;
+  if (enabled_kinds[CUPTI_ACTIVITY_KIND_RUNTIME]) {
+    CUpti_ActivityAPI* api = (CUpti_ActivityAPI*) append_record(CUPTI_ACTIVITY_KIND_RUNTIME);
+    if (api != NULL) {
+      api->cbid = cbid;
+      api->start = now;
+      api->end = api_end;
+      api->processId = getpid();
+      api->threadId = 1;
+      api->correlationId = correlation_id;
+    }
+  }
+
+  uint64_t start = (gpu_cursor > api_end) ? gpu_cursor : api_end + 1000;
+  uint64_t duration = 5000 + correlation_id % 50000;
+  gpu_cursor = start + duration;
+
+  if (kind == CUPTI_ACTIVITY_KIND_KERNEL) {
+    kind = enabled_kinds[CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL] ? CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL : CUPTI_ACTIVITY_KIND_KERNEL;
+    if (!enabled_kinds[kind])
+      return;
+    CUpti_ActivityKernel3* kernel = (CUpti_ActivityKernel3*) append_record(kind);
+    if (kernel == NULL)
+      return;
+    kernel->start = start;
+    kernel->end = start + duration;
+    kernel->streamId = 7;
+    kernel->gridX = 128;
+    kernel->gridY = kernel->gridZ = 1;
+    kernel->blockX = 256;
+    kernel->blockY = kernel->blockZ = 1;
+    kernel->correlationId = correlation_id;
+    kernel->name = kernel_names[correlation_id % SHIM_NUM_KERNEL_NAMES];
+    generate_pc_samples(correlation_id % SHIM_NUM_KERNEL_NAMES, correlation_id, duration);
+  } else if (kind == CUPTI_ACTIVITY_KIND_MEMCPY && enabled_kinds[kind]) {
+    CUpti_ActivityMemcpy* memcpy = (CUpti_ActivityMemcpy*) append_record(kind);
+    if (memcpy == NULL)
+      return;
+    memcpy->copyKind = (correlation_id % 4) ? CUPTI_ACTIVITY_MEMCPY_KIND_HTOD : CUPTI_ACTIVITY_MEMCPY_KIND_DTOH;
+    memcpy->srcKind = (correlation_id % 8) ? CUPTI_ACTIVITY_MEMORY_KIND_PINNED : CUPTI_ACTIVITY_MEMORY_KIND_PAGEABLE;
+    memcpy->dstKind = CUPTI_ACTIVITY_MEMORY_KIND_DEVICE;
+    memcpy->flags = (cbid == CUPTI_RUNTIME_TRACE_CBID_cudaMemcpyAsync_v3020) ? CUPTI_ACTIVITY_FLAG_MEMCPY_ASYNC : 0;
+    memcpy->bytes = duration * 10;
+    memcpy->start = start;
+    memcpy->end = start + duration;
+    memcpy->streamId = 7;
+    memcpy->correlationId = correlation_id;
+  } else if (kind == CUPTI_ACTIVITY_KIND_MEMSET && enabled_kinds[kind]) {
+    CUpti_ActivityMemset* memset = (CUpti_ActivityMemset*) append_record(kind);
+    if (memset == NULL)
+      return;
+    memset->bytes = duration * 50;
+    memset->start = start;
+    memset->end = start + duration;
+    memset->streamId = 7;
+    memset->correlationId = correlation_id;
+  } else if (kind == CUPTI_ACTIVITY_KIND_SYNCHRONIZATION && enabled_kinds[kind]) {
+    CUpti_ActivitySynchronization* sync = (CUpti_ActivitySynchronization*) append_record(kind);
+    if (sync == NULL)
+      return;
+    sync->type = CUPTI_ACTIVITY_SYNCHRONIZATION_TYPE_STREAM_SYNCHRONIZE;
+    sync->start = now;
+    sync->end = gpu_cursor;
+    sync->streamId = 7;
+    sync->correlationId = correlation_id;
+  }
+}
+
+// called with mutex held
+static void append_marker(uint32_t flags, uint32_t id, uint64_t timestamp, const char* name)
+{
+  if (!enabled_kinds[CUPTI_ACTIVITY_KIND_MARKER])
+    return;
+  CUpti_ActivityMarker2* marker = (CUpti_ActivityMarker2*) append_record(CUPTI_ACTIVITY_KIND_MARKER);
+  if (marker == NULL)
+    return;
+  marker->flags = flags;
+  marker->id = id;
+  marker->timestamp = timestamp;
+  marker->objectKind = CUPTI_ACTIVITY_OBJECT_THREAD;
+  marker->objectId.pt.processId = getpid();
+  marker->objectId.pt.threadId = 1;
+  marker->name = name;
+  marker->domain = name != NULL ? "shim" : NULL;
+}
+
+// a colored NVTX range with a nested one, called with mutex held
+static void generate_range(uint64_t now)
+{
+  uint32_t outer = next_marker_id++;
+  append_marker(CUPTI_ACTIVITY_FLAG_MARKER_START, outer, now, "synthetic_range");
+  if (enabled_kinds[CUPTI_ACTIVITY_KIND_MARKER_DATA]) {
+    CUpti_ActivityMarkerData* data = (CUpti_ActivityMarkerData*) append_record(CUPTI_ACTIVITY_KIND_MARKER_DATA);
+    if (data != NULL) {
+      data->flags = CUPTI_ACTIVITY_FLAG_MARKER_COLOR_ARGB;
+      data->id = outer;
+      data->color = 0xff76b900;
+      data->category = 1;
+      data->payloadKind = CUPTI_METRIC_VALUE_KIND_UINT64;
+      data->payload.metricValueUint64 = outer;
+    }
+  }
+  uint32_t inner = next_marker_id++;
+  append_marker(CUPTI_ACTIVITY_FLAG_MARKER_START, inner, now + 1000, "synthetic_nested_range");
+  append_marker(CUPTI_ACTIVITY_FLAG_MARKER_END, inner, now + 500000, NULL);
+  open_ranges.push_back(std::make_pair(outer, now + 900000));
+}
+
+// called with mutex held
+static void append_overhead(CUpti_ActivityOverheadKind overhead_kind, uint64_t start, uint64_t end)
+{
+  if (!enabled_kinds[CUPTI_ACTIVITY_KIND_OVERHEAD])
+    return;
+  CUpti_ActivityOverhead* overhead = (CUpti_ActivityOverhead*) append_record(CUPTI_ACTIVITY_KIND_OVERHEAD);
+  if (overhead == NULL)
+    return;
+  overhead->overheadKind = overhead_kind;
+  overhead->objectKind = CUPTI_ACTIVITY_OBJECT_THREAD;
+  overhead->objectId.pt.processId = getpid();
+  overhead->objectId.pt.threadId = 1;
+  overhead->start = start;
+  overhead->end = end;
+}
+
+// called with mutex held
+static void append_memory(CUpti_ActivityMemoryOperationType operation, uint64_t address, uint64_t bytes,
+                          uint64_t timestamp, uint32_t correlation_id)
+{
+  if (!enabled_kinds[CUPTI_ACTIVITY_KIND_MEMORY2])
+    return;
+  CUpti_ActivityMemory2* memory = (CUpti_ActivityMemory2*) append_record(CUPTI_ACTIVITY_KIND_MEMORY2);
+  if (memory == NULL)
+    return;
+  memory->memoryOperationType = operation;
+  memory->memoryKind = CUPTI_ACTIVITY_MEMORY_KIND_DEVICE;
+  memory->correlationId = correlation_id;
+  memory->address = address;
+  memory->bytes = bytes;
+  memory->timestamp = timestamp;
+  memory->PC = 0x400000 + (bytes >> 20) % 8 * 0x100;
+  memory->processId = getpid();
+  memory->contextId = 1;
+  memory->streamId = 7;
+}
+
+// A cudaMalloc growing the working set up to 64 live allocations of 1 to
+// 8 MB, each one releasing the oldest one after that. Called with mutex held.
+static void generate_allocation(uint64_t now)
+{
+  if (!pool_created && enabled_kinds[CUPTI_ACTIVITY_KIND_MEMORY_POOL]) {
+    CUpti_ActivityMemoryPool* pool = (CUpti_ActivityMemoryPool*) append_record(CUPTI_ACTIVITY_KIND_MEMORY_POOL);
+    if (pool != NULL) {
+      pool->memoryPoolOperationType = CUPTI_ACTIVITY_MEMORY_POOL_OPERATION_TYPE_CREATED;
+      pool->address = 0x7e0000000000ULL;
+      pool->size = 256ULL << 20;
+      pool->timestamp = now;
+      pool_created = true;
+    }
+  }
+  uint32_t correlation_id = next_correlation_id++;
+  invoke_runtime_callback(CUPTI_RUNTIME_TRACE_CBID_cudaMalloc_v3020, CUPTI_API_ENTER, correlation_id);
+  invoke_runtime_callback(CUPTI_RUNTIME_TRACE_CBID_cudaMalloc_v3020, CUPTI_API_EXIT, correlation_id);
+  uint64_t bytes = (1 + correlation_id % 8) << 20;
+  append_memory(CUPTI_ACTIVITY_MEMORY_OPERATION_TYPE_ALLOCATION, next_address, bytes, now, correlation_id);
+  live_allocations.push_back(std::make_pair(next_address, bytes));
+  next_address += bytes;
+  if (live_allocations.size() > 64) {
+    append_memory(CUPTI_ACTIVITY_MEMORY_OPERATION_TYPE_RELEASE, live_allocations.front().first,
+                  live_allocations.front().second, now + 1000, next_correlation_id++);
+    live_allocations.erase(live_allocations.begin());
+  }
+}
+
+// generates count operations of one type, carrying the fractional part
+static void generate(long rate, uint64_t elapsed_ns, double& carry, CUpti_ActivityKind kind,
+                     CUpti_runtime_api_trace_cbid cbid, uint64_t now)
+{
+  carry += (double) rate * elapsed_ns / 1e9;
+  while (carry >= 1.0) {
+    generate_operation(kind, cbid, now);
+    carry -= 1.0;
+  }
+}
+
+static void generator_loop()
+{
+  double kernel_carry = 0, memcpy_carry = 0, memset_carry = 0, sync_carry = 0, nvtx_carry = 0, alloc_carry = 0;
+  uint64_t last = now_ns();
+  while (generator_running) {
+    struct timespec tick = {0, SHIM_TICK_NS};
+    nanosleep(&tick, NULL);
+    uint64_t now = now_ns();
+    uint64_t elapsed = now - last;
+    last = now;
+
+    std::lock_guard<std::mutex> guard(mutex);
+    if (request_buffer == NULL)
+      continue;
+    generate(kernel_rate, elapsed, kernel_carry, CUPTI_ACTIVITY_KIND_KERNEL,
+             CUPTI_RUNTIME_TRACE_CBID_cudaLaunchKernel_v7000, now);
+    generate(memcpy_rate, elapsed, memcpy_carry, CUPTI_ACTIVITY_KIND_MEMCPY,
+             CUPTI_RUNTIME_TRACE_CBID_cudaMemcpyAsync_v3020, now);
+    generate(memset_rate, elapsed, memset_carry, CUPTI_ACTIVITY_KIND_MEMSET,
+             CUPTI_RUNTIME_TRACE_CBID_cudaMemsetAsync_v3020, now);
+    generate(sync_rate, elapsed, sync_carry, CUPTI_ACTIVITY_KIND_SYNCHRONIZATION,
+             CUPTI_RUNTIME_TRACE_CBID_cudaStreamSynchronize_v3020, now);
+
+    for (auto& range : open_ranges) {
+      append_marker(CUPTI_ACTIVITY_FLAG_MARKER_END, range.first, range.second, NULL);
+    }
+    open_ranges.clear();
+    for (nvtx_carry += (double) nvtx_rate * elapsed / 1e9; nvtx_carry >= 1.0; nvtx_carry -= 1.0) {
+      generate_range(now);
+    }
+    for (alloc_carry += (double) alloc_rate * elapsed / 1e9; alloc_carry >= 1.0; alloc_carry -= 1.0) {
+      generate_allocation(now);
+    }
+    // generating the tick stands in for CUPTI's instrumentation
+    append_overhead(CUPTI_ACTIVITY_OVERHEAD_CUPTI_INSTRUMENTATION, now, now_ns());
+  }
+}
+
+// Feeds every buffer of a dump to the tracer, SMPROFILER_SHIM_REPLAY_LOOPS
+// times. Runs on the generator thread.
+static void replay_loop(std::string path)
+{
+  long loops = smprofiler_config_int("SMPROFILER_SHIM_REPLAY_LOOPS", 1);
+  // strings stay valid for the records of later loops
+  static ActivityDumpStrings strings;
+  for (long loop = 0; loop < loops && generator_running; loop++) {
+    FILE* file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+      printf("cupti shim: could not open dump %s\n", path.c_str());
+      return;
+    }
+    ActivityDumpHeader header;
+    bool sizes_known = false, rejected = false;
+    while (!rejected && generator_running && fread(&header, sizeof(header), 1, file) == 1) {
+      if (header.magic != ACTIVITY_DUMP_MAGIC) {
+        printf("cupti shim: corrupt dump %s\n", path.c_str());
+        break;
+      }
+      if (header.type == ACTIVITY_DUMP_RECORD_SIZES) {
+        std::vector<ActivityDumpRecordSize> sizes(header.valid_size / sizeof(ActivityDumpRecordSize));
+        if (fread(sizes.data(), sizeof(ActivityDumpRecordSize), sizes.size(), file) != sizes.size())
+          break;
+        fseek(file, activity_dump_padded_size(header.valid_size) - sizes.size() * sizeof(ActivityDumpRecordSize),
+              SEEK_CUR);
+        for (const ActivityDumpRecordSize& size : sizes) {
+          if (cupti_shim_set_record_size(size.kind, size.size) != 0) {
+            printf("cupti shim: records of kind %u in dump %s are %u bytes, smaller than the CUPTI %u struct\n",
+                   size.kind, path.c_str(), size.size, CUPTI_API_VERSION);
+            rejected = true;
+            break;
+          }
+        }
+        sizes_known = true;
+        continue;
+      }
+      // without record sizes buffers only walk with the structs they were written with
+      if (!sizes_known && header.type == ACTIVITY_DUMP_BUFFER && header.cupti_version != CUPTI_API_VERSION) {
+        printf("cupti shim: dump %s was recorded with CUPTI API version %u and no record sizes, shim uses %u\n",
+               path.c_str(), header.cupti_version, CUPTI_API_VERSION);
+        break;
+      }
+      if (header.type == ACTIVITY_DUMP_STRING) {
+        std::string string(header.valid_size, '\0');
+        if (fread(&string[0], 1, header.valid_size, file) != header.valid_size)
+          break;
+        strings.Add(header.context, string.data(), string.size());
+        fseek(file, activity_dump_padded_size(header.valid_size) - header.valid_size, SEEK_CUR);
+        continue;
+      }
+      // phase marks are for the offline decoder, the replayed session has its own
+      if (header.type != ACTIVITY_DUMP_BUFFER) {
+        fseek(file, activity_dump_padded_size(header.valid_size), SEEK_CUR);
+        continue;
+      }
+
+      std::lock_guard<std::mutex> guard(mutex);
+      uint8_t* replay_buffer;
+      size_t size, max_records;
+      request_buffer(&replay_buffer, &size, &max_records);
+      size_t valid_size = header.valid_size;
+      if (valid_size > size) {
+        printf("cupti shim: dump buffer of %zu bytes truncated to %zu\n", valid_size, size);
+        valid_size = size;
+      }
+      if (fread(replay_buffer, 1, valid_size, file) != valid_size) {
+        complete_buffer(NULL, 0, replay_buffer, size, 0);
+        break;
+      }
+      fseek(file, activity_dump_padded_size(header.valid_size) - valid_size, SEEK_CUR);
+      strings.Patch(replay_buffer, valid_size);
+      complete_buffer((CUcontext) header.context, header.stream_id, replay_buffer, size, valid_size);
+    }
+    fclose(file);
+  }
+}
+
+static void stop_generator()
+{
+  generator_running = false;
+  if (generator_thread.joinable())
+    generator_thread.join();
+}
+
+// Like the real CUDA, a forked child gets no activity from the parent's
+// generator; the thread object it inherits is dropped without a join.
+static void after_fork_child()
+{
+  // the thread does not exist here to be joined or detached
+  new (&generator_thread) std::thread();
+  generator_running = false;
+}
+
+static void start_generator()
+{
+  if (generator_running)
+    return;
+  kernel_rate = smprofiler_config_int("SMPROFILER_SHIM_KERNEL_RATE", 10000);
+  memcpy_rate = smprofiler_config_int("SMPROFILER_SHIM_MEMCPY_RATE", 500);
+  memset_rate = smprofiler_config_int("SMPROFILER_SHIM_MEMSET_RATE", 100);
+  sync_rate = smprofiler_config_int("SMPROFILER_SHIM_SYNC_RATE", 50);
+  nvtx_rate = smprofiler_config_int("SMPROFILER_SHIM_NVTX_RATE", 20);
+  alloc_rate = smprofiler_config_int("SMPROFILER_SHIM_ALLOC_RATE", 200);
+  for (int i = 0; i < SHIM_NUM_KERNEL_NAMES; i++) {
+    snprintf(kernel_names[i], sizeof(kernel_names[i]), "synthetic_kernel_%d", i);
+  }
+
+  generator_running = true;
+  std::string replay_path = smprofiler_config_string("SMPROFILER_SHIM_REPLAY", "");
+  if (replay_path.empty())
+    generator_thread = std::thread(generator_loop);
+  else
+    generator_thread = std::thread(replay_loop, replay_path);
+  static bool registered = false;
+  if (!registered) {
+    pthread_atfork(NULL, NULL, after_fork_child);
+    atexit(stop_generator);
+    registered = true;
+  }
+}
+
+CUptiResult cuptiGetResultString(CUptiResult result, const char** str)
+{
+  *str = (result == CUPTI_SUCCESS) ? "CUPTI_SUCCESS" : "CUPTI shim error";
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiGetVersion(uint32_t* version)
+{
+  *version = CUPTI_API_VERSION;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiGetCallbackName(CUpti_CallbackDomain domain, uint32_t cbid, const char** name)
+{
+  switch (cbid) {
+  case CUPTI_RUNTIME_TRACE_CBID_cudaLaunchKernel_v7000:
+    *name = "cudaLaunchKernel_v7000";
+    break;
+  case CUPTI_RUNTIME_TRACE_CBID_cudaMemcpyAsync_v3020:
+    *name = "cudaMemcpyAsync_v3020";
+    break;
+  case CUPTI_RUNTIME_TRACE_CBID_cudaMemsetAsync_v3020:
+    *name = "cudaMemsetAsync_v3020";
+    break;
+  case CUPTI_RUNTIME_TRACE_CBID_cudaStreamSynchronize_v3020:
+    *name = "cudaStreamSynchronize_v3020";
+    break;
+  default:
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivityEnable(CUpti_ActivityKind kind)
+{
+  if (kind >= CUPTI_ACTIVITY_KIND_COUNT)
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  enabled_kinds[kind] = true;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivityDisable(CUpti_ActivityKind kind)
+{
+  if (kind >= CUPTI_ACTIVITY_KIND_COUNT)
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  enabled_kinds[kind] = false;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivityRegisterCallbacks(CUpti_BuffersCallbackRequestFunc request, CUpti_BuffersCallbackCompleteFunc complete)
+{
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    request_buffer = request;
+    complete_buffer = complete;
+  }
+  start_generator();
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivityGetNextRecord(uint8_t* records, size_t validBufferSizeBytes, CUpti_Activity** record)
+{
+  size_t offset = 0;
+  if (*record != NULL) {
+    offset = (uint8_t*) *record - records;
+    offset += record_stride((*record)->kind);
+  }
+  if (offset + sizeof(CUpti_Activity) > validBufferSizeBytes)
+    return CUPTI_ERROR_MAX_LIMIT_REACHED;
+
+  CUpti_Activity* next = (CUpti_Activity*) (records + offset);
+  size_t size = record_size(next->kind);
+  if (size == 0 || offset + size > validBufferSizeBytes) {
+    // unknown layout, the rest of the buffer can't be walked
+    return CUPTI_ERROR_MAX_LIMIT_REACHED;
+  }
+  *record = next;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivityFlushAll(uint32_t flag)
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (complete_buffer != NULL) {
+    uint64_t now = now_ns();
+    append_overhead(CUPTI_ACTIVITY_OVERHEAD_CUPTI_BUFFER_FLUSH, now, now + 1000);
+    complete_current_buffer();
+  }
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivityGetAttribute(CUpti_ActivityAttribute attr, size_t* valueSize, void* value)
+{
+  if (*valueSize < sizeof(size_t))
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  switch (attr) {
+  case CUPTI_ACTIVITY_ATTR_DEVICE_BUFFER_SIZE:
+    *(size_t*) value = device_buffer_size;
+    break;
+  case CUPTI_ACTIVITY_ATTR_DEVICE_BUFFER_POOL_LIMIT:
+    *(size_t*) value = device_buffer_pool_limit;
+    break;
+  default:
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivitySetAttribute(CUpti_ActivityAttribute attr, size_t* valueSize, void* value)
+{
+  if (*valueSize < sizeof(size_t))
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  switch (attr) {
+  case CUPTI_ACTIVITY_ATTR_DEVICE_BUFFER_SIZE:
+    device_buffer_size = *(size_t*) value;
+    break;
+  case CUPTI_ACTIVITY_ATTR_DEVICE_BUFFER_POOL_LIMIT:
+    device_buffer_pool_limit = *(size_t*) value;
+    break;
+  default:
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  }
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiGetTimestamp(uint64_t* timestamp)
+{
+  *timestamp = now_ns();
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiGetContextId(CUcontext context, uint32_t* contextId)
+{
+  *contextId = 1;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivityGetNumDroppedRecords(CUcontext context, uint32_t streamId, size_t* dropped)
+{
+  *dropped = dropped_records.exchange(0);
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiActivityConfigurePCSampling(CUcontext ctx, CUpti_ActivityPCSamplingConfig* config)
+{
+  if (config == NULL)
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiDeviceGetTimestamp(CUcontext context, uint64_t* timestamp)
+{
+  *timestamp = now_ns();
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiSubscribe(CUpti_SubscriberHandle* subscriber, CUpti_CallbackFunc callback, void* userdata)
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (subscriber_state.callback != NULL)
+    return CUPTI_ERROR_INVALID_PARAMETER;
+  subscriber_state.callback = callback;
+  subscriber_state.userdata = userdata;
+  *subscriber = (CUpti_SubscriberHandle) &subscriber_state;
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiUnsubscribe(CUpti_SubscriberHandle subscriber)
+{
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    subscriber_state.callback = NULL;
+  }
+  std::lock_guard<std::mutex> guard(callback_mutex);
+  enabled_domains.clear();
+  enabled_callbacks.clear();
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEnableDomain(uint32_t enable, CUpti_SubscriberHandle subscriber, CUpti_CallbackDomain domain)
+{
+  std::lock_guard<std::mutex> guard(callback_mutex);
+  if (enable)
+    enabled_domains.insert(domain);
+  else
+    enabled_domains.erase(domain);
+  // like CUPTI, the domain switch covers every callback in it
+  for (auto it = enabled_callbacks.begin(); it != enabled_callbacks.end();)
+    it = it->first == (uint32_t) domain ? enabled_callbacks.erase(it) : std::next(it);
+  return CUPTI_SUCCESS;
+}
+
+CUptiResult cuptiEnableCallback(uint32_t enable, CUpti_SubscriberHandle subscriber, CUpti_CallbackDomain domain, CUpti_CallbackId cbid)
+{
+  std::lock_guard<std::mutex> guard(callback_mutex);
+  if (enable)
+    enabled_callbacks.insert(std::make_pair((uint32_t) domain, (uint32_t) cbid));
+  else
+    enabled_callbacks.erase(std::make_pair((uint32_t) domain, (uint32_t) cbid));
+  return CUPTI_SUCCESS;
+}
@@ -1,6 +1,24 @@
+#include <string.h>
+#include <mutex>
+#include <vector>
 #include "activity_definitions.h"
 #include "cupti_tracer.h"
 #include "smprofiler_timeline.h"
+#include "callstack_collector.h"
+#include "pystack_collector.h"
+#include "activity_aggregator.h"
+#include "idle_gap_analyzer.h"
+#include "memcpy_analyzer.h"
+#include "marker_pairing.h"
+#include "memory_tracker.h"
+#include "overhead_monitor.h"
+#include "overhead_governor.h"
+#include "pc_sampling.h"
+#include "live_stats.h"
+#include "metrics_exporter.h"
+#include "activity_dump.h"
+#include "activity_dump_writer.h"
+#include "stack_table.h"
 
 #define CUPTI_CALL(call)                                                    \
   do {                                                                      \
@@ -16,8 +34,6 @@
 
 #define BUF_SIZE (32 * 1024)
 #define ALIGN_SIZE (8)
-#define ALIGN_BUFFER(buffer, align)                                            \
-  (((uintptr_t) (buffer) & ((align)-1)) ? ((buffer) + (align) - ((uintptr_t) (buffer) & ((align)-1))) : (buffer))
 
 // start timestamp
 static uint64_t start_timestamp;
@@ -28,8 +44,60 @@ CUpti_SubscriberHandle subscriber;
 // timeline writer to create chrome trace output file
 Timeline& tl = Timeline::getInstance();
 
-// phase name provided by user in the python script
-static char* phase;
+// phase name provided by user in the python script, copied as the python
+// string does not outlive smprofiler.start()
+static char phase[256];
+
+// activity kinds traced while a phase runs
+static const CUpti_ActivityKind activity_kinds[] = {
+  CUPTI_ACTIVITY_KIND_DEVICE,
+  CUPTI_ACTIVITY_KIND_CONTEXT,
+  CUPTI_ACTIVITY_KIND_DRIVER,
+  CUPTI_ACTIVITY_KIND_RUNTIME,
+  CUPTI_ACTIVITY_KIND_MEMCPY,
+  CUPTI_ACTIVITY_KIND_MEMSET,
+  CUPTI_ACTIVITY_KIND_NAME,
+  CUPTI_ACTIVITY_KIND_MARKER,
+  CUPTI_ACTIVITY_KIND_MARKER_DATA,
+  CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL,
+  CUPTI_ACTIVITY_KIND_SYNCHRONIZATION,
+};
+
+// traced in addition while memory tracking is enabled
+static const CUpti_ActivityKind memory_activity_kinds[] = {
+  CUPTI_ACTIVITY_KIND_MEMORY2,
+  CUPTI_ACTIVITY_KIND_MEMORY_POOL,
+};
+
+// traced in addition in PC sampling mode
+static const CUpti_ActivityKind pc_sampling_activity_kinds[] = {
+  CUPTI_ACTIVITY_KIND_PC_SAMPLING,
+  CUPTI_ACTIVITY_KIND_PC_SAMPLING_RECORD_INFO,
+  CUPTI_ACTIVITY_KIND_FUNCTION,
+  CUPTI_ACTIVITY_KIND_SOURCE_LOCATOR,
+};
+
+// enables or disables the activity kinds of the phase
+static void set_activity_kinds(bool enable)
+{
+  bool drop_api = overhead_governor_level() >= GOVERNOR_NO_API;
+  for (CUpti_ActivityKind kind : activity_kinds) {
+    bool api = kind == CUPTI_ACTIVITY_KIND_DRIVER || kind == CUPTI_ACTIVITY_KIND_RUNTIME;
+    CUPTI_CALL(enable && !(api && drop_api) ? cuptiActivityEnable(kind) : cuptiActivityDisable(kind));
+  }
+  if (memory_tracker_enabled()) {
+    for (CUpti_ActivityKind kind : memory_activity_kinds) {
+      CUPTI_CALL(enable ? cuptiActivityEnable(kind) : cuptiActivityDisable(kind));
+    }
+  }
+  if (pc_sampling_enabled()) {
+    for (CUpti_ActivityKind kind : pc_sampling_activity_kinds) {
+      CUPTI_CALL(enable ? cuptiActivityEnable(kind) : cuptiActivityDisable(kind));
+    }
+  }
+  if (overhead_monitor_enabled())
+    CUPTI_CALL(enable ? cuptiActivityEnable(CUPTI_ACTIVITY_KIND_OVERHEAD) : cuptiActivityDisable(CUPTI_ACTIVITY_KIND_OVERHEAD));
+}
 
 static void print_activity(CUpti_Activity *record)
 {
@@ -66,7 +134,26 @@ static void print_activity(CUpti_Activity *record)
     }
   case CUPTI_ACTIVITY_KIND_MEMCPY:
     {
-      CUpti_ActivityMemcpy2 *memcpy = (CUpti_ActivityMemcpy2 *) record;
+      CUpti_ActivityMemcpy *memcpy = (CUpti_ActivityMemcpy *) record;
+      MemcpyRecord copy = {memcpy->copyKind, memcpy->srcKind, memcpy->dstKind,
+                           (memcpy->flags & CUPTI_ACTIVITY_FLAG_MEMCPY_ASYNC) != 0,
+                           memcpy->bytes, memcpy->start, memcpy->end};
+      uint32_t flags = memcpy_analyzer_add(phase, copy);
+      std::string args = ", \"correlation_id\":" + std::to_string(memcpy->correlationId) +
+                         ", \"bytes\":" + std::to_string(memcpy->bytes);
+      if (flags & MEMCPY_FLAG_PAGEABLE)
+        args += ", \"pageable\":true";
+      if (flags & MEMCPY_FLAG_SYNC)
+        args += ", \"sync\":true";
+      if (flags & MEMCPY_FLAG_SMALL_STORM)
+        args += ", \"small_copy_storm\":true";
+      tl.SMRecordDeviceEvent(phase, std::string("memcpy_") + get_memcopy_events_string((CUpti_ActivityMemcpyKind)memcpy->copyKind),
+                             memcpy->start/1000, (memcpy->end - memcpy->start)/1000,
+                             memcpy->deviceId, memcpy->streamId, args);
+      activity_aggregator_record(phase, "memcpy", get_memcopy_events_string((CUpti_ActivityMemcpyKind)memcpy->copyKind),
+                                 memcpy->end - memcpy->start);
+      idle_gap_add_gpu(phase, memcpy->deviceId, memcpy->start, memcpy->end, memcpy->correlationId);
+      live_stats_add_memcpy(memcpy->bytes, memcpy->end - memcpy->start);
       printf("Phase %s MEMCPY %s [ %llu - %llu ] device %u, context %u, stream %u, size %llu, correlation %u\n",
               phase, get_memcopy_events_string((CUpti_ActivityMemcpyKind)memcpy->copyKind),
               (unsigned long long) (memcpy->start - start_timestamp),
@@ -78,6 +165,9 @@ static void print_activity(CUpti_Activity *record)
   case CUPTI_ACTIVITY_KIND_MEMSET:
     {
       CUpti_ActivityMemset *memset = (CUpti_ActivityMemset *) record;
+      activity_aggregator_record(phase, "memset", "memset", memset->end - memset->start);
+      idle_gap_add_gpu(phase, memset->deviceId, memset->start, memset->end, memset->correlationId);
+      live_stats_add_gpu(NULL, memset->end - memset->start);
       printf("Phase %s MEMSET value=%u [ %llu - %llu ] device %u, context %u, stream %u, correlation %u\n",
              phase, memset->value,
              (unsigned long long) (memset->start - start_timestamp),
@@ -91,7 +181,26 @@ static void print_activity(CUpti_Activity *record)
     {
       const char* kindString = (record->kind == CUPTI_ACTIVITY_KIND_KERNEL) ? "KERNEL" : "CONC KERNEL";
       CUpti_ActivityKernel3 *kernel = (CUpti_ActivityKernel3 *) record;
-//      tl.SMRecordEvent(phase, kernel->name, kernel->start/1000.0, (kernel->end - kernel->start)/1000,  "X");
+      std::string args = ", \"correlation_id\":" + std::to_string(kernel->correlationId) +
+                         ", \"grid\": \"" + std::to_string(kernel->gridX) + "x" + std::to_string(kernel->gridY) + "x" +
+                         std::to_string(kernel->gridZ) + "\", \"block\": \"" + std::to_string(kernel->blockX) + "x" +
+                         std::to_string(kernel->blockY) + "x" + std::to_string(kernel->blockZ) + "\"";
+      uint32_t stack_id = callstack_lookup(kernel->correlationId);
+      if (stack_id != StackTable::INVALID_ID)
+        args += ", \"stack_id\":" + std::to_string(stack_id);
+      uint32_t py_stack_id = pystack_lookup(kernel->correlationId);
+      if (py_stack_id != StackTable::INVALID_ID)
+        args += ", \"py_stack_id\":" + std::to_string(py_stack_id);
+      pystack_record_kernel(kernel->correlationId, kernel->name, kernel->end - kernel->start);
+      activity_aggregator_record(phase, "kernel", kernel->name, kernel->end - kernel->start);
+      idle_gap_add_gpu(phase, kernel->deviceId, kernel->start, kernel->end, kernel->correlationId);
+      live_stats_add_gpu(kernel->name, kernel->end - kernel->start);
+      if (overhead_governor_level() >= GOVERNOR_AGGREGATE_KERNELS) {
+        overhead_governor_add_kernel(kernel->name, kernel->start, kernel->end);
+        break;
+      }
+      tl.SMRecordDeviceEvent(phase, kernel->name, kernel->start/1000, (kernel->end - kernel->start)/1000,
+                             kernel->deviceId, kernel->streamId, args);
       printf("Phase %s %s \"%s\" [ %llu - %llu ] device %u, context %u, stream %u, correlation %u\n",
              phase, kindString,
              kernel->name,
@@ -109,6 +218,7 @@ static void print_activity(CUpti_Activity *record)
     {
       CUpti_ActivityAPI *api = (CUpti_ActivityAPI *) record;
       tl.SMRecordEvent(phase, "DRIVER", api->start/1000, (api->end - api->start)/1000,  "X");
+      idle_gap_add_cpu(phase, IDLE_GAP_CPU_DRIVER, api->cbid, api->start, api->end, api->correlationId);
       printf("Phase %s DRIVER cbid=%u [ %llu - %llu ] process %u, thread %u, correlation %u\n",
              phase, api->cbid,
              (unsigned long long) (api->start - start_timestamp),
@@ -120,6 +230,7 @@ static void print_activity(CUpti_Activity *record)
     {
       CUpti_ActivityAPI *api = (CUpti_ActivityAPI *) record;
       tl.SMRecordEvent(phase, "RUNTIME", api->start/1000, (api->end - api->start)/1000,  "X");
+      idle_gap_add_cpu(phase, IDLE_GAP_CPU_RUNTIME, api->cbid, api->start, api->end, api->correlationId);
       printf("Phase %s RUNTIME cbid=%u [ %llu - %llu ] process %u, thread %u, correlation %u\n",
              phase, api->cbid,
              (unsigned long long) (api->start - start_timestamp),
@@ -165,6 +276,15 @@ static void print_activity(CUpti_Activity *record)
   case CUPTI_ACTIVITY_KIND_MARKER:
     {
       CUpti_ActivityMarker2 *marker = (CUpti_ActivityMarker2 *) record;
+      MarkerRecord r;
+      r.kind = (marker->flags & CUPTI_ACTIVITY_FLAG_MARKER_START) ? MARKER_START
+               : (marker->flags & CUPTI_ACTIVITY_FLAG_MARKER_END) ? MARKER_END : MARKER_INSTANT;
+      r.id = marker->id;
+      r.timestamp = marker->timestamp;
+      r.thread_id = marker->objectKind == CUPTI_ACTIVITY_OBJECT_THREAD ? marker->objectId.pt.threadId : 0;
+      r.name = marker->name;
+      r.domain = marker->domain;
+      marker_pairing_add(phase, r);
       printf("Phase %s MARKER id %u [ %llu ], name %s, domain %s\n",
              phase, marker->id, (unsigned long long) marker->timestamp, marker->name, marker->domain);
       break;
@@ -172,16 +292,75 @@ static void print_activity(CUpti_Activity *record)
   case CUPTI_ACTIVITY_KIND_MARKER_DATA:
     {
       CUpti_ActivityMarkerData *marker = (CUpti_ActivityMarkerData *) record;
+      MarkerData d;
+      d.id = marker->id;
+      d.has_color = marker->flags & CUPTI_ACTIVITY_FLAG_MARKER_COLOR_ARGB;
+      d.color = marker->color;
+      d.category = marker->category;
+      // an unset payload cannot be told apart from 0, leave those out
+      if (marker->payloadKind == CUPTI_METRIC_VALUE_KIND_DOUBLE && marker->payload.metricValueDouble != 0)
+        d.payload = std::to_string(marker->payload.metricValueDouble);
+      else if (marker->payloadKind != CUPTI_METRIC_VALUE_KIND_DOUBLE && marker->payload.metricValueUint64 != 0)
+        d.payload = std::to_string(marker->payload.metricValueUint64);
+      marker_pairing_add_data(phase, d);
       printf("Phase %s MARKER_DATA id %u, color 0x%x, category %u, payload %llu/%f\n",
              phase, marker->id, marker->color, marker->category,
              (unsigned long long) marker->payload.metricValueUint64,
              marker->payload.metricValueDouble);
       break;
     }
+  case CUPTI_ACTIVITY_KIND_MEMORY2:
+    {
+      CUpti_ActivityMemory2 *memory = (CUpti_ActivityMemory2 *) record;
+      // host allocations are not device memory
+      if (memory->memoryKind != CUPTI_ACTIVITY_MEMORY_KIND_DEVICE &&
+          memory->memoryKind != CUPTI_ACTIVITY_MEMORY_KIND_MANAGED)
+        break;
+      MemoryRecord r;
+      r.release = memory->memoryOperationType == CUPTI_ACTIVITY_MEMORY_OPERATION_TYPE_RELEASE;
+      r.device = memory->deviceId;
+      r.context = memory->contextId;
+      r.address = memory->address;
+      r.bytes = memory->bytes;
+      r.timestamp = memory->timestamp;
+      uint32_t py_stack_id = pystack_lookup(memory->correlationId);
+      uint32_t stack_id = callstack_lookup(memory->correlationId);
+      if (py_stack_id != StackTable::INVALID_ID)
+        r.site = memory_site(MEMORY_SITE_PY_STACK, py_stack_id);
+      else if (stack_id != StackTable::INVALID_ID)
+        r.site = memory_site(MEMORY_SITE_STACK, stack_id);
+      else
+        r.site = memory_site(MEMORY_SITE_PC, memory->PC);
+      memory_tracker_add(phase, r);
+      printf("Phase %s MEMORY %s [ %llu ] device %u, context %u, address 0x%llx, size %llu, correlation %u\n",
+             phase, r.release ? "RELEASE" : "ALLOCATION",
+             (unsigned long long) (memory->timestamp - start_timestamp),
+             memory->deviceId, memory->contextId, (unsigned long long) memory->address,
+             (unsigned long long) memory->bytes, memory->correlationId);
+      break;
+    }
+  case CUPTI_ACTIVITY_KIND_MEMORY_POOL:
+    {
+      CUpti_ActivityMemoryPool *pool = (CUpti_ActivityMemoryPool *) record;
+      MemoryPoolRecord r;
+      r.operation = pool->memoryPoolOperationType == CUPTI_ACTIVITY_MEMORY_POOL_OPERATION_TYPE_DESTROYED ? MEMORY_POOL_DESTROYED
+                    : pool->memoryPoolOperationType == CUPTI_ACTIVITY_MEMORY_POOL_OPERATION_TYPE_TRIMMED ? MEMORY_POOL_TRIMMED
+                    : MEMORY_POOL_CREATED;
+      r.device = pool->deviceId;
+      r.address = pool->address;
+      r.size = pool->size;
+      memory_tracker_add_pool(phase, r, pool->timestamp);
+      printf("Phase %s MEMORY_POOL operation %u [ %llu ] device %u, address 0x%llx, size %llu\n",
+             phase, (unsigned int) pool->memoryPoolOperationType,
+             (unsigned long long) (pool->timestamp - start_timestamp),
+             pool->deviceId, (unsigned long long) pool->address, (unsigned long long) pool->size);
+      break;
+    }
   case CUPTI_ACTIVITY_KIND_SYNCHRONIZATION:
     {
 	  CUpti_ActivitySynchronization *activity_sync = (CUpti_ActivitySynchronization *) record;
 	  tl.SMRecordEvent(phase, get_sync_events_string(activity_sync->type), activity_sync->start/1000, (activity_sync->end - activity_sync->start),  "X");//, activity_sync->contextId);
+	  idle_gap_add_cpu(phase, IDLE_GAP_CPU_SYNC, activity_sync->type, activity_sync->start, activity_sync->end, activity_sync->correlationId);
 	  printf("Phase %s SYNC %s [ %llu, %llu ] contextId %d streamID %d cudaEventId %d correlationId %d\n",
 			  phase,
 			  get_sync_events_string(activity_sync->type),
@@ -193,47 +372,102 @@ static void print_activity(CUpti_Activity *record)
 			  activity_sync->correlationId);
           break;
     }
+  case CUPTI_ACTIVITY_KIND_OVERHEAD:
+    {
+      CUpti_ActivityOverhead *overhead = (CUpti_ActivityOverhead *) record;
+      overhead_monitor_add_cupti(overhead->overheadKind, overhead->start, overhead->end);
+      printf("Phase %s OVERHEAD %s [ %llu - %llu ]\n",
+             phase, get_activity_overhead_string(overhead->overheadKind),
+             (unsigned long long) (overhead->start - start_timestamp),
+             (unsigned long long) (overhead->end - start_timestamp));
+      break;
+    }
   case CUPTI_ACTIVITY_KIND_PC_SAMPLING:
       {
+        // too many to print, aggregated and summarized at exit
         CUpti_ActivityPCSampling2 *psRecord = (CUpti_ActivityPCSampling2 *)record;
-
-        printf("source %u, functionId %u, pc 0x%x, corr %u, samples %u \n",
-          psRecord->sourceLocatorId,
-          psRecord->functionId,
-          psRecord->pcOffset,
-          psRecord->correlationId,
-          psRecord->samples);
+        PcSample sample = {psRecord->functionId, psRecord->pcOffset, psRecord->sourceLocatorId,
+                           (uint32_t) psRecord->stallReason, psRecord->samples, psRecord->latencySamples};
+        pc_sampling_add_sample(sample);
         break;
       }
+  case CUPTI_ACTIVITY_KIND_PC_SAMPLING_RECORD_INFO:
+    {
+      CUpti_ActivityPCSamplingRecordInfo *info = (CUpti_ActivityPCSamplingRecordInfo *) record;
+      // one per kernel, only the totals are reported
+      pc_sampling_add_record_info(info->totalSamples, info->droppedSamples);
+      break;
+    }
+  case CUPTI_ACTIVITY_KIND_FUNCTION:
+    {
+      CUpti_ActivityFunction *function = (CUpti_ActivityFunction *) record;
+      pc_sampling_add_function(function->id, function->name);
+      break;
+    }
+  case CUPTI_ACTIVITY_KIND_SOURCE_LOCATOR:
+    {
+      CUpti_ActivitySourceLocator *locator = (CUpti_ActivitySourceLocator *) record;
+      pc_sampling_add_source_locator(locator->id, locator->fileName, locator->lineNumber);
+      break;
+    }
   default:
     printf("unknown\n");
     break;
   }
 }
 
+// activity buffers handed back by CUPTI, reused instead of going through
+// malloc for every buffer. Buffers beyond the limit, left over from a burst,
+// are freed.
+#define BUFFER_POOL_LIMIT (64)
+static std::mutex buffer_pool_mutex;
+static std::vector<uint8_t*> buffer_pool;
+
 void CUPTIAPI bufferRequested(uint8_t **buffer, size_t *size, size_t *maxNumRecords)
 {
-  uint8_t *bfr = (uint8_t *) malloc(BUF_SIZE + ALIGN_SIZE);
-  if (bfr == NULL) {
+  uint8_t *bfr = NULL;
+  {
+    std::lock_guard<std::mutex> guard(buffer_pool_mutex);
+    if (!buffer_pool.empty()) {
+      bfr = buffer_pool.back();
+      buffer_pool.pop_back();
+    }
+  }
+  if (bfr == NULL && posix_memalign((void **) &bfr, ALIGN_SIZE, BUF_SIZE) != 0) {
     printf("Error: out of memory\n");
     exit(-1);
   }
 
   *size = BUF_SIZE;
-  *buffer = ALIGN_BUFFER(bfr, ALIGN_SIZE);
+  *buffer = bfr;
   *maxNumRecords = 0;
 }
 
-void CUPTIAPI bufferCompleted(CUcontext ctx, uint32_t streamId, uint8_t *buffer, size_t size, size_t validSize)
+static void release_buffer(uint8_t *buffer)
+{
+  {
+    std::lock_guard<std::mutex> guard(buffer_pool_mutex);
+    if (buffer_pool.size() < BUFFER_POOL_LIMIT) {
+      buffer_pool.push_back(buffer);
+      return;
+    }
+  }
+  free(buffer);
+}
+
+void cupti_tracer_decode(uint8_t *buffer, size_t validSize)
 {
   CUptiResult status;
   CUpti_Activity *record = NULL;
 
   if (validSize > 0) {
+    uint64_t begin = overhead_monitor_enabled() ? overhead_monitor_now() : 0;
+    size_t records = 0;
     do {
       status = cuptiActivityGetNextRecord(buffer, validSize, &record);
       if (status == CUPTI_SUCCESS) {
         print_activity(record);
+        records++;
       }
       else if (status == CUPTI_ERROR_MAX_LIMIT_REACHED)
         break;
@@ -242,112 +476,223 @@ void CUPTIAPI bufferCompleted(CUcontext ctx, uint32_t streamId, uint8_t *buffer,
       }
     } while (1);
 
+    // instant markers whose data did not follow in this buffer
+    marker_pairing_flush(phase);
+    if (overhead_monitor_enabled())
+      overhead_monitor_add_decode(overhead_monitor_now() - begin, records);
+    live_stats_add_records(records, 0);
   }
+}
 
-  free(buffer);
+void CUPTIAPI bufferCompleted(CUcontext ctx, uint32_t streamId, uint8_t *buffer, size_t size, size_t validSize)
+{
+  if (live_stats_enabled()) {
+    size_t dropped = 0;
+    CUPTI_CALL(cuptiActivityGetNumDroppedRecords(ctx, streamId, &dropped));
+    live_stats_add_records(0, dropped);
+  }
+  // in raw capture mode records are decoded offline by smprofiler_decode,
+  // the dump writer returns the buffer once it is written
+  if (activity_dump_enabled() && validSize > 0) {
+    activity_dump_write_buffer((uint64_t) (uintptr_t) ctx, streamId, buffer, validSize, release_buffer);
+    return;
+  }
+  if (!activity_dump_enabled())
+    cupti_tracer_decode(buffer, validSize);
+  release_buffer(buffer);
 }
 
 
-//Callback called on every CUDA API call entry
+// set while a runtime API call is in progress on this thread, so the driver
+// call it issues underneath does not capture the same stack a second time
+static thread_local bool in_runtime_api = false;
+
+static void capture_launch_stacks(uint32_t correlationId)
+{
+	if (callstack_enabled())
+		callstack_capture(correlationId);
+	if (pystack_enabled())
+		pystack_capture(correlationId);
+}
+
+//Callback called on every CUDA driver API call entry
 static void OnDriverApiEnter(CUpti_CallbackDomain domain, CUpti_driver_api_trace_cbid cbid, const CUpti_CallbackData *cbdata)
 {
-	// get timestamp
-	uint64_t tsc;
-	if (cuptiDeviceGetTimestamp(cbdata->context, &tsc) == CUPTI_SUCCESS){
-		printf("Enter API callback %llu %s %s \n", (unsigned long long) tsc-start_timestamp, cbdata->symbolName, cbdata->functionName);
-	}
-	//CUpti_driver_api_trace_cbid cbid_new = (CUpti_driver_api_trace_cbid) cbid;
-        printf("cbid %d", cbid);
 	switch (cbid) {
+	case CUPTI_DRIVER_TRACE_CBID_cuMemAlloc_v2:
+		// allocation sites of the memory tracker
+		if (!in_runtime_api && memory_tracker_enabled())
+			capture_launch_stacks(cbdata->correlationId);
+		break;
 	case CUPTI_DRIVER_TRACE_CBID_cuLaunchKernel:
-		{
-			printf("symbolName %s correlationID %d\n", cbdata->symbolName, cbdata->correlationId);
-			break;
-		}
-
 	case CUPTI_DRIVER_TRACE_CBID_cuLaunchCooperativeKernel:
-	case CUPTI_DRIVER_TRACE_CBID_cuLaunchCooperativeKernelMultiDevice: {
-       	    printf("symbolName %s correlationID %d\n", cbdata->symbolName, cbdata->correlationId);
-	    break;
-     	    }
+	case CUPTI_DRIVER_TRACE_CBID_cuLaunchCooperativeKernelMultiDevice:
+		if (!in_runtime_api)
+			capture_launch_stacks(cbdata->correlationId);
+		break;
+	default:
+		break;
 	}
+}
 
-        /***
-        // libunwind variables
-	unw_word_t ip;
-        unw_cursor_t cursor;
-        unw_context_t uc;
-        char funcName[128];
-
-        uint32_t correlationId = cbdata->correlationId;
-
-	// stack unwinding with libunwind. record first 20 function calls in the stack.
-	unw_getcontext(&uc);
-
-	if (unw_init_local(&cursor, &uc) <0)
-      		printf("unw_init_local failed\n");
-
-    	int count = 0;
-	while (unw_step(&cursor) > 0 && count < 20) {
-      		unw_get_reg(&cursor, UNW_REG_IP, &ip);
-      		unw_get_proc_name(&cursor, funcName, sizeof(funcName), NULL);
-		printf("%d 0x%016lx %s\n", count, (unsigned long)ip, funcName);
-      		count++;
-    }***/
+//Callback called on every CUDA runtime API call entry
+static void OnRuntimeApiEnter(CUpti_CallbackDomain domain, CUpti_runtime_api_trace_cbid cbid, const CUpti_CallbackData *cbdata)
+{
+	in_runtime_api = true;
+	switch (cbid) {
+	case CUPTI_RUNTIME_TRACE_CBID_cudaLaunch_v3020:
+	case CUPTI_RUNTIME_TRACE_CBID_cudaLaunchKernel_v7000:
+	case CUPTI_RUNTIME_TRACE_CBID_cudaLaunchCooperativeKernel_v9000:
+	case CUPTI_RUNTIME_TRACE_CBID_cudaLaunchCooperativeKernelMultiDevice_v9000:
+		capture_launch_stacks(cbdata->correlationId);
+		break;
+	case CUPTI_RUNTIME_TRACE_CBID_cudaMalloc_v3020:
+	case CUPTI_RUNTIME_TRACE_CBID_cudaMallocManaged_v6000:
+	case CUPTI_RUNTIME_TRACE_CBID_cudaMallocAsync_v11020:
+	case CUPTI_RUNTIME_TRACE_CBID_cudaMallocFromPoolAsync_v11020:
+		if (memory_tracker_enabled())
+			capture_launch_stacks(cbdata->correlationId);
+		break;
+	default:
+		break;
+	}
 }
 
-//Callback called on every CUDA API call exit
-static void OnDriverApiExit(CUpti_CallbackDomain domain, CUpti_CallbackId cbid, const CUpti_CallbackData *cbdata)
+//Callback called on every CUDA runtime API call exit
+static void OnRuntimeApiExit(CUpti_CallbackDomain domain, CUpti_runtime_api_trace_cbid cbid, const CUpti_CallbackData *cbdata)
 {
-	uint64_t tsc;
-	if (cuptiDeviceGetTimestamp(cbdata->context, &tsc) == CUPTI_SUCCESS){
-		printf("Exit API callback %llu %s %s \n", (unsigned long long) tsc-start_timestamp, cbdata->symbolName, cbdata->functionName);
-        }
+	in_runtime_api = false;
 }
 
 //registered callback
 static void CUPTIAPI trace_callback(void *userdata, CUpti_CallbackDomain domain,  CUpti_CallbackId cbid, const void *cbdata)
 {
+  if (domain == CUPTI_CB_DOMAIN_RESOURCE) {
+	// resource callbacks carry CUpti_ResourceData, not CUpti_CallbackData
+	if (cbid == CUPTI_CBID_RESOURCE_CONTEXT_CREATED && pc_sampling_period() > 0) {
+		const CUpti_ResourceData *resource = (const CUpti_ResourceData *)cbdata;
+		CUpti_ActivityPCSamplingConfig config;
+		memset(&config, 0, sizeof(config));
+		config.size = sizeof(config);
+		config.samplingPeriod2 = pc_sampling_period();
+		CUPTI_CALL(cuptiActivityConfigurePCSampling(resource->context, &config));
+	}
+	if (cbid == CUPTI_CBID_RESOURCE_CONTEXT_DESTROY_STARTING) {
+		// the allocations of the context are freed without release records
+		const CUpti_ResourceData *resource = (const CUpti_ResourceData *)cbdata;
+		uint32_t context_id = 0;
+		uint64_t timestamp = 0;
+		if (cuptiGetContextId(resource->context, &context_id) == CUPTI_SUCCESS &&
+		    cuptiGetTimestamp(&timestamp) == CUPTI_SUCCESS)
+			memory_tracker_context_destroyed(phase, context_id, timestamp);
+	}
+	return;
+  }
   const CUpti_CallbackData *cbInfo = (CUpti_CallbackData *)cbdata;
-  if (cbInfo->callbackSite == CUPTI_API_ENTER){
-	OnDriverApiEnter(domain, (CUpti_driver_api_trace_cbid) cbid, cbInfo);
+  if (domain == CUPTI_CB_DOMAIN_DRIVER_API) {
+	if (cbInfo->callbackSite == CUPTI_API_ENTER)
+		OnDriverApiEnter(domain, (CUpti_driver_api_trace_cbid) cbid, cbInfo);
   }
-  else if (cbInfo->callbackSite == CUPTI_API_EXIT)
-  {
-	  if (cbid == CUPTI_DRIVER_TRACE_CBID_cuLaunchCooperativeKernelMultiDevice){
-		printf("correlationID: %d", cbInfo->correlationId);
-	  }
-	  OnDriverApiExit(domain, cbid, cbInfo);
+  else if (domain == CUPTI_CB_DOMAIN_RUNTIME_API) {
+	if (cbInfo->callbackSite == CUPTI_API_ENTER)
+		OnRuntimeApiEnter(domain, (CUpti_runtime_api_trace_cbid) cbid, cbInfo);
+	else if (cbInfo->callbackSite == CUPTI_API_EXIT)
+		OnRuntimeApiExit(domain, (CUpti_runtime_api_trace_cbid) cbid, cbInfo);
   }
-  if (domain == CUPTI_CB_DOMAIN_RESOURCE) {
-	printf("Callback %s \n", cbInfo->symbolName);
-    	printf("Callback %s \n", cbInfo->functionName);
-	}
- }
+}
+
+// subscribe to the launch API and resource callbacks once per process,
+// cuptiSubscribe only supports a single subscriber
+static void subscribe_callbacks()
+{
+  static bool subscribed = false;
+  if (subscribed)
+    return;
+  subscribed = true;
+
+  CUPTI_CALL(cuptiSubscribe(&subscriber, (CUpti_CallbackFunc)trace_callback, NULL));
+  if (callstack_enabled() || pystack_enabled()) {
+    // the whole runtime domain is needed to track in_runtime_api
+    CUPTI_CALL(cuptiEnableDomain(1, subscriber, CUPTI_CB_DOMAIN_RUNTIME_API));
+    CUPTI_CALL(cuptiEnableCallback(1, subscriber, CUPTI_CB_DOMAIN_DRIVER_API, CUPTI_DRIVER_TRACE_CBID_cuLaunchKernel));
+    CUPTI_CALL(cuptiEnableCallback(1, subscriber, CUPTI_CB_DOMAIN_DRIVER_API, CUPTI_DRIVER_TRACE_CBID_cuLaunchCooperativeKernel));
+    CUPTI_CALL(cuptiEnableCallback(1, subscriber, CUPTI_CB_DOMAIN_DRIVER_API, CUPTI_DRIVER_TRACE_CBID_cuLaunchCooperativeKernelMultiDevice));
+    if (memory_tracker_enabled())
+      CUPTI_CALL(cuptiEnableCallback(1, subscriber, CUPTI_CB_DOMAIN_DRIVER_API, CUPTI_DRIVER_TRACE_CBID_cuMemAlloc_v2));
+  }
+  if (memory_tracker_enabled() || pc_sampling_period() > 0)
+    CUPTI_CALL(cuptiEnableDomain(1, subscriber, CUPTI_CB_DOMAIN_RESOURCE));
+}
+
+// read the configuration of the optional collectors once
+static void init_collectors()
+{
+  static bool collectors_initialized = false;
+  if (!collectors_initialized) {
+    callstack_init();
+    pystack_init();
+    activity_aggregator_init();
+    idle_gap_init();
+    memcpy_analyzer_init();
+    marker_pairing_init();
+    memory_tracker_init();
+    overhead_monitor_init();
+    overhead_governor_init();
+    pc_sampling_init();
+    live_stats_init();
+    metrics_exporter_init();
+    activity_dump_init();
+    collectors_initialized = true;
+  }
+}
+
+// work done by the collectors at the end of every phase, after all of its
+// records were decoded. end_timestamp is 0 when decoding offline.
+static void end_phase(uint64_t end_timestamp)
+{
+   // symbolize and write out launch stacks seen so far
+   callstack_dump();
+   // append this window's GPU time to the folded and pprof profiles
+   activity_aggregator_flush();
+   // charge this window's device idle gaps to the phase
+   idle_gap_analyze(phase);
+   // copies still in flight end with the phase on the memcpy counters
+   memcpy_analyzer_end_phase(phase);
+   // peak device memory of the phase
+   memory_tracker_end_phase(phase);
+   // what tracing the phase cost, and how much to trace of the next one
+   OverheadSample sample = overhead_monitor_end_phase(phase, start_timestamp, end_timestamp);
+   overhead_governor_end_phase(phase, sample, end_timestamp);
+   // completed phase for smprofiler_top
+   live_stats_end_phase(phase, start_timestamp, end_timestamp);
+}
+
+void cupti_tracer_decode_begin(char* phase_name, uint64_t phase_start_timestamp)
+{
+  snprintf(phase, sizeof(phase), "%s", phase_name);
+  start_timestamp = phase_start_timestamp;
+  init_collectors();
+}
+
+void cupti_tracer_decode_end()
+{
+  end_phase(0);
+}
 
 void cupti_tracer_init(char* phase_name)
 {
-  phase = phase_name;
+  snprintf(phase, sizeof(phase), "%s", phase_name);
+
+  init_collectors();
 
   // enable activities
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_DEVICE));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_CONTEXT));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_DRIVER));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_RUNTIME));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_MEMCPY));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_MEMSET));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_NAME));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_MARKER));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL));
-  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_SYNCHRONIZATION));
-//  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_PC_SAMPLING));
-
-  // register callback
-//  CUPTI_CALL(cuptiSubscribe(&subscriber, (CUpti_CallbackFunc)trace_callback, NULL));
-//  CUPTI_CALL(cuptiEnableDomain(1, subscriber,  CUPTI_CB_DOMAIN_RUNTIME_API));
-//  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_OVERHEAD))
-//  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_FUNCTION));
-//  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_SOURCE_LOCATOR));
+  set_activity_kinds(true);
+
+  // register callbacks for launch call-stack capture and context creation
+  // and teardown
+  if (callstack_enabled() || pystack_enabled() || memory_tracker_enabled() || pc_sampling_period() > 0)
+    subscribe_callbacks();
+
 //  CUPTI_CALL(cuptiActivityEnable(CUPTI_ACTIVITY_KIND_INSTRUCTION_EXECUTION));
 //  Register callbacks for buffer requests and for buffers completed by CUPTI.
   CUPTI_CALL(cuptiActivityRegisterCallbacks(bufferRequested, bufferCompleted));
@@ -364,12 +709,26 @@ void cupti_tracer_init(char* phase_name)
   CUPTI_CALL(cuptiActivitySetAttribute(CUPTI_ACTIVITY_ATTR_DEVICE_BUFFER_POOL_LIMIT, &attrValueSize, &attrValue));
 
   CUPTI_CALL(cuptiGetTimestamp(&start_timestamp));
+  live_stats_begin_phase(phase);
 
+  if (activity_dump_enabled())
+    activity_dump_write(ACTIVITY_DUMP_PHASE_START, start_timestamp, 0, (const uint8_t *) phase, strlen(phase));
+}
+
+void cupti_tracer_pause()
+{
+  set_activity_kinds(false);
+  CUPTI_CALL(cuptiActivityFlushAll(1));
 }
 
 void cupti_tracer_close()
 {
    // Force flush any remaining activity buffers before termination of the application
    CUPTI_CALL(cuptiActivityFlushAll(1));
+   uint64_t end_timestamp;
+   CUPTI_CALL(cuptiGetTimestamp(&end_timestamp));
+   if (activity_dump_enabled())
+     activity_dump_write(ACTIVITY_DUMP_PHASE_END, 0, 0, NULL, 0);
+   end_phase(end_timestamp);
   // CUPTI_CALL(cuptiUnsubscribe(subscriber));
 }
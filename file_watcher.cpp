@@ -0,0 +1,136 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+
+#include "file_watcher.h"
+#include "profiler_thread.h"
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+                      IN_DELETE_SELF | IN_MOVE_SELF)
+
+FileWatcher::FileWatcher(const std::vector<std::string>& paths, int poll_ms, std::function<void()> on_change)
+  : poll_ms_(poll_ms > 0 ? poll_ms : 1000), on_change_(std::move(on_change)), owner_pid_(getpid())
+{
+  for (const std::string& path : paths) {
+    Watched watched;
+    watched.path = path;
+    size_t slash = path.find_last_of('/');
+    watched.directory = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    watched.name = slash == std::string::npos ? path : path.substr(slash + 1);
+    Refresh(watched);
+    watched_.push_back(watched);
+  }
+  inotify_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  thread_ = std::thread(&FileWatcher::WatchLoop, this);
+}
+
+FileWatcher::~FileWatcher()
+{
+  // a forked child has a copy of the object but not the thread, and the
+  // eventfd would wake the parent's
+  if (getpid() != owner_pid_) {
+    profiler_thread_forget(thread_);
+  } else {
+    uint64_t one = 1;
+    if (wake_fd_ >= 0 && write(wake_fd_, &one, sizeof(one)) < 0)
+      perror("smprofiler: file watcher");
+    if (thread_.joinable())
+      thread_.join();
+  }
+  if (inotify_fd_ >= 0)
+    close(inotify_fd_);
+  if (wake_fd_ >= 0)
+    close(wake_fd_);
+}
+
+bool FileWatcher::Refresh(Watched& watched)
+{
+  struct stat buffer;
+  bool exists = stat(watched.path.c_str(), &buffer) == 0;
+  struct timespec mtime = exists ? buffer.st_mtim : timespec{0, 0};
+  off_t size = exists ? buffer.st_size : 0;
+  bool changed = exists != watched.exists || mtime.tv_sec != watched.mtime.tv_sec ||
+                 mtime.tv_nsec != watched.mtime.tv_nsec || size != watched.size;
+  watched.exists = exists;
+  watched.mtime = mtime;
+  watched.size = size;
+  return changed;
+}
+
+void FileWatcher::AddWatches()
+{
+  if (inotify_fd_ < 0)
+    return;
+  for (Watched& watched : watched_) {
+    if (watched.watch >= 0)
+      continue;
+    // inotify returns the same descriptor for a directory watched twice
+    watched.watch = inotify_add_watch(inotify_fd_, watched.directory.c_str(), WATCH_EVENTS);
+    // catch what happened before the watch was in place
+    if (watched.watch >= 0 && Refresh(watched))
+      on_change_();
+  }
+}
+
+bool FileWatcher::ReadEvents()
+{
+  alignas(struct inotify_event) char buffer[4096];
+  bool changed = false;
+  while (true) {
+    ssize_t length = read(inotify_fd_, buffer, sizeof(buffer));
+    if (length <= 0)
+      break;
+    for (char* pos = buffer; pos < buffer + length;) {
+      struct inotify_event* event = (struct inotify_event*) pos;
+      for (Watched& watched : watched_) {
+        if (watched.watch != event->wd)
+          continue;
+        if (event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+          // the directory went away, poll until it is back
+          watched.watch = -1;
+          changed |= Refresh(watched);
+        } else if (event->len > 0 && watched.name == event->name) {
+          Refresh(watched);
+          changed = true;
+        }
+      }
+      pos += sizeof(struct inotify_event) + event->len;
+    }
+  }
+  return changed;
+}
+
+bool FileWatcher::PollUnwatched()
+{
+  bool changed = false;
+  for (Watched& watched : watched_) {
+    if (watched.watch < 0)
+      changed |= Refresh(watched);
+  }
+  return changed;
+}
+
+void FileWatcher::WatchLoop()
+{
+  profiler_thread_setup("watch");
+  on_change_();
+  while (true) {
+    AddWatches();
+    struct pollfd fds[2] = {{wake_fd_, POLLIN, 0}, {inotify_fd_, POLLIN, 0}};
+    int ready = poll(fds, inotify_fd_ >= 0 ? 2 : 1, poll_ms_);
+    if (ready < 0 && errno != EINTR)
+      return;
+    if (fds[0].revents & POLLIN)
+      return;
+    bool changed = false;
+    if (inotify_fd_ >= 0 && (fds[1].revents & POLLIN))
+      changed |= ReadEvents();
+    changed |= PollUnwatched();
+    if (changed)
+      on_change_();
+  }
+}
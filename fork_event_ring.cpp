@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <new>
+
+#include "fork_event_ring.h"
+
+// the counters are shared between processes, that only works lock free
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "fork event ring needs lock free 64 bit atomics");
+
+ForkEventRing* ForkEventRing::Create(size_t slots)
+{
+  size_t count = 1;
+  while (count < slots)
+    count <<= 1;
+
+  size_t size = sizeof(Header) + count * sizeof(Slot);
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    perror("smprofiler: fork event ring");
+    return NULL;
+  }
+  Header* header = new (mapping) Header;
+  header->mask = count - 1;
+  header->head = 0;
+  header->tail = 0;
+  header->dropped = 0;
+  Slot* ring = (Slot*) ((char*) mapping + sizeof(Header));
+  for (size_t i = 0; i < count; i++)
+    new (&ring[i].sequence) std::atomic<uint64_t>(i);
+  return new ForkEventRing(header, ring);
+}
+
+// A slot is free for position pos when its sequence is pos, and holds the
+// event of pos once the sequence is pos + 1.
+bool ForkEventRing::Push(const ForkEvent& event)
+{
+  uint64_t pos;
+  return Claim(pos) && Fill(pos, event);
+}
+
+bool ForkEventRing::Claim(uint64_t& pos)
+{
+  pos = header_->head.load(std::memory_order_relaxed);
+  for (;;) {
+    Slot& slot = slots_[pos & header_->mask];
+    uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    int64_t diff = (int64_t) (sequence - pos);
+    if (diff == 0) {
+      if (header_->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        return true;
+    } else if (diff < 0) {
+      header_->dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    } else {
+      pos = header_->head.load(std::memory_order_relaxed);
+    }
+  }
+}
+
+bool ForkEventRing::Fill(uint64_t pos, const ForkEvent& event)
+{
+  Slot& slot = slots_[pos & header_->mask];
+  slot.event = event;
+  uint64_t claimed = pos;
+  if (!slot.sequence.compare_exchange_strong(claimed, pos + 1, std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+    // Pop gave up waiting for this slot
+    header_->dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+static uint64_t monotonic_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool ForkEventRing::SkipStale(Slot& slot, uint64_t pos)
+{
+  uint64_t now = monotonic_ns();
+  if (!stalled_ || stalled_pos_ != pos) {
+    stalled_ = true;
+    stalled_pos_ = pos;
+    stalled_since_ns_ = now;
+    return false;
+  }
+  if (now - stalled_since_ns_ < (uint64_t) FORK_EVENT_STALE_MS * 1000000)
+    return false;
+  // frees the slot for the next lap, unless the push completed meanwhile
+  uint64_t claimed = pos;
+  if (!slot.sequence.compare_exchange_strong(claimed, pos + header_->mask + 1, std::memory_order_acq_rel))
+    return false;
+  header_->tail.store(pos + 1, std::memory_order_relaxed);
+  header_->dropped.fetch_add(1, std::memory_order_relaxed);
+  stalled_ = false;
+  return true;
+}
+
+bool ForkEventRing::Pop(ForkEvent& event)
+{
+  uint64_t pos = header_->tail.load(std::memory_order_relaxed);
+  Slot& slot = slots_[pos & header_->mask];
+  uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+  if (sequence != pos + 1) {
+    // empty, or claimed by a push that has not filled it yet
+    if (header_->head.load(std::memory_order_relaxed) == pos || !SkipStale(slot, pos))
+      return false;
+    return Pop(event);
+  }
+  stalled_ = false;
+  event = slot.event;
+  slot.sequence.store(pos + header_->mask + 1, std::memory_order_release);
+  header_->tail.store(pos + 1, std::memory_order_relaxed);
+  return true;
+}
+
+uint64_t ForkEventRing::Dropped() const
+{
+  return header_->dropped.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "activity_definitions.h"
+#include "idle_gap_analyzer.h"
+#include "smprofiler_config.h"
+
+struct GpuInterval {
+  uint64_t start;
+  uint64_t end;
+  uint32_t device_id;
+  uint32_t correlation_id;
+};
+
+struct CpuInterval {
+  uint64_t start;
+  uint64_t end;
+  uint32_t correlation_id;
+  uint32_t id;
+  IdleGapCpuKind kind;
+};
+
+struct GapStats {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+struct DeviceStats {
+  uint64_t busy_ns;
+  uint64_t span_ns;
+};
+
+static bool enabled = false;
+static uint64_t min_gap_ns;
+static size_t max_window_records;
+static std::string report_path;
+
+static std::mutex mutex;
+static std::vector<GpuInterval> gpu_intervals;
+static std::vector<CpuInterval> cpu_intervals;
+// (phase, blocker) -> gaps, ordered so the report groups by phase
+static std::map<std::pair<std::string, std::string>, GapStats> gap_stats;
+static std::map<std::pair<std::string, uint32_t>, DeviceStats> device_stats;
+// end of the last busy period of every device in a window that filled up
+// before the phase ended, so the gap to the next window is not lost
+static std::unordered_map<uint32_t, uint64_t> carried_busy_end;
+
+void idle_gap_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_IDLE_GAPS", false);
+  min_gap_ns = smprofiler_config_int("SMPROFILER_IDLE_GAPS_MIN_NS", 1000);
+  // a very long phase is analyzed in several windows to bound memory
+  max_window_records = smprofiler_config_int("SMPROFILER_IDLE_GAPS_MAX_RECORDS", 1 << 20);
+  report_path = smprofiler_config_string("SMPROFILER_IDLE_GAPS_FILE",
+                                         smprofiler_output_path("idle_gaps.txt"));
+  if (enabled)
+    smprofiler_atexit(idle_gap_report);
+}
+
+bool idle_gap_enabled()
+{
+  return enabled;
+}
+
+static void analyze_locked(const std::string& phase, bool window_full);
+
+void idle_gap_add_gpu(const char* phase, uint32_t device_id, uint64_t start, uint64_t end, uint32_t correlation_id)
+{
+  if (!enabled || end <= start)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  gpu_intervals.push_back({start, end, device_id, correlation_id});
+  if (gpu_intervals.size() >= max_window_records)
+    analyze_locked(phase, true);
+}
+
+void idle_gap_add_cpu(const char* phase, IdleGapCpuKind kind, uint32_t id, uint64_t start, uint64_t end,
+                      uint32_t correlation_id)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  cpu_intervals.push_back({start, end, correlation_id, id, kind});
+  if (cpu_intervals.size() >= max_window_records)
+    analyze_locked(phase, true);
+}
+
+static std::string blocker_name(const CpuInterval& blocker)
+{
+  if (blocker.kind == IDLE_GAP_CPU_SYNC)
+    return std::string("sync:") + get_sync_events_string(blocker.id);
+
+  const char* name = NULL;
+  CUpti_CallbackDomain domain = (blocker.kind == IDLE_GAP_CPU_RUNTIME) ? CUPTI_CB_DOMAIN_RUNTIME_API
+                                                                        : CUPTI_CB_DOMAIN_DRIVER_API;
+  if (cuptiGetCallbackName(domain, blocker.id, &name) != CUPTI_SUCCESS || name == NULL)
+    return "api:" + std::to_string(blocker.id);
+  std::string api = name;
+  if (api.find("emcpy") != std::string::npos)
+    return "memcpy:" + api;
+  return "api:" + api;
+}
+
+static void charge_gap(const std::string& phase, const std::string& blocker, uint64_t gap_ns)
+{
+  GapStats& stats = gap_stats[std::make_pair(phase, blocker)];
+  stats.count++;
+  stats.total_ns += gap_ns;
+  stats.max_ns = std::max(stats.max_ns, gap_ns);
+}
+
+// CPU records sorted by start, and for each the index of the one ending last
+// among it and those before it
+struct CpuTimeline {
+  std::unordered_map<uint32_t, size_t> launches;
+  std::vector<size_t> latest_end;
+};
+
+// charges the idle time from busy_end until next starts to the CPU record that
+// held it up
+static void charge_idle(const std::string& phase, const CpuTimeline& cpu, uint64_t busy_end, const GpuInterval& next)
+{
+  uint64_t gap_ns = next.start - busy_end;
+  if (gap_ns < min_gap_ns)
+    return;
+  std::string blocker = "cpu";
+  auto launch = cpu.launches.find(next.correlation_id);
+  uint64_t launch_start = (launch != cpu.launches.end()) ? cpu_intervals[launch->second].start : next.start;
+  if (launch != cpu.launches.end() && launch_start <= busy_end) {
+    blocker = "queued";
+  } else {
+    // launches do not come in the order of the operations they start, so the
+    // records started before this one are found by binary search
+    size_t started = std::lower_bound(cpu_intervals.begin(), cpu_intervals.end(), launch_start,
+                                      [](const CpuInterval& a, uint64_t t) { return a.start < t; }) -
+                     cpu_intervals.begin();
+    if (started > 0) {
+      const CpuInterval& latest = cpu_intervals[cpu.latest_end[started - 1]];
+      if (latest.end > busy_end)
+        blocker = blocker_name(latest);
+    }
+  }
+  charge_gap(phase, blocker, gap_ns);
+}
+
+// window_full is set when the records reached the window size before the
+// phase ended; the busy periods then continue into the next window
+static void analyze_locked(const std::string& phase, bool window_full)
+{
+  if (gpu_intervals.empty()) {
+    cpu_intervals.clear();
+    if (!window_full)
+      carried_busy_end.clear();
+    return;
+  }
+
+  std::sort(gpu_intervals.begin(), gpu_intervals.end(), [](const GpuInterval& a, const GpuInterval& b) {
+    return a.device_id != b.device_id ? a.device_id < b.device_id : a.start < b.start;
+  });
+  std::sort(cpu_intervals.begin(), cpu_intervals.end(), [](const CpuInterval& a, const CpuInterval& b) {
+    return a.start < b.start;
+  });
+  CpuTimeline cpu;
+  // launch API call of every GPU operation
+  cpu.launches.reserve(cpu_intervals.size());
+  cpu.latest_end.resize(cpu_intervals.size());
+  for (size_t i = 0; i < cpu_intervals.size(); i++) {
+    if (cpu_intervals[i].kind != IDLE_GAP_CPU_SYNC)
+      cpu.launches.emplace(cpu_intervals[i].correlation_id, i);
+    size_t latest = i > 0 ? cpu.latest_end[i - 1] : i;
+    cpu.latest_end[i] = cpu_intervals[i].end > cpu_intervals[latest].end ? i : latest;
+  }
+
+  std::unordered_map<uint32_t, uint64_t> busy_ends;
+  size_t i = 0;
+  while (i < gpu_intervals.size()) {
+    uint32_t device_id = gpu_intervals[i].device_id;
+    DeviceStats& device = device_stats[std::make_pair(phase, device_id)];
+    uint64_t first_start = gpu_intervals[i].start;
+    uint64_t busy_start = gpu_intervals[i].start;
+    uint64_t busy_end = gpu_intervals[i].end;
+
+    // the gap from the previous window's last busy period; an operation
+    // overlapping that period extends it, the previous window counted the
+    // time up to its end already
+    auto carried = carried_busy_end.find(device_id);
+    if (carried != carried_busy_end.end()) {
+      if (carried->second < first_start) {
+        charge_idle(phase, cpu, carried->second, gpu_intervals[i]);
+      } else {
+        busy_start = carried->second;
+        busy_end = std::max(busy_end, carried->second);
+      }
+      first_start = carried->second;
+    }
+
+    for (i++; i <= gpu_intervals.size(); i++) {
+      bool device_done = (i == gpu_intervals.size() || gpu_intervals[i].device_id != device_id);
+      if (!device_done && gpu_intervals[i].start <= busy_end) {
+        busy_end = std::max(busy_end, gpu_intervals[i].end);
+        continue;
+      }
+      device.busy_ns += busy_end - busy_start;
+      if (device_done)
+        break;
+
+      // idle from busy_end until gpu_intervals[i] starts
+      const GpuInterval& next = gpu_intervals[i];
+      charge_idle(phase, cpu, busy_end, next);
+      busy_start = next.start;
+      busy_end = next.end;
+    }
+    device.span_ns += busy_end - first_start;
+    busy_ends[device_id] = busy_end;
+  }
+
+  // devices without records in this window keep their carried end
+  if (window_full) {
+    for (auto& entry : busy_ends) {
+      carried_busy_end[entry.first] = entry.second;
+    }
+  } else {
+    carried_busy_end.clear();
+  }
+  gpu_intervals.clear();
+  cpu_intervals.clear();
+}
+
+void idle_gap_analyze(const char* phase)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  analyze_locked(phase, false);
+}
+
+void idle_gap_report()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (gap_stats.empty() && device_stats.empty())
+    return;
+
+  smprofiler_create_parent_dirs(report_path);
+  FILE* file = fopen(report_path.c_str(), "w");
+  if (file == NULL) {
+    printf("Error: could not open idle gap report %s\n", report_path.c_str());
+    return;
+  }
+
+  fprintf(file, "# device busy time per phase\n");
+  fprintf(file, "%-20s %6s %14s %14s %7s\n", "phase", "device", "busy_us", "span_us", "busy%");
+  for (auto& entry : device_stats) {
+    const DeviceStats& device = entry.second;
+    fprintf(file, "%-20s %6u %14llu %14llu %6.1f%%\n", entry.first.first.c_str(), entry.first.second,
+            (unsigned long long) (device.busy_ns / 1000), (unsigned long long) (device.span_ns / 1000),
+            device.span_ns ? 100.0 * device.busy_ns / device.span_ns : 0.0);
+  }
+
+  // rank all (phase, blocker) pairs by the idle time they caused
+  std::vector<std::pair<std::pair<std::string, std::string>, GapStats>> ranked(gap_stats.begin(), gap_stats.end());
+  std::sort(ranked.begin(), ranked.end(), [](const std::pair<std::pair<std::string, std::string>, GapStats>& a,
+                                             const std::pair<std::pair<std::string, std::string>, GapStats>& b) {
+    return a.second.total_ns > b.second.total_ns;
+  });
+  fprintf(file, "\n# idle gaps ranked by total idle time\n");
+  fprintf(file, "%-20s %-40s %10s %14s %12s %12s\n", "phase", "blocker", "gaps", "idle_us", "mean_us", "max_us");
+  for (auto& entry : ranked) {
+    const GapStats& stats = entry.second;
+    fprintf(file, "%-20s %-40s %10llu %14llu %12.2f %12.2f\n", entry.first.first.c_str(), entry.first.second.c_str(),
+            (unsigned long long) stats.count, (unsigned long long) (stats.total_ns / 1000),
+            stats.total_ns / 1000.0 / stats.count, stats.max_ns / 1000.0);
+  }
+  fclose(file);
+}
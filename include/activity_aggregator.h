@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+
+// Aggregates GPU time of activity records by (phase, op, name) for the
+// current profiling window. activity_aggregator_flush, called on every
+// cupti_tracer_close, appends the window to a folded-stack text file
+// ("phase;op;name gpu_ns", for flamegraph.pl) and to a streamed pprof
+// profile, then clears it, so memory only grows with the number of distinct
+// names. Enabled with SMPROFILER_GPU_PROFILE=1.
+void activity_aggregator_init();
+bool activity_aggregator_enabled();
+void activity_aggregator_record(const char* phase, const char* op, const char* name, uint64_t duration_ns);
+void activity_aggregator_flush();
@@ -47,7 +47,7 @@ static const char* get_sync_events_string(uint32_t kind)
 }
 
 
-const char * get_activity_overhead_string(CUpti_ActivityOverheadKind kind)
+static const char * get_activity_overhead_string(CUpti_ActivityOverheadKind kind)
 {
   switch (kind) {
   case CUPTI_ACTIVITY_OVERHEAD_DRIVER_COMPILER:
@@ -65,7 +65,41 @@ const char * get_activity_overhead_string(CUpti_ActivityOverheadKind kind)
   return "unknown";
 }
 
-const char * get_activity_object_string(CUpti_ActivityObjectKind kind)
+static const char * get_pc_sampling_stall_string(CUpti_ActivityPCSamplingStallReason reason)
+{
+  switch (reason) {
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_NONE:
+    return "none";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_INST_FETCH:
+    return "inst_fetch";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_EXEC_DEPENDENCY:
+    return "exec_dependency";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_MEMORY_DEPENDENCY:
+    return "memory_dependency";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_TEXTURE:
+    return "texture";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_SYNC:
+    return "sync";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_CONSTANT_MEMORY_DEPENDENCY:
+    return "constant_memory_dependency";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_PIPE_BUSY:
+    return "pipe_busy";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_MEMORY_THROTTLE:
+    return "memory_throttle";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_NOT_SELECTED:
+    return "not_selected";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_OTHER:
+    return "other";
+  case CUPTI_ACTIVITY_PC_SAMPLING_STALL_SLEEPING:
+    return "sleeping";
+  default:
+    break;
+  }
+
+  return "unknown";
+}
+
+static const char * get_activity_object_string(CUpti_ActivityObjectKind kind)
 {
   switch (kind) {
   case CUPTI_ACTIVITY_OBJECT_PROCESS:
@@ -85,7 +119,7 @@ const char * get_activity_object_string(CUpti_ActivityObjectKind kind)
   return "unknown";
 }
 
-uint32_t get_activity_object_id_string(CUpti_ActivityObjectKind kind, CUpti_ActivityObjectKindId *id)
+static uint32_t get_activity_object_id_string(CUpti_ActivityObjectKind kind, CUpti_ActivityObjectKindId *id)
 {
   switch (kind) {
   case CUPTI_ACTIVITY_OBJECT_PROCESS:
@@ -0,0 +1,129 @@
+#pragma once
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <cupti.h>
+
+// On-disk layout of raw CUPTI activity buffer dumps. A dump is a sequence of
+// entries, each an ActivityDumpHeader followed by valid_size bytes of
+// payload padded to ACTIVITY_DUMP_ALIGN bytes. Buffer entries carry the
+// records exactly as CUPTI handed them to bufferCompleted; phase entries
+// mark smprofiler.start()/stop() so a dump can be decoded per phase.
+//
+// Some records point to strings owned by CUPTI in the recording process
+// (kernel names, marker names, ...). Each such pointer is written once as a
+// string entry ahead of the first buffer using it, and the fields are
+// pointed at the decoder's copies before the records are read.
+//
+// CUPTI fills buffers with the newest record struct of each kind its
+// version has (e.g. CUpti_ActivityKernel9), whatever struct the reader
+// casts them to. The stride of every kind seen is written in a record sizes
+// entry ahead of the first buffer holding it, so the dump can be walked by
+// a reader built against other structs.
+#define ACTIVITY_DUMP_MAGIC (0x44504d53) // "SMPD"
+#define ACTIVITY_DUMP_ALIGN (8)
+
+enum ActivityDumpEntryType {
+  // payload is an activity buffer, context and stream_id as passed by CUPTI
+  ACTIVITY_DUMP_BUFFER = 0,
+  // payload is the phase name, context holds the CUPTI timestamp at start
+  ACTIVITY_DUMP_PHASE_START = 1,
+  // no payload, all buffers of the phase precede it
+  ACTIVITY_DUMP_PHASE_END = 2,
+  // payload is the string, context holds the pointer value it replaces
+  ACTIVITY_DUMP_STRING = 3,
+  // payload is an array of ActivityDumpRecordSize
+  ACTIVITY_DUMP_RECORD_SIZES = 4,
+};
+
+// distance from a record of the kind to the next one in a buffer
+struct ActivityDumpRecordSize {
+  uint32_t kind;
+  uint32_t size;
+};
+
+#define ACTIVITY_DUMP_MAX_STRING_FIELDS (2)
+
+struct ActivityDumpHeader {
+  uint32_t magic;
+  // CUPTI API version the records were produced with
+  uint32_t cupti_version;
+  uint64_t valid_size;
+  uint64_t context;
+  uint32_t stream_id;
+  // ActivityDumpEntryType
+  uint32_t type;
+};
+
+// Implemented by the replay shim only: sets the stride a recorded kind is
+// walked with, non-zero if the tracer could not read records that size. A
+// weak reference, NULL when linked against the real libcupti, which walks
+// buffers of its own version only.
+extern "C" int cupti_shim_set_record_size(uint32_t kind, uint32_t size) __attribute__((weak));
+
+inline uint64_t activity_dump_padded_size(uint64_t size)
+{
+  return (size + ACTIVITY_DUMP_ALIGN - 1) & ~(uint64_t) (ACTIVITY_DUMP_ALIGN - 1);
+}
+
+// Collects the string pointer fields of a record, returns their number.
+inline int activity_dump_string_fields(CUpti_Activity* record, const char** fields[ACTIVITY_DUMP_MAX_STRING_FIELDS])
+{
+  switch (record->kind) {
+  case CUPTI_ACTIVITY_KIND_KERNEL:
+  case CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL:
+    fields[0] = &((CUpti_ActivityKernel3*) record)->name;
+    return 1;
+  case CUPTI_ACTIVITY_KIND_DEVICE:
+    fields[0] = &((CUpti_ActivityDevice2*) record)->name;
+    return 1;
+  case CUPTI_ACTIVITY_KIND_NAME:
+    fields[0] = &((CUpti_ActivityName*) record)->name;
+    return 1;
+  case CUPTI_ACTIVITY_KIND_MARKER:
+    fields[0] = &((CUpti_ActivityMarker2*) record)->name;
+    fields[1] = &((CUpti_ActivityMarker2*) record)->domain;
+    return 2;
+  case CUPTI_ACTIVITY_KIND_FUNCTION:
+    fields[0] = &((CUpti_ActivityFunction*) record)->name;
+    return 1;
+  case CUPTI_ACTIVITY_KIND_SOURCE_LOCATOR:
+    fields[0] = &((CUpti_ActivitySourceLocator*) record)->fileName;
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// String entries read back from a dump, used to repoint the string fields
+// of recorded buffers before they are decoded.
+class ActivityDumpStrings {
+public:
+  void Add(uint64_t recorded_pointer, const char* data, size_t size)
+  {
+    strings_.emplace_back(data, size);
+    pointers_[recorded_pointer] = strings_.back().c_str();
+  }
+
+  // rewrites every string field in place
+  void Patch(uint8_t* buffer, size_t valid_size)
+  {
+    CUpti_Activity* record = NULL;
+    while (cuptiActivityGetNextRecord(buffer, valid_size, &record) == CUPTI_SUCCESS) {
+      const char** fields[ACTIVITY_DUMP_MAX_STRING_FIELDS];
+      int count = activity_dump_string_fields(record, fields);
+      for (int i = 0; i < count; i++) {
+        if (*fields[i] == NULL)
+          continue;
+        auto it = pointers_.find((uint64_t) (uintptr_t) *fields[i]);
+        *fields[i] = (it != pointers_.end()) ? it->second : "<unknown>";
+      }
+    }
+  }
+
+private:
+  // deque keeps the strings in place as it grows
+  std::deque<std::string> strings_;
+  std::unordered_map<uint64_t, const char*> pointers_;
+};
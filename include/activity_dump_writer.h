@@ -0,0 +1,20 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// Raw capture mode: completed activity buffers are appended to a dump file
+// (see activity_dump.h) without decoding a single record, to be decoded
+// offline by smprofiler_decode. Enabled with SMPROFILER_RAW_DUMP=1. Entries
+// are queued and written in order by a writer thread.
+void activity_dump_init();
+bool activity_dump_enabled();
+// appends one entry, the payload is copied, thread safe
+void activity_dump_write(uint32_t type, uint64_t context, uint32_t stream_id,
+                         const uint8_t* payload, size_t size);
+// appends a completed activity buffer, preceded by the strings its records
+// point to that were not written before. The buffer is handed to release
+// once written; blocks while the writer is DUMP_QUEUE_LIMIT buffers behind.
+void activity_dump_write_buffer(uint64_t context, uint32_t stream_id, uint8_t* buffer, size_t valid_size,
+                                void (*release)(uint8_t*));
+// writes out everything queued and staged and trims the preallocated tail
+void activity_dump_close();
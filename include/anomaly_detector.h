@@ -0,0 +1,89 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Durations in log spaced buckets, each 2% wider than the previous one, so
+// a quantile is known to within 1% whatever the range, in constant memory.
+class QuantileSketch {
+public:
+  void Add(uint64_t ns);
+  // 0 while empty
+  uint64_t Quantile(double q) const;
+  inline uint64_t Count() const { return count_; }
+
+private:
+  std::vector<uint32_t> buckets_;
+  uint64_t count_ = 0;
+};
+
+struct AnomalyConfig {
+  // steps of a phase seen before any is judged
+  uint32_t warmup;
+  // a step is anomalous above factor times the larger of the EWMA and this
+  // quantile of the previous steps
+  double quantile;
+  double factor;
+  // fixed threshold instead, 0 to use the relative one
+  uint64_t threshold_ns;
+  // weight of the newest step in the EWMA
+  double ewma_alpha;
+};
+
+struct AnomalyVerdict {
+  bool anomalous;
+  uint64_t threshold_ns;
+  // of the steps before this one
+  double ewma_ns;
+  uint64_t quantile_ns;
+  uint64_t steps;
+};
+
+struct PhaseDistribution {
+  uint64_t steps = 0;
+  uint64_t anomalies = 0;
+  uint64_t max_ns = 0;
+  double ewma_ns = 0;
+  QuantileSketch sketch;
+};
+
+// Online duration distribution of every phase name, judging each step
+// against the steps before it.
+class StepAnomalyDetector {
+public:
+  explicit StepAnomalyDetector(const AnomalyConfig& config) : config_(config) {}
+  AnomalyVerdict Add(const std::string& phase, uint64_t duration_ns);
+  inline const std::map<std::string, PhaseDistribution>& Phases() const { return phases_; }
+
+private:
+  AnomalyConfig config_;
+  std::map<std::string, PhaseDistribution> phases_;
+};
+
+// Always-on detection of straggler steps and slowdowns, with detailed
+// capture only when one happens. The duration of every phase is taken
+// between smprofiler.start() and stop() and compared to the distribution of
+// earlier phases of its name: after SMPROFILER_ANOMALY_WARMUP (20) steps, a
+// step longer than SMPROFILER_ANOMALY_FACTOR_PERCENT (150) percent of the
+// larger of the EWMA (SMPROFILER_ANOMALY_EWMA_PERMILLE, weight 100/1000 of
+// the newest step) and the SMPROFILER_ANOMALY_QUANTILE_PERMILLE (990)
+// quantile, or than SMPROFILER_ANOMALY_THRESHOLD_MS when set, is anomalous.
+// Phases are not traced until then; an anomaly switches full tracing on
+// for the next SMPROFILER_ANOMALY_CAPTURE_STEPS (5) steps of its phase and
+// everything in between, but for no more than
+// SMPROFILER_ANOMALY_CAPTURE_MAX_PHASES (100) phases of any name or
+// SMPROFILER_ANOMALY_CAPTURE_MAX_MS (60000). The slow step and the capture
+// window are put on the "anomaly" track of the timeline, and at exit every
+// phase's distribution and every anomaly are written to
+// /tmp/framework/<pid>_anomalies.txt. Enabled with SMPROFILER_ANOMALY=1.
+void anomaly_detector_init();
+bool anomaly_detector_enabled();
+// called by smprofiler.start(), false when the phase is not to be traced
+bool anomaly_detector_trace_phase(const char* phase);
+// the step boundaries, around the phase's own work; traced is whether the
+// phase ended up traced
+void anomaly_detector_begin_phase(bool traced);
+void anomaly_detector_end_phase();
+void anomaly_detector_report();
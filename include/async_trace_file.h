@@ -0,0 +1,93 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+#include "trace_file.h"
+
+// Append-only trace file that batches writes into large page aligned
+// buffers and keeps several of them in flight through io_uring, so the
+// timeline writer thread does not wait for the disk on every event. Falls
+// back to a synchronous pwritev per submitted buffer where io_uring is not
+// available (old kernel, seccomp). The io_uring ring is set up with raw
+// syscalls, no liburing needed.
+class AsyncTraceFile : public TraceFile {
+public:
+  enum Backend { IO_URING, PWRITEV };
+
+  // buffer_size is rounded up to whole pages
+  AsyncTraceFile(size_t buffer_size, int num_buffers, bool allow_io_uring);
+  ~AsyncTraceFile() override;
+  AsyncTraceFile(const AsyncTraceFile&) = delete;
+  void operator=(const AsyncTraceFile&) = delete;
+
+  using TraceFile::Append;
+  bool Open(const std::string& path) override;
+  void Append(const char* data, size_t size) override;
+  // hands what the current buffer gained since its last write to the
+  // kernel and keeps filling it, waiting only for that previous write
+  void Submit() override;
+  // blocks are plain byte ranges
+  inline void EndBlock() override { block_ends_.push_back(file_size_); }
+  inline const std::vector<uint64_t>& BlockEnds() override { return block_ends_; }
+  // writes out everything appended so far and waits for it
+  void Flush();
+  void Close() override;
+  inline bool IsOpen() const override { return fd_ >= 0; }
+  inline bool Good() const override { return !failed_; }
+  inline uint64_t Size() const override { return file_size_; }
+  inline Backend GetBackend() const { return ring_fd_ >= 0 ? IO_URING : PWRITEV; }
+
+private:
+  struct Buffer {
+    uint8_t* data;
+    size_t used;
+    // bytes handed to the kernel, the rest is still being filled
+    size_t submitted;
+    // file offset and range of the latest write
+    uint64_t offset;
+    struct iovec iov;
+    // io_uring: the latest write is in flight
+    bool pending;
+  };
+
+  bool SetupRing(unsigned entries);
+  void TeardownRing();
+  // submits the rest of the full current buffer and moves on to the next
+  void Rotate();
+  // writes the part of a buffer not submitted yet
+  void SubmitBuffer(int index);
+  // waits until a buffer is free for filling again
+  void WaitForBuffer(int index);
+  // io_uring: reaps completions, blocking for at least min_complete
+  void Reap(unsigned min_complete);
+  void Finish(Buffer& buffer, ssize_t written);
+
+  std::vector<Buffer> buffers_;
+  size_t buffer_size_;
+  int current_ = 0;
+  int fd_ = -1;
+  uint64_t file_size_ = 0;
+  std::vector<uint64_t> block_ends_;
+  unsigned in_flight_ = 0;
+  bool failed_ = false;
+  std::string path_;
+
+  // io_uring state, ring_fd_ < 0 when falling back to pwritev
+  int ring_fd_ = -1;
+  void* sq_ring_ = NULL;
+  size_t sq_ring_size_ = 0;
+  void* cq_ring_ = NULL;
+  size_t cq_ring_size_ = 0;
+  void* sqes_ = NULL;
+  size_t sqes_size_ = 0;
+  unsigned* sq_head_ = NULL;
+  unsigned* sq_tail_ = NULL;
+  unsigned* sq_mask_ = NULL;
+  unsigned* sq_array_ = NULL;
+  unsigned* cq_head_ = NULL;
+  unsigned* cq_tail_ = NULL;
+  unsigned* cq_mask_ = NULL;
+  void* cqes_ = NULL;
+};
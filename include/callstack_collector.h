@@ -0,0 +1,13 @@
+#pragma once
+#include <stdint.h>
+
+// Optional capture of the host call stack at every kernel launch. Only raw
+// instruction pointers are recorded on the launch path; stacks are
+// deduplicated into a StackTable and symbolized once per unique IP when
+// callstack_dump is called. Enabled with SMPROFILER_CALLSTACK=1.
+void callstack_init();
+bool callstack_enabled();
+void callstack_capture(uint32_t correlation_id);
+// stack id recorded for a correlation id, StackTable::INVALID_ID if none
+uint32_t callstack_lookup(uint32_t correlation_id);
+void callstack_dump();
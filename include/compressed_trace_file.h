@@ -0,0 +1,119 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace_file.h"
+
+// Compresses the timeline on its own thread before it goes to the disk.
+// Appended data is collected in one of two buffers while the other one is
+// compressed and handed to the output file, so formatting and compression
+// overlap. Every file is one complete zstd or LZ4 frame, or one per block
+// when the timeline is indexed, and can be decompressed on its own. Codecs are compiled in with
+// -DSMPROFILER_WITH_ZSTD (-lzstd) and -DSMPROFILER_WITH_LZ4 (-llz4).
+enum TraceCompression { TRACE_COMPRESSION_NONE, TRACE_COMPRESSION_ZSTD, TRACE_COMPRESSION_LZ4 };
+
+class CompressedTraceFile : public TraceFile {
+public:
+  // parses "zstd", "lz4" or "none", TRACE_COMPRESSION_NONE for a codec
+  // that is unknown or not compiled in
+  static TraceCompression ParseCodec(const std::string& name);
+  // file name suffix of the codec, e.g. ".zst"
+  static const char* Suffix(TraceCompression codec);
+
+  CompressedTraceFile(TraceCompression codec, int level, size_t buffer_size, std::unique_ptr<TraceFile> out);
+  ~CompressedTraceFile() override;
+  CompressedTraceFile(const CompressedTraceFile&) = delete;
+  void operator=(const CompressedTraceFile&) = delete;
+
+  using TraceFile::Append;
+  bool Open(const std::string& path) override;
+  void Append(const char* data, size_t size) override;
+  // compresses and writes what was appended so far as a flushed block
+  void Submit() override;
+  // ends the frame, the next block starts a new one
+  void EndBlock() override;
+  // waits for the compression of the blocks ended so far
+  const std::vector<uint64_t>& BlockEnds() override;
+  // written uncompressed after the last frame
+  void AppendFooter(const std::string& data) override;
+  // ends the frame and closes the output, reports ratio and throughput
+  void Close() override;
+  inline bool IsOpen() const override { return out_->IsOpen(); }
+  inline bool Good() const override { return !failed_ && out_->Good(); }
+  // compressed bytes written so far
+  inline uint64_t Size() const override { return compressed_bytes_; }
+
+private:
+  enum Directive { COMPRESS_CONTINUE, COMPRESS_FLUSH, COMPRESS_END };
+
+  // passes the filling buffer to the compression thread
+  void HandOff(Directive directive);
+  void WaitIdle();
+  void CompressLoop();
+  void Compress(const uint8_t* data, size_t size, Directive directive);
+  void CompressZstd(const uint8_t* data, size_t size, Directive directive);
+  void CompressLz4(const uint8_t* data, size_t size, Directive directive);
+
+  TraceCompression codec_;
+  int compression_level_;
+  // written to by the compression thread only while the writer waits for
+  // it or hands it a job
+  std::unique_ptr<TraceFile> out_;
+  std::string path_;
+  std::atomic_bool failed_{false};
+
+  // double buffer, buffers_[filling_] collects appended data
+  uint8_t* buffers_[2] = {NULL, NULL};
+  size_t buffer_size_;
+  size_t used_ = 0;
+  int filling_ = 0;
+  // data was appended since the last frame ended
+  bool frame_open_ = false;
+
+  // job for the compression thread, guarded by mutex_
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool job_ready_ = false;
+  bool stopping_ = false;
+  const uint8_t* job_data_ = NULL;
+  size_t job_size_ = 0;
+  Directive job_directive_ = COMPRESS_CONTINUE;
+  std::thread thread_;
+
+  // codec state, only used on the compression thread
+  void* context_ = NULL;
+  uint8_t* out_buffer_ = NULL;
+  size_t out_buffer_size_ = 0;
+  bool frame_started_ = false;
+
+  // per file statistics
+  uint64_t raw_bytes_ = 0;
+  std::atomic<uint64_t> compressed_bytes_{0};
+  // compressed size at the end of each frame, appended by the compression
+  // thread
+  std::vector<uint64_t> block_ends_;
+  uint64_t compress_ns_ = 0;
+};
+
+// bytes of a trace file trace_file_read reads at a time
+#define TRACE_FILE_CHUNK_SIZE (1024 * 1024)
+
+// Reads a whole trace file into contents, decompressing zstd and LZ4 frames
+// (recognized by their magic number) and passing other files through. For
+// the tools that consume timeline files. False on a corrupt or truncated
+// frame, with contents holding what was decoded before it.
+bool trace_file_read(const std::string& path, std::string& contents);
+// same for data already in memory, e.g. one block of an indexed file
+bool trace_file_decode(const std::string& input, std::string& contents);
+// Reads a trace file like trace_file_read, chunk_size bytes at a time,
+// passing the decoded data to output as it comes, so that a file of any
+// size is read in constant memory.
+bool trace_file_scan(const std::string& path, size_t chunk_size,
+                     const std::function<void(const char* data, size_t size)>& output);
@@ -0,0 +1,12 @@
+#pragma once
+
+// Switches collection on and off at runtime without restarting the job.
+// The control file (SMPROFILER_CONTROL_FILE, default
+// /tmp/framework/<pid>_control) is watched for changes: while it starts with
+// "off", "disable" or "0" collection is disabled, otherwise, or when it does
+// not exist, it is enabled. With SMPROFILER_CONTROL_SIGNAL set to a signal
+// number, e.g. 12 for SIGUSR2, every delivery of that signal toggles
+// collection. A change takes effect at the next smprofiler.start(), phases
+// already running are completed.
+void control_channel_init();
+bool control_channel_enabled();
@@ -10,3 +10,16 @@
 
 void cupti_tracer_init(char *phase);
 void cupti_tracer_close();
+// stops tracing between phases while collection is disabled, the next
+// cupti_tracer_init resumes it
+void cupti_tracer_pause();
+// CUPTI activity buffer callbacks, registered by cupti_tracer_init
+void CUPTIAPI bufferRequested(uint8_t **buffer, size_t *size, size_t *maxNumRecords);
+void CUPTIAPI bufferCompleted(CUcontext ctx, uint32_t streamId, uint8_t *buffer, size_t size, size_t validSize);
+
+// Decoding of recorded activity buffers outside of a CUPTI session, used by
+// smprofiler_decode for raw dumps. Records are fed to the timeline and the
+// enabled collectors the same way bufferCompleted does during training.
+void cupti_tracer_decode_begin(char *phase, uint64_t phase_start_timestamp);
+void cupti_tracer_decode(uint8_t *buffer, size_t validSize);
+void cupti_tracer_decode_end();
@@ -0,0 +1,53 @@
+#pragma once
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <atomic>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Calls on_change on its own thread whenever one of the watched files is
+// created, written, renamed or removed. Changes are noticed through inotify
+// on the files' directories; directories that do not exist yet, or all of
+// them where inotify is not available, are checked with stat() every
+// poll_ms instead. on_change is also called once when the watcher starts.
+// Destroyed in a forked child, it leaves the parent's thread alone.
+class FileWatcher {
+public:
+  FileWatcher(const std::vector<std::string>& paths, int poll_ms, std::function<void()> on_change);
+  ~FileWatcher();
+  FileWatcher(const FileWatcher&) = delete;
+  void operator=(const FileWatcher&) = delete;
+
+private:
+  struct Watched {
+    std::string path;
+    std::string directory;
+    std::string name;
+    int watch = -1;
+    // last seen state, compared by the fallback poll
+    bool exists = false;
+    struct timespec mtime = {0, 0};
+    off_t size = 0;
+  };
+
+  void WatchLoop();
+  // adds the inotify watches that are missing
+  void AddWatches();
+  // reads pending inotify events, true if one was about a watched file
+  bool ReadEvents();
+  // re-reads the state of the files without a watch, true if it changed
+  bool PollUnwatched();
+  bool Refresh(Watched& watched);
+
+  std::vector<Watched> watched_;
+  int poll_ms_;
+  std::function<void()> on_change_;
+  int inotify_fd_ = -1;
+  // written to stop the thread
+  int wake_fd_ = -1;
+  // process that runs the thread, see ~FileWatcher
+  pid_t owner_pid_;
+  std::thread thread_;
+};
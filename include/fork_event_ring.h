@@ -0,0 +1,76 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+#define FORK_EVENT_TENSOR_NAME_SIZE (64)
+#define FORK_EVENT_OP_NAME_SIZE (128)
+#define FORK_EVENT_ARGS_SIZE (320)
+// a slot claimed by a push but not filled for this long is given up on
+#define FORK_EVENT_STALE_MS (1000)
+
+// A timeline event recorded by a forked child, names and args truncated to
+// fit.
+struct ForkEvent {
+  char phase;
+  // start and end are tsc_clock_now() ticks, else the start relative to
+  // the timeline start and the duration, in microseconds
+  bool ticks;
+  int32_t pid;
+  uint64_t threadid;
+  int64_t start;
+  int64_t end;
+  char tensor_name[FORK_EVENT_TENSOR_NAME_SIZE];
+  char op_name[FORK_EVENT_OP_NAME_SIZE];
+  char args[FORK_EVENT_ARGS_SIZE];
+};
+
+// Bounded queue in an anonymous shared mapping, created before the process
+// forks so that its children inherit it. Any number of processes push, the
+// process that created it pops. Both sides are lock free and allocate
+// nothing, which keeps pushing safe in a child whatever state the other
+// threads of the parent left behind. Events that do not fit are dropped and
+// counted.
+//
+// A push claims its slot before filling it, and events are popped in order.
+// A child killed or stopped in between would hold up every later event, so
+// Pop skips a slot left unfilled for FORK_EVENT_STALE_MS and counts it as
+// dropped; a push that completes after that drops its event. A pusher that
+// stalls long enough for the ring to come round to its slot again can still
+// overwrite the event of the next lap.
+class ForkEventRing {
+public:
+  // slots is rounded up to a power of two, NULL if the mapping fails
+  static ForkEventRing* Create(size_t slots);
+  bool Push(const ForkEvent& event);
+  // the two steps of Push: claims the next slot, then fills it with the
+  // event, false when it is dropped
+  bool Claim(uint64_t& pos);
+  bool Fill(uint64_t pos, const ForkEvent& event);
+  // only called by the creating process
+  bool Pop(ForkEvent& event);
+  uint64_t Dropped() const;
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> sequence;
+    ForkEvent event;
+  };
+  struct Header {
+    uint64_t mask;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<uint64_t> dropped;
+  };
+
+  ForkEventRing(Header* header, Slot* slots) : header_(header), slots_(slots) {}
+  // true once the claimed, unfilled slot at pos has been given up on
+  bool SkipStale(Slot& slot, uint64_t pos);
+
+  Header* header_;
+  Slot* slots_;
+  // the popper's: position found claimed but unfilled, and since when
+  bool stalled_ = false;
+  uint64_t stalled_pos_ = 0;
+  uint64_t stalled_since_ns_ = 0;
+};
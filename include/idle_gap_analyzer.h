@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+// Finds the periods in which a device runs no kernel, memcpy or memset and
+// attributes each idle gap to the CPU side activity that held up the work
+// ending it: the sync, memcpy or other API call that was running before the
+// next operation was launched (found through its correlation id), plain CPU
+// time if there was none, or "queued" if the operation had already been
+// launched when the gap started. Gaps are computed per profiling window with
+// sorted interval sweeps and accumulated into a ranked report written at
+// exit. Enabled with SMPROFILER_IDLE_GAPS=1.
+enum IdleGapCpuKind { IDLE_GAP_CPU_RUNTIME, IDLE_GAP_CPU_DRIVER, IDLE_GAP_CPU_SYNC };
+
+void idle_gap_init();
+bool idle_gap_enabled();
+// phase is the running phase, a window that fills up before the phase ends
+// is analyzed and charged to it
+void idle_gap_add_gpu(const char* phase, uint32_t device_id, uint64_t start, uint64_t end, uint32_t correlation_id);
+// id is the callback id for API records and the synchronization type for syncs
+void idle_gap_add_cpu(const char* phase, IdleGapCpuKind kind, uint32_t id, uint64_t start, uint64_t end,
+                      uint32_t correlation_id);
+// analyzes the records collected since the last call and charges the gaps to phase
+void idle_gap_analyze(const char* phase);
+void idle_gap_report();
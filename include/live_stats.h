@@ -0,0 +1,122 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+
+// Layout of the shared memory segment /dev/shm/smprofiler_live.<pid>, read
+// by smprofiler_top. Bump LIVE_STATS_VERSION on any change to it.
+#define LIVE_STATS_MAGIC (0x534d504cU)
+#define LIVE_STATS_VERSION (2)
+#define LIVE_STATS_SHM_PREFIX "smprofiler_live."
+#define LIVE_STATS_PHASE_NAME_SIZE (64)
+#define LIVE_STATS_KERNEL_NAME_SIZE (128)
+#define LIVE_STATS_MAX_PHASES (32)
+#define LIVE_STATS_MAX_KERNELS (64)
+
+struct LiveStatsPhase {
+  char name[LIVE_STATS_PHASE_NAME_SIZE];
+  uint64_t count;
+  // summed over all completed phases of this name, and of the last one
+  uint64_t wall_ns;
+  uint64_t gpu_ns;
+  uint64_t last_wall_ns;
+  uint64_t last_gpu_ns;
+};
+
+struct LiveStatsKernel {
+  char name[LIVE_STATS_KERNEL_NAME_SIZE];
+  uint64_t count;
+  uint64_t gpu_ns;
+  uint64_t max_ns;
+};
+
+// Everything updated while the job runs, copied as a whole under the
+// sequence lock.
+struct LiveStatsSnapshot {
+  // CLOCK_REALTIME of the last update
+  uint64_t update_ns;
+  uint64_t updates;
+  // current or last phase
+  char phase[LIVE_STATS_PHASE_NAME_SIZE];
+  uint32_t tracing;
+  uint64_t phase_elapsed_ns;
+  // GPU time of the records of the current phase decoded so far, summed
+  // over streams and devices
+  uint64_t phase_gpu_ns;
+  uint64_t records;
+  uint64_t memcpy_bytes;
+  uint64_t memcpy_ns;
+  // records CUPTI could not store because no buffer was free
+  uint64_t dropped_records;
+  // kernel records of names that did not fit the kernel table
+  uint64_t kernels_not_listed;
+  uint32_t num_phases;
+  uint32_t num_kernels;
+  LiveStatsPhase phases[LIVE_STATS_MAX_PHASES];
+  // by GPU time, highest first
+  LiveStatsKernel kernels[LIVE_STATS_MAX_KERNELS];
+};
+
+struct LiveStatsSegment {
+  // written once before magic is set
+  uint32_t magic;
+  uint32_t version;
+  uint32_t size;
+  int32_t rank;
+  int32_t local_rank;
+  uint32_t pid;
+  // CLOCK_REALTIME when the segment was created
+  uint64_t start_ns;
+  // odd while the writer is updating snapshot
+  std::atomic<uint64_t> sequence;
+  LiveStatsSnapshot snapshot;
+};
+
+// Copies the snapshot of a segment mapped read-only, retrying while the
+// writer is in the middle of an update. False if no consistent copy could
+// be taken within max_tries.
+inline bool live_stats_read(const LiveStatsSegment* segment, LiveStatsSnapshot* snapshot, int max_tries = 1000)
+{
+  for (int i = 0; i < max_tries; i++) {
+    uint64_t before = segment->sequence.load(std::memory_order_acquire);
+    if (before & 1)
+      continue;
+    memcpy(snapshot, (const void*) &segment->snapshot, sizeof(*snapshot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (segment->sequence.load(std::memory_order_relaxed) == before)
+      return true;
+  }
+  return false;
+}
+
+// Fraction of wall_ns the GPU was busy. gpu_ns sums the records of all
+// streams and devices and exceeds the wall time when they overlap, the
+// ratio is clamped to 1 then.
+inline double live_stats_busy_ratio(uint64_t gpu_ns, uint64_t wall_ns)
+{
+  if (wall_ns == 0)
+    return 0.0;
+  return gpu_ns >= wall_ns ? 1.0 : (double) gpu_ns / wall_ns;
+}
+
+// Aggregated counters of the running job, kept for the metrics exporter and
+// published to the shared memory segment above for smprofiler_top to show
+// without reading trace files. Records only update atomic counters while
+// they are decoded; with SMPROFILER_LIVE_STATS=1 a thread copies them into
+// the segment every SMPROFILER_LIVE_STATS_INTERVAL_MS (500) under a
+// sequence lock, so readers never block the profiler. The segment is
+// removed at exit. Enabled with SMPROFILER_LIVE_STATS=1 or
+// SMPROFILER_METRICS=1.
+void live_stats_init();
+bool live_stats_enabled();
+// fills snapshot from the counters, without allocating
+void live_stats_snapshot(LiveStatsSnapshot* snapshot);
+void live_stats_begin_phase(const char* phase);
+// GPU time of one record of the current phase, kernel_name NULL for memsets
+void live_stats_add_gpu(const char* kernel_name, uint64_t duration_ns);
+void live_stats_add_memcpy(uint64_t bytes, uint64_t duration_ns);
+void live_stats_add_records(size_t records, size_t dropped);
+// start and end are CUPTI timestamps, end is 0 when decoding offline
+void live_stats_end_phase(const char* phase, uint64_t start, uint64_t end);
+void live_stats_close();
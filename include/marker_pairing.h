@@ -0,0 +1,89 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+enum MarkerKind { MARKER_INSTANT, MARKER_START, MARKER_END };
+
+// Plain copy of the marker record fields the pairing needs, so it can be
+// driven by synthetic records without CUPTI. name and domain are only read
+// during AddMarker.
+struct MarkerRecord {
+  MarkerKind kind;
+  uint32_t id;
+  uint64_t timestamp;
+  uint32_t thread_id;
+  const char* name;    // NULL on end markers
+  const char* domain;  // NULL for the default domain
+};
+
+// attributes of a start or instant marker, from its MARKER_DATA record
+struct MarkerData {
+  uint32_t id;
+  bool has_color;
+  uint32_t color;      // ARGB
+  uint32_t category;
+  std::string payload; // formatted value, empty without payload
+};
+
+// An NVTX range, or an instant marker with start == end.
+struct MarkerSpan {
+  std::string name;
+  std::string domain;
+  uint64_t start;
+  uint64_t end;
+  uint32_t thread_id;
+  // ranges of the same thread that were open when this one started
+  uint32_t depth;
+  bool instant;
+  bool has_data;
+  MarkerData data;
+};
+
+// Pairs start and end markers by id into spans. Open ranges stay in a hash
+// table across activity buffers until their end marker comes, so every
+// marker is handled in constant time. Instant markers are held until their
+// data record, which follows them, or the next Flush. Data records of
+// markers that are not open any more are counted and ignored. At most
+// max_open markers are kept, further ones are dropped.
+class MarkerPairing {
+public:
+  explicit MarkerPairing(size_t max_open = 65536) : max_open_(max_open) {}
+  // appends the span completed by the marker, if any, to spans
+  void AddMarker(const MarkerRecord& r, std::vector<MarkerSpan>& spans);
+  void AddData(const MarkerData& d, std::vector<MarkerSpan>& spans);
+  // completes the instant markers still waiting for their data
+  void Flush(std::vector<MarkerSpan>& spans);
+
+  inline size_t OpenRanges() const { return open_.size(); }
+  inline uint64_t UnmatchedEnds() const { return unmatched_ends_; }
+  inline uint64_t UnmatchedData() const { return unmatched_data_; }
+  inline uint64_t Dropped() const { return dropped_; }
+
+private:
+  // entry of the marker, NULL when the table is full
+  MarkerSpan* Lookup(uint32_t id);
+  void Complete(std::unordered_map<uint32_t, MarkerSpan>::iterator it, std::vector<MarkerSpan>& spans);
+
+  size_t max_open_;
+  std::unordered_map<uint32_t, MarkerSpan> open_;
+  std::unordered_map<uint32_t, uint32_t> thread_depth_;
+  std::vector<uint32_t> held_instants_;
+  uint64_t unmatched_ends_ = 0;
+  uint64_t unmatched_data_ = 0;
+  uint64_t dropped_ = 0;
+};
+
+// NVTX ranges of the traced job as complete 'X' events on the timeline, with
+// domain, color, category and payload as args. Enabled by default, disabled
+// with SMPROFILER_NVTX_SPANS=0.
+void marker_pairing_init();
+bool marker_pairing_enabled();
+// take the fields of the CUPTI records, called while decoding a buffer
+void marker_pairing_add(const char* phase, const MarkerRecord& r);
+void marker_pairing_add_data(const char* phase, const MarkerData& d);
+// called after every decoded buffer
+void marker_pairing_flush(const char* phase);
+void marker_pairing_report();
@@ -0,0 +1,96 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <utility>
+#include <vector>
+
+// Plain copy of the memcpy record fields the analyzer needs, so the
+// detection logic can be driven by synthetic records without CUPTI.
+struct MemcpyRecord {
+  uint8_t copy_kind;   // CUpti_ActivityMemcpyKind
+  uint8_t src_kind;    // CUpti_ActivityMemoryKind
+  uint8_t dst_kind;    // CUpti_ActivityMemoryKind
+  bool async;
+  uint64_t bytes;
+  uint64_t start;
+  uint64_t end;
+};
+
+// findings reported by MemcpyAnalyzer::Add
+enum MemcpyFlag {
+  MEMCPY_FLAG_PAGEABLE = 1 << 0,     // host side is pageable memory
+  MEMCPY_FLAG_SYNC = 1 << 1,         // copy was not issued asynchronously
+  MEMCPY_FLAG_SMALL_STORM = 1 << 2,  // part of a burst of small copies
+};
+
+#define MEMCPY_KINDS (16)
+// log2 buckets of achieved bandwidth in MB/s, bucket i holds [2^(i-1), 2^i)
+#define MEMCPY_BANDWIDTH_BUCKETS (24)
+
+struct MemcpyDirectionStats {
+  uint64_t count;
+  uint64_t bytes;
+  uint64_t time_ns;
+  uint64_t pageable_count;
+  uint64_t sync_count;
+  uint64_t small_count;
+  uint64_t storm_count;
+  uint64_t bandwidth_histogram[MEMCPY_BANDWIDTH_BUCKETS];
+};
+
+// value of the bandwidth counter of a direction from timestamp on
+struct MemcpyCounterSample {
+  uint8_t copy_kind;
+  uint64_t timestamp;
+  double gbps;         // summed over the copies in flight
+  uint32_t in_flight;
+};
+
+// Keeps per direction bandwidth histograms and flags pageable, synchronous
+// and bursts of small copies. A storm is storm_count copies of at most
+// small_copy_bytes each within storm_window_ns in the same direction.
+class MemcpyAnalyzer {
+public:
+  MemcpyAnalyzer(uint64_t small_copy_bytes = 64 * 1024, uint32_t storm_count = 32, uint64_t storm_window_ns = 1000000);
+  // returns the MemcpyFlag bits of the record
+  uint32_t Add(const MemcpyRecord& r);
+  // Adds the copy to those in flight in its direction and appends the
+  // counter samples that can no longer change: the ends of the copies that
+  // finished by its start, then its start. A copy starting before samples
+  // already appended counts from its start on without revising them.
+  void Track(const MemcpyRecord& r, std::vector<MemcpyCounterSample>& samples);
+  // appends the ends of all copies still in flight
+  void EndInFlight(std::vector<MemcpyCounterSample>& samples);
+  const MemcpyDirectionStats& Stats(uint8_t copy_kind) const { return stats_[copy_kind % MEMCPY_KINDS]; }
+  void Summary(FILE* file, const char* (*kind_name)(uint8_t)) const;
+
+  static double BandwidthGBps(const MemcpyRecord& r);
+
+private:
+  static const uint32_t MAX_STORM_COUNT = 256;
+
+  void EndCopy(uint32_t kind, std::vector<MemcpyCounterSample>& samples);
+
+  uint64_t small_copy_bytes_;
+  uint32_t storm_count_;
+  uint64_t storm_window_ns_;
+  MemcpyDirectionStats stats_[MEMCPY_KINDS] = {};
+  // ring of the start times of the last storm_count_ small copies per direction
+  uint64_t small_starts_[MEMCPY_KINDS][MAX_STORM_COUNT] = {};
+  uint32_t small_pos_[MEMCPY_KINDS] = {};
+  bool in_storm_[MEMCPY_KINDS] = {};
+  // min-heaps of (end, GB/s) of the copies in flight per direction
+  std::vector<std::pair<uint64_t, double>> in_flight_[MEMCPY_KINDS];
+  double in_flight_gbps_[MEMCPY_KINDS] = {};
+};
+
+// Memcpy analysis of the traced job: counter tracks of the achieved
+// bandwidth and the copies in flight per direction on the timeline and a
+// summary written at exit. Enabled with SMPROFILER_MEMCPY_ANALYSIS=1.
+void memcpy_analyzer_init();
+bool memcpy_analyzer_enabled();
+// returns the MemcpyFlag bits of the record
+uint32_t memcpy_analyzer_add(const char* phase, const MemcpyRecord& r);
+// ends the counters of the copies still in flight at the end of the phase
+void memcpy_analyzer_end_phase(const char* phase);
+void memcpy_analyzer_report();
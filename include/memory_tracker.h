@@ -0,0 +1,143 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define MEMORY_MAX_DEVICES (64)
+
+// Allocation sites are the Python stack, the native launch stack or the
+// calling PC of the allocation, whichever is available, tagged in the top
+// byte of the site key.
+enum MemorySiteKind { MEMORY_SITE_PC = 0, MEMORY_SITE_STACK = 1, MEMORY_SITE_PY_STACK = 2 };
+
+inline uint64_t memory_site(MemorySiteKind kind, uint64_t value)
+{
+  return ((uint64_t) kind << 56) | (value & ((1ULL << 56) - 1));
+}
+
+// Plain copy of the memory record fields the tracker needs, so it can be
+// driven by synthetic records without CUPTI.
+struct MemoryRecord {
+  bool release;
+  uint32_t device;
+  uint32_t context;
+  uint64_t address;
+  uint64_t bytes;
+  uint64_t timestamp;
+  uint64_t site;       // memory_site(), not used for releases
+};
+
+enum MemoryPoolOperation { MEMORY_POOL_CREATED, MEMORY_POOL_DESTROYED, MEMORY_POOL_TRIMMED };
+
+struct MemoryPoolRecord {
+  MemoryPoolOperation operation;
+  uint32_t device;
+  uint64_t address;
+  uint64_t size;       // reserved size after the operation
+};
+
+// Bytes allocated by one site on one device. bytes may overcount by at most
+// error, see MemoryTracker.
+struct MemorySite {
+  uint64_t site;
+  uint32_t device;
+  uint64_t bytes;
+  uint64_t count;
+  uint64_t error;
+  uint64_t live_bytes;
+  // tells the entry apart from earlier entries of the same site that were
+  // evicted
+  uint64_t entry;
+};
+
+struct MemoryDeviceStats {
+  uint64_t live_bytes;
+  uint64_t peak_bytes;
+  uint64_t phase_peak_bytes;
+  // live bytes of allocations that did not fit into the live table
+  uint64_t untracked_bytes;
+  // live bytes of sites evicted from the site table
+  uint64_t other_live_bytes;
+  // reserved by memory pools
+  uint64_t pool_bytes;
+  uint64_t allocations;
+  uint64_t releases;
+  // live bytes of the top sites when peak_bytes and phase_peak_bytes were reached
+  std::vector<MemorySite> peak_sites;
+  std::vector<MemorySite> phase_peak_sites;
+};
+
+// Live and peak device memory from allocation and release records. Memory
+// stays bounded however many allocations the job makes: at most max_live
+// live allocations are kept to charge their release to a site, and the top
+// allocation sites by bytes are kept in a Space-Saving table of max_sites
+// entries. A site that is not in the table replaces the one with the fewest
+// bytes and inherits its count as error, so every site allocating more than
+// 1/max_sites of all bytes is guaranteed to be listed. The live bytes of an
+// evicted site move to the device's other_live_bytes, so the live bytes of
+// the sites, the other bucket and the untracked bytes add up to the device's
+// live bytes. Releases of allocations made before tracing started are
+// ignored.
+class MemoryTracker {
+public:
+  explicit MemoryTracker(size_t max_live = 262144, size_t max_sites = 32);
+  void Add(const MemoryRecord& r);
+  void AddPool(const MemoryPoolRecord& r);
+  // Allocations of a destroyed context are freed without release records.
+  // Returns the devices whose live bytes changed.
+  std::vector<uint32_t> ReleaseContext(uint32_t context);
+  // resets the phase peaks of all devices
+  void EndPhase();
+
+  const MemoryDeviceStats& Device(uint32_t device) const { return devices_[device % MEMORY_MAX_DEVICES]; }
+  // sites sorted by bytes allocated
+  std::vector<MemorySite> TopSites() const;
+  inline uint64_t Dropped() const { return dropped_; }
+  void Summary(FILE* file) const;
+
+  static void FormatSite(uint64_t site, char* buf, size_t size);
+
+private:
+  struct LiveAllocation {
+    uint64_t bytes;
+    uint64_t site;
+    uint64_t entry;
+    uint32_t device;
+    uint32_t context;
+  };
+
+  MemorySite* FindSite(uint64_t site, uint32_t device);
+  void Release(const LiveAllocation& allocation);
+  void Snapshot(uint32_t device, std::vector<MemorySite>& sites) const;
+
+  size_t max_live_;
+  size_t max_sites_;
+  MemoryDeviceStats devices_[MEMORY_MAX_DEVICES] = {};
+  std::unordered_map<uint64_t, LiveAllocation> live_;
+  // the table is small, a scan is cheaper than keeping an index
+  std::vector<MemorySite> sites_;
+  // pool address -> device, reserved size
+  std::unordered_map<uint64_t, std::pair<uint32_t, uint64_t>> pools_;
+  // allocations not kept in live_
+  uint64_t dropped_ = 0;
+  uint64_t next_entry_ = 0;
+};
+
+// Device memory tracking of the traced job from CUPTI memory and memory pool
+// records: a live bytes counter track per device on the timeline, the peak
+// of every phase, and the top allocation sites, written at exit. Sites are
+// the launch stacks of the allocation calls when SMPROFILER_CALLSTACK or
+// SMPROFILER_PYTHON_STACKS is enabled, otherwise the calling PC. Enabled with
+// SMPROFILER_MEMORY=1.
+void memory_tracker_init();
+bool memory_tracker_enabled();
+void memory_tracker_add(const char* phase, const MemoryRecord& r);
+void memory_tracker_add_pool(const char* phase, const MemoryPoolRecord& r, uint64_t timestamp);
+// called from the resource callback when a context is about to be destroyed
+void memory_tracker_context_destroyed(const char* phase, uint32_t context, uint64_t timestamp);
+// records the peaks of the phase and resets them
+void memory_tracker_end_phase(const char* phase);
+void memory_tracker_report();
@@ -0,0 +1,29 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "live_stats.h"
+
+struct MetricsIdentity {
+  uint32_t pid;
+  int32_t rank;
+  int32_t local_rank;
+};
+
+// Writes the OpenMetrics text exposition of a live statistics snapshot and
+// of the perf counter totals (task clock ns, context switches) into buffer,
+// ending with "# EOF". Series that do not fit are left out. Returns the
+// length of the text.
+size_t metrics_format(char* buffer, size_t size, const MetricsIdentity& identity,
+                      const LiveStatsSnapshot& snapshot, const uint64_t* perf_totals);
+
+// Serves the job's aggregated metrics for Prometheus scrapes: GPU busy
+// fraction and duration of every phase name, per-kernel GPU time, memcpy
+// bytes and bandwidth, decoded and dropped record counts, and the perf
+// counters, side by side. A thread answers HTTP GET /metrics on the Unix
+// socket /tmp/framework/<pid>_metrics.sock (SMPROFILER_METRICS_SOCKET), or
+// on 127.0.0.1:SMPROFILER_METRICS_PORT + LOCAL_RANK when the port is set.
+// Every scrape formats a fresh snapshot of the counters into a buffer
+// allocated once. Enabled with SMPROFILER_METRICS=1.
+void metrics_exporter_init();
+bool metrics_exporter_enabled();
+void metrics_exporter_close();
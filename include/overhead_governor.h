@@ -0,0 +1,65 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include "overhead_monitor.h"
+
+// Collection levels, each one also dropping what the ones before dropped.
+enum GovernorLevel {
+  GOVERNOR_FULL = 0,
+  // no DRIVER and RUNTIME API records
+  GOVERNOR_NO_API = 1,
+  // kernels are summed up per name and phase instead of one event each
+  GOVERNOR_AGGREGATE_KERNELS = 2,
+  // only one phase out of sample_every is traced
+  GOVERNOR_SAMPLE_PHASES = 3,
+};
+
+struct GovernorConfig {
+  // self time allowed, in permille of the phase wall time
+  uint32_t budget_permille;
+  // self time below which fidelity is restored, in permille
+  uint32_t restore_permille;
+  // phases in a row below restore_permille before going up one level
+  uint32_t restore_phases;
+  // timeline queue depth that counts as over budget
+  size_t max_queue_depth;
+  uint32_t sample_every;
+};
+
+// Decides the collection level from the overhead of every traced phase. A
+// phase over budget, or whose timeline queue got deeper than allowed, moves
+// one level down right away; restore_phases phases in a row well below
+// budget move one level up.
+class OverheadGovernor {
+public:
+  explicit OverheadGovernor(const GovernorConfig& config) : config_(config) {}
+  // returns the level for the next phase
+  GovernorLevel Update(const OverheadSample& sample);
+  // counts phases while sampling, false for the ones to skip
+  bool TracePhase();
+  inline GovernorLevel Level() const { return level_; }
+
+  static const char* LevelName(GovernorLevel level);
+
+private:
+  GovernorConfig config_;
+  GovernorLevel level_ = GOVERNOR_FULL;
+  uint32_t calm_phases_ = 0;
+  uint64_t phase_count_ = 0;
+};
+
+// Throttles collection to a CPU budget, measured by the overhead monitor.
+// At the end of every phase its self time is compared to
+// SMPROFILER_GOVERNOR_BUDGET_PERMILLE (20, i.e. 2%) of the phase wall time
+// and collection is degraded or restored by one level for the next phase.
+// Every level change is recorded on the "profiler" track of the timeline.
+// Enabled with SMPROFILER_GOVERNOR=1.
+void overhead_governor_init();
+bool overhead_governor_enabled();
+GovernorLevel overhead_governor_level();
+// called by smprofiler.start(), false when the phase is skipped for sampling
+bool overhead_governor_trace_phase();
+// a kernel record while kernels are only aggregated
+void overhead_governor_add_kernel(const char* name, uint64_t start, uint64_t end);
+// writes out the kernel aggregates of the phase and picks the next level
+void overhead_governor_end_phase(const char* phase, const OverheadSample& sample, uint64_t end_timestamp);
@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// what the profiler cost in one phase
+struct OverheadSample {
+  uint64_t self_ns;
+  // wall time of the phase, 0 when not known
+  uint64_t traced_ns;
+  size_t max_queue_depth;
+};
+
+// Cost of the profiler itself: CUPTI's OVERHEAD records (buffer flushes,
+// instrumentation, resources, compiler), the time spent decoding activity
+// buffers and enqueueing and writing timeline events, and the depth of the
+// timeline queue. At the end of every phase the numbers of the phase are
+// put on a "profiler" track of the timeline as a span over the phase and
+// counters, and at exit a summary is written to
+// /tmp/framework/<pid>_overhead.txt. Enabled with SMPROFILER_OVERHEAD=1,
+// or by SMPROFILER_GOVERNOR=1 which needs the measurements.
+void overhead_monitor_init();
+bool overhead_monitor_enabled();
+// monotonic clock for the internal timers
+uint64_t overhead_monitor_now();
+// a decoded activity buffer, enqueueing its events included
+void overhead_monitor_add_decode(uint64_t ns, size_t records);
+// an OVERHEAD record, kind is a CUpti_ActivityOverheadKind
+void overhead_monitor_add_cupti(uint32_t kind, uint64_t start, uint64_t end);
+// Charges the time since the previous call to the phase. start and end are
+// the CUPTI timestamps of the phase, 0 when they are not known, e.g. when
+// decoding offline.
+OverheadSample overhead_monitor_end_phase(const char* phase, uint64_t start, uint64_t end);
+void overhead_monitor_report();
@@ -0,0 +1,84 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#define PC_SAMPLING_STALL_REASONS (32)
+
+// Plain copy of the PC sampling record fields the aggregator needs, so it
+// can be driven by synthetic records without CUPTI.
+struct PcSample {
+  uint32_t function_id;
+  uint32_t pc_offset;
+  uint32_t source_locator_id;
+  uint32_t stall_reason;   // CUpti_ActivityPCSamplingStallReason
+  uint32_t samples;
+  uint32_t latency_samples;
+};
+
+// Sums up PC samples by (function, PC offset, stall reason) in an open
+// addressing hash table of fixed size, so memory does not grow with the
+// number of samples. Samples of keys that do not fit once max_pcs keys are
+// kept are only counted as dropped. Function names and source lines come
+// from the FUNCTION and SOURCE_LOCATOR records, which can arrive before or
+// after the samples referring to them, and are joined in Summary.
+class PcSamplingAggregator {
+public:
+  explicit PcSamplingAggregator(size_t max_pcs = 65536);
+  void AddSample(const PcSample& s);
+  void AddFunction(uint32_t id, const char* name);
+  void AddSourceLocator(uint32_t id, const char* file, uint32_t line);
+  // totals of one kernel from its PC_SAMPLING_RECORD_INFO record
+  void AddRecordInfo(uint64_t total_samples, uint64_t dropped_samples);
+
+  inline size_t Size() const { return size_; }
+  inline uint64_t Samples() const { return samples_; }
+  inline uint64_t Dropped() const { return dropped_; }
+  // per kernel samples and top stall reasons, then the top_lines hottest
+  // source lines of each kernel
+  void Summary(FILE* file, size_t top_lines, const char* (*stall_name)(uint32_t)) const;
+
+private:
+  struct Entry {
+    uint32_t function_id;
+    uint32_t pc_offset;
+    uint32_t source_locator_id;
+    uint32_t stall_reason;
+    uint64_t samples;
+    uint64_t latency_samples;
+    bool used;
+  };
+
+  static uint64_t Hash(uint32_t function_id, uint32_t pc_offset, uint32_t stall_reason);
+
+  size_t max_pcs_;
+  // power of two, at least twice max_pcs_ so probes stay short
+  std::vector<Entry> entries_;
+  size_t size_ = 0;
+  uint64_t samples_ = 0;
+  uint64_t dropped_ = 0;
+  uint64_t cupti_total_samples_ = 0;
+  uint64_t cupti_dropped_samples_ = 0;
+  std::unordered_map<uint32_t, std::string> functions_;
+  std::unordered_map<uint32_t, std::pair<std::string, uint32_t>> source_locators_;
+};
+
+// PC sampling of the traced job: samples are aggregated instead of printed,
+// and at exit /tmp/framework/<pid>_pc_sampling.txt lists the stall reasons
+// per kernel and its hottest source lines. PC sampling serializes kernel
+// execution, so it is meant for dedicated profiling runs. Enabled with
+// SMPROFILER_PC_SAMPLING=1.
+void pc_sampling_init();
+bool pc_sampling_enabled();
+// sampling period 2^period cycles for contexts created while tracing, 0 for
+// the CUPTI default
+uint32_t pc_sampling_period();
+void pc_sampling_add_sample(const PcSample& s);
+void pc_sampling_add_function(uint32_t id, const char* name);
+void pc_sampling_add_source_locator(uint32_t id, const char* file, uint32_t line);
+void pc_sampling_add_record_info(uint64_t total_samples, uint64_t dropped_samples);
+void pc_sampling_report();
@@ -2,3 +2,5 @@ int perf_init(char* phase);
 void perf_close();
 
 void perf_read_all(uint64_t* vals);
+// task clock (ns) and context switches summed over all closed phases
+void perf_read_totals(uint64_t* vals);
@@ -0,0 +1,80 @@
+#pragma once
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#include "proto_writer.h"
+
+// One timeline event as the JSON writer models it: phases are processes,
+// the threads that recorded events are their threads, GPU operations may
+// name the device and stream they ran on.
+struct PerfettoEvent {
+  const std::string& phase_name;
+  int phase_index;
+  uint64_t thread_id;
+  int pid;
+  // 'X' complete, 'i' instant or 'C' counter, as in the JSON trace
+  char type;
+  const std::string& name;
+  // JSON object members, "key": value pairs separated by commas
+  const std::string& args;
+  uint64_t ts_ns;
+  uint64_t duration_ns;
+  int32_t device;
+  int32_t stream;
+};
+
+// Encodes timeline events as a stream of Perfetto TracePacket messages, each
+// one a complete Trace.packet entry so a file can be appended to packet by
+// packet and read back at any size. Event and argument names are interned;
+// process, thread, device/stream and counter tracks are described the first
+// time an event uses them. Complete events that overlap on a track without
+// nesting go to an extra lane track, as Perfetto requires slices on one
+// track to nest.
+class PerfettoWriter {
+public:
+  PerfettoWriter();
+  // forgets interned names and tracks, for the start of a new file
+  void Reset();
+  // appends the packets of one event to out
+  void AddEvent(const PerfettoEvent& event, std::string& out);
+
+private:
+  struct Lane {
+    uint64_t uuid;
+    uint64_t last_start;
+    // ends of the slices still open at last_start, innermost last
+    std::vector<uint64_t> open_ends;
+  };
+  // a thread or device/stream track and the lanes added next to it
+  struct Track {
+    std::string name;
+    std::vector<Lane> lanes;
+  };
+
+  uint64_t NewUuid();
+  void AppendPacket(ProtoWriter& packet, std::string& out);
+  void AppendDescriptor(ProtoWriter& descriptor, std::string& out);
+  uint64_t ProcessTrack(const PerfettoEvent& event, std::string& out);
+  Track& ThreadTrack(const PerfettoEvent& event, uint64_t process_uuid, std::string& out);
+  Track& DeviceTrack(const PerfettoEvent& event, uint64_t process_uuid, std::string& out);
+  uint64_t CounterTrack(const PerfettoEvent& event, const std::string& series, uint64_t process_uuid, std::string& out);
+  // a lane of track the slice [start, end] nests on
+  uint64_t LaneFor(Track& track, uint64_t process_uuid, uint64_t start, uint64_t end, std::string& out);
+  uint64_t InternName(std::unordered_map<std::string, uint64_t>& names, const std::string& name,
+                      uint32_t field, ProtoWriter& interned, bool& has_interned);
+
+  uint64_t uuid_prefix_;
+  uint64_t next_uuid_ = 1;
+  int next_tid_ = 1;
+  bool sequence_started_ = false;
+  std::map<int, uint64_t> processes_;
+  std::map<std::pair<int, uint64_t>, Track> threads_;
+  std::map<std::tuple<int, int32_t, int32_t>, Track> devices_;
+  std::map<std::pair<int, std::string>, uint64_t> counters_;
+  std::unordered_map<std::string, uint64_t> event_names_;
+  std::unordered_map<std::string, uint64_t> annotation_names_;
+};
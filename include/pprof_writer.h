@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Streams a pprof profile (profile.proto, uncompressed) to disk. Repeated
+// fields of concatenated protobuf messages are merged by the reader, so every
+// AddSample call appends its own small Profile message and only the string,
+// function and location tables stay in memory.
+class PprofWriter {
+public:
+  // value_types are (type, unit) pairs, one per sample value
+  bool Open(const std::string& path, const std::vector<std::pair<std::string, std::string>>& value_types);
+  // frames are leaf first
+  void AddSample(const std::vector<std::string>& frames, const std::vector<int64_t>& values);
+  void Flush();
+  void Close();
+  inline bool IsOpen() const { return file_ != NULL; }
+
+private:
+  uint64_t InternString(const std::string& value, std::string& pending_strings);
+  uint64_t InternLocation(const std::string& name, std::string& pending);
+
+  FILE* file_ = NULL;
+  std::unordered_map<std::string, uint64_t> strings_;
+  // one function and one location per frame name, sharing the id
+  std::unordered_map<std::string, uint64_t> locations_;
+};
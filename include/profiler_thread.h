@@ -0,0 +1,29 @@
+#pragma once
+#include <new>
+#include <thread>
+
+// Scheduling of the profiler's own background threads (timeline writer,
+// compression, file watcher, live statistics, metrics server, worker CPU
+// sampler), so they keep off the cores of the training loop and its
+// dataloader workers. Every such thread calls profiler_thread_setup() with
+// its short name first thing. It is named "smprof-<name>" for top and
+// perf, and the following options are applied, each also settable per
+// thread as SMPROFILER_THREAD_<NAME>_<OPTION>, e.g.
+// SMPROFILER_THREAD_WRITER_CPUS:
+//   SMPROFILER_THREAD_CPUS       CPUs to run on, a list such as "0-3,8"
+//   SMPROFILER_THREAD_NUMA_NODE  run on the CPUs of this node, within
+//                                SMPROFILER_THREAD_CPUS if set, and prefer
+//                                its memory
+//   SMPROFILER_THREAD_SCHED      "idle" (SCHED_IDLE, runs only on otherwise
+//                                idle CPUs), "batch" or "other" (default)
+//   SMPROFILER_THREAD_NICE       nice level, e.g. 10, unchanged if 0
+// Settings that cannot be applied are reported and skipped.
+void profiler_thread_setup(const char* name);
+
+// Drops a thread object a forked child inherited from its parent. The child
+// has no such thread, so it can neither be joined nor detached, and
+// destroying the object while joinable would terminate the process.
+inline void profiler_thread_forget(std::thread& thread)
+{
+  new (&thread) std::thread();
+}
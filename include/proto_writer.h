@@ -0,0 +1,54 @@
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Minimal protocol buffer encoder, enough to stream pprof and Perfetto
+// messages without depending on libprotobuf.
+class ProtoWriter {
+public:
+  inline void Varint(uint32_t field, uint64_t value) {
+    WriteVarint(((uint64_t) field << 3) | 0);
+    WriteVarint(value);
+  }
+  inline void Double(uint32_t field, double value) {
+    WriteVarint(((uint64_t) field << 3) | 1);
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++) {
+      data_.push_back((char) (bits >> (8 * i)));
+    }
+  }
+  inline void Bytes(uint32_t field, const char* value, size_t size) {
+    WriteVarint(((uint64_t) field << 3) | 2);
+    WriteVarint(size);
+    data_.append(value, size);
+  }
+  inline void String(uint32_t field, const std::string& value) {
+    Bytes(field, value.data(), value.size());
+  }
+  inline void Message(uint32_t field, const ProtoWriter& message) {
+    Bytes(field, message.data_.data(), message.data_.size());
+  }
+  inline void PackedVarints(uint32_t field, const std::vector<uint64_t>& values) {
+    ProtoWriter packed;
+    for (uint64_t value : values) {
+      packed.WriteVarint(value);
+    }
+    Message(field, packed);
+  }
+  inline const std::string& Data() const { return data_; }
+  inline void Clear() { data_.clear(); }
+
+private:
+  inline void WriteVarint(uint64_t value) {
+    while (value >= 0x80) {
+      data_.push_back((char) (value | 0x80));
+      value >>= 7;
+    }
+    data_.push_back((char) value);
+  }
+
+  std::string data_;
+};
@@ -0,0 +1,18 @@
+#pragma once
+#include <stdint.h>
+
+// Optional capture of the Python frame chain at every kernel launch. The
+// launch callback only copies (code object, instruction offset) pairs of the
+// calling thread into a StackTable; no GIL is taken. The first launch from
+// a stack also names its frames, while the frames keep their code objects
+// alive, so no code object is referenced after the launch returns. Kernel
+// activity records are joined by correlation id and their GPU time is
+// accumulated per Python stack. Enabled with SMPROFILER_PYTHON_STACKS=1.
+void pystack_init();
+bool pystack_enabled();
+void pystack_capture(uint32_t correlation_id);
+// stack id recorded for a correlation id, StackTable::INVALID_ID if none
+uint32_t pystack_lookup(uint32_t correlation_id);
+void pystack_record_kernel(uint32_t correlation_id, const char* kernel_name, uint64_t duration_ns);
+// Writes the per-callsite GPU time breakdown and the folded stacks.
+void pystack_dump();
@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+
+// Runtime configuration of the profiler. All options are read from
+// SMPROFILER_* environment variables so they can be set per job without
+// touching the training script.
+bool smprofiler_config_flag(const char* name, bool default_value);
+long smprofiler_config_int(const char* name, long default_value);
+std::string smprofiler_config_string(const char* name, const std::string& default_value);
+
+// Path of a per-process output file "<output dir>/<pid>_<name>" in
+// SMPROFILER_OUTPUT_DIR (default /tmp/framework).
+std::string smprofiler_output_path(const std::string& name);
+// Creates the directories above an output file. Called right before the file
+// is opened, so collectors that stay disabled create nothing.
+void smprofiler_create_parent_dirs(const std::string& path);
+
+// Runs hook at exit like atexit, but only in the process that registered it.
+// Forked children inherit atexit hooks, and a child running its parent's
+// would write the parent's reports again, remove its files and sockets or
+// join threads that do not exist in the child.
+void smprofiler_atexit(void (*hook)());
@@ -12,6 +12,11 @@
 #include <sys/types.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include "file_watcher.h"
+#include "fork_event_ring.h"
+#include "perfetto_writer.h"
+#include "trace_file.h"
+#include "trace_index.h"
 
 enum TimelineRecordType { EVENT, MARKER };
 
@@ -27,6 +32,29 @@ struct TimelineRecord {
   long duration;
   pthread_t threadid;
   pid_t pid;
+  // CPU spans captured as tsc_clock_now() ticks, converted by the writer
+  // thread into the fields above and the nanosecond ones below
+  bool ticks = false;
+  uint64_t start_ticks;
+  uint64_t end_ticks;
+  int64_t rel_ts_nanos;
+  int64_t duration_nanos;
+  // GPU operations, the device and stream they ran on
+  int32_t device = -1;
+  int32_t stream = -1;
+};
+
+// work done by the timeline writer since it started
+struct TimelineWriterStats {
+  uint64_t enqueued;
+  // time spent in EnqueueWriteEvent, only measured while
+  // Timeline::MeasureOverhead is on
+  uint64_t enqueue_ns;
+  uint64_t written;
+  // time the writer thread spent in DoWriteEvent
+  uint64_t write_ns;
+  // deepest the queue got since the previous Stats(true)
+  size_t max_queue_depth;
 };
 
 class TimelineWriter {
@@ -36,18 +64,42 @@ public:
   inline bool ShouldCollectDataloaderMetrics() const { return should_collect_dataloader_metrics_; }
   void EnqueueWriteEvent(const std::string& tensor_name, char phase,
                          const std::string& op_name, const std::string& args,
-                         long ts_micros, pthread_t threadid, pid_t pid, long duration=0);
+                         long ts_micros, pthread_t threadid, pid_t pid, long duration=0,
+                         int32_t device=-1, int32_t stream=-1);
+  void EnqueueCpuEvent(const std::string& tensor_name, const std::string& op_name, const std::string& args,
+                       uint64_t start_ticks, uint64_t end_ticks, pthread_t threadid, pid_t pid);
+  // number of records waiting for the writer thread
+  size_t QueueDepth();
+  TimelineWriterStats Stats(bool reset_max_queue_depth);
+  inline void MeasureOverhead(bool on) { measure_overhead_ = on; }
+  // In the process that created it the writer thread also writes the events
+  // of forked children from ring; in a child every event goes to the ring.
+  inline void SetForkRing(ForkEventRing* ring, bool child) { fork_ring_ = ring; fork_child_ = child; }
   ~TimelineWriter();
   uint64_t start_time_since_epoch_utc_micros_;
 
 
 private:
   void DoWriteEvent(const TimelineRecord& r);
+  // DoWriteEvent for SMPROFILER_TIMELINE_FORMAT=perfetto
+  void WritePerfettoEvent(const TimelineRecord& r);
+  // hands the record of a forked child to the process that writes the file
+  void PushForkEvent(const TimelineRecord& r);
+  // the record of an event popped from the ring
+  void PopForkEvent(const ForkEvent& event, TimelineRecord& r);
+  // fills in the times of a record enqueued with ticks
+  void ConvertTicks(TimelineRecord& r);
+  // writes one record on the writer thread
+  void WriteRecord(TimelineRecord& r);
   void WriterLoop();
   bool open_file_and_init(std::string file_name);
   bool shouldRotateToNew(uint64_t absolute_event_ts);
   std::string create_new_file_path(uint64_t timestamp_utc);
   void close_and_rename_file();
+  // ends the append-only file with the index footer, if any, and closes it
+  void close_trace_file();
+  bool is_file_open();
+  bool is_file_good();
   void update_dataloader_collection_status();
   bool file_exists(std::string filename);
 
@@ -58,6 +110,8 @@ private:
   std::string pid_node_id_ = "";
   std::string tf_dataloader_start_flag_filepath;
   std::string tf_dataloader_end_flag_filepath;
+  // calls update_dataloader_collection_status when a flag file changes
+  std::unique_ptr<FileWatcher> dataloader_flag_watcher_;
   int64_t file_close_interval_;
   int64_t continuous_fail_count_threshold_;
   int continuous_fail_count_ = 0;
@@ -70,6 +124,25 @@ private:
 
   // Timeline file.
   std::fstream file_;
+  // Set when SMPROFILER_TIMELINE_WRITER selects the batched asynchronous
+  // backend or the timeline is compressed, replaces file_. Events are
+  // appended without the closing ']' after each one, which the trace
+  // viewer does not require.
+  std::unique_ptr<TraceFile> trace_file_;
+  // appended to rotated file names, e.g. ".zst"
+  std::string trace_file_suffix_;
+  // how long appended events may wait in a partly filled buffer
+  uint64_t trace_file_submit_interval_micros_;
+  uint64_t last_trace_file_submit_micros_ = 0;
+  // SMPROFILER_TIMELINE_INDEX: the append-only file is cut into blocks of
+  // about this many bytes that are indexed in its footer, 0 when disabled
+  uint64_t trace_index_block_bytes_ = 0;
+  TraceIndex trace_index_;
+  ForkEventRing* fork_ring_ = nullptr;
+  bool fork_child_ = false;
+  // SMPROFILER_TIMELINE_FORMAT=perfetto: events are encoded as Perfetto
+  // trace packets instead of JSON, always through trace_file_
+  std::unique_ptr<PerfettoWriter> perfetto_;
   // tensor_Existed_ is to find if this is first write in the file
   // see smprofiler_timeline.cc::DoWriteEvent
   bool tensor_existed_ = false;
@@ -78,6 +151,14 @@ private:
   std::string current_tmp_filename_;
   // Timeline record queue.
   std::queue<TimelineRecord> record_queue_;
+  std::atomic_bool measure_overhead_{false};
+  // guarded by mutex_
+  uint64_t enqueued_ = 0;
+  uint64_t enqueue_ns_ = 0;
+  size_t max_queue_depth_ = 0;
+  // updated by the writer thread
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> write_ns_{0};
   std::map<std::string, int> tensor_table_;
   // putting tid in table.
   std::set<pthread_t> tid_table_;
@@ -105,17 +186,39 @@ public:
   void operator=(Timeline const&)  = delete;
   void Initialize();
   inline bool Initialized() const { return initialized_; }
+  inline size_t QueueDepth() { return writer_->QueueDepth(); }
+  inline TimelineWriterStats WriterStats(bool reset_max_queue_depth = false) { return writer_->Stats(reset_max_queue_depth); }
+  // time the enqueue and write of every event, see TimelineWriterStats
+  inline void MeasureOverhead(bool on) { writer_->MeasureOverhead(on); }
+  // this process is a fork of the one that writes the timeline
+  inline bool IsForkedChild() const { return forked_child_; }
   void SMRecordEvent(const std::string training_phase,
                           const std::string op_name, uint64_t start_ts, uint64_t duration, const std::string args = "", char event_type='X');
+  // record a GPU operation, the same event as SMRecordEvent in the JSON
+  // timeline; the Perfetto one puts it on a track of its device and stream
+  void SMRecordDeviceEvent(const std::string training_phase, const std::string op_name, uint64_t start_ts,
+                           uint64_t duration, int32_t device, int32_t stream, const std::string args = "");
+  // record a CPU span between two tsc_clock_now() readings, in nanosecond
+  // resolution; the ticks are converted by the writer thread
+  void SMRecordCpuEvent(const std::string training_phase, const std::string op_name,
+                        uint64_t start_ticks, uint64_t end_ticks, const std::string args = "");
+  // record a sample of a counter track, values is a list of "\"series\": value" pairs
+  void SMRecordCounter(const std::string training_phase, const std::string counter_name,
+                       uint64_t ts, const std::string& values);
   uint64_t start_time_;
 
 private:
 
   Timeline();
   Timeline(Timeline&&) = default;
+  // pthread_atfork child handler
+  static void AfterForkChild();
   // Boolean flag indicating whether Timeline was initialized (and thus should
   // be recorded).
   bool initialized_ = false;
+  bool forked_child_ = false;
+  // shared with forked children, NULL when SMPROFILER_FORK_RING_SLOTS=0
+  ForkEventRing* fork_ring_ = nullptr;
   // Data Loader Config parameters.
   std::string base_folder;
   std::string node_id;
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+// Deduplicating store for call stacks. Every distinct frame sequence is kept
+// once and identified by a dense stack id, so hot paths only have to pass a
+// 32 bit id around and symbolization can happen once per stack at dump time.
+class StackTable {
+public:
+  static const uint32_t INVALID_ID = 0xffffffff;
+
+  explicit StackTable(size_t max_stacks = 65536) : max_stacks_(max_stacks) {}
+
+  // Returns the id of the given frame sequence, inserting it if unseen, and
+  // sets *inserted if it was. Returns INVALID_ID once the table is full.
+  uint32_t Intern(const uintptr_t* frames, int depth, bool* inserted = NULL);
+
+  // Copies the frames of a stack id, returns false for unknown ids.
+  bool GetFrames(uint32_t stack_id, std::vector<uintptr_t>& frames);
+
+  size_t Size();
+
+private:
+  struct StackEntry {
+    uint32_t offset;
+    uint32_t depth;
+  };
+
+  size_t max_stacks_;
+  std::mutex mutex_;
+  // all frames of all stacks back to back, entries index into it
+  std::vector<uintptr_t> frame_pool_;
+  std::vector<StackEntry> entries_;
+  // hash of frame sequence -> stack ids with that hash
+  std::unordered_multimap<uint64_t, uint32_t> index_;
+};
+
+// Maps correlation ids of recent launches to stack ids. Activity records
+// arrive shortly after their launch, so a direct mapped window of recent
+// correlation ids is enough and keeps the memory constant for the whole job.
+class StackCorrelationMap {
+public:
+  inline void Set(uint32_t correlation_id, uint32_t stack_id) {
+    slots_[correlation_id % SLOTS].store(((uint64_t) correlation_id << 32) | stack_id, std::memory_order_relaxed);
+  }
+  inline uint32_t Lookup(uint32_t correlation_id) const {
+    uint64_t slot = slots_[correlation_id % SLOTS].load(std::memory_order_relaxed);
+    return ((uint32_t) (slot >> 32) == correlation_id) ? (uint32_t) slot : StackTable::INVALID_ID;
+  }
+
+private:
+  static const uint32_t SLOTS = 1 << 16;
+  // (correlation id << 32) | stack id
+  std::atomic<uint64_t> slots_[SLOTS] {};
+};
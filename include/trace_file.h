@@ -0,0 +1,32 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Append-only output of the timeline writer, used instead of std::fstream
+// by the asynchronous and compressing backends. Only the writer thread
+// calls into it.
+class TraceFile {
+public:
+  virtual ~TraceFile() {}
+  virtual bool Open(const std::string& path) = 0;
+  virtual void Append(const char* data, size_t size) = 0;
+  inline void Append(const std::string& data) { Append(data.data(), data.size()); }
+  // hands what was appended on towards the disk without waiting for it
+  virtual void Submit() = 0;
+  // ends a block that can be read without what came before it, see
+  // trace_index.h
+  virtual void EndBlock() = 0;
+  // file offsets the blocks of the current file ended at
+  virtual const std::vector<uint64_t>& BlockEnds() = 0;
+  // appended after the last block as it is, compressing files do not
+  // compress it
+  virtual void AppendFooter(const std::string& data) { Append(data); }
+  // writes out everything appended and closes the file
+  virtual void Close() = 0;
+  virtual bool IsOpen() const = 0;
+  virtual bool Good() const = 0;
+  // bytes the current file has on disk once everything is written
+  virtual uint64_t Size() const = 0;
+};
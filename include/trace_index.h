@@ -0,0 +1,95 @@
+#pragma once
+#include <stdint.h>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Seekable index of a timeline file. The append-only timeline files are cut
+// into blocks that can be read on their own: byte ranges of complete events
+// in plain JSON files, one zstd/LZ4 frame each in compressed files. When a
+// file is closed the index of its blocks (time range, phases, file range)
+// is written as a footer:
+//  * plain JSON: a "smprofiler_index" metadata event followed by a fixed
+//    size "smprofiler_index_offset" event pointing at it, so the file stays
+//    valid JSON
+//  * compressed: a skippable frame, ignored by zstd and lz4, ending in
+//    the length of the index and TRACE_INDEX_MAGIC
+// The index itself is text, one "phase <id> <name>" or
+// "block <offset> <size> <min ts> <max ts> <metadata> <phase ids>" per line.
+#define TRACE_INDEX_MAGIC "SMPIDX01"
+
+struct TraceIndexBlock {
+  uint64_t offset;
+  uint64_t size;
+  int64_t min_ts;
+  int64_t max_ts;
+  // has process/thread name events, needed to display any of the others
+  bool metadata;
+  std::set<int> phases;
+};
+
+// Collects the index while a file is written, used by the timeline writer.
+class TraceIndex {
+public:
+  void Reset();
+  void AddPhase(int id, const std::string& name);
+  // ts and end of an event in the file's microseconds, metadata when the
+  // event came with process or thread name events
+  void AddEvent(int64_t ts, int64_t end, int phase, bool metadata, size_t bytes);
+  // bytes appended since the last block ended
+  inline uint64_t BlockBytes() const { return block_bytes_; }
+  inline bool Empty() const { return blocks_.empty(); }
+  // closes the current block, after the file ended it
+  void EndBlock();
+  // Footers for the file offsets the blocks ended at. The one of plain JSON
+  // files goes after the last event at offset and closes the array.
+  std::string JsonFooter(const std::vector<uint64_t>& block_ends, uint64_t offset) const;
+  std::string SkippableFrame(const std::vector<uint64_t>& block_ends) const;
+
+private:
+  std::string Text(const std::vector<uint64_t>& block_ends) const;
+
+  std::map<int, std::string> phases_;
+  std::vector<TraceIndexBlock> blocks_;
+  TraceIndexBlock current_;
+  uint64_t block_bytes_ = 0;
+};
+
+// Extracts events from an indexed timeline file by reading only the blocks
+// that can contain them. Files without an index are read from start to end,
+// TRACE_FILE_CHUNK_SIZE bytes at a time. Only JSON timelines are read, not
+// Perfetto traces.
+class TraceReader {
+public:
+  bool Open(const std::string& path);
+  inline bool Indexed() const { return indexed_; }
+  inline const std::vector<TraceIndexBlock>& Blocks() const { return blocks_; }
+  inline const std::map<int, std::string>& Phases() const { return phases_; }
+  // Appends the events overlapping [start, end] (microseconds, < 0 for
+  // open ended) of phase (empty for all) to events, one JSON object per
+  // element. Metadata events are always included. Returns the number of
+  // blocks read, -1 on error.
+  int Query(int64_t start, int64_t end, const std::string& phase, std::vector<std::string>& events);
+  // Calls visit with every event of the file, metadata included, in file
+  // order, holding one block, or one chunk of a file without an index, in
+  // memory at a time. Returns the number of blocks read, 1 for a file
+  // without an index, -1 on error.
+  int Scan(const std::function<void(const std::string& event)>& visit);
+
+private:
+  bool ReadIndex();
+  bool ParseIndex(const std::string& text);
+  bool ReadRange(uint64_t offset, uint64_t size, std::string& data);
+  bool ReadBlock(const TraceIndexBlock& block, std::string& text);
+
+  std::string path_;
+  std::ifstream file_;
+  uint64_t file_size_ = 0;
+  bool compressed_ = false;
+  bool indexed_ = false;
+  std::vector<TraceIndexBlock> blocks_;
+  std::map<int, std::string> phases_;
+};
@@ -0,0 +1,38 @@
+#pragma once
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// CPU timestamps for timeline spans. With an invariant TSC a timestamp is
+// a single rdtsc, converted to nanoseconds only when the event is written,
+// from a calibration against CLOCK_MONOTONIC taken at startup and refined
+// every SMPROFILER_TSC_CALIBRATE_MS (1000); a refined frequency takes over
+// where the previous one left off, so later readings never convert to
+// earlier times. Converted times are anchored to the wall clock once at
+// startup, so later wall clock jumps do not move them. Without an invariant
+// TSC, when the startup calibration looks wrong, or with SMPROFILER_TSC=0,
+// timestamps are CLOCK_MONOTONIC nanoseconds.
+extern bool tsc_clock_use_tsc;
+
+void tsc_clock_init();
+bool tsc_clock_uses_tsc();
+
+// ticks, only meaningful to tsc_clock_to_ns
+static inline uint64_t tsc_clock_now()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (tsc_clock_use_tsc)
+    return __rdtsc();
+#endif
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// nanoseconds since the epoch of a tsc_clock_now() reading
+uint64_t tsc_clock_to_ns(uint64_t ticks);
+
+// microseconds since the epoch, now
+uint64_t tsc_clock_epoch_micros();
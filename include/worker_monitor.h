@@ -0,0 +1,10 @@
+#pragma once
+
+// CPU time of forked children, dataloader workers in particular. In every
+// child forked after smprofiler is imported a thread reads the CPU time of
+// the process every SMPROFILER_WORKER_CPU_MS (100) and puts each interval
+// in which it ran on the parent's timeline, as a "cpu" span of the
+// "dataloader_workers" phase with the CPU time and utilization, one row per
+// child. Children that exec right away record nothing. Set
+// SMPROFILER_WORKER_CPU_MS=0 to disable.
+void worker_monitor_init();
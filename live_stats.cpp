@@ -0,0 +1,307 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "live_stats.h"
+#include "profiler_thread.h"
+#include "smprofiler_config.h"
+
+// slots of the kernel table, names beyond that are only counted
+#define LIVE_STATS_KERNEL_SLOTS (1024)
+#define LIVE_STATS_MAX_PROBES (32)
+
+// Kernel totals updated by the decoding threads. The first thread to see a
+// name claims its slot by hash and then copies the name in.
+struct KernelSlot {
+  std::atomic<uint64_t> hash;
+  std::atomic<bool> named;
+  char name[LIVE_STATS_KERNEL_NAME_SIZE];
+  std::atomic<uint64_t> count;
+  std::atomic<uint64_t> gpu_ns;
+  std::atomic<uint64_t> max_ns;
+};
+
+static bool enabled = false;
+static LiveStatsSegment* segment = NULL;
+static std::string segment_name;
+static long interval_ms;
+
+// hot path, lock free
+static KernelSlot* kernel_slots = NULL;
+static std::atomic<uint64_t> phase_gpu_ns{0};
+static std::atomic<uint64_t> records{0};
+static std::atomic<uint64_t> memcpy_bytes{0};
+static std::atomic<uint64_t> memcpy_ns{0};
+static std::atomic<uint64_t> dropped_records{0};
+static std::atomic<uint64_t> kernels_not_listed{0};
+
+// per phase, updated once per phase under mutex
+static std::mutex mutex;
+static std::vector<LiveStatsPhase> phases;
+static char current_phase[LIVE_STATS_PHASE_NAME_SIZE];
+static bool tracing = false;
+static uint64_t phase_start_ns;
+
+static std::thread publisher;
+static std::mutex publisher_mutex;
+static std::condition_variable publisher_wake;
+static bool stopping = false;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t hash_name(const char* name)
+{
+  // FNV-1a, never 0 as that marks a free slot
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (const char* c = name; *c; c++) {
+    hash = (hash ^ (uint8_t) *c) * 0x100000001b3ULL;
+  }
+  return hash ? hash : 1;
+}
+
+static void add_kernel(const char* name, uint64_t duration_ns)
+{
+  uint64_t hash = hash_name(name);
+  for (size_t probe = 0; probe < LIVE_STATS_MAX_PROBES; probe++) {
+    KernelSlot& slot = kernel_slots[(hash + probe) % LIVE_STATS_KERNEL_SLOTS];
+    uint64_t current = slot.hash.load(std::memory_order_acquire);
+    if (current == 0) {
+      if (slot.hash.compare_exchange_strong(current, hash)) {
+        snprintf(slot.name, sizeof(slot.name), "%s", name);
+        slot.named.store(true, std::memory_order_release);
+        current = hash;
+      }
+    }
+    if (current != hash)
+      continue;
+    slot.count.fetch_add(1, std::memory_order_relaxed);
+    slot.gpu_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+    uint64_t max = slot.max_ns.load(std::memory_order_relaxed);
+    while (duration_ns > max && !slot.max_ns.compare_exchange_weak(max, duration_ns, std::memory_order_relaxed)) {
+    }
+    return;
+  }
+  kernels_not_listed.fetch_add(1, std::memory_order_relaxed);
+}
+
+void live_stats_snapshot(LiveStatsSnapshot* snapshot_out)
+{
+  LiveStatsSnapshot& snapshot = *snapshot_out;
+  memset(&snapshot, 0, sizeof(snapshot));
+  snapshot.update_ns = clock_ns(CLOCK_REALTIME);
+  snapshot.records = records.load(std::memory_order_relaxed);
+  snapshot.memcpy_bytes = memcpy_bytes.load(std::memory_order_relaxed);
+  snapshot.memcpy_ns = memcpy_ns.load(std::memory_order_relaxed);
+  snapshot.dropped_records = dropped_records.load(std::memory_order_relaxed);
+  snapshot.kernels_not_listed = kernels_not_listed.load(std::memory_order_relaxed);
+  snapshot.phase_gpu_ns = phase_gpu_ns.load(std::memory_order_relaxed);
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    memcpy(snapshot.phase, current_phase, sizeof(snapshot.phase));
+    snapshot.tracing = tracing;
+    snapshot.phase_elapsed_ns = tracing ? clock_ns(CLOCK_MONOTONIC) - phase_start_ns : 0;
+    snapshot.num_phases = phases.size();
+    std::copy(phases.begin(), phases.end(), snapshot.phases);
+  }
+
+  // the kernels with the most GPU time
+  const KernelSlot* named[LIVE_STATS_KERNEL_SLOTS];
+  size_t num_named = 0;
+  for (size_t i = 0; i < LIVE_STATS_KERNEL_SLOTS; i++) {
+    if (kernel_slots[i].named.load(std::memory_order_acquire))
+      named[num_named++] = &kernel_slots[i];
+  }
+  size_t count = std::min(num_named, (size_t) LIVE_STATS_MAX_KERNELS);
+  std::partial_sort(named, named + count, named + num_named, [](const KernelSlot* a, const KernelSlot* b) {
+    return a->gpu_ns.load(std::memory_order_relaxed) > b->gpu_ns.load(std::memory_order_relaxed);
+  });
+  for (size_t i = 0; i < count; i++) {
+    LiveStatsKernel& kernel = snapshot.kernels[i];
+    memcpy(kernel.name, named[i]->name, sizeof(kernel.name));
+    kernel.count = named[i]->count.load(std::memory_order_relaxed);
+    kernel.gpu_ns = named[i]->gpu_ns.load(std::memory_order_relaxed);
+    kernel.max_ns = named[i]->max_ns.load(std::memory_order_relaxed);
+  }
+  snapshot.num_kernels = count;
+}
+
+// copies a snapshot of the counters into the segment
+static void publish()
+{
+  static LiveStatsSnapshot snapshot;
+  live_stats_snapshot(&snapshot);
+  uint64_t sequence = segment->sequence.load(std::memory_order_relaxed);
+  snapshot.updates = sequence / 2 + 1;
+  segment->sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy((void*) &segment->snapshot, &snapshot, sizeof(snapshot));
+  segment->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+static void publish_loop()
+{
+  profiler_thread_setup("live");
+  std::unique_lock<std::mutex> lock(publisher_mutex);
+  while (!stopping) {
+    publish();
+    publisher_wake.wait_for(lock, std::chrono::milliseconds(interval_ms));
+  }
+}
+
+// A forked child has the parent's segment mapped and its publisher thread
+// object, but not the thread. Both are left to the parent. The locks and
+// condition variable the publisher uses are made anew, as it may have held
+// one or been waiting on the other.
+static void after_fork_child()
+{
+  profiler_thread_forget(publisher);
+  new (&mutex) std::mutex();
+  new (&publisher_mutex) std::mutex();
+  new (&publisher_wake) std::condition_variable();
+  segment = NULL;
+}
+
+void live_stats_init()
+{
+  bool shared = smprofiler_config_flag("SMPROFILER_LIVE_STATS", false);
+  // the metrics exporter only needs the counters, not the segment
+  bool metrics = smprofiler_config_flag("SMPROFILER_METRICS", false);
+  enabled = shared || metrics;
+  if (!enabled)
+    return;
+  kernel_slots = new KernelSlot[LIVE_STATS_KERNEL_SLOTS]();
+  if (!shared)
+    return;
+  interval_ms = std::max(10L, smprofiler_config_int("SMPROFILER_LIVE_STATS_INTERVAL_MS", 500));
+
+  segment_name = "/" LIVE_STATS_SHM_PREFIX + std::to_string(getpid());
+  int fd = shm_open(segment_name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+  if (fd < 0 || ftruncate(fd, sizeof(LiveStatsSegment)) != 0) {
+    perror("smprofiler: live stats");
+    if (fd >= 0)
+      close(fd);
+    enabled = metrics;
+    return;
+  }
+  void* mapped = mmap(NULL, sizeof(LiveStatsSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    perror("smprofiler: live stats");
+    shm_unlink(segment_name.c_str());
+    enabled = metrics;
+    return;
+  }
+  // the new segment is zero filled, sequence starts at 0
+  segment = (LiveStatsSegment*) mapped;
+  segment->version = LIVE_STATS_VERSION;
+  segment->size = sizeof(LiveStatsSegment);
+  segment->rank = smprofiler_config_int("RANK", smprofiler_config_int("OMPI_COMM_WORLD_RANK", -1));
+  segment->local_rank = smprofiler_config_int("LOCAL_RANK", smprofiler_config_int("OMPI_COMM_WORLD_LOCAL_RANK", -1));
+  segment->pid = getpid();
+  segment->start_ns = clock_ns(CLOCK_REALTIME);
+  std::atomic_thread_fence(std::memory_order_release);
+  segment->magic = LIVE_STATS_MAGIC;
+
+  publisher = std::thread(publish_loop);
+  pthread_atfork(NULL, NULL, after_fork_child);
+  smprofiler_atexit(live_stats_close);
+}
+
+bool live_stats_enabled()
+{
+  return enabled;
+}
+
+void live_stats_begin_phase(const char* phase)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  snprintf(current_phase, sizeof(current_phase), "%s", phase);
+  tracing = true;
+  phase_start_ns = clock_ns(CLOCK_MONOTONIC);
+}
+
+void live_stats_add_gpu(const char* kernel_name, uint64_t duration_ns)
+{
+  if (!enabled)
+    return;
+  phase_gpu_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+  if (kernel_name != NULL)
+    add_kernel(kernel_name, duration_ns);
+}
+
+void live_stats_add_memcpy(uint64_t bytes, uint64_t duration_ns)
+{
+  if (!enabled)
+    return;
+  phase_gpu_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+  memcpy_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  memcpy_ns.fetch_add(duration_ns, std::memory_order_relaxed);
+}
+
+void live_stats_add_records(size_t count, size_t dropped)
+{
+  if (!enabled)
+    return;
+  records.fetch_add(count, std::memory_order_relaxed);
+  if (dropped > 0)
+    dropped_records.fetch_add(dropped, std::memory_order_relaxed);
+}
+
+void live_stats_end_phase(const char* phase, uint64_t start, uint64_t end)
+{
+  if (!enabled)
+    return;
+  uint64_t gpu_ns = phase_gpu_ns.exchange(0, std::memory_order_relaxed);
+  uint64_t wall_ns = end > start ? end - start : 0;
+  std::lock_guard<std::mutex> guard(mutex);
+  tracing = false;
+  auto it = std::find_if(phases.begin(), phases.end(),
+                         [phase](const LiveStatsPhase& p) { return strncmp(p.name, phase, sizeof(p.name) - 1) == 0; });
+  if (it == phases.end()) {
+    // later phase names are not listed
+    if (phases.size() >= LIVE_STATS_MAX_PHASES)
+      return;
+    LiveStatsPhase added = {};
+    snprintf(added.name, sizeof(added.name), "%s", phase);
+    it = phases.insert(phases.end(), added);
+  }
+  it->count++;
+  it->wall_ns += wall_ns;
+  it->gpu_ns += gpu_ns;
+  it->last_wall_ns = wall_ns;
+  it->last_gpu_ns = gpu_ns;
+}
+
+void live_stats_close()
+{
+  if (segment == NULL)
+    return;
+  {
+    std::lock_guard<std::mutex> lock(publisher_mutex);
+    stopping = true;
+  }
+  publisher_wake.notify_one();
+  if (publisher.joinable())
+    publisher.join();
+  shm_unlink(segment_name.c_str());
+  munmap(segment, sizeof(LiveStatsSegment));
+  segment = NULL;
+}
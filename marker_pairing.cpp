@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <mutex>
+#include <string>
+#include "marker_pairing.h"
+#include "smprofiler_config.h"
+#include "smprofiler_timeline.h"
+
+MarkerSpan* MarkerPairing::Lookup(uint32_t id)
+{
+  auto it = open_.find(id);
+  if (it != open_.end())
+    return &it->second;
+  if (open_.size() >= max_open_) {
+    dropped_++;
+    return NULL;
+  }
+  MarkerSpan& span = open_[id];
+  span = MarkerSpan();
+  return &span;
+}
+
+void MarkerPairing::Complete(std::unordered_map<uint32_t, MarkerSpan>::iterator it, std::vector<MarkerSpan>& spans)
+{
+  spans.push_back(std::move(it->second));
+  open_.erase(it);
+}
+
+void MarkerPairing::AddMarker(const MarkerRecord& r, std::vector<MarkerSpan>& spans)
+{
+  if (r.kind == MARKER_END) {
+    auto it = open_.find(r.id);
+    if (it == open_.end()) {
+      // started before tracing, or dropped
+      unmatched_ends_++;
+      return;
+    }
+    MarkerSpan& span = it->second;
+    span.end = r.timestamp;
+    uint32_t& depth = thread_depth_[span.thread_id];
+    if (depth > 0)
+      depth--;
+    Complete(it, spans);
+    return;
+  }
+
+  MarkerSpan* span = Lookup(r.id);
+  if (span == NULL)
+    return;
+  span->name = r.name != NULL ? r.name : "";
+  span->domain = r.domain != NULL ? r.domain : "";
+  span->start = span->end = r.timestamp;
+  span->thread_id = r.thread_id;
+  span->instant = r.kind == MARKER_INSTANT;
+  span->depth = thread_depth_[r.thread_id];
+  if (r.kind == MARKER_START)
+    thread_depth_[r.thread_id]++;
+  else
+    held_instants_.push_back(r.id);
+}
+
+void MarkerPairing::AddData(const MarkerData& d, std::vector<MarkerSpan>& spans)
+{
+  // data follows its marker, so without an open one the span is already
+  // complete (a flushed instant, an ended range) or was dropped
+  auto it = open_.find(d.id);
+  if (it == open_.end()) {
+    unmatched_data_++;
+    return;
+  }
+  it->second.has_data = true;
+  it->second.data = d;
+  if (it->second.instant)
+    Complete(it, spans);
+}
+
+void MarkerPairing::Flush(std::vector<MarkerSpan>& spans)
+{
+  for (uint32_t id : held_instants_) {
+    auto it = open_.find(id);
+    // completed by its data in the meantime
+    if (it == open_.end() || !it->second.instant)
+      continue;
+    Complete(it, spans);
+  }
+  held_instants_.clear();
+}
+
+static bool enabled = false;
+static std::mutex mutex;
+static MarkerPairing* pairing = NULL;
+
+void marker_pairing_init()
+{
+  if (pairing != NULL)
+    return;
+  enabled = smprofiler_config_flag("SMPROFILER_NVTX_SPANS", true);
+  if (!enabled)
+    return;
+  pairing = new MarkerPairing(smprofiler_config_int("SMPROFILER_NVTX_MAX_OPEN", 65536));
+  smprofiler_atexit(marker_pairing_report);
+}
+
+bool marker_pairing_enabled()
+{
+  return enabled;
+}
+
+static void record_spans(const char* phase, const std::vector<MarkerSpan>& spans)
+{
+  Timeline& tl = Timeline::getInstance();
+  for (const MarkerSpan& span : spans) {
+    std::string args;
+    if (!span.domain.empty())
+      args += ", \"domain\": \"" + span.domain + "\"";
+    args += ", \"nvtx_thread\": " + std::to_string(span.thread_id);
+    args += ", \"depth\": " + std::to_string(span.depth);
+    if (span.has_data) {
+      if (span.data.has_color) {
+        char color[16];
+        snprintf(color, sizeof(color), "#%06x", span.data.color & 0xffffff);
+        args += ", \"color\": \"" + std::string(color) + "\"";
+      }
+      if (span.data.category != 0)
+        args += ", \"category\": " + std::to_string(span.data.category);
+      if (!span.data.payload.empty())
+        args += ", \"payload\": " + span.data.payload;
+    }
+    if (span.instant)
+      tl.SMRecordEvent(phase, span.name, span.start/1000, 0, args, 'i');
+    else
+      tl.SMRecordEvent(phase, span.name, span.start/1000, (span.end - span.start)/1000, args);
+  }
+}
+
+void marker_pairing_add(const char* phase, const MarkerRecord& r)
+{
+  if (!enabled)
+    return;
+  std::vector<MarkerSpan> spans;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    pairing->AddMarker(r, spans);
+  }
+  record_spans(phase, spans);
+}
+
+void marker_pairing_add_data(const char* phase, const MarkerData& d)
+{
+  if (!enabled)
+    return;
+  std::vector<MarkerSpan> spans;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    pairing->AddData(d, spans);
+  }
+  record_spans(phase, spans);
+}
+
+void marker_pairing_flush(const char* phase)
+{
+  if (!enabled)
+    return;
+  std::vector<MarkerSpan> spans;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    pairing->Flush(spans);
+  }
+  record_spans(phase, spans);
+}
+
+void marker_pairing_report()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (pairing == NULL)
+    return;
+  if (pairing->OpenRanges() > 0 || pairing->UnmatchedEnds() > 0 || pairing->UnmatchedData() > 0 ||
+      pairing->Dropped() > 0)
+    printf("smprofiler: NVTX ranges never ended %zu, ends without start %llu, data without marker %llu, "
+           "dropped markers %llu\n", pairing->OpenRanges(), (unsigned long long) pairing->UnmatchedEnds(),
+           (unsigned long long) pairing->UnmatchedData(), (unsigned long long) pairing->Dropped());
+}
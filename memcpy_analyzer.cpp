@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+
+#include "activity_definitions.h"
+#include "memcpy_analyzer.h"
+#include "smprofiler_config.h"
+#include "smprofiler_timeline.h"
+
+MemcpyAnalyzer::MemcpyAnalyzer(uint64_t small_copy_bytes, uint32_t storm_count, uint64_t storm_window_ns)
+    : small_copy_bytes_(small_copy_bytes),
+      storm_count_(storm_count < 2 ? 2 : (storm_count > MAX_STORM_COUNT ? MAX_STORM_COUNT : storm_count)),
+      storm_window_ns_(storm_window_ns) {}
+
+double MemcpyAnalyzer::BandwidthGBps(const MemcpyRecord& r)
+{
+  if (r.end <= r.start)
+    return 0.0;
+  // bytes per ns is GB/s
+  return (double) r.bytes / (double) (r.end - r.start);
+}
+
+static bool is_host_pageable(uint8_t memory_kind)
+{
+  return memory_kind == CUPTI_ACTIVITY_MEMORY_KIND_PAGEABLE;
+}
+
+uint32_t MemcpyAnalyzer::Add(const MemcpyRecord& r)
+{
+  uint32_t kind = r.copy_kind % MEMCPY_KINDS;
+  MemcpyDirectionStats& stats = stats_[kind];
+  uint32_t flags = 0;
+
+  stats.count++;
+  stats.bytes += r.bytes;
+  stats.time_ns += (r.end > r.start) ? r.end - r.start : 0;
+
+  double mbps = BandwidthGBps(r) * 1000.0;
+  int bucket = 0;
+  while (bucket < MEMCPY_BANDWIDTH_BUCKETS - 1 && mbps >= (double) (1ULL << bucket)) {
+    bucket++;
+  }
+  stats.bandwidth_histogram[bucket]++;
+
+  if (is_host_pageable(r.src_kind) || is_host_pageable(r.dst_kind)) {
+    flags |= MEMCPY_FLAG_PAGEABLE;
+    stats.pageable_count++;
+  }
+  if (!r.async) {
+    flags |= MEMCPY_FLAG_SYNC;
+    stats.sync_count++;
+  }
+
+  if (r.bytes <= small_copy_bytes_) {
+    stats.small_count++;
+    uint64_t* starts = small_starts_[kind];
+    uint32_t& pos = small_pos_[kind];
+    // the slot about to be overwritten holds the small copy storm_count_ - 1 copies back
+    uint64_t oldest = starts[(pos + 1) % storm_count_];
+    bool filled = stats.small_count >= storm_count_;
+    starts[pos] = r.start;
+    pos = (pos + 1) % storm_count_;
+    if (filled && r.start - oldest <= storm_window_ns_) {
+      flags |= MEMCPY_FLAG_SMALL_STORM;
+      if (!in_storm_[kind])
+        stats.storm_count++;
+      in_storm_[kind] = true;
+    } else {
+      in_storm_[kind] = false;
+    }
+  } else {
+    in_storm_[kind] = false;
+  }
+  return flags;
+}
+
+// ends the copy of the direction that finishes first
+void MemcpyAnalyzer::EndCopy(uint32_t kind, std::vector<MemcpyCounterSample>& samples)
+{
+  std::vector<std::pair<uint64_t, double>>& copies = in_flight_[kind];
+  std::pop_heap(copies.begin(), copies.end(), std::greater<std::pair<uint64_t, double>>());
+  uint64_t end = copies.back().first;
+  in_flight_gbps_[kind] -= copies.back().second;
+  copies.pop_back();
+  // no rounding left over once the direction is idle
+  if (copies.empty())
+    in_flight_gbps_[kind] = 0.0;
+  samples.push_back({(uint8_t) kind, end, in_flight_gbps_[kind], (uint32_t) copies.size()});
+}
+
+void MemcpyAnalyzer::Track(const MemcpyRecord& r, std::vector<MemcpyCounterSample>& samples)
+{
+  uint32_t kind = r.copy_kind % MEMCPY_KINDS;
+  std::vector<std::pair<uint64_t, double>>& copies = in_flight_[kind];
+  while (!copies.empty() && copies.front().first <= r.start) {
+    EndCopy(kind, samples);
+  }
+  double gbps = BandwidthGBps(r);
+  copies.push_back(std::make_pair(std::max(r.start, r.end), gbps));
+  std::push_heap(copies.begin(), copies.end(), std::greater<std::pair<uint64_t, double>>());
+  in_flight_gbps_[kind] += gbps;
+  samples.push_back({(uint8_t) kind, r.start, in_flight_gbps_[kind], (uint32_t) copies.size()});
+}
+
+void MemcpyAnalyzer::EndInFlight(std::vector<MemcpyCounterSample>& samples)
+{
+  for (uint32_t kind = 0; kind < MEMCPY_KINDS; kind++) {
+    while (!in_flight_[kind].empty()) {
+      EndCopy(kind, samples);
+    }
+  }
+}
+
+void MemcpyAnalyzer::Summary(FILE* file, const char* (*kind_name)(uint8_t)) const
+{
+  fprintf(file, "%-6s %10s %14s %12s %10s %10s %10s %10s\n", "kind", "copies", "bytes", "avg_GB/s",
+          "pageable", "sync", "small", "storms");
+  for (uint32_t kind = 0; kind < MEMCPY_KINDS; kind++) {
+    const MemcpyDirectionStats& stats = stats_[kind];
+    if (stats.count == 0)
+      continue;
+    fprintf(file, "%-6s %10llu %14llu %12.2f %10llu %10llu %10llu %10llu\n", kind_name(kind),
+            (unsigned long long) stats.count, (unsigned long long) stats.bytes,
+            stats.time_ns ? (double) stats.bytes / stats.time_ns : 0.0,
+            (unsigned long long) stats.pageable_count, (unsigned long long) stats.sync_count,
+            (unsigned long long) stats.small_count, (unsigned long long) stats.storm_count);
+    fprintf(file, "       bandwidth histogram (MB/s: copies)");
+    for (int bucket = 0; bucket < MEMCPY_BANDWIDTH_BUCKETS; bucket++) {
+      if (stats.bandwidth_histogram[bucket])
+        fprintf(file, " <%llu: %llu", 1ULL << bucket, (unsigned long long) stats.bandwidth_histogram[bucket]);
+    }
+    fprintf(file, "\n");
+  }
+}
+
+static bool enabled = false;
+static std::mutex mutex;
+static MemcpyAnalyzer* analyzer = NULL;
+static std::string report_path;
+
+void memcpy_analyzer_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_MEMCPY_ANALYSIS", false);
+  if (!enabled)
+    return;
+  analyzer = new MemcpyAnalyzer(smprofiler_config_int("SMPROFILER_MEMCPY_SMALL_BYTES", 64 * 1024),
+                                smprofiler_config_int("SMPROFILER_MEMCPY_STORM_COUNT", 32),
+                                smprofiler_config_int("SMPROFILER_MEMCPY_STORM_WINDOW_NS", 1000000));
+  report_path = smprofiler_config_string("SMPROFILER_MEMCPY_FILE",
+                                         smprofiler_output_path("memcpy.txt"));
+  smprofiler_atexit(memcpy_analyzer_report);
+}
+
+bool memcpy_analyzer_enabled()
+{
+  return enabled;
+}
+
+// one counter track per direction
+static void record_counters(const char* phase, const std::vector<MemcpyCounterSample>& samples)
+{
+  Timeline& tl = Timeline::getInstance();
+  for (const MemcpyCounterSample& sample : samples) {
+    std::string counter = std::string("memcpy_") + get_memcopy_events_string((CUpti_ActivityMemcpyKind) sample.copy_kind);
+    tl.SMRecordCounter(phase, counter, sample.timestamp/1000,
+                       "\"GB/s\": " + std::to_string(sample.gbps) + ", \"in_flight\": " + std::to_string(sample.in_flight));
+  }
+}
+
+uint32_t memcpy_analyzer_add(const char* phase, const MemcpyRecord& r)
+{
+  if (!enabled)
+    return 0;
+
+  uint32_t flags;
+  std::vector<MemcpyCounterSample> samples;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    flags = analyzer->Add(r);
+    analyzer->Track(r, samples);
+  }
+  record_counters(phase, samples);
+  return flags;
+}
+
+void memcpy_analyzer_end_phase(const char* phase)
+{
+  if (!enabled)
+    return;
+  std::vector<MemcpyCounterSample> samples;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    analyzer->EndInFlight(samples);
+  }
+  record_counters(phase, samples);
+}
+
+static const char* kind_name(uint8_t kind)
+{
+  return get_memcopy_events_string((CUpti_ActivityMemcpyKind) kind);
+}
+
+void memcpy_analyzer_report()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (analyzer == NULL)
+    return;
+  smprofiler_create_parent_dirs(report_path);
+  FILE* file = fopen(report_path.c_str(), "w");
+  if (file == NULL) {
+    printf("Error: could not open memcpy report %s\n", report_path.c_str());
+    return;
+  }
+  analyzer->Summary(file, kind_name);
+  fclose(file);
+}
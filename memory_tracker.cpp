@@ -0,0 +1,331 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "memory_tracker.h"
+#include "smprofiler_config.h"
+#include "smprofiler_timeline.h"
+
+// sites listed for a device peak
+#define MEMORY_PEAK_SITES (8)
+
+MemoryTracker::MemoryTracker(size_t max_live, size_t max_sites)
+    : max_live_(max_live), max_sites_(max_sites < 1 ? 1 : max_sites)
+{
+  sites_.reserve(max_sites_);
+}
+
+MemorySite* MemoryTracker::FindSite(uint64_t site, uint32_t device)
+{
+  for (MemorySite& entry : sites_) {
+    if (entry.site == site && entry.device == device)
+      return &entry;
+  }
+  return NULL;
+}
+
+void MemoryTracker::Snapshot(uint32_t device, std::vector<MemorySite>& sites) const
+{
+  sites.clear();
+  for (const MemorySite& entry : sites_) {
+    if (entry.device == device && entry.live_bytes > 0)
+      sites.push_back(entry);
+  }
+  size_t count = std::min(sites.size(), (size_t) MEMORY_PEAK_SITES);
+  std::partial_sort(sites.begin(), sites.begin() + count, sites.end(),
+                    [](const MemorySite& a, const MemorySite& b) { return a.live_bytes > b.live_bytes; });
+  sites.resize(count);
+}
+
+static inline void subtract(uint64_t& value, uint64_t bytes)
+{
+  value -= std::min(value, bytes);
+}
+
+// takes a released allocation off the live bytes of its device and of the
+// site entry it was charged to, or of the other bucket if that was evicted
+void MemoryTracker::Release(const LiveAllocation& allocation)
+{
+  MemoryDeviceStats& device = devices_[allocation.device];
+  subtract(device.live_bytes, allocation.bytes);
+  MemorySite* site = FindSite(allocation.site, allocation.device);
+  if (site != NULL && site->entry == allocation.entry)
+    subtract(site->live_bytes, allocation.bytes);
+  else
+    subtract(device.other_live_bytes, allocation.bytes);
+}
+
+void MemoryTracker::Add(const MemoryRecord& r)
+{
+  uint32_t device_id = r.device % MEMORY_MAX_DEVICES;
+  MemoryDeviceStats& device = devices_[device_id];
+  auto it = live_.find(r.address);
+  if (it != live_.end()) {
+    // the release of a reused address, or one we missed
+    Release(it->second);
+    live_.erase(it);
+  } else if (r.release) {
+    // not in the live table, or allocated before tracing started
+    uint64_t bytes = std::min(r.bytes, device.untracked_bytes);
+    device.untracked_bytes -= bytes;
+    device.live_bytes -= bytes;
+  }
+  if (r.release) {
+    device.releases++;
+    return;
+  }
+
+  device.allocations++;
+  device.live_bytes += r.bytes;
+
+  MemorySite* site = FindSite(r.site, device_id);
+  if (site == NULL) {
+    if (sites_.size() < max_sites_) {
+      sites_.push_back(MemorySite{r.site, device_id, 0, 0, 0, 0, next_entry_++});
+      site = &sites_.back();
+    } else {
+      site = &*std::min_element(sites_.begin(), sites_.end(),
+                                [](const MemorySite& a, const MemorySite& b) { return a.bytes < b.bytes; });
+      devices_[site->device].other_live_bytes += site->live_bytes;
+      *site = MemorySite{r.site, device_id, site->bytes, 0, site->bytes, 0, next_entry_++};
+    }
+  }
+  site->bytes += r.bytes;
+  site->count++;
+
+  if (live_.size() < max_live_) {
+    site->live_bytes += r.bytes;
+    live_[r.address] = LiveAllocation{r.bytes, r.site, site->entry, device_id, r.context};
+  } else {
+    dropped_++;
+    device.untracked_bytes += r.bytes;
+  }
+
+  if (device.live_bytes > device.phase_peak_bytes) {
+    device.phase_peak_bytes = device.live_bytes;
+    Snapshot(device_id, device.phase_peak_sites);
+    if (device.live_bytes > device.peak_bytes) {
+      device.peak_bytes = device.live_bytes;
+      device.peak_sites = device.phase_peak_sites;
+    }
+  }
+}
+
+void MemoryTracker::AddPool(const MemoryPoolRecord& r)
+{
+  uint32_t device_id = r.device % MEMORY_MAX_DEVICES;
+  auto it = pools_.find(r.address);
+  if (it != pools_.end()) {
+    subtract(devices_[it->second.first].pool_bytes, it->second.second);
+    pools_.erase(it);
+  }
+  if (r.operation == MEMORY_POOL_DESTROYED)
+    return;
+  pools_[r.address] = std::make_pair(device_id, r.size);
+  devices_[device_id].pool_bytes += r.size;
+}
+
+std::vector<uint32_t> MemoryTracker::ReleaseContext(uint32_t context)
+{
+  std::vector<uint32_t> changed;
+  for (auto it = live_.begin(); it != live_.end();) {
+    const LiveAllocation& allocation = it->second;
+    if (allocation.context != context) {
+      ++it;
+      continue;
+    }
+    Release(allocation);
+    if (std::find(changed.begin(), changed.end(), allocation.device) == changed.end())
+      changed.push_back(allocation.device);
+    it = live_.erase(it);
+  }
+  return changed;
+}
+
+void MemoryTracker::EndPhase()
+{
+  for (uint32_t device_id = 0; device_id < MEMORY_MAX_DEVICES; device_id++) {
+    MemoryDeviceStats& device = devices_[device_id];
+    device.phase_peak_bytes = device.live_bytes;
+    Snapshot(device_id, device.phase_peak_sites);
+  }
+}
+
+std::vector<MemorySite> MemoryTracker::TopSites() const
+{
+  std::vector<MemorySite> sites(sites_);
+  std::sort(sites.begin(), sites.end(), [](const MemorySite& a, const MemorySite& b) { return a.bytes > b.bytes; });
+  return sites;
+}
+
+void MemoryTracker::FormatSite(uint64_t site, char* buf, size_t size)
+{
+  uint64_t value = site & ((1ULL << 56) - 1);
+  switch (site >> 56) {
+  case MEMORY_SITE_PY_STACK:
+    snprintf(buf, size, "py_stack_id %" PRIu64, value);
+    break;
+  case MEMORY_SITE_STACK:
+    snprintf(buf, size, "stack_id %" PRIu64, value);
+    break;
+  default:
+    snprintf(buf, size, "pc 0x%" PRIx64, value);
+    break;
+  }
+}
+
+static void print_sites(FILE* file, const std::vector<MemorySite>& sites)
+{
+  for (const MemorySite& entry : sites) {
+    char name[64];
+    MemoryTracker::FormatSite(entry.site, name, sizeof(name));
+    fprintf(file, "    %-30s %14.1f MB live\n", name, entry.live_bytes / 1048576.0);
+  }
+}
+
+void MemoryTracker::Summary(FILE* file) const
+{
+  fprintf(file, "# device memory\n");
+  fprintf(file, "%6s %12s %12s %12s %12s %12s\n", "device", "peak_MB", "live_MB", "pool_MB", "allocations", "releases");
+  for (uint32_t device_id = 0; device_id < MEMORY_MAX_DEVICES; device_id++) {
+    const MemoryDeviceStats& device = devices_[device_id];
+    if (device.allocations == 0 && device.pool_bytes == 0)
+      continue;
+    fprintf(file, "%6u %12.1f %12.1f %12.1f %12" PRIu64 " %12" PRIu64 "\n", device_id,
+            device.peak_bytes / 1048576.0, device.live_bytes / 1048576.0, device.pool_bytes / 1048576.0,
+            device.allocations, device.releases);
+    print_sites(file, device.peak_sites);
+  }
+  if (dropped_ > 0)
+    fprintf(file, "# %" PRIu64 " allocations exceeded the live table and are not charged to a site\n", dropped_);
+
+  fprintf(file, "\n# top allocation sites by bytes allocated\n");
+  fprintf(file, "%-30s %6s %14s %12s %14s %12s\n", "site", "device", "allocated_MB", "count", "max_error_MB", "live_MB");
+  for (const MemorySite& entry : TopSites()) {
+    char name[64];
+    FormatSite(entry.site, name, sizeof(name));
+    fprintf(file, "%-30s %6u %14.1f %12" PRIu64 " %14.1f %12.1f\n", name, entry.device,
+            entry.bytes / 1048576.0, entry.count, entry.error / 1048576.0, entry.live_bytes / 1048576.0);
+  }
+  // live bytes not charged to a listed site, so the column adds up per device
+  for (uint32_t device_id = 0; device_id < MEMORY_MAX_DEVICES; device_id++) {
+    const MemoryDeviceStats& device = devices_[device_id];
+    if (device.other_live_bytes > 0)
+      fprintf(file, "%-30s %6u %14s %12s %14s %12.1f\n", "(evicted sites)", device_id, "-", "-", "-",
+              device.other_live_bytes / 1048576.0);
+    if (device.untracked_bytes > 0)
+      fprintf(file, "%-30s %6u %14s %12s %14s %12.1f\n", "(untracked)", device_id, "-", "-", "-",
+              device.untracked_bytes / 1048576.0);
+  }
+}
+
+struct PhasePeak {
+  uint64_t peak_bytes;
+  std::vector<MemorySite> sites;
+};
+
+static bool enabled = false;
+static std::mutex mutex;
+static MemoryTracker* tracker = NULL;
+static std::string report_path;
+// highest peak of every (phase, device)
+static std::map<std::pair<std::string, uint32_t>, PhasePeak> phase_peaks;
+
+void memory_tracker_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_MEMORY", false);
+  if (!enabled)
+    return;
+  tracker = new MemoryTracker(smprofiler_config_int("SMPROFILER_MEMORY_MAX_LIVE", 262144),
+                              smprofiler_config_int("SMPROFILER_MEMORY_SITES", 32));
+  report_path = smprofiler_config_string("SMPROFILER_MEMORY_FILE",
+                                         smprofiler_output_path("memory.txt"));
+  smprofiler_atexit(memory_tracker_report);
+}
+
+bool memory_tracker_enabled()
+{
+  return enabled;
+}
+
+// live bytes counter track of a device, called with mutex held
+static void record_counter(const char* phase, uint32_t device_id, uint64_t timestamp)
+{
+  const MemoryDeviceStats& device = tracker->Device(device_id);
+  Timeline::getInstance().SMRecordCounter(phase, "gpu_memory_" + std::to_string(device_id), timestamp/1000,
+                                          "\"live_bytes\": " + std::to_string(device.live_bytes) +
+                                          ", \"pool_bytes\": " + std::to_string(device.pool_bytes));
+}
+
+void memory_tracker_add(const char* phase, const MemoryRecord& r)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  tracker->Add(r);
+  record_counter(phase, r.device % MEMORY_MAX_DEVICES, r.timestamp);
+}
+
+void memory_tracker_add_pool(const char* phase, const MemoryPoolRecord& r, uint64_t timestamp)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  tracker->AddPool(r);
+  record_counter(phase, r.device % MEMORY_MAX_DEVICES, timestamp);
+}
+
+void memory_tracker_context_destroyed(const char* phase, uint32_t context, uint64_t timestamp)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  for (uint32_t device_id : tracker->ReleaseContext(context)) {
+    record_counter(phase, device_id, timestamp);
+  }
+}
+
+void memory_tracker_end_phase(const char* phase)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  for (uint32_t device_id = 0; device_id < MEMORY_MAX_DEVICES; device_id++) {
+    const MemoryDeviceStats& device = tracker->Device(device_id);
+    if (device.phase_peak_bytes == 0)
+      continue;
+    printf("Phase %s MEMORY device %u, peak %.1f MB, live %.1f MB\n", phase, device_id,
+           device.phase_peak_bytes / 1048576.0, device.live_bytes / 1048576.0);
+    PhasePeak& peak = phase_peaks[std::make_pair(std::string(phase), device_id)];
+    if (device.phase_peak_bytes > peak.peak_bytes) {
+      peak.peak_bytes = device.phase_peak_bytes;
+      peak.sites = device.phase_peak_sites;
+    }
+  }
+  tracker->EndPhase();
+}
+
+void memory_tracker_report()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (tracker == NULL)
+    return;
+  smprofiler_create_parent_dirs(report_path);
+  FILE* file = fopen(report_path.c_str(), "w");
+  if (file == NULL) {
+    printf("Error: could not open memory report %s\n", report_path.c_str());
+    return;
+  }
+  tracker->Summary(file);
+  fprintf(file, "\n# peak per phase\n");
+  fprintf(file, "%-20s %6s %12s\n", "phase", "device", "peak_MB");
+  for (auto& entry : phase_peaks) {
+    fprintf(file, "%-20s %6u %12.1f\n", entry.first.first.c_str(), entry.first.second,
+            entry.second.peak_bytes / 1048576.0);
+    print_sites(file, entry.second.sites);
+  }
+  fclose(file);
+}
@@ -0,0 +1,359 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+#include <thread>
+
+#include "metrics_exporter.h"
+#include "perf_collector.h"
+#include "profiler_thread.h"
+#include "smprofiler_config.h"
+
+#define METRICS_BUFFER_SIZE (256 * 1024)
+#define METRICS_REQUEST_SIZE (4096)
+#define METRICS_READ_TIMEOUT_MS (1000)
+
+// Appends formatted text to a fixed buffer. Once a line does not fit the
+// text is cut back to the last complete line and nothing more is added.
+struct MetricsText {
+  char* buffer;
+  size_t size;
+  size_t length;
+  bool full;
+
+  void Append(const char* format, ...) __attribute__((format(printf, 2, 3)))
+  {
+    if (full)
+      return;
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + length, size - length, format, args);
+    va_end(args);
+    if (written < 0 || (size_t) written >= size - length) {
+      full = true;
+      while (length > 0 && buffer[length - 1] != '\n') {
+        length--;
+      }
+      buffer[length] = '\0';
+      return;
+    }
+    length += written;
+  }
+
+  void Family(const char* name, const char* type, const char* help)
+  {
+    Append("# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+  }
+};
+
+// label values escape backslash, double quote and newline
+static const char* escape_label(const char* value, char* escaped, size_t size)
+{
+  size_t length = 0;
+  for (const char* c = value; *c && length + 2 < size; c++) {
+    if (*c == '\\' || *c == '"') {
+      escaped[length++] = '\\';
+      escaped[length++] = *c;
+    } else if (*c == '\n') {
+      escaped[length++] = '\\';
+      escaped[length++] = 'n';
+    } else {
+      escaped[length++] = *c;
+    }
+  }
+  escaped[length] = '\0';
+  return escaped;
+}
+
+size_t metrics_format(char* buffer, size_t size, const MetricsIdentity& identity,
+                      const LiveStatsSnapshot& s, const uint64_t* perf_totals)
+{
+  // series are cut before the room the end marker needs
+  const size_t eof_length = strlen("# EOF\n");
+  MetricsText text = {buffer, size > eof_length ? size - eof_length : 0, 0, size <= eof_length};
+  if (size > 0)
+    buffer[0] = '\0';
+  char label[2 * LIVE_STATS_KERNEL_NAME_SIZE + 1];
+
+  text.Family("smprofiler_info", "gauge", "Profiled process.");
+  text.Append("smprofiler_info{pid=\"%u\",rank=\"%d\",local_rank=\"%d\"} 1\n",
+              identity.pid, identity.rank, identity.local_rank);
+  text.Family("smprofiler_tracing", "gauge", "1 while a phase is traced.");
+  text.Append("smprofiler_tracing{phase=\"%s\"} %u\n", escape_label(s.phase, label, sizeof(label)), s.tracing);
+
+  text.Family("smprofiler_phase_gpu_busy_ratio", "gauge",
+              "GPU time of the last completed phase over its wall time, at most 1.");
+  for (uint32_t i = 0; i < s.num_phases; i++) {
+    const LiveStatsPhase& phase = s.phases[i];
+    text.Append("smprofiler_phase_gpu_busy_ratio{phase=\"%s\"} %.6g\n", escape_label(phase.name, label, sizeof(label)),
+                live_stats_busy_ratio(phase.last_gpu_ns, phase.last_wall_ns));
+  }
+  text.Family("smprofiler_phase_last_duration_seconds", "gauge", "Wall time of the last completed phase.");
+  for (uint32_t i = 0; i < s.num_phases; i++) {
+    text.Append("smprofiler_phase_last_duration_seconds{phase=\"%s\"} %.9g\n",
+                escape_label(s.phases[i].name, label, sizeof(label)), s.phases[i].last_wall_ns / 1e9);
+  }
+  text.Family("smprofiler_phases", "counter", "Completed phases.");
+  for (uint32_t i = 0; i < s.num_phases; i++) {
+    text.Append("smprofiler_phases_total{phase=\"%s\"} %llu\n", escape_label(s.phases[i].name, label, sizeof(label)),
+                (unsigned long long) s.phases[i].count);
+  }
+  text.Family("smprofiler_phase_duration_seconds", "counter", "Wall time of completed phases.");
+  for (uint32_t i = 0; i < s.num_phases; i++) {
+    text.Append("smprofiler_phase_duration_seconds_total{phase=\"%s\"} %.9g\n",
+                escape_label(s.phases[i].name, label, sizeof(label)), s.phases[i].wall_ns / 1e9);
+  }
+  text.Family("smprofiler_phase_gpu_seconds", "counter", "GPU time of kernels, copies and memsets of completed phases.");
+  for (uint32_t i = 0; i < s.num_phases; i++) {
+    text.Append("smprofiler_phase_gpu_seconds_total{phase=\"%s\"} %.9g\n",
+                escape_label(s.phases[i].name, label, sizeof(label)), s.phases[i].gpu_ns / 1e9);
+  }
+
+  text.Family("smprofiler_memcpy_bytes", "counter", "Bytes copied by memcpy records.");
+  text.Append("smprofiler_memcpy_bytes_total %llu\n", (unsigned long long) s.memcpy_bytes);
+  text.Family("smprofiler_memcpy_seconds", "counter", "GPU time of memcpy records.");
+  text.Append("smprofiler_memcpy_seconds_total %.9g\n", s.memcpy_ns / 1e9);
+  text.Family("smprofiler_memcpy_bandwidth_bytes_per_second", "gauge", "Average memcpy bandwidth.");
+  text.Append("smprofiler_memcpy_bandwidth_bytes_per_second %.6g\n",
+              s.memcpy_ns ? s.memcpy_bytes / (s.memcpy_ns / 1e9) : 0.0);
+
+  text.Family("smprofiler_records", "counter", "Activity records decoded.");
+  text.Append("smprofiler_records_total %llu\n", (unsigned long long) s.records);
+  text.Family("smprofiler_dropped_records", "counter", "Activity records CUPTI dropped for lack of buffers.");
+  text.Append("smprofiler_dropped_records_total %llu\n", (unsigned long long) s.dropped_records);
+  text.Family("smprofiler_kernel_records_not_listed", "counter", "Kernel records of names beyond the kernel table.");
+  text.Append("smprofiler_kernel_records_not_listed_total %llu\n", (unsigned long long) s.kernels_not_listed);
+
+  text.Family("smprofiler_perf_task_clock_seconds", "counter", "Task clock of completed phases.");
+  text.Append("smprofiler_perf_task_clock_seconds_total %.9g\n", perf_totals[0] / 1e9);
+  text.Family("smprofiler_perf_context_switches", "counter", "Context switches of completed phases.");
+  text.Append("smprofiler_perf_context_switches_total %llu\n", (unsigned long long) perf_totals[1]);
+
+  // kernels last, they are the first to be left out when the buffer is full
+  text.Family("smprofiler_kernel_gpu_seconds", "counter", "GPU time of the kernels with the most GPU time.");
+  for (uint32_t i = 0; i < s.num_kernels; i++) {
+    text.Append("smprofiler_kernel_gpu_seconds_total{kernel=\"%s\"} %.9g\n",
+                escape_label(s.kernels[i].name, label, sizeof(label)), s.kernels[i].gpu_ns / 1e9);
+  }
+  text.Family("smprofiler_kernel_launches", "counter", "Records of the kernels with the most GPU time.");
+  for (uint32_t i = 0; i < s.num_kernels; i++) {
+    text.Append("smprofiler_kernel_launches_total{kernel=\"%s\"} %llu\n",
+                escape_label(s.kernels[i].name, label, sizeof(label)), (unsigned long long) s.kernels[i].count);
+  }
+
+  text.size = size;
+  text.full = size <= eof_length;
+  text.Append("# EOF\n");
+  return text.length;
+}
+
+static bool enabled = false;
+static int listen_fd = -1;
+// written to stop the thread
+static int wake_fd = -1;
+static std::string socket_path;
+static std::thread server;
+static MetricsIdentity identity;
+// allocated once, only used by the server thread
+static char* body = NULL;
+static LiveStatsSnapshot* snapshot = NULL;
+
+static bool write_all(int fd, const char* data, size_t length)
+{
+  while (length > 0) {
+    ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return false;
+    data += written;
+    length -= written;
+  }
+  return true;
+}
+
+static void respond(int fd, const char* status, const char* content_type, const char* content, size_t length)
+{
+  char header[256];
+  int header_length = snprintf(header, sizeof(header),
+                               "HTTP/1.0 %s\r\nContent-Type: %s\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                               status, content_type, length);
+  if (write_all(fd, header, header_length))
+    write_all(fd, content, length);
+}
+
+// reads one request and answers it
+static void serve(int fd)
+{
+  char request[METRICS_REQUEST_SIZE];
+  size_t length = 0;
+  while (length < sizeof(request) - 1) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, METRICS_READ_TIMEOUT_MS) <= 0)
+      return;
+    ssize_t count = read(fd, request + length, sizeof(request) - 1 - length);
+    if (count <= 0)
+      return;
+    length += count;
+    request[length] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+      break;
+  }
+  request[length] = '\0';
+
+  static const char* text_type = "text/plain; charset=utf-8";
+  if (strncmp(request, "GET ", 4) != 0) {
+    respond(fd, "405 Method Not Allowed", text_type, "", 0);
+    return;
+  }
+  const char* path = request + 4;
+  size_t path_length = strcspn(path, " ?\r\n");
+  if (!(path_length == 8 && strncmp(path, "/metrics", 8) == 0) && !(path_length == 1 && path[0] == '/')) {
+    respond(fd, "404 Not Found", text_type, "", 0);
+    return;
+  }
+  uint64_t perf_totals[2];
+  perf_read_totals(perf_totals);
+  live_stats_snapshot(snapshot);
+  size_t body_length = metrics_format(body, METRICS_BUFFER_SIZE, identity, *snapshot, perf_totals);
+  respond(fd, "200 OK", "application/openmetrics-text; version=1.0.0; charset=utf-8", body, body_length);
+}
+
+static void serve_loop()
+{
+  profiler_thread_setup("metrics");
+  while (true) {
+    struct pollfd fds[2] = {{listen_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("smprofiler: metrics exporter");
+      return;
+    }
+    if (fds[1].revents)
+      return;
+    if (fds[0].revents & POLLIN) {
+      int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0)
+        continue;
+      serve(fd);
+      close(fd);
+    }
+  }
+}
+
+// the listening socket, -1 on error
+static int open_socket()
+{
+  long port = smprofiler_config_int("SMPROFILER_METRICS_PORT", 0);
+  int fd;
+  if (port > 0) {
+    // one port per rank on the same machine
+    port += identity.local_rank > 0 ? identity.local_rank : 0;
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+      close(fd);
+      return -1;
+    }
+    printf("smprofiler: metrics on http://127.0.0.1:%ld/metrics\n", port);
+  } else {
+    socket_path = smprofiler_config_string("SMPROFILER_METRICS_SOCKET", smprofiler_output_path("metrics.sock"));
+    struct sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+    smprofiler_create_parent_dirs(socket_path);
+    unlink(socket_path.c_str());
+    if (bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+      close(fd);
+      return -1;
+    }
+    printf("smprofiler: metrics on unix socket %s\n", socket_path.c_str());
+  }
+  if (listen(fd, 16) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// A forked child inherits the socket, the eventfd and the server thread
+// object, but not the thread. They are left to the parent; writing the
+// eventfd or unlinking the socket would stop the parent's exporter.
+static void after_fork_child()
+{
+  profiler_thread_forget(server);
+  listen_fd = wake_fd = -1;
+  enabled = false;
+}
+
+void metrics_exporter_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_METRICS", false);
+  if (!enabled)
+    return;
+  identity.pid = getpid();
+  identity.rank = smprofiler_config_int("RANK", smprofiler_config_int("OMPI_COMM_WORLD_RANK", -1));
+  identity.local_rank = smprofiler_config_int("LOCAL_RANK", smprofiler_config_int("OMPI_COMM_WORLD_LOCAL_RANK", -1));
+  listen_fd = open_socket();
+  wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (listen_fd < 0 || wake_fd < 0) {
+    perror("smprofiler: metrics exporter");
+    if (listen_fd >= 0)
+      close(listen_fd);
+    if (wake_fd >= 0)
+      close(wake_fd);
+    enabled = false;
+    return;
+  }
+  body = new char[METRICS_BUFFER_SIZE];
+  snapshot = new LiveStatsSnapshot();
+  server = std::thread(serve_loop);
+  pthread_atfork(NULL, NULL, after_fork_child);
+  smprofiler_atexit(metrics_exporter_close);
+}
+
+bool metrics_exporter_enabled()
+{
+  return enabled;
+}
+
+void metrics_exporter_close()
+{
+  if (!enabled)
+    return;
+  enabled = false;
+  uint64_t one = 1;
+  if (write(wake_fd, &one, sizeof(one)) < 0)
+    perror("smprofiler: metrics exporter");
+  if (server.joinable())
+    server.join();
+  close(listen_fd);
+  close(wake_fd);
+  if (!socket_path.empty())
+    unlink(socket_path.c_str());
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "overhead_governor.h"
+#include "smprofiler_config.h"
+#include "smprofiler_timeline.h"
+
+GovernorLevel OverheadGovernor::Update(const OverheadSample& sample)
+{
+  // nothing to judge without the wall time, e.g. offline decoding
+  if (sample.traced_ns == 0)
+    return level_;
+  bool over = sample.self_ns * 1000 > config_.budget_permille * sample.traced_ns ||
+              sample.max_queue_depth > config_.max_queue_depth;
+  bool calm = sample.self_ns * 1000 < config_.restore_permille * sample.traced_ns &&
+              sample.max_queue_depth <= config_.max_queue_depth / 2;
+  if (over) {
+    calm_phases_ = 0;
+    if (level_ < GOVERNOR_SAMPLE_PHASES)
+      level_ = (GovernorLevel) (level_ + 1);
+  } else if (calm) {
+    if (++calm_phases_ >= config_.restore_phases && level_ > GOVERNOR_FULL) {
+      level_ = (GovernorLevel) (level_ - 1);
+      calm_phases_ = 0;
+    }
+  } else {
+    calm_phases_ = 0;
+  }
+  return level_;
+}
+
+bool OverheadGovernor::TracePhase()
+{
+  if (level_ < GOVERNOR_SAMPLE_PHASES)
+    return true;
+  return phase_count_++ % config_.sample_every == 0;
+}
+
+const char* OverheadGovernor::LevelName(GovernorLevel level)
+{
+  switch (level) {
+  case GOVERNOR_FULL:
+    return "full";
+  case GOVERNOR_NO_API:
+    return "no_api";
+  case GOVERNOR_AGGREGATE_KERNELS:
+    return "aggregate_kernels";
+  case GOVERNOR_SAMPLE_PHASES:
+    return "sample_phases";
+  }
+  return "unknown";
+}
+
+struct KernelAggregate {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t first_start;
+  uint64_t last_end;
+};
+
+static bool enabled = false;
+static std::mutex mutex;
+static OverheadGovernor* governor = NULL;
+// read for every kernel record
+static std::atomic<int> level{GOVERNOR_FULL};
+// kernels of the current phase by name, while aggregating
+static std::map<std::string, KernelAggregate> kernels;
+
+void overhead_governor_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_GOVERNOR", false);
+  if (!enabled)
+    return;
+  GovernorConfig config;
+  config.budget_permille = smprofiler_config_int("SMPROFILER_GOVERNOR_BUDGET_PERMILLE", 20);
+  config.restore_permille = smprofiler_config_int("SMPROFILER_GOVERNOR_RESTORE_PERMILLE", config.budget_permille / 2);
+  config.restore_phases = smprofiler_config_int("SMPROFILER_GOVERNOR_RESTORE_PHASES", 5);
+  config.max_queue_depth = smprofiler_config_int("SMPROFILER_GOVERNOR_MAX_QUEUE", 100000);
+  config.sample_every = std::max(1L, smprofiler_config_int("SMPROFILER_GOVERNOR_SAMPLE_EVERY", 10));
+  governor = new OverheadGovernor(config);
+}
+
+bool overhead_governor_enabled()
+{
+  return enabled;
+}
+
+GovernorLevel overhead_governor_level()
+{
+  return (GovernorLevel) level.load(std::memory_order_relaxed);
+}
+
+bool overhead_governor_trace_phase()
+{
+  if (!enabled)
+    return true;
+  std::lock_guard<std::mutex> guard(mutex);
+  return governor->TracePhase();
+}
+
+void overhead_governor_add_kernel(const char* name, uint64_t start, uint64_t end)
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  KernelAggregate& kernel = kernels[name];
+  if (kernel.count == 0 || start < kernel.first_start)
+    kernel.first_start = start;
+  if (end > kernel.last_end)
+    kernel.last_end = end;
+  kernel.count++;
+  kernel.total_ns += end - start;
+}
+
+void overhead_governor_end_phase(const char* phase, const OverheadSample& sample, uint64_t end_timestamp)
+{
+  if (!enabled)
+    return;
+  Timeline& tl = Timeline::getInstance();
+  std::lock_guard<std::mutex> guard(mutex);
+
+  // one event per kernel name spanning its first to last launch
+  for (auto& entry : kernels) {
+    const KernelAggregate& kernel = entry.second;
+    tl.SMRecordEvent(phase, entry.first, kernel.first_start/1000, (kernel.last_end - kernel.first_start)/1000,
+                     ", \"aggregated\": true, \"count\": " + std::to_string(kernel.count) +
+                     ", \"gpu_us\": " + std::to_string(kernel.total_ns / 1000));
+  }
+  kernels.clear();
+
+  GovernorLevel previous = governor->Level();
+  GovernorLevel next = governor->Update(sample);
+  if (next == previous)
+    return;
+  level = next;
+  double percent = sample.traced_ns ? 100.0 * sample.self_ns / sample.traced_ns : 0.0;
+  printf("Phase %s GOVERNOR %s -> %s, self %.2f%%, max queue depth %zu\n", phase,
+         OverheadGovernor::LevelName(previous), OverheadGovernor::LevelName(next), percent, sample.max_queue_depth);
+  tl.SMRecordEvent("profiler", "governor_mode", end_timestamp/1000, 0,
+                   ", \"phase\": \"" + std::string(phase) + "\"" +
+                   ", \"from\": \"" + OverheadGovernor::LevelName(previous) + "\"" +
+                   ", \"to\": \"" + OverheadGovernor::LevelName(next) + "\"" +
+                   ", \"self_percent\": " + std::to_string(percent) +
+                   ", \"max_queue_depth\": " + std::to_string(sample.max_queue_depth), 'i');
+}
@@ -0,0 +1,224 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+#include <mutex>
+#include <string>
+
+#include "activity_definitions.h"
+#include "overhead_monitor.h"
+#include "smprofiler_config.h"
+#include "smprofiler_timeline.h"
+
+#define OVERHEAD_CUPTI_KINDS (5)
+
+static const CUpti_ActivityOverheadKind cupti_kinds[OVERHEAD_CUPTI_KINDS] = {
+  CUPTI_ACTIVITY_OVERHEAD_UNKNOWN,
+  CUPTI_ACTIVITY_OVERHEAD_DRIVER_COMPILER,
+  CUPTI_ACTIVITY_OVERHEAD_CUPTI_BUFFER_FLUSH,
+  CUPTI_ACTIVITY_OVERHEAD_CUPTI_INSTRUMENTATION,
+  CUPTI_ACTIVITY_OVERHEAD_CUPTI_RESOURCE,
+};
+
+struct OverheadTotals {
+  uint64_t decode_ns;
+  uint64_t buffers;
+  uint64_t records;
+  uint64_t cupti_ns[OVERHEAD_CUPTI_KINDS];
+  uint64_t cupti_count[OVERHEAD_CUPTI_KINDS];
+  uint64_t enqueue_ns;
+  uint64_t enqueued;
+  uint64_t write_ns;
+  uint64_t written;
+  size_t max_queue_depth;
+  // wall time of the phases
+  uint64_t traced_ns;
+};
+
+static bool enabled = false;
+static std::mutex mutex;
+static std::string report_path;
+// since the previous end of phase, and over the whole job
+static OverheadTotals window = {};
+static OverheadTotals totals = {};
+static TimelineWriterStats last_writer_stats = {};
+
+static const char* PROFILER_TRACK = "profiler";
+
+void overhead_monitor_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_OVERHEAD", false) ||
+            smprofiler_config_flag("SMPROFILER_GOVERNOR", false);
+  if (!enabled)
+    return;
+  report_path = smprofiler_config_string("SMPROFILER_OVERHEAD_FILE",
+                                         smprofiler_output_path("overhead.txt"));
+  Timeline& tl = Timeline::getInstance();
+  tl.MeasureOverhead(true);
+  last_writer_stats = tl.WriterStats(true);
+  smprofiler_atexit(overhead_monitor_report);
+}
+
+bool overhead_monitor_enabled()
+{
+  return enabled;
+}
+
+uint64_t overhead_monitor_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void overhead_monitor_add_decode(uint64_t ns, size_t records)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  window.decode_ns += ns;
+  window.buffers++;
+  window.records += records;
+}
+
+static int cupti_kind_index(uint32_t kind)
+{
+  for (int i = 1; i < OVERHEAD_CUPTI_KINDS; i++) {
+    if (cupti_kinds[i] == kind)
+      return i;
+  }
+  return 0;
+}
+
+void overhead_monitor_add_cupti(uint32_t kind, uint64_t start, uint64_t end)
+{
+  if (!enabled)
+    return;
+  int index = cupti_kind_index(kind);
+  uint64_t ns = end > start ? end - start : 0;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    window.cupti_ns[index] += ns;
+    window.cupti_count[index]++;
+  }
+  Timeline::getInstance().SMRecordEvent(PROFILER_TRACK, std::string("cupti_") + get_activity_overhead_string(cupti_kinds[index]),
+                                        start/1000, ns/1000);
+}
+
+static uint64_t cupti_ns(const OverheadTotals& t)
+{
+  uint64_t ns = 0;
+  for (int i = 0; i < OVERHEAD_CUPTI_KINDS; i++) {
+    ns += t.cupti_ns[i];
+  }
+  return ns;
+}
+
+// enqueueing is part of decoding for the records of activity buffers, so it
+// is not added again
+static uint64_t self_ns(const OverheadTotals& t)
+{
+  return t.decode_ns + t.write_ns + cupti_ns(t);
+}
+
+static void add_totals(OverheadTotals& to, const OverheadTotals& from)
+{
+  to.decode_ns += from.decode_ns;
+  to.buffers += from.buffers;
+  to.records += from.records;
+  for (int i = 0; i < OVERHEAD_CUPTI_KINDS; i++) {
+    to.cupti_ns[i] += from.cupti_ns[i];
+    to.cupti_count[i] += from.cupti_count[i];
+  }
+  to.enqueue_ns += from.enqueue_ns;
+  to.enqueued += from.enqueued;
+  to.write_ns += from.write_ns;
+  to.written += from.written;
+  if (from.max_queue_depth > to.max_queue_depth)
+    to.max_queue_depth = from.max_queue_depth;
+  to.traced_ns += from.traced_ns;
+}
+
+OverheadSample overhead_monitor_end_phase(const char* phase, uint64_t start, uint64_t end)
+{
+  if (!enabled)
+    return OverheadSample{0, 0, 0};
+  Timeline& tl = Timeline::getInstance();
+  TimelineWriterStats writer = tl.WriterStats(true);
+
+  OverheadTotals phase_totals;
+  {
+    std::lock_guard<std::mutex> guard(mutex);
+    window.enqueue_ns = writer.enqueue_ns - last_writer_stats.enqueue_ns;
+    window.enqueued = writer.enqueued - last_writer_stats.enqueued;
+    window.write_ns = writer.write_ns - last_writer_stats.write_ns;
+    window.written = writer.written - last_writer_stats.written;
+    window.max_queue_depth = writer.max_queue_depth;
+    window.traced_ns = end > start ? end - start : 0;
+    last_writer_stats = writer;
+    phase_totals = window;
+    add_totals(totals, window);
+    window = OverheadTotals();
+  }
+
+  uint64_t self = self_ns(phase_totals);
+  double percent = phase_totals.traced_ns ? 100.0 * self / phase_totals.traced_ns : 0.0;
+  printf("Phase %s PROFILER self %.3f ms (%.2f%%), decode %.3f ms for %" PRIu64 " records, enqueue %.3f ms, "
+         "write %.3f ms for %" PRIu64 " events, cupti %.3f ms, max queue depth %zu\n",
+         phase, self / 1e6, percent, phase_totals.decode_ns / 1e6, phase_totals.records, phase_totals.enqueue_ns / 1e6,
+         phase_totals.write_ns / 1e6, phase_totals.written, cupti_ns(phase_totals) / 1e6, phase_totals.max_queue_depth);
+
+  std::string args = ", \"phase\": \"" + std::string(phase) + "\"" +
+                     ", \"self_us\": " + std::to_string(self / 1000) +
+                     ", \"self_percent\": " + std::to_string(percent) +
+                     ", \"decode_us\": " + std::to_string(phase_totals.decode_ns / 1000) +
+                     ", \"records\": " + std::to_string(phase_totals.records) +
+                     ", \"enqueue_us\": " + std::to_string(phase_totals.enqueue_ns / 1000) +
+                     ", \"write_us\": " + std::to_string(phase_totals.write_ns / 1000) +
+                     ", \"events_written\": " + std::to_string(phase_totals.written) +
+                     ", \"cupti_us\": " + std::to_string(cupti_ns(phase_totals) / 1000) +
+                     ", \"max_queue_depth\": " + std::to_string(phase_totals.max_queue_depth);
+  tl.SMRecordEvent(PROFILER_TRACK, "profiler_overhead", start/1000, (end > start ? end - start : 0)/1000, args);
+  uint64_t ts = (end > start ? end : start)/1000;
+  tl.SMRecordCounter(PROFILER_TRACK, "profiler_self_us", ts,
+                     "\"decode\": " + std::to_string(phase_totals.decode_ns / 1000) +
+                     ", \"write\": " + std::to_string(phase_totals.write_ns / 1000) +
+                     ", \"cupti\": " + std::to_string(cupti_ns(phase_totals) / 1000));
+  tl.SMRecordCounter(PROFILER_TRACK, "profiler_queue_depth", ts,
+                     "\"max\": " + std::to_string(phase_totals.max_queue_depth));
+  return OverheadSample{self, phase_totals.traced_ns, phase_totals.max_queue_depth};
+}
+
+void overhead_monitor_report()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (!enabled)
+    return;
+  smprofiler_create_parent_dirs(report_path);
+  FILE* file = fopen(report_path.c_str(), "w");
+  if (file == NULL) {
+    printf("Error: could not open overhead report %s\n", report_path.c_str());
+    return;
+  }
+  uint64_t self = self_ns(totals);
+  fprintf(file, "# profiler overhead over %.3f s of traced phases\n", totals.traced_ns / 1e9);
+  fprintf(file, "%-26s %14.3f ms %8.2f%%\n", "self time", self / 1e6,
+          totals.traced_ns ? 100.0 * self / totals.traced_ns : 0.0);
+  fprintf(file, "%-26s %14.3f ms %8" PRIu64 " buffers %12" PRIu64 " records %10.1f ns/record\n", "decode",
+          totals.decode_ns / 1e6, totals.buffers, totals.records,
+          totals.records ? (double) totals.decode_ns / totals.records : 0.0);
+  fprintf(file, "%-26s %14.3f ms %12" PRIu64 " events %10.1f ns/event (part of decode)\n", "enqueue",
+          totals.enqueue_ns / 1e6, totals.enqueued,
+          totals.enqueued ? (double) totals.enqueue_ns / totals.enqueued : 0.0);
+  fprintf(file, "%-26s %14.3f ms %12" PRIu64 " events %10.1f ns/event\n", "write",
+          totals.write_ns / 1e6, totals.written,
+          totals.written ? (double) totals.write_ns / totals.written : 0.0);
+  for (int i = 0; i < OVERHEAD_CUPTI_KINDS; i++) {
+    if (totals.cupti_count[i] == 0)
+      continue;
+    fprintf(file, "%-26s %14.3f ms %12" PRIu64 " records\n",
+            (std::string("cupti ") + get_activity_overhead_string(cupti_kinds[i])).c_str(),
+            totals.cupti_ns[i] / 1e6, totals.cupti_count[i]);
+  }
+  fprintf(file, "%-26s %14zu\n", "max queue depth", totals.max_queue_depth);
+  fclose(file);
+}
@@ -0,0 +1,253 @@
+#include <inttypes.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "activity_definitions.h"
+#include "pc_sampling.h"
+#include "smprofiler_config.h"
+
+PcSamplingAggregator::PcSamplingAggregator(size_t max_pcs) : max_pcs_(max_pcs < 1 ? 1 : max_pcs)
+{
+  size_t capacity = 1;
+  while (capacity < 2 * max_pcs_) {
+    capacity <<= 1;
+  }
+  entries_.resize(capacity);
+}
+
+uint64_t PcSamplingAggregator::Hash(uint32_t function_id, uint32_t pc_offset, uint32_t stall_reason)
+{
+  uint64_t key = ((uint64_t) function_id << 32) ^ ((uint64_t) stall_reason << 27) ^ pc_offset;
+  // murmur3 finalizer
+  key ^= key >> 33;
+  key *= 0xff51afd7ed558ccdULL;
+  key ^= key >> 33;
+  key *= 0xc4ceb9fe1a85ec53ULL;
+  key ^= key >> 33;
+  return key;
+}
+
+void PcSamplingAggregator::AddSample(const PcSample& s)
+{
+  samples_ += s.samples;
+  size_t mask = entries_.size() - 1;
+  for (size_t i = Hash(s.function_id, s.pc_offset, s.stall_reason) & mask;; i = (i + 1) & mask) {
+    Entry& entry = entries_[i];
+    if (!entry.used) {
+      if (size_ >= max_pcs_) {
+        dropped_ += s.samples;
+        return;
+      }
+      entry = Entry{s.function_id, s.pc_offset, s.source_locator_id, s.stall_reason, 0, 0, true};
+      size_++;
+    } else if (entry.function_id != s.function_id || entry.pc_offset != s.pc_offset ||
+               entry.stall_reason != s.stall_reason) {
+      continue;
+    }
+    entry.samples += s.samples;
+    entry.latency_samples += s.latency_samples;
+    return;
+  }
+}
+
+void PcSamplingAggregator::AddFunction(uint32_t id, const char* name)
+{
+  functions_[id] = name != NULL ? name : "";
+}
+
+void PcSamplingAggregator::AddSourceLocator(uint32_t id, const char* file, uint32_t line)
+{
+  source_locators_[id] = std::make_pair(std::string(file != NULL ? file : ""), line);
+}
+
+void PcSamplingAggregator::AddRecordInfo(uint64_t total_samples, uint64_t dropped_samples)
+{
+  cupti_total_samples_ += total_samples;
+  cupti_dropped_samples_ += dropped_samples;
+}
+
+struct PcSamplingStats {
+  uint64_t samples;
+  uint64_t latency_samples;
+  uint64_t stalls[PC_SAMPLING_STALL_REASONS];
+};
+
+static void add_stats(PcSamplingStats& stats, uint32_t stall_reason, uint64_t samples, uint64_t latency_samples)
+{
+  stats.samples += samples;
+  stats.latency_samples += latency_samples;
+  stats.stalls[stall_reason % PC_SAMPLING_STALL_REASONS] += samples;
+}
+
+// the top stall reasons of stats as "name share%, ..."
+static std::string top_stalls(const PcSamplingStats& stats, size_t count, const char* (*stall_name)(uint32_t))
+{
+  std::vector<uint32_t> reasons;
+  for (uint32_t reason = 0; reason < PC_SAMPLING_STALL_REASONS; reason++) {
+    if (stats.stalls[reason] > 0)
+      reasons.push_back(reason);
+  }
+  std::sort(reasons.begin(), reasons.end(),
+            [&stats](uint32_t a, uint32_t b) { return stats.stalls[a] > stats.stalls[b]; });
+  std::string text;
+  for (size_t i = 0; i < reasons.size() && i < count; i++) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s%s %.1f%%", i ? ", " : "", stall_name(reasons[i]),
+             100.0 * stats.stalls[reasons[i]] / stats.samples);
+    text += buf;
+  }
+  return text;
+}
+
+void PcSamplingAggregator::Summary(FILE* file, size_t top_lines, const char* (*stall_name)(uint32_t)) const
+{
+  // per function, and per (function, source line or PC when the line is unknown)
+  std::map<uint32_t, PcSamplingStats> functions;
+  std::map<std::pair<uint32_t, uint64_t>, PcSamplingStats> lines;
+  for (const Entry& entry : entries_) {
+    if (!entry.used)
+      continue;
+    add_stats(functions[entry.function_id], entry.stall_reason, entry.samples, entry.latency_samples);
+    bool has_line = source_locators_.count(entry.source_locator_id) > 0;
+    uint64_t line_key = has_line ? entry.source_locator_id : (1ULL << 32) | entry.pc_offset;
+    add_stats(lines[std::make_pair(entry.function_id, line_key)], entry.stall_reason,
+              entry.samples, entry.latency_samples);
+  }
+
+  fprintf(file, "# %" PRIu64 " samples in %zu PCs, %" PRIu64 " not aggregated (table full)", samples_, size_, dropped_);
+  if (cupti_total_samples_ > 0)
+    fprintf(file, ", CUPTI dropped %" PRIu64 " of %" PRIu64, cupti_dropped_samples_, cupti_total_samples_);
+  fprintf(file, "\n\n# samples per kernel\n");
+
+  std::vector<std::pair<uint32_t, const PcSamplingStats*>> ranked;
+  for (auto& entry : functions) {
+    ranked.push_back(std::make_pair(entry.first, &entry.second));
+  }
+  std::sort(ranked.begin(), ranked.end(),
+            [](const std::pair<uint32_t, const PcSamplingStats*>& a, const std::pair<uint32_t, const PcSamplingStats*>& b) {
+              return a.second->samples > b.second->samples;
+            });
+  fprintf(file, "%12s %7s %12s  %-60s %s\n", "samples", "share", "latency", "kernel", "top stall reasons");
+  for (auto& entry : ranked) {
+    auto name = functions_.find(entry.first);
+    std::string kernel = name != functions_.end() ? name->second : "function " + std::to_string(entry.first);
+    fprintf(file, "%12" PRIu64 " %6.1f%% %12" PRIu64 "  %-60s %s\n", entry.second->samples,
+            samples_ ? 100.0 * entry.second->samples / samples_ : 0.0, entry.second->latency_samples,
+            kernel.c_str(), top_stalls(*entry.second, 3, stall_name).c_str());
+  }
+
+  fprintf(file, "\n# hottest source lines per kernel\n");
+  for (auto& entry : ranked) {
+    auto name = functions_.find(entry.first);
+    fprintf(file, "%s\n", name != functions_.end() ? name->second.c_str() : ("function " + std::to_string(entry.first)).c_str());
+    std::vector<std::pair<uint64_t, const PcSamplingStats*>> hot;
+    for (auto it = lines.lower_bound(std::make_pair(entry.first, (uint64_t) 0));
+         it != lines.end() && it->first.first == entry.first; ++it) {
+      hot.push_back(std::make_pair(it->first.second, &it->second));
+    }
+    size_t count = std::min(hot.size(), top_lines);
+    std::partial_sort(hot.begin(), hot.begin() + count, hot.end(),
+                      [](const std::pair<uint64_t, const PcSamplingStats*>& a, const std::pair<uint64_t, const PcSamplingStats*>& b) {
+                        return a.second->samples > b.second->samples;
+                      });
+    for (size_t i = 0; i < count; i++) {
+      std::string where;
+      if (hot[i].first >> 32) {
+        char pc[32];
+        snprintf(pc, sizeof(pc), "pc 0x%x", (uint32_t) hot[i].first);
+        where = pc;
+      } else {
+        const std::pair<std::string, uint32_t>& line = source_locators_.at((uint32_t) hot[i].first);
+        where = line.first + ":" + std::to_string(line.second);
+      }
+      fprintf(file, "  %12" PRIu64 " %6.1f%%  %-58s %s\n", hot[i].second->samples,
+              100.0 * hot[i].second->samples / entry.second->samples, where.c_str(),
+              top_stalls(*hot[i].second, 2, stall_name).c_str());
+    }
+  }
+}
+
+static bool enabled = false;
+static std::mutex mutex;
+static PcSamplingAggregator* aggregator = NULL;
+static std::string report_path;
+static size_t top_lines;
+static uint32_t period;
+
+void pc_sampling_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_PC_SAMPLING", false);
+  if (!enabled)
+    return;
+  aggregator = new PcSamplingAggregator(smprofiler_config_int("SMPROFILER_PC_SAMPLING_MAX_PCS", 65536));
+  top_lines = smprofiler_config_int("SMPROFILER_PC_SAMPLING_TOP_LINES", 10);
+  period = smprofiler_config_int("SMPROFILER_PC_SAMPLING_PERIOD", 0);
+  report_path = smprofiler_config_string("SMPROFILER_PC_SAMPLING_FILE",
+                                         smprofiler_output_path("pc_sampling.txt"));
+  smprofiler_atexit(pc_sampling_report);
+}
+
+bool pc_sampling_enabled()
+{
+  return enabled;
+}
+
+uint32_t pc_sampling_period()
+{
+  return period;
+}
+
+void pc_sampling_add_sample(const PcSample& s)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  aggregator->AddSample(s);
+}
+
+void pc_sampling_add_function(uint32_t id, const char* name)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  aggregator->AddFunction(id, name);
+}
+
+void pc_sampling_add_source_locator(uint32_t id, const char* file, uint32_t line)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  aggregator->AddSourceLocator(id, file, line);
+}
+
+void pc_sampling_add_record_info(uint64_t total_samples, uint64_t dropped_samples)
+{
+  if (!enabled)
+    return;
+  std::lock_guard<std::mutex> guard(mutex);
+  aggregator->AddRecordInfo(total_samples, dropped_samples);
+}
+
+static const char* stall_name(uint32_t reason)
+{
+  return get_pc_sampling_stall_string((CUpti_ActivityPCSamplingStallReason) reason);
+}
+
+void pc_sampling_report()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (aggregator == NULL)
+    return;
+  smprofiler_create_parent_dirs(report_path);
+  FILE* file = fopen(report_path.c_str(), "w");
+  if (file == NULL) {
+    printf("Error: could not open PC sampling report %s\n", report_path.c_str());
+    return;
+  }
+  aggregator->Summary(file, top_lines, stall_name);
+  fclose(file);
+}
@@ -8,9 +8,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <pthread.h>
+#include <atomic>
 #include <sstream>
 #include "perf_collector.h"
 #include "smprofiler_timeline.h"
+#include "tsc_clock.h"
 
 //perf counter syscall
 static inline int perf_event_open(struct perf_event_attr * hw,
@@ -25,13 +28,36 @@ static unsigned int n_counters = 2;
 // if running on bare metal instance (e.g. g4dn.metal), one can enable hardware events
 static int perf_events[2] = {PERF_COUNT_SW_TASK_CLOCK, PERF_COUNT_SW_CONTEXT_SWITCHES};//, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_CPU_CYCLES};//, PERF_COUNT_HW_STALLED_CYCLES_FRONTEND, PERF_COUNT_HW_STALLED_CYCLES_BACKEND};
 static uint64_t perf_start[2];
-static uint64_t start_time;
+static uint64_t start_ticks;
+// counts of all closed phases, read by the metrics exporter
+static std::atomic<uint64_t> perf_totals[2];
 
 // phase name provided by user in the python script
 static char* phase;
 
+// A child forked during a phase gets copies of the counter descriptors of
+// the parent's phase; it opens its own with its next perf_init.
+static void perf_after_fork_child()
+{
+    if (fds) {
+        for (unsigned int i = 0; i < n_counters; i++)
+            close(fds[i]);
+        free(fds);
+        fds = NULL;
+    }
+    if (pe) {
+        free(pe);
+        pe = NULL;
+    }
+}
+
 int perf_init(char* phase_name)
 {
+    static bool fork_handler_registered = false;
+    if (!fork_handler_registered) {
+        pthread_atfork(NULL, NULL, perf_after_fork_child);
+        fork_handler_registered = true;
+    }
     phase = phase_name;
 
     pe = (struct perf_event_attr*)calloc(n_counters, sizeof(struct perf_event_attr));
@@ -70,9 +96,7 @@ int perf_init(char* phase_name)
     perf_read_all(perf_start);
 
     // set start timer
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    start_time = (tv.tv_sec) * 1000000 + tv.tv_usec;
+    start_ticks = tsc_clock_now();
 
     return 0;
 }
@@ -80,6 +104,8 @@ int perf_init(char* phase_name)
 void perf_close() {
 	uint64_t perf_end[n_counters];
 	perf_read_all(perf_end);
+	for (unsigned int i=0; i<n_counters; i++)
+		perf_totals[i] += perf_end[i] - perf_start[i];
   	printf("Task Clocks: %10lu\n",perf_end[0] - perf_start[0]);
 	printf("Context Switches: %10lu\n", perf_end[1] - perf_start[1]);
 //	printf("Instructions: %10lu\n", perf_end[2] - perf_start[2]);
@@ -105,14 +131,11 @@ void perf_close() {
 	ss.append(std::to_string(diff1/diff2));*/
   	ss.append(std::to_string(getpid()));
 
-	char event_type = 'X';
         Timeline& tl = Timeline::getInstance();
-	struct timeval tv;
-        gettimeofday(&tv, nullptr);
-        uint64_t current_timestamp = (tv.tv_sec) * 1000000 + tv.tv_usec;
+        uint64_t end_ticks = tsc_clock_now();
 
 	//record perf metrics in timeline
-	tl.SMRecordEvent("perf", phase, start_time, current_timestamp-start_time , (const std::string) ss, event_type);
+	tl.SMRecordCpuEvent("perf", phase, start_ticks, end_ticks, (const std::string) ss);
 
 	for (int i=0; i<n_counters; i++) {
 		close(fds[i]);
@@ -136,3 +159,8 @@ void perf_read_all(uint64_t* vals) {
 		vals[i] = val;
 	}
 }
+
+void perf_read_totals(uint64_t* vals) {
+	for (unsigned int i=0; i<n_counters; i++)
+		vals[i] = perf_totals[i].load(std::memory_order_relaxed);
+}
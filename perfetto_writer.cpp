@@ -0,0 +1,389 @@
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "perfetto_writer.h"
+
+// perfetto_trace.proto field numbers
+#define TRACE_PACKET (1)
+#define PACKET_TIMESTAMP (8)
+#define PACKET_SEQUENCE_ID (10)
+#define PACKET_TRACK_EVENT (11)
+#define PACKET_INTERNED_DATA (12)
+#define PACKET_SEQUENCE_FLAGS (13)
+#define PACKET_TRACK_DESCRIPTOR (60)
+
+#define SEQ_INCREMENTAL_STATE_CLEARED (1)
+#define SEQ_NEEDS_INCREMENTAL_STATE (2)
+
+#define TRACK_UUID (1)
+#define TRACK_NAME (2)
+#define TRACK_PROCESS (3)
+#define TRACK_THREAD (4)
+#define TRACK_PARENT_UUID (5)
+#define TRACK_COUNTER (8)
+
+#define EVENT_DEBUG_ANNOTATIONS (4)
+#define EVENT_TYPE (9)
+#define EVENT_NAME_IID (10)
+#define EVENT_TRACK_UUID (11)
+#define EVENT_DOUBLE_COUNTER_VALUE (44)
+
+#define EVENT_TYPE_SLICE_BEGIN (1)
+#define EVENT_TYPE_SLICE_END (2)
+#define EVENT_TYPE_INSTANT (3)
+#define EVENT_TYPE_COUNTER (4)
+
+#define ANNOTATION_NAME_IID (1)
+#define ANNOTATION_BOOL (2)
+#define ANNOTATION_INT (4)
+#define ANNOTATION_DOUBLE (5)
+#define ANNOTATION_STRING (6)
+#define ANNOTATION_LEGACY_JSON (9)
+
+#define INTERNED_EVENT_NAMES (2)
+#define INTERNED_ANNOTATION_NAMES (3)
+
+// every packet of a file comes from one writer
+#define SEQUENCE_ID (1)
+
+// Splits "key": value pairs of a JSON object body, without the braces.
+// Values are returned as written: quoted strings keep their quotes, nested
+// objects and arrays are returned whole.
+static void split_members(const std::string& json, std::vector<std::pair<std::string, std::string>>& members)
+{
+  size_t i = 0;
+  size_t n = json.size();
+  while (i < n) {
+    while (i < n && (json[i] == ' ' || json[i] == ',' || json[i] == '\n' || json[i] == '\t'))
+      i++;
+    if (i >= n || json[i] != '"')
+      return;
+    size_t key_end = json.find('"', i + 1);
+    if (key_end == std::string::npos)
+      return;
+    std::string key = json.substr(i + 1, key_end - i - 1);
+    i = json.find(':', key_end);
+    if (i == std::string::npos)
+      return;
+    i++;
+    while (i < n && json[i] == ' ')
+      i++;
+    size_t value_start = i;
+    int depth = 0;
+    bool quoted = false;
+    for (; i < n; i++) {
+      char c = json[i];
+      if (quoted) {
+        if (c == '\\')
+          i++;
+        else if (c == '"')
+          quoted = false;
+      } else if (c == '"') {
+        quoted = true;
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if (c == '}' || c == ']') {
+        depth--;
+      } else if (c == ',' && depth == 0) {
+        break;
+      }
+    }
+    size_t value_end = i;
+    while (value_end > value_start && json[value_end - 1] == ' ')
+      value_end--;
+    members.emplace_back(key, json.substr(value_start, value_end - value_start));
+  }
+}
+
+// the text of a JSON string literal, with the common escapes undone
+static std::string unquote(const std::string& value)
+{
+  std::string text;
+  for (size_t i = 1; i + 1 < value.size(); i++) {
+    char c = value[i];
+    if (c == '\\' && i + 2 < value.size()) {
+      c = value[++i];
+      if (c == 'n')
+        c = '\n';
+      else if (c == 't')
+        c = '\t';
+    }
+    text.push_back(c);
+  }
+  return text;
+}
+
+// sets the annotation value from a JSON value, by its type
+static void annotation_value(ProtoWriter& annotation, const std::string& value)
+{
+  if (value.size() >= 2 && value.front() == '"') {
+    annotation.String(ANNOTATION_STRING, unquote(value));
+    return;
+  }
+  if (value == "true" || value == "false") {
+    annotation.Varint(ANNOTATION_BOOL, value == "true");
+    return;
+  }
+  if (!value.empty() && value.find_first_of(".eE") == std::string::npos) {
+    char* end;
+    long long number = strtoll(value.c_str(), &end, 10);
+    if (*end == '\0') {
+      annotation.Varint(ANNOTATION_INT, (uint64_t) number);
+      return;
+    }
+  }
+  if (!value.empty()) {
+    char* end;
+    double number = strtod(value.c_str(), &end);
+    if (*end == '\0') {
+      annotation.Double(ANNOTATION_DOUBLE, number);
+      return;
+    }
+  }
+  annotation.String(ANNOTATION_LEGACY_JSON, value);
+}
+
+PerfettoWriter::PerfettoWriter()
+{
+  // track uuids only have to be unique within a trace, the pid keeps them
+  // apart when the files of several ranks are opened together
+  uuid_prefix_ = (uint64_t) getpid() << 32;
+}
+
+void PerfettoWriter::Reset()
+{
+  next_uuid_ = 1;
+  next_tid_ = 1;
+  sequence_started_ = false;
+  processes_.clear();
+  threads_.clear();
+  devices_.clear();
+  counters_.clear();
+  event_names_.clear();
+  annotation_names_.clear();
+}
+
+uint64_t PerfettoWriter::NewUuid()
+{
+  return uuid_prefix_ | next_uuid_++;
+}
+
+void PerfettoWriter::AppendPacket(ProtoWriter& packet, std::string& out)
+{
+  packet.Varint(PACKET_SEQUENCE_ID, SEQUENCE_ID);
+  ProtoWriter trace;
+  trace.Message(TRACE_PACKET, packet);
+  out += trace.Data();
+}
+
+void PerfettoWriter::AppendDescriptor(ProtoWriter& descriptor, std::string& out)
+{
+  ProtoWriter packet;
+  packet.Message(PACKET_TRACK_DESCRIPTOR, descriptor);
+  AppendPacket(packet, out);
+}
+
+uint64_t PerfettoWriter::ProcessTrack(const PerfettoEvent& event, std::string& out)
+{
+  auto it = processes_.find(event.phase_index);
+  if (it != processes_.end())
+    return it->second;
+
+  uint64_t uuid = NewUuid();
+  processes_.emplace(event.phase_index, uuid);
+  ProtoWriter process;
+  process.Varint(1, event.phase_index);
+  process.String(6, event.phase_name);
+  ProtoWriter descriptor;
+  descriptor.Varint(TRACK_UUID, uuid);
+  descriptor.Message(TRACK_PROCESS, process);
+  AppendDescriptor(descriptor, out);
+  return uuid;
+}
+
+PerfettoWriter::Track& PerfettoWriter::ThreadTrack(const PerfettoEvent& event, uint64_t process_uuid, std::string& out)
+{
+  auto key = std::make_pair(event.phase_index, event.thread_id);
+  auto it = threads_.find(key);
+  if (it != threads_.end())
+    return it->second;
+
+  // pthread ids do not fit the 32 bit tid, the name keeps them as the
+  // JSON timeline names its threads
+  Track& track = threads_[key];
+  track.name = "tid-" + std::to_string(event.thread_id) + "_pid-" + std::to_string(event.pid);
+  uint64_t uuid = NewUuid();
+  track.lanes.push_back({uuid, 0, {}});
+  ProtoWriter thread;
+  thread.Varint(1, event.phase_index);
+  thread.Varint(2, next_tid_++);
+  thread.String(5, track.name);
+  // the pid and the parent make it a thread of the phase process, like the
+  // device and counter tracks next to it
+  ProtoWriter descriptor;
+  descriptor.Varint(TRACK_UUID, uuid);
+  descriptor.Varint(TRACK_PARENT_UUID, process_uuid);
+  descriptor.Message(TRACK_THREAD, thread);
+  AppendDescriptor(descriptor, out);
+  return track;
+}
+
+PerfettoWriter::Track& PerfettoWriter::DeviceTrack(const PerfettoEvent& event, uint64_t process_uuid, std::string& out)
+{
+  auto key = std::make_tuple(event.phase_index, event.device, event.stream);
+  auto it = devices_.find(key);
+  if (it != devices_.end())
+    return it->second;
+
+  Track& track = devices_[key];
+  track.name = "GPU " + std::to_string(event.device);
+  if (event.stream >= 0)
+    track.name += " stream " + std::to_string(event.stream);
+  uint64_t uuid = NewUuid();
+  track.lanes.push_back({uuid, 0, {}});
+  ProtoWriter descriptor;
+  descriptor.Varint(TRACK_UUID, uuid);
+  descriptor.Varint(TRACK_PARENT_UUID, process_uuid);
+  descriptor.String(TRACK_NAME, track.name);
+  AppendDescriptor(descriptor, out);
+  return track;
+}
+
+uint64_t PerfettoWriter::CounterTrack(const PerfettoEvent& event, const std::string& series,
+                                      uint64_t process_uuid, std::string& out)
+{
+  std::string name = event.name + " " + series;
+  auto key = std::make_pair(event.phase_index, name);
+  auto it = counters_.find(key);
+  if (it != counters_.end())
+    return it->second;
+
+  uint64_t uuid = NewUuid();
+  counters_.emplace(key, uuid);
+  ProtoWriter counter;
+  ProtoWriter descriptor;
+  descriptor.Varint(TRACK_UUID, uuid);
+  descriptor.Varint(TRACK_PARENT_UUID, process_uuid);
+  descriptor.String(TRACK_NAME, name);
+  descriptor.Message(TRACK_COUNTER, counter);
+  AppendDescriptor(descriptor, out);
+  return uuid;
+}
+
+// Events mostly arrive in start order. A slice fits a lane when it starts
+// no earlier than the last one and ends within every slice still open.
+uint64_t PerfettoWriter::LaneFor(Track& track, uint64_t process_uuid, uint64_t start, uint64_t end, std::string& out)
+{
+  for (Lane& lane : track.lanes) {
+    if (start < lane.last_start)
+      continue;
+    while (!lane.open_ends.empty() && lane.open_ends.back() <= start)
+      lane.open_ends.pop_back();
+    if (!lane.open_ends.empty() && end > lane.open_ends.back())
+      continue;
+    lane.last_start = start;
+    lane.open_ends.push_back(end);
+    return lane.uuid;
+  }
+
+  uint64_t uuid = NewUuid();
+  track.lanes.push_back({uuid, start, {end}});
+  ProtoWriter descriptor;
+  descriptor.Varint(TRACK_UUID, uuid);
+  descriptor.Varint(TRACK_PARENT_UUID, process_uuid);
+  descriptor.String(TRACK_NAME, track.name + " #" + std::to_string(track.lanes.size() - 1));
+  AppendDescriptor(descriptor, out);
+  return uuid;
+}
+
+// New names are added to interned, which must go out in the packet that
+// first refers to them.
+uint64_t PerfettoWriter::InternName(std::unordered_map<std::string, uint64_t>& names, const std::string& name,
+                                    uint32_t field, ProtoWriter& interned, bool& has_interned)
+{
+  auto it = names.find(name);
+  if (it != names.end())
+    return it->second;
+
+  // iids start at 1, 0 is reserved
+  uint64_t iid = names.size() + 1;
+  names.emplace(name, iid);
+  ProtoWriter entry;
+  entry.Varint(1, iid);
+  entry.String(2, name);
+  interned.Message(field, entry);
+  has_interned = true;
+  return iid;
+}
+
+void PerfettoWriter::AddEvent(const PerfettoEvent& event, std::string& out)
+{
+  uint64_t process_uuid = ProcessTrack(event, out);
+
+  std::vector<std::pair<std::string, std::string>> members;
+  split_members(event.args, members);
+
+  if (event.type == 'C') {
+    for (auto& member : members) {
+      char* end;
+      double value = strtod(member.second.c_str(), &end);
+      if (end == member.second.c_str())
+        continue;
+      ProtoWriter track_event;
+      track_event.Varint(EVENT_TYPE, EVENT_TYPE_COUNTER);
+      track_event.Varint(EVENT_TRACK_UUID, CounterTrack(event, member.first, process_uuid, out));
+      track_event.Double(EVENT_DOUBLE_COUNTER_VALUE, value);
+      ProtoWriter packet;
+      packet.Varint(PACKET_TIMESTAMP, event.ts_ns);
+      packet.Message(PACKET_TRACK_EVENT, track_event);
+      AppendPacket(packet, out);
+    }
+    return;
+  }
+
+  Track& track = event.device >= 0 ? DeviceTrack(event, process_uuid, out) : ThreadTrack(event, process_uuid, out);
+  uint64_t end_ns = event.ts_ns + event.duration_ns;
+  uint64_t track_uuid = event.type == 'X' ? LaneFor(track, process_uuid, event.ts_ns, end_ns, out)
+                                          : track.lanes[0].uuid;
+
+  ProtoWriter interned;
+  bool has_interned = false;
+  ProtoWriter track_event;
+  track_event.Varint(EVENT_TYPE, event.type == 'X' ? EVENT_TYPE_SLICE_BEGIN : EVENT_TYPE_INSTANT);
+  track_event.Varint(EVENT_TRACK_UUID, track_uuid);
+  track_event.Varint(EVENT_NAME_IID, InternName(event_names_, event.name, INTERNED_EVENT_NAMES,
+                                                interned, has_interned));
+  for (auto& member : members) {
+    // the thread and process are the track
+    if (member.first == "pid" || member.first == "thread_id")
+      continue;
+    ProtoWriter annotation;
+    annotation.Varint(ANNOTATION_NAME_IID, InternName(annotation_names_, member.first, INTERNED_ANNOTATION_NAMES,
+                                                      interned, has_interned));
+    annotation_value(annotation, member.second);
+    track_event.Message(EVENT_DEBUG_ANNOTATIONS, annotation);
+  }
+
+  ProtoWriter packet;
+  packet.Varint(PACKET_TIMESTAMP, event.ts_ns);
+  packet.Message(PACKET_TRACK_EVENT, track_event);
+  if (has_interned)
+    packet.Message(PACKET_INTERNED_DATA, interned);
+  if (!sequence_started_) {
+    packet.Varint(PACKET_SEQUENCE_FLAGS, SEQ_INCREMENTAL_STATE_CLEARED | SEQ_NEEDS_INCREMENTAL_STATE);
+    sequence_started_ = true;
+  } else {
+    packet.Varint(PACKET_SEQUENCE_FLAGS, SEQ_NEEDS_INCREMENTAL_STATE);
+  }
+  AppendPacket(packet, out);
+
+  if (event.type == 'X') {
+    ProtoWriter end_event;
+    end_event.Varint(EVENT_TYPE, EVENT_TYPE_SLICE_END);
+    end_event.Varint(EVENT_TRACK_UUID, track_uuid);
+    ProtoWriter end_packet;
+    end_packet.Varint(PACKET_TIMESTAMP, end_ns);
+    end_packet.Message(PACKET_TRACK_EVENT, end_event);
+    AppendPacket(end_packet, out);
+  }
+}
@@ -0,0 +1,110 @@
+#include "pprof_writer.h"
+#include "proto_writer.h"
+
+// profile.proto field numbers
+#define PPROF_SAMPLE_TYPE (1)
+#define PPROF_SAMPLE (2)
+#define PPROF_LOCATION (4)
+#define PPROF_FUNCTION (5)
+#define PPROF_STRING_TABLE (6)
+
+bool PprofWriter::Open(const std::string& path, const std::vector<std::pair<std::string, std::string>>& value_types)
+{
+  file_ = fopen(path.c_str(), "wb");
+  if (file_ == NULL)
+    return false;
+
+  strings_.clear();
+  locations_.clear();
+
+  ProtoWriter profile;
+  std::string pending_strings;
+  // string 0 has to be the empty string
+  InternString("", pending_strings);
+  for (auto& value_type : value_types) {
+    ProtoWriter type;
+    type.Varint(1, InternString(value_type.first, pending_strings));
+    type.Varint(2, InternString(value_type.second, pending_strings));
+    profile.Message(PPROF_SAMPLE_TYPE, type);
+  }
+  fwrite(pending_strings.data(), 1, pending_strings.size(), file_);
+  fwrite(profile.Data().data(), 1, profile.Data().size(), file_);
+  return true;
+}
+
+// New strings are returned encoded in pending_strings, they must be written
+// before any message that refers to them.
+uint64_t PprofWriter::InternString(const std::string& value, std::string& pending_strings)
+{
+  auto it = strings_.find(value);
+  if (it != strings_.end())
+    return it->second;
+
+  uint64_t index = strings_.size();
+  strings_.emplace(value, index);
+  ProtoWriter entry;
+  entry.String(PPROF_STRING_TABLE, value);
+  pending_strings += entry.Data();
+  return index;
+}
+
+uint64_t PprofWriter::InternLocation(const std::string& name, std::string& pending)
+{
+  auto it = locations_.find(name);
+  if (it != locations_.end())
+    return it->second;
+
+  // ids start at 1, 0 is reserved
+  uint64_t id = locations_.size() + 1;
+  locations_.emplace(name, id);
+
+  ProtoWriter function;
+  function.Varint(1, id);
+  function.Varint(2, InternString(name, pending));
+  ProtoWriter line;
+  line.Varint(1, id);
+  ProtoWriter location;
+  location.Varint(1, id);
+  location.Message(4, line);
+
+  ProtoWriter profile;
+  profile.Message(PPROF_FUNCTION, function);
+  profile.Message(PPROF_LOCATION, location);
+  pending += profile.Data();
+  return id;
+}
+
+void PprofWriter::AddSample(const std::vector<std::string>& frames, const std::vector<int64_t>& values)
+{
+  if (file_ == NULL)
+    return;
+
+  std::string pending;
+  std::vector<uint64_t> location_ids;
+  for (const std::string& frame : frames) {
+    location_ids.push_back(InternLocation(frame, pending));
+  }
+  std::vector<uint64_t> sample_values(values.begin(), values.end());
+
+  ProtoWriter sample;
+  sample.PackedVarints(1, location_ids);
+  sample.PackedVarints(2, sample_values);
+  ProtoWriter profile;
+  profile.Message(PPROF_SAMPLE, sample);
+  pending += profile.Data();
+  fwrite(pending.data(), 1, pending.size(), file_);
+}
+
+void PprofWriter::Flush()
+{
+  if (file_ != NULL)
+    fflush(file_);
+}
+
+void PprofWriter::Close()
+{
+  if (file_ != NULL) {
+    fclose(file_);
+    file_ = NULL;
+  }
+}
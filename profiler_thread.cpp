@@ -0,0 +1,130 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <string>
+
+#include "profiler_thread.h"
+#include "smprofiler_config.h"
+
+// the per thread option if set, else the one for all threads
+static std::string setting(const char* name, const char* option)
+{
+  std::string upper;
+  for (const char* c = name; *c; c++)
+    upper.push_back(toupper(*c));
+  std::string specific = "SMPROFILER_THREAD_" + upper + "_" + option;
+  std::string common = std::string("SMPROFILER_THREAD_") + option;
+  return smprofiler_config_string(specific.c_str(), smprofiler_config_string(common.c_str(), ""));
+}
+
+// parses a CPU list such as "0-3,8", false if malformed
+static bool parse_cpu_list(const std::string& list, cpu_set_t* cpus)
+{
+  CPU_ZERO(cpus);
+  const char* p = list.c_str();
+  while (*p) {
+    char* end;
+    long first = strtol(p, &end, 10);
+    if (end == p || first < 0)
+      return false;
+    long last = first;
+    p = end;
+    if (*p == '-') {
+      last = strtol(p + 1, &end, 10);
+      if (end == p + 1 || last < first)
+        return false;
+      p = end;
+    }
+    for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+      CPU_SET(cpu, cpus);
+    while (*p == ',' || *p == ' ' || *p == '\n')
+      p++;
+  }
+  return true;
+}
+
+static bool node_cpus(long node, cpu_set_t* cpus)
+{
+  std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+  FILE* file = fopen(path.c_str(), "r");
+  if (file == NULL)
+    return false;
+  char list[4096];
+  bool ok = fgets(list, sizeof(list), file) != NULL && parse_cpu_list(list, cpus);
+  fclose(file);
+  return ok;
+}
+
+static void apply_affinity(const char* thread_name, const std::string& cpu_list, const std::string& node)
+{
+  if (cpu_list.empty() && node.empty())
+    return;
+  cpu_set_t cpus;
+  if (!cpu_list.empty() && !parse_cpu_list(cpu_list, &cpus)) {
+    printf("smprofiler: thread %s: invalid CPU list %s\n", thread_name, cpu_list.c_str());
+    return;
+  }
+  if (!node.empty()) {
+    long node_id = atol(node.c_str());
+    cpu_set_t on_node;
+    if (!node_cpus(node_id, &on_node)) {
+      printf("smprofiler: thread %s: NUMA node %ld not found\n", thread_name, node_id);
+      return;
+    }
+    if (cpu_list.empty())
+      cpus = on_node;
+    else
+      CPU_AND(&cpus, &cpus, &on_node);
+    if (CPU_COUNT(&cpus) == 0) {
+      printf("smprofiler: thread %s: no CPU of %s is on NUMA node %ld\n", thread_name, cpu_list.c_str(), node_id);
+      return;
+    }
+    // allocations of the thread come from the node while it has memory; the
+    // mask is a single word, so only nodes below 64 are supported
+    if (node_id >= 64) {
+      printf("smprofiler: thread %s: memory policy for NUMA node %ld not supported, only CPUs are bound\n",
+             thread_name, node_id);
+    } else {
+      unsigned long nodemask = 1UL << node_id;
+      if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &nodemask, 8 * sizeof(nodemask)) != 0)
+        printf("smprofiler: thread %s: set_mempolicy: %s\n", thread_name, strerror(errno));
+    }
+  }
+  if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+    printf("smprofiler: thread %s: sched_setaffinity: %s\n", thread_name, strerror(errno));
+}
+
+static void apply_scheduling(const char* thread_name, const std::string& policy, const std::string& nice)
+{
+  if (!policy.empty() && policy != "other") {
+    int sched = policy == "idle" ? SCHED_IDLE : policy == "batch" ? SCHED_BATCH : -1;
+    struct sched_param param = {0};
+    if (sched < 0)
+      printf("smprofiler: thread %s: unknown scheduling policy %s\n", thread_name, policy.c_str());
+    else if (pthread_setschedparam(pthread_self(), sched, &param) != 0)
+      printf("smprofiler: thread %s: could not set scheduling policy %s\n", thread_name, policy.c_str());
+  }
+  int level = atoi(nice.c_str());
+  // on Linux the nice level belongs to the thread
+  if (level != 0 && setpriority(PRIO_PROCESS, syscall(SYS_gettid), level) != 0)
+    printf("smprofiler: thread %s: setpriority: %s\n", thread_name, strerror(errno));
+}
+
+void profiler_thread_setup(const char* name)
+{
+  // names are limited to 15 characters
+  char thread_name[16];
+  snprintf(thread_name, sizeof(thread_name), "smprof-%s", name);
+  pthread_setname_np(pthread_self(), thread_name);
+
+  apply_affinity(thread_name, setting(name, "CPUS"), setting(name, "NUMA_NODE"));
+  apply_scheduling(thread_name, setting(name, "SCHED"), setting(name, "NICE"));
+}
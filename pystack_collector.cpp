@@ -0,0 +1,208 @@
+#include <Python.h>
+#include <frameobject.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pystack_collector.h"
+#include "smprofiler_config.h"
+#include "stack_table.h"
+
+#define PYSTACK_MAX_FRAMES (48)
+
+// GPU time of one kernel name under one Python stack
+struct KernelTime {
+  uint64_t count;
+  uint64_t total_ns;
+};
+
+static bool enabled = false;
+// every frame takes two words: the code object address, and the instruction
+// offset with the code's first line number above it, so that a code object
+// allocated where a freed one was is unlikely to share its stacks
+static StackTable stacks;
+static StackCorrelationMap correlations;
+
+// guards kernel_times and frame_names
+static std::mutex mutex;
+// python stack id -> kernel name -> time
+static std::unordered_map<uint32_t, std::unordered_map<std::string, KernelTime>> kernel_times;
+// python stack id -> frame names, outermost first
+static std::unordered_map<uint32_t, std::vector<std::string>> frame_names;
+static std::string callsite_path;
+static std::string folded_path;
+
+void pystack_init()
+{
+  enabled = smprofiler_config_flag("SMPROFILER_PYTHON_STACKS", false);
+#if PY_VERSION_HEX >= 0x030B0000
+  // 3.11 moved frames into the interpreter, they can no longer be read
+  // without holding the GIL
+  if (enabled) {
+    printf("Python stack capture is not supported on Python 3.11+\n");
+    enabled = false;
+  }
+#endif
+  callsite_path = smprofiler_config_string("SMPROFILER_PYTHON_CALLSITE_FILE", smprofiler_output_path("python_callsites.txt"));
+  folded_path = smprofiler_config_string("SMPROFILER_PYTHON_FOLDED_FILE", smprofiler_output_path("python_kernels.folded"));
+  if (enabled)
+    smprofiler_atexit(pystack_dump);
+}
+
+bool pystack_enabled()
+{
+  return enabled;
+}
+
+#if PY_VERSION_HEX < 0x030B0000
+// UTF-8 text of a str, read without the GIL: strings are immutable and this
+// one is kept alive by its code object
+static std::string unicode_text(PyObject* object)
+{
+  if (object == NULL || !PyUnicode_Check(object) || !PyUnicode_IS_READY(object))
+    return "?";
+  int kind = PyUnicode_KIND(object);
+  const void* data = PyUnicode_DATA(object);
+  std::string text;
+  for (Py_ssize_t i = 0; i < PyUnicode_GET_LENGTH(object); i++) {
+    Py_UCS4 c = PyUnicode_READ(kind, data, i);
+    if (c < 0x80) {
+      text.push_back((char) c);
+    } else if (c < 0x800) {
+      text.push_back((char) (0xc0 | (c >> 6)));
+      text.push_back((char) (0x80 | (c & 0x3f)));
+    } else if (c < 0x10000) {
+      text.push_back((char) (0xe0 | (c >> 12)));
+      text.push_back((char) (0x80 | ((c >> 6) & 0x3f)));
+      text.push_back((char) (0x80 | (c & 0x3f)));
+    } else {
+      text.push_back((char) (0xf0 | (c >> 18)));
+      text.push_back((char) (0x80 | ((c >> 12) & 0x3f)));
+      text.push_back((char) (0x80 | ((c >> 6) & 0x3f)));
+      text.push_back((char) (0x80 | (c & 0x3f)));
+    }
+  }
+  return text;
+}
+
+// only called while a frame of the calling thread holds code
+static std::string frame_name(PyCodeObject* code, int lasti)
+{
+  int offset = lasti;
+#if PY_VERSION_HEX >= 0x030A0000
+  // f_lasti counts code units since 3.10
+  offset *= sizeof(_Py_CODEUNIT);
+#endif
+  std::string name = unicode_text(code->co_filename) + ":" + unicode_text(code->co_name) + ":" +
+                     std::to_string(PyCode_Addr2Line(code, offset));
+  std::replace(name.begin(), name.end(), ';', ':');
+  return name;
+}
+#endif
+
+void pystack_capture(uint32_t correlation_id)
+{
+#if PY_VERSION_HEX < 0x030B0000
+  // looks up the thread state from thread local storage, no GIL needed. The
+  // frames of the calling thread can't change while it is inside the launch.
+  PyThreadState* tstate = PyGILState_GetThisThreadState();
+  if (tstate == NULL)
+    return;
+
+  uintptr_t frames[2 * PYSTACK_MAX_FRAMES];
+  int depth = 0;
+  for (PyFrameObject* frame = tstate->frame; frame != NULL && depth < 2 * PYSTACK_MAX_FRAMES; frame = frame->f_back) {
+    frames[depth++] = (uintptr_t) frame->f_code;
+    frames[depth++] = (uint32_t) frame->f_lasti | ((uint64_t) (uint32_t) frame->f_code->co_firstlineno << 32);
+  }
+  bool inserted = false;
+  uint32_t stack_id = stacks.Intern(frames, depth, &inserted);
+  if (stack_id == StackTable::INVALID_ID)
+    return;
+  if (inserted) {
+    // the code objects may be freed once the launch returns, name them now
+    std::vector<std::string> names;
+    for (int i = depth; i >= 2; i -= 2)
+      names.push_back(frame_name((PyCodeObject*) frames[i - 2], (int) (uint32_t) frames[i - 1]));
+    std::lock_guard<std::mutex> guard(mutex);
+    frame_names[stack_id] = std::move(names);
+  }
+  correlations.Set(correlation_id, stack_id);
+#endif
+}
+
+uint32_t pystack_lookup(uint32_t correlation_id)
+{
+  return correlations.Lookup(correlation_id);
+}
+
+void pystack_record_kernel(uint32_t correlation_id, const char* kernel_name, uint64_t duration_ns)
+{
+  if (!enabled)
+    return;
+  uint32_t stack_id = correlations.Lookup(correlation_id);
+  if (stack_id == StackTable::INVALID_ID)
+    return;
+
+  std::lock_guard<std::mutex> guard(mutex);
+  KernelTime& time = kernel_times[stack_id][kernel_name];
+  time.count++;
+  time.total_ns += duration_ns;
+}
+
+void pystack_dump()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (kernel_times.empty())
+    return;
+
+  smprofiler_create_parent_dirs(folded_path);
+  smprofiler_create_parent_dirs(callsite_path);
+  FILE* folded = fopen(folded_path.c_str(), "w");
+  FILE* callsites = fopen(callsite_path.c_str(), "w");
+  if (folded == NULL || callsites == NULL) {
+    printf("Error: could not open python stack output files\n");
+    if (folded) fclose(folded);
+    if (callsites) fclose(callsites);
+    return;
+  }
+
+  // innermost frame -> time, over all kernels launched from it
+  std::unordered_map<std::string, KernelTime> callsite_times;
+  for (auto& stack : kernel_times) {
+    auto named = frame_names.find(stack.first);
+    if (named == frame_names.end() || named->second.empty())
+      continue;
+    const std::vector<std::string>& names = named->second;
+    std::string prefix;
+    for (const std::string& name : names) {
+      prefix += name + ";";
+    }
+    KernelTime& callsite = callsite_times[names.back()];
+    for (auto& kernel : stack.second) {
+      fprintf(folded, "%s%s %llu\n", prefix.c_str(), kernel.first.c_str(),
+              (unsigned long long) kernel.second.total_ns);
+      callsite.count += kernel.second.count;
+      callsite.total_ns += kernel.second.total_ns;
+    }
+  }
+
+  std::vector<std::pair<std::string, KernelTime>> sorted(callsite_times.begin(), callsite_times.end());
+  std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, KernelTime>& a,
+                                             const std::pair<std::string, KernelTime>& b) {
+    return a.second.total_ns > b.second.total_ns;
+  });
+  fprintf(callsites, "%14s %10s  %s\n", "gpu_time_us", "kernels", "callsite");
+  for (auto& callsite : sorted) {
+    fprintf(callsites, "%14llu %10llu  %s\n", (unsigned long long) (callsite.second.total_ns / 1000),
+            (unsigned long long) callsite.second.count, callsite.first.c_str());
+  }
+
+  fclose(folded);
+  fclose(callsites);
+}
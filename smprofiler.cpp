@@ -1,8 +1,30 @@
 #include <Python.h>
+#include <pthread.h>
+#include "anomaly_detector.h"
+#include "control_channel.h"
 #include "cupti_tracer.h"
+#include "overhead_governor.h"
 #include "perf_collector.h"
+#include "pystack_collector.h"
+#include "smprofiler_timeline.h"
+#include "trace_index.h"
+#include "worker_monitor.h"
 
 static uint64_t perf_start[2];
+// the phase was started, not skipped because collection is disabled, the
+// overhead governor samples phases or the anomaly detector waits for one
+static bool phase_started = false;
+// nothing is traced before the first phase
+static bool tracer_paused = true;
+
+// Forked children, dataloader workers in particular, cannot use the CUDA
+// context of their parent: their phases only collect perf counters, which
+// reach the parent's timeline through the fork ring.
+static void after_fork_child()
+{
+  phase_started = false;
+  tracer_paused = true;
+}
 
 static PyObject* start(PyObject * self, PyObject * args)
 {
@@ -10,18 +32,57 @@ static PyObject* start(PyObject * self, PyObject * args)
   if (!PyArg_Parse(args, "s", &phase))
         return NULL;
 
+  if (Timeline::getInstance().IsForkedChild()) {
+    phase_started = true;
+    perf_init(phase);
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+
+  phase_started = anomaly_detector_trace_phase(phase) && control_channel_enabled() &&
+                  overhead_governor_trace_phase();
+  if (!phase_started) {
+    // activities stay enabled after a phase, nothing is traced until the
+    // next enabled one
+    if (!tracer_paused)
+      cupti_tracer_pause();
+    tracer_paused = true;
+    anomaly_detector_begin_phase(false);
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+
+  tracer_paused = false;
+
   //start perf collection
   perf_init(phase);
 
   //start cupti tracer
   cupti_tracer_init(phase);
 
+  anomaly_detector_begin_phase(true);
+
   Py_INCREF(Py_None);
   return Py_None;
 }
 
 static PyObject* stop(PyObject * self, PyObject * args)
 {
+  if (Timeline::getInstance().IsForkedChild()) {
+    if (phase_started)
+      perf_close();
+    phase_started = false;
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+
+  anomaly_detector_end_phase();
+  if (!phase_started) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  phase_started = false;
+
   // finalize cupti tracer
   cupti_tracer_close();
 
@@ -32,9 +93,43 @@ static PyObject* stop(PyObject * self, PyObject * args)
   return Py_None;
 }
 
+// query(path, start=-1, end=-1, phase="") returns the events of a timeline
+// file overlapping [start, end] (microseconds, -1 for open ended) of phase
+// as a JSON array, reading only the blocks an indexed file needs
+static PyObject* query(PyObject * self, PyObject * args, PyObject * kwargs)
+{
+  static const char* keywords[] = {"path", "start", "end", "phase", NULL};
+  char* path;
+  long long start = -1;
+  long long end = -1;
+  char* phase = (char*) "";
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|LLs", (char**) keywords, &path, &start, &end, &phase))
+    return NULL;
+
+  std::string json = "[";
+  int blocks_read;
+  Py_BEGIN_ALLOW_THREADS
+  TraceReader reader;
+  std::vector<std::string> events;
+  blocks_read = reader.Open(path) ? reader.Query(start, end, phase, events) : -1;
+  for (size_t i = 0; i < events.size(); i++) {
+    if (i > 0)
+      json += ",\n";
+    json += events[i];
+  }
+  json += "]";
+  Py_END_ALLOW_THREADS
+  if (blocks_read < 0) {
+    PyErr_Format(PyExc_IOError, "could not read %s", path);
+    return NULL;
+  }
+  return PyUnicode_FromStringAndSize(json.data(), json.size());
+}
+
 static PyMethodDef methods[] = {
     	 {"start", (PyCFunction) start, METH_O, NULL},
 	 {"stop", (PyCFunction) stop, METH_NOARGS, NULL},
+	 {"query", (PyCFunction) query, METH_VARARGS | METH_KEYWORDS, NULL},
 	{NULL,NULL,0,NULL}
 };
 
@@ -48,5 +143,9 @@ static PyModuleDef definitions = {
 
 PyMODINIT_FUNC PyInit_smprofiler() {
     PyObject *module = PyModule_Create(&definitions);
+    control_channel_init();
+    anomaly_detector_init();
+    worker_monitor_init();
+    pthread_atfork(NULL, NULL, after_fork_child);
     return module;
 }
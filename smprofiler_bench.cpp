@@ -0,0 +1,437 @@
+// Overhead benchmarks of the profiler pipeline. Every stage runs in its own
+// process (the timeline writer is a process wide singleton) and appends one
+// JSON line with its throughput and latency percentiles to the results file,
+// so runs can be compared against a stored baseline.
+//
+//   smprofiler_bench [--stage=<name>|all] [--events=N] [--threads=N] [--output=path]
+//
+// Stages: record_event, record_event_mt, writer, writer_async,
+// writer_pwritev, decode, raw_dump, perf, e2e, jitter, jitter_idle,
+// jitter_isolated. Link
+// against smprofiler.so and libcupti_replay.so so no GPU is needed.
+#include <stdio.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cupti_tracer.h"
+#include "perf_collector.h"
+#include "smprofiler_timeline.h"
+
+extern char** environ;
+
+struct BenchOptions {
+  std::string stage = "all";
+  std::string output = "bench_results.json";
+  long events = 200000;
+  int threads = 4;
+};
+
+static const char* STAGES[] = {"record_event", "record_event_mt", "writer", "writer_async", "writer_pwritev",
+                               "decode", "raw_dump", "perf", "e2e", "jitter", "jitter_idle", "jitter_isolated"};
+
+static uint64_t now_ns()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static uint64_t now_micros()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (1000000 * tv.tv_sec) + tv.tv_usec;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+  size_t index = (size_t) (p * (sorted.size() - 1));
+  return sorted[index];
+}
+
+// appends one result line, latencies may be empty for throughput only stages
+static void report(const BenchOptions& options, const char* stage, uint64_t events, uint64_t elapsed_ns,
+                   std::vector<uint64_t>& latencies, const std::string& extra = "")
+{
+  std::sort(latencies.begin(), latencies.end());
+  double seconds = elapsed_ns / 1e9;
+  double events_per_sec = seconds > 0 ? events / seconds : 0;
+  char line[1024];
+  snprintf(line, sizeof(line),
+           "{\"stage\": \"%s\", \"events\": %llu, \"seconds\": %.6f, \"events_per_sec\": %.1f, "
+           "\"p50_ns\": %llu, \"p90_ns\": %llu, \"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu%s}\n",
+           stage, (unsigned long long) events, seconds, events_per_sec,
+           (unsigned long long) percentile(latencies, 0.5), (unsigned long long) percentile(latencies, 0.9),
+           (unsigned long long) percentile(latencies, 0.99), (unsigned long long) percentile(latencies, 0.999),
+           (unsigned long long) (latencies.empty() ? 0 : latencies.back()), extra.c_str());
+
+  fprintf(stderr, "%s", line);
+  FILE* file = fopen(options.output.c_str(), "a");
+  if (file != NULL) {
+    fputs(line, file);
+    fclose(file);
+  }
+}
+
+static void wait_for_writer(Timeline& tl)
+{
+  while (tl.QueueDepth() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+}
+
+// latency of enqueuing one event from producer threads
+static void bench_record_event(const BenchOptions& options, int threads, const char* stage)
+{
+  Timeline& tl = Timeline::getInstance();
+  long per_thread = options.events / threads;
+  std::vector<std::vector<uint64_t>> thread_latencies(threads);
+  std::vector<std::thread> producers;
+
+  uint64_t start = now_ns();
+  for (int t = 0; t < threads; t++) {
+    producers.emplace_back([&, t]() {
+      std::vector<uint64_t>& latencies = thread_latencies[t];
+      latencies.reserve(per_thread);
+      for (long i = 0; i < per_thread; i++) {
+        uint64_t ts = now_micros();
+        uint64_t before = now_ns();
+        tl.SMRecordEvent("bench", "record_event", ts, 1);
+        latencies.push_back(now_ns() - before);
+      }
+    });
+  }
+  for (std::thread& producer : producers) {
+    producer.join();
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  std::vector<uint64_t> latencies;
+  for (auto& l : thread_latencies) {
+    latencies.insert(latencies.end(), l.begin(), l.end());
+  }
+  report(options, stage, per_thread * threads, elapsed, latencies, ", \"threads\": " + std::to_string(threads));
+  wait_for_writer(tl);
+}
+
+// timeline writer backend a stage runs with, NULL if it does not matter
+static const char* writer_backend(const std::string& stage)
+{
+  if (stage == "writer")
+    return "fstream";
+  if (stage == "writer_async")
+    return "async";
+  if (stage == "writer_pwritev")
+    return "pwritev";
+  return NULL;
+}
+
+// environment a stage has to start with, the profiler threads are created
+// and set up when smprofiler.so is loaded
+static std::vector<std::pair<const char*, const char*>> stage_environment(const std::string& stage)
+{
+  std::vector<std::pair<const char*, const char*>> environment;
+  if (writer_backend(stage) != NULL)
+    environment.emplace_back("SMPROFILER_TIMELINE_WRITER", writer_backend(stage));
+  // the stepping loop runs on CPU 0
+  if (stage == "jitter" || stage == "jitter_idle")
+    environment.emplace_back("SMPROFILER_THREAD_CPUS", "0");
+  if (stage == "jitter_idle")
+    environment.emplace_back("SMPROFILER_THREAD_SCHED", "idle");
+  if (stage == "jitter_isolated")
+    environment.emplace_back("SMPROFILER_THREAD_CPUS", "1");
+  return environment;
+}
+
+// events per second the writer thread formats and writes
+static void bench_writer(const BenchOptions& options)
+{
+  Timeline& tl = Timeline::getInstance();
+  wait_for_writer(tl);
+  uint64_t start = now_ns();
+  for (long i = 0; i < options.events; i++) {
+    tl.SMRecordEvent("bench", "writer", now_micros(), 1);
+  }
+  wait_for_writer(tl);
+  std::vector<uint64_t> none;
+  report(options, options.stage.c_str(), options.events, now_ns() - start, none);
+}
+
+// records per second through bufferCompleted, with latency per buffer, raw
+// capture mode only appends the buffers to the dump file
+static void bench_decode(const BenchOptions& options, const char* stage)
+{
+  if (strcmp(stage, "raw_dump") == 0)
+    setenv("SMPROFILER_RAW_DUMP", "1", 1);
+  // no synthetic workload, buffers are fed by hand
+  setenv("SMPROFILER_SHIM_KERNEL_RATE", "0", 1);
+  setenv("SMPROFILER_SHIM_MEMCPY_RATE", "0", 1);
+  setenv("SMPROFILER_SHIM_MEMSET_RATE", "0", 1);
+  setenv("SMPROFILER_SHIM_SYNC_RATE", "0", 1);
+  char phase[] = "bench";
+  cupti_tracer_init(phase);
+  // print_activity writes every record to stdout
+  if (freopen("/dev/null", "w", stdout) == NULL)
+    return;
+
+  std::vector<uint64_t> latencies;
+  long decoded = 0;
+  uint64_t start = now_ns();
+  uint64_t ts = now_micros() * 1000;
+  while (decoded < options.events) {
+    uint8_t* buffer;
+    size_t size, max_records;
+    bufferRequested(&buffer, &size, &max_records);
+    size_t used = 0;
+    while (used + 2 * sizeof(CUpti_ActivityKernel3) <= size && decoded < options.events) {
+      CUpti_ActivityKernel3* kernel = (CUpti_ActivityKernel3*) (buffer + used);
+      memset(kernel, 0, sizeof(*kernel));
+      kernel->kind = CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL;
+      kernel->start = ts;
+      kernel->end = ts + 5000;
+      kernel->correlationId = decoded + 1;
+      kernel->name = "bench_kernel";
+      used += (sizeof(CUpti_ActivityKernel3) + 7) & ~(size_t) 7;
+      ts += 6000;
+      decoded++;
+    }
+    uint64_t before = now_ns();
+    bufferCompleted(NULL, 0, buffer, size, used);
+    latencies.push_back(now_ns() - before);
+  }
+  uint64_t elapsed = now_ns() - start;
+  report(options, stage, decoded, elapsed, latencies, ", \"latency_unit\": \"buffer\"");
+  wait_for_writer(Timeline::getInstance());
+}
+
+// cost of one perf_init / perf_close pair
+static void bench_perf(const BenchOptions& options)
+{
+  std::vector<uint64_t> latencies;
+  long iterations = std::min(options.events, 10000L);
+  char phase[] = "bench";
+  if (freopen("/dev/null", "w", stdout) == NULL)
+    return;
+  uint64_t start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    uint64_t before = now_ns();
+    if (perf_init(phase) != 0) {
+      fprintf(stderr, "perf: perf_event_open is not permitted, skipping\n");
+      return;
+    }
+    perf_close();
+    latencies.push_back(now_ns() - before);
+  }
+  report(options, "perf", iterations, now_ns() - start, latencies);
+  wait_for_writer(Timeline::getInstance());
+}
+
+// kernels per second of the synthetic workload, rate unless configured
+static long synthetic_kernel_rate(long rate)
+{
+  const char* configured = getenv("SMPROFILER_SHIM_KERNEL_RATE");
+  if (configured == NULL)
+    setenv("SMPROFILER_SHIM_KERNEL_RATE", std::to_string(rate).c_str(), 1);
+  else
+    rate = atol(configured);
+  return rate;
+}
+
+static void stop_synthetic_workload()
+{
+  cuptiActivityDisable(CUPTI_ACTIVITY_KIND_RUNTIME);
+  cuptiActivityDisable(CUPTI_ACTIVITY_KIND_CONCURRENT_KERNEL);
+  cuptiActivityDisable(CUPTI_ACTIVITY_KIND_MEMCPY);
+  cuptiActivityDisable(CUPTI_ACTIVITY_KIND_MEMSET);
+  cuptiActivityDisable(CUPTI_ACTIVITY_KIND_SYNCHRONIZATION);
+  cupti_tracer_close();
+}
+
+// synthetic kernels from the shim through decode, timeline and file
+static void bench_e2e(const BenchOptions& options)
+{
+  long rate = synthetic_kernel_rate(200000);
+  if (freopen("/dev/null", "w", stdout) == NULL)
+    return;
+
+  Timeline& tl = Timeline::getInstance();
+  char phase[] = "bench";
+  double seconds = std::max(1.0, (double) options.events / rate);
+  size_t max_depth = 0;
+
+  uint64_t start = now_ns();
+  cupti_tracer_init(phase);
+  while (now_ns() - start < seconds * 1e9) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    max_depth = std::max(max_depth, tl.QueueDepth());
+  }
+  // stop the synthetic workload so the writer can drain
+  stop_synthetic_workload();
+  uint64_t stop = now_ns();
+  wait_for_writer(tl);
+  uint64_t drained = now_ns();
+
+  // every synthetic launch produces a runtime API and a kernel event
+  uint64_t events = 2 * (uint64_t) (rate * ((stop - start) / 1e9));
+  std::vector<uint64_t> none;
+  report(options, "e2e", events, drained - start, none,
+         ", \"requested_kernels_per_sec\": " + std::to_string(rate) +
+         ", \"drain_seconds\": " + std::to_string((drained - stop) / 1e9) +
+         ", \"max_queue_depth\": " + std::to_string(max_depth));
+}
+
+static uint64_t spin(uint64_t iterations)
+{
+  volatile uint64_t x = 0;
+  for (uint64_t i = 0; i < iterations; i++)
+    x = x * 31 + i;
+  return x;
+}
+
+// Step times of a CPU bound loop on CPU 0, standing in for the training
+// loop, while the profiler traces synthetic kernels. The jitter stages only
+// differ in where and how the profiler threads are scheduled: on the
+// step's CPU, there with SCHED_IDLE, or on another CPU.
+static void bench_jitter(const BenchOptions& options, const char* stage)
+{
+  if (strcmp(stage, "jitter_isolated") == 0 && sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+    fprintf(stderr, "%s: needs a second CPU, skipping\n", stage);
+    return;
+  }
+  long rate = synthetic_kernel_rate(100000);
+  if (freopen("/dev/null", "w", stdout) == NULL)
+    return;
+
+  // about 1ms of work per step, measured before tracing starts
+  uint64_t iterations = 1000000;
+  uint64_t before = now_ns();
+  spin(iterations);
+  iterations = iterations * 1000000 / std::max<uint64_t>(now_ns() - before, 1);
+
+  char phase[] = "bench";
+  cupti_tracer_init(phase);
+  // after the tracer started, its threads do not inherit the affinity
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(0, &cpus);
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+
+  long steps = std::min(options.events, 2000L);
+  std::vector<uint64_t> latencies;
+  uint64_t start = now_ns();
+  for (long i = 0; i < steps; i++) {
+    before = now_ns();
+    spin(iterations);
+    latencies.push_back(now_ns() - before);
+  }
+  uint64_t elapsed = now_ns() - start;
+  stop_synthetic_workload();
+
+  double mean = 0;
+  for (uint64_t latency : latencies)
+    mean += latency;
+  mean /= latencies.size();
+  double variance = 0;
+  for (uint64_t latency : latencies)
+    variance += (latency - mean) * (latency - mean);
+  double stddev = std::sqrt(variance / latencies.size());
+  report(options, stage, steps, elapsed, latencies,
+         ", \"latency_unit\": \"step\", \"requested_kernels_per_sec\": " + std::to_string(rate) +
+         ", \"mean_ns\": " + std::to_string((uint64_t) mean) + ", \"stddev_ns\": " + std::to_string((uint64_t) stddev));
+  wait_for_writer(Timeline::getInstance());
+}
+
+static int run_stage(const BenchOptions& options)
+{
+  const std::string& stage = options.stage;
+  if (stage == "record_event")
+    bench_record_event(options, 1, "record_event");
+  else if (stage == "record_event_mt")
+    bench_record_event(options, options.threads, "record_event_mt");
+  else if (writer_backend(stage) != NULL)
+    bench_writer(options);
+  else if (stage == "decode" || stage == "raw_dump")
+    bench_decode(options, stage.c_str());
+  else if (stage == "perf")
+    bench_perf(options);
+  else if (stage == "e2e")
+    bench_e2e(options);
+  else if (stage == "jitter" || stage == "jitter_idle" || stage == "jitter_isolated")
+    bench_jitter(options, stage.c_str());
+  else {
+    fprintf(stderr, "unknown stage %s\n", stage.c_str());
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char** argv)
+{
+  BenchOptions options;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg.rfind("--stage=", 0) == 0)
+      options.stage = arg.substr(8);
+    else if (arg.rfind("--events=", 0) == 0)
+      options.events = atol(arg.c_str() + 9);
+    else if (arg.rfind("--threads=", 0) == 0)
+      options.threads = atoi(arg.c_str() + 10);
+    else if (arg.rfind("--output=", 0) == 0)
+      options.output = arg.substr(9);
+    else {
+      fprintf(stderr, "usage: %s [--stage=<name>|all] [--events=N] [--threads=N] [--output=path]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if (options.stage != "all") {
+    // the timeline writer is set up when smprofiler.so is loaded, restart
+    // with the stage's settings in the environment
+    bool restart = false;
+    for (auto& setting : stage_environment(options.stage)) {
+      const char* configured = getenv(setting.first);
+      if (configured == NULL || strcmp(configured, setting.second) != 0) {
+        setenv(setting.first, setting.second, 1);
+        restart = true;
+      }
+    }
+    if (restart) {
+      execv("/proc/self/exe", argv);
+      perror("execv");
+      return 1;
+    }
+    return run_stage(options);
+  }
+
+  // one fresh process per stage
+  int failed = 0;
+  for (const char* stage : STAGES) {
+    std::string stage_arg = std::string("--stage=") + stage;
+    std::string events_arg = "--events=" + std::to_string(options.events);
+    std::string threads_arg = "--threads=" + std::to_string(options.threads);
+    std::string output_arg = "--output=" + options.output;
+    char* child_argv[] = {argv[0], (char*) stage_arg.c_str(), (char*) events_arg.c_str(),
+                          (char*) threads_arg.c_str(), (char*) output_arg.c_str(), NULL};
+    pid_t pid;
+    if (posix_spawn(&pid, "/proc/self/exe", NULL, NULL, child_argv, environ) != 0) {
+      perror("posix_spawn");
+      return 1;
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed++;
+  }
+  return failed ? 1 : 0;
+}
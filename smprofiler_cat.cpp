@@ -0,0 +1,30 @@
+// Prints timeline files to stdout, decompressing the zstd and LZ4 files
+// written with SMPROFILER_TIMELINE_COMPRESSION, so they can be piped into
+// tools that expect plain JSON.
+//
+//   smprofiler_cat <timeline file>...
+#include <stdio.h>
+#include <string>
+
+#include "compressed_trace_file.h"
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <timeline file>...\n", argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  std::string contents;
+  for (int i = 1; i < argc; i++) {
+    // like zcat, what precedes a truncated frame is still printed
+    bool ok = trace_file_read(argv[i], contents);
+    fwrite(contents.data(), 1, contents.size(), stdout);
+    if (!ok) {
+      fprintf(stderr, "could not read %s\n", argv[i]);
+      failed++;
+    }
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <mutex>
+#include "smprofiler_config.h"
+
+#define EXIT_HOOKS_MAX (32)
+
+struct ExitHook {
+  void (*hook)();
+  pid_t pid;
+};
+
+static std::mutex exit_hooks_mutex;
+static ExitHook exit_hooks[EXIT_HOOKS_MAX];
+static int num_exit_hooks = 0;
+
+bool smprofiler_config_flag(const char* name, bool default_value)
+{
+  const char* value = getenv(name);
+  if (value == NULL || *value == '\0')
+    return default_value;
+  return strcmp(value, "0") != 0 && strcasecmp(value, "false") != 0 && strcasecmp(value, "off") != 0;
+}
+
+long smprofiler_config_int(const char* name, long default_value)
+{
+  const char* value = getenv(name);
+  if (value == NULL || *value == '\0')
+    return default_value;
+  char* end;
+  long parsed = strtol(value, &end, 0);
+  return (*end == '\0') ? parsed : default_value;
+}
+
+std::string smprofiler_config_string(const char* name, const std::string& default_value)
+{
+  const char* value = getenv(name);
+  if (value == NULL || *value == '\0')
+    return default_value;
+  return value;
+}
+
+std::string smprofiler_output_path(const std::string& name)
+{
+  std::string directory = smprofiler_config_string("SMPROFILER_OUTPUT_DIR", "/tmp/framework");
+  return directory + "/" + std::to_string(getpid()) + "_" + name;
+}
+
+void smprofiler_create_parent_dirs(const std::string& path)
+{
+  // every prefix ending in a slash, existing ones fail harmlessly
+  for (size_t pos = path.find('/', 1); pos != std::string::npos; pos = path.find('/', pos + 1))
+    mkdir(path.substr(0, pos).c_str(), 0755);
+}
+
+// registered with atexit once, runs the hooks of this process in reverse order
+static void run_exit_hooks()
+{
+  pid_t pid = getpid();
+  for (int i = num_exit_hooks - 1; i >= 0; i--) {
+    if (exit_hooks[i].pid == pid)
+      exit_hooks[i].hook();
+  }
+}
+
+void smprofiler_atexit(void (*hook)())
+{
+  std::lock_guard<std::mutex> guard(exit_hooks_mutex);
+  if (num_exit_hooks == EXIT_HOOKS_MAX) {
+    printf("Error: too many exit hooks, one will not run\n");
+    return;
+  }
+  if (num_exit_hooks == 0)
+    atexit(run_exit_hooks);
+  exit_hooks[num_exit_hooks++] = ExitHook{hook, getpid()};
+}
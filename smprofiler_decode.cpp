@@ -0,0 +1,146 @@
+// Offline decoder for raw activity dumps written with SMPROFILER_RAW_DUMP=1
+// (see activity_dump.h). Every buffer is decoded exactly as bufferCompleted
+// would have done during training: records are printed, put on the timeline
+// and fed to the collectors enabled through the usual SMPROFILER_*
+// variables, phase by phase.
+//
+//   smprofiler_decode <dump>...
+//
+// The dump must be decoded with the CUPTI version it was recorded with.
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <thread>
+
+#include "activity_dump.h"
+#include "cupti_tracer.h"
+#include "smprofiler_timeline.h"
+
+// phase names stay alive for the whole run, collectors keep the pointer
+static std::deque<std::string> phase_names;
+static bool phase_open = false;
+static ActivityDumpStrings strings;
+
+static void begin_phase(const std::string& name, uint64_t start_timestamp)
+{
+  if (phase_open)
+    cupti_tracer_decode_end();
+  phase_names.push_back(name);
+  cupti_tracer_decode_begin((char*) phase_names.back().c_str(), start_timestamp);
+  phase_open = true;
+}
+
+static void end_phase()
+{
+  if (phase_open)
+    cupti_tracer_decode_end();
+  phase_open = false;
+}
+
+static bool decode_dump(const char* path, uint8_t* buffer, size_t buffer_size)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "could not open %s\n", path);
+    return false;
+  }
+
+  ActivityDumpHeader header;
+  bool sizes_known = false;
+  bool ok = true;
+  while (fread(&header, sizeof(header), 1, file) == 1) {
+    if (header.magic != ACTIVITY_DUMP_MAGIC || header.valid_size > buffer_size) {
+      fprintf(stderr, "%s: corrupt entry at offset %ld\n", path, ftell(file) - (long) sizeof(header));
+      ok = false;
+      break;
+    }
+    uint64_t padded_size = activity_dump_padded_size(header.valid_size);
+    if (fread(buffer, 1, padded_size, file) != padded_size) {
+      fprintf(stderr, "%s: truncated entry\n", path);
+      ok = false;
+      break;
+    }
+
+    switch (header.type) {
+    case ACTIVITY_DUMP_PHASE_START:
+      begin_phase(std::string((const char*) buffer, header.valid_size), header.context);
+      break;
+    case ACTIVITY_DUMP_PHASE_END:
+      end_phase();
+      break;
+    case ACTIVITY_DUMP_STRING:
+      strings.Add(header.context, (const char*) buffer, header.valid_size);
+      break;
+    case ACTIVITY_DUMP_RECORD_SIZES:
+      // only the replay shim walks buffers with sizes other than its own
+      if (cupti_shim_set_record_size == NULL)
+        break;
+      for (uint64_t offset = 0; offset + sizeof(ActivityDumpRecordSize) <= header.valid_size;
+           offset += sizeof(ActivityDumpRecordSize)) {
+        const ActivityDumpRecordSize* size = (const ActivityDumpRecordSize*) (buffer + offset);
+        if (cupti_shim_set_record_size(size->kind, size->size) != 0) {
+          fprintf(stderr, "%s: records of kind %u are %u bytes, smaller than the CUPTI %u struct\n",
+                  path, size->kind, size->size, CUPTI_API_VERSION);
+          ok = false;
+          break;
+        }
+      }
+      sizes_known = true;
+      break;
+    case ACTIVITY_DUMP_BUFFER:
+      // a buffer walked with other structs than it was written with misparses
+      if (header.cupti_version != CUPTI_API_VERSION && !(sizes_known && cupti_shim_set_record_size != NULL)) {
+        fprintf(stderr, "%s: recorded with CUPTI API version %u, cannot decode with %u\n",
+                path, header.cupti_version, CUPTI_API_VERSION);
+        ok = false;
+        break;
+      }
+      // buffers from before the first phase mark, e.g. a dump cut short
+      if (!phase_open)
+        begin_phase("unknown", 0);
+      strings.Patch(buffer, header.valid_size);
+      cupti_tracer_decode(buffer, header.valid_size);
+      break;
+    default:
+      fprintf(stderr, "%s: skipping entry of unknown type %u\n", path, header.type);
+      break;
+    }
+    if (!ok)
+      break;
+  }
+  end_phase();
+  fclose(file);
+  return ok;
+}
+
+int main(int argc, char** argv)
+{
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <dump>...\n", argv[0]);
+    return 1;
+  }
+
+  // large enough for any buffer the tracer hands to CUPTI
+  size_t buffer_size = 64 * 1024 * 1024;
+  uint8_t* buffer;
+  if (posix_memalign((void**) &buffer, ACTIVITY_DUMP_ALIGN, buffer_size) != 0) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+
+  int failed = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!decode_dump(argv[i], buffer, buffer_size))
+      failed++;
+  }
+  free(buffer);
+
+  // let the writer thread drain before the timeline is closed
+  Timeline& tl = Timeline::getInstance();
+  while (tl.QueueDepth() > 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,530 @@
+// Compares two runs, e.g. before and after a PyTorch, CUDA or model
+// upgrade, and reports the phases, kernels and memcpys that got slower or
+// faster, more or less frequent, or copy more or fewer bytes. Inputs are
+// JSON timeline files (plain, compressed or indexed, held in memory one
+// block or, without an index, one TRACE_FILE_CHUNK_SIZE chunk at a time;
+// Perfetto timelines are not accepted) or the folded GPU time profiles of
+// SMPROFILER_GPU_PROFILE; several files per side, such as the timelines of
+// all ranks, are added up. Entries are
+// joined by hash on
+//  * phases: the name, one step per "perf" span of the phase
+//  * kernels: phase, name and launch config (grid and block)
+//  * memcpys: phase and copy kind
+// Durations are compared with Welch's t-test on the per step, per launch or
+// per copy durations; counts and bytes, which hardly vary between steps,
+// are compared per step. A change is reported when it is at least
+// --min-change percent and, for durations, its p-value is below --alpha.
+//
+//   smprofiler_diff [--alpha 0.01] [--min-change 5] [--top 50] [--all] [--json]
+//                   --baseline <file>... --candidate <file>...
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "trace_index.h"
+
+// running mean and variance, Welford's method
+struct Moments {
+  uint64_t count = 0;
+  double mean = 0;
+  double m2 = 0;
+
+  void Add(double x)
+  {
+    count++;
+    double delta = x - mean;
+    mean += delta / count;
+    m2 += delta * (x - mean);
+  }
+  double Variance() const { return count > 1 ? m2 / (count - 1) : 0; }
+};
+
+struct EntryStats {
+  std::string kind;
+  std::string phase;
+  std::string name;
+  // grid and block of kernels, "" otherwise
+  std::string config;
+  // durations in microseconds, of steps for phases
+  Moments time_us;
+  double total_us = 0;
+  double total_bytes = 0;
+};
+
+struct RunStats {
+  std::vector<const char*> paths;
+  std::unordered_map<std::string, EntryStats> entries;
+  // steps of every phase, the number of its "perf" spans
+  std::unordered_map<std::string, uint64_t> steps;
+  uint64_t events = 0;
+};
+
+// The value of the first "key": in an event, as written, without quotes for
+// strings. Top level fields come before args, and the timeline writer puts
+// a space after the colon of top level fields only.
+static bool event_field(const std::string& event, const char* key, std::string& value)
+{
+  size_t pos = event.find(key);
+  if (pos == std::string::npos)
+    return false;
+  pos += strlen(key);
+  while (pos < event.size() && (event[pos] == ' ' || event[pos] == ':'))
+    pos++;
+  if (pos < event.size() && event[pos] == '"') {
+    value.clear();
+    for (pos++; pos < event.size() && event[pos] != '"'; pos++) {
+      if (event[pos] == '\\' && pos + 1 < event.size())
+        pos++;
+      value.push_back(event[pos]);
+    }
+    return true;
+  }
+  size_t end = event.find_first_of(",}", pos);
+  value = event.substr(pos, end == std::string::npos ? std::string::npos : end - pos);
+  return true;
+}
+
+static EntryStats& entry(RunStats& run, const char* kind, const std::string& phase, const std::string& name,
+                         const std::string& config)
+{
+  std::string key = std::string(kind) + '\x1f' + phase + '\x1f' + name + '\x1f' + config;
+  auto found = run.entries.find(key);
+  if (found != run.entries.end())
+    return found->second;
+  EntryStats& stats = run.entries[key];
+  stats.kind = kind;
+  stats.phase = phase;
+  stats.name = name;
+  stats.config = config;
+  return stats;
+}
+
+// the phase tracks of a timeline file, by pid
+struct TimelineState {
+  std::unordered_map<std::string, std::string> phases;
+};
+
+static void add_event(RunStats& run, TimelineState& state, const std::string& event)
+{
+  std::string ph, name, pid;
+  if (!event_field(event, "\"ph\"", ph) || !event_field(event, "\"name\"", name) ||
+      !event_field(event, "\"pid\"", pid))
+    return;
+  if (ph == "M") {
+    std::string phase;
+    if (name == "process_name" && event_field(event, "\"args\": {\"name\"", phase))
+      state.phases[pid] = phase;
+    return;
+  }
+  std::string dur;
+  if (ph != "X" || !event_field(event, "\"dur\"", dur))
+    return;
+  auto track = state.phases.find(pid);
+  if (track == state.phases.end())
+    return;
+  const std::string& phase = track->second;
+  double duration_us = atof(dur.c_str());
+  run.events++;
+
+  const char* kind = NULL;
+  std::string config, value;
+  if (phase == "perf") {
+    // the span of a whole step of the phase it is named after
+    run.steps[name]++;
+    EntryStats& stats = entry(run, "phase", name, name, "");
+    stats.time_us.Add(duration_us);
+    stats.total_us += duration_us;
+    return;
+  } else if (name.compare(0, 7, "memcpy_") == 0) {
+    kind = "memcpy";
+  } else if (event_field(event, "\"grid\"", value)) {
+    kind = "kernel";
+    config = "grid " + value;
+    if (event_field(event, "\"block\"", value))
+      config += " block " + value;
+  } else if (name != "DRIVER" && name != "RUNTIME" && event.find("\"correlation_id\"") != std::string::npos) {
+    // kernels of timelines written before launch configs were recorded
+    kind = "kernel";
+  } else {
+    return;
+  }
+  EntryStats& stats = entry(run, kind, phase, name, config);
+  stats.time_us.Add(duration_us);
+  stats.total_us += duration_us;
+  if (event_field(event, "\"bytes\"", value))
+    stats.total_bytes += atof(value.c_str());
+}
+
+static bool read_timeline(RunStats& run, const char* path)
+{
+  TraceReader reader;
+  if (!reader.Open(path))
+    return false;
+  TimelineState state;
+  return reader.Scan([&](const std::string& event) { add_event(run, state, event); }) >= 0;
+}
+
+// "phase;op;name gpu_ns" lines, one per phase and window: each line is one
+// sample of the window's GPU time
+static bool read_folded(RunStats& run, const char* path)
+{
+  std::ifstream file(path);
+  if (!file)
+    return false;
+  std::string line;
+  while (std::getline(file, line)) {
+    size_t space = line.rfind(' ');
+    size_t first = line.find(';');
+    size_t second = first == std::string::npos ? std::string::npos : line.find(';', first + 1);
+    if (space == std::string::npos || second == std::string::npos || second > space)
+      continue;
+    std::string op = line.substr(first + 1, second - first - 1);
+    const char* kind = op == "kernel" ? "kernel" : op == "memcpy" ? "memcpy" : "memset";
+    double duration_us = atof(line.c_str() + space + 1) / 1000;
+    EntryStats& stats = entry(run, kind, line.substr(0, first), line.substr(second + 1, space - second - 1), "");
+    stats.time_us.Add(duration_us);
+    stats.total_us += duration_us;
+    run.events++;
+  }
+  return true;
+}
+
+static bool ends_with(const char* text, const char* suffix)
+{
+  size_t length = strlen(text);
+  size_t suffix_length = strlen(suffix);
+  return length >= suffix_length && strcmp(text + length - suffix_length, suffix) == 0;
+}
+
+static bool read_run(RunStats& run)
+{
+  for (const char* path : run.paths) {
+    if (strstr(path, ".perfetto-trace") != NULL) {
+      fprintf(stderr, "%s is a Perfetto trace, only JSON timelines can be compared\n", path);
+      return false;
+    }
+    if (!(ends_with(path, ".folded") ? read_folded(run, path) : read_timeline(run, path))) {
+      fprintf(stderr, "could not read %s\n", path);
+      return false;
+    }
+  }
+  return true;
+}
+
+// continued fraction of the regularized incomplete beta function, from
+// Numerical Recipes
+static double beta_fraction(double a, double b, double x)
+{
+  const double tiny = 1e-300;
+  double c = 1;
+  double d = 1 - (a + b) * x / (a + 1);
+  d = 1 / (fabs(d) < tiny ? tiny : d);
+  double h = d;
+  for (int m = 1; m <= 300; m++) {
+    double m2 = 2 * m;
+    double coefficient = m * (b - m) * x / ((a + m2 - 1) * (a + m2));
+    d = 1 + coefficient * d;
+    d = 1 / (fabs(d) < tiny ? tiny : d);
+    c = 1 + coefficient / c;
+    c = fabs(c) < tiny ? tiny : c;
+    h *= d * c;
+    coefficient = -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1));
+    d = 1 + coefficient * d;
+    d = 1 / (fabs(d) < tiny ? tiny : d);
+    c = 1 + coefficient / c;
+    c = fabs(c) < tiny ? tiny : c;
+    double step = d * c;
+    h *= step;
+    if (fabs(step - 1) < 1e-12)
+      break;
+  }
+  return h;
+}
+
+static double incomplete_beta(double a, double b, double x)
+{
+  if (x <= 0)
+    return 0;
+  if (x >= 1)
+    return 1;
+  double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1 - x));
+  if (x < (a + 1) / (a + b + 2))
+    return front * beta_fraction(a, b, x) / a;
+  return 1 - front * beta_fraction(b, a, 1 - x) / b;
+}
+
+// two sided p-value of Welch's t-test, NAN when a side has fewer than two
+// samples
+static double welch_p_value(const Moments& a, const Moments& b)
+{
+  if (a.count < 2 || b.count < 2)
+    return NAN;
+  double va = a.Variance() / a.count;
+  double vb = b.Variance() / b.count;
+  if (va + vb == 0)
+    return a.mean == b.mean ? 1 : 0;
+  double t = (b.mean - a.mean) / sqrt(va + vb);
+  double df = (va + vb) * (va + vb) / (va * va / (a.count - 1) + vb * vb / (b.count - 1));
+  return incomplete_beta(df / 2, 0.5, df / (df + t * t));
+}
+
+static double percent_change(double before, double after)
+{
+  if (before == 0)
+    return after == 0 ? 0 : INFINITY;
+  return 100 * (after - before) / before;
+}
+
+struct DiffOptions {
+  double alpha = 0.01;
+  double min_change = 5;
+  size_t top = 50;
+  bool all = false;
+  bool json = false;
+};
+
+// an entry of both runs, or of one with the other side empty
+struct DiffRow {
+  const EntryStats* baseline;
+  const EntryStats* candidate;
+  double baseline_steps;
+  double candidate_steps;
+  double p_value;
+  double time_change;
+  double count_change;
+  double bytes_change;
+  bool time_significant;
+  bool count_significant;
+  bool bytes_significant;
+  // change of the time per step, to rank by impact
+  double impact_us;
+};
+
+static const EntryStats& any(const DiffRow& row)
+{
+  return row.baseline ? *row.baseline : *row.candidate;
+}
+
+// per step values of a side, whole totals when the phase has no steps
+static double steps_of(const RunStats& run, const std::string& phase)
+{
+  auto found = run.steps.find(phase);
+  return found == run.steps.end() || found->second == 0 ? 1 : (double) found->second;
+}
+
+static DiffRow compare(const EntryStats* baseline, const EntryStats* candidate, const RunStats& baseline_run,
+                       const RunStats& candidate_run, const DiffOptions& options)
+{
+  static const EntryStats empty;
+  DiffRow row;
+  row.baseline = baseline;
+  row.candidate = candidate;
+  const EntryStats& a = baseline ? *baseline : empty;
+  const EntryStats& b = candidate ? *candidate : empty;
+  const std::string& phase = any(row).phase;
+  row.baseline_steps = steps_of(baseline_run, phase);
+  row.candidate_steps = steps_of(candidate_run, phase);
+
+  row.p_value = welch_p_value(a.time_us, b.time_us);
+  row.time_change = percent_change(a.time_us.mean, b.time_us.mean);
+  row.count_change = percent_change(a.time_us.count / row.baseline_steps, b.time_us.count / row.candidate_steps);
+  row.bytes_change = percent_change(a.total_bytes / row.baseline_steps, b.total_bytes / row.candidate_steps);
+  row.time_significant = fabs(row.time_change) >= options.min_change && row.p_value < options.alpha;
+  // a phase has one step per step, only its duration can change
+  row.count_significant = any(row).kind != "phase" && fabs(row.count_change) >= options.min_change;
+  row.bytes_significant = fabs(row.bytes_change) >= options.min_change;
+  row.impact_us = b.total_us / row.candidate_steps - a.total_us / row.baseline_steps;
+  return row;
+}
+
+static std::string json_string(const std::string& text)
+{
+  std::string quoted = "\"";
+  for (char c : text) {
+    if (c == '"' || c == '\\') {
+      quoted.push_back('\\');
+      quoted.push_back(c);
+    } else if ((unsigned char) c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      quoted += escape;
+    } else {
+      quoted.push_back(c);
+    }
+  }
+  return quoted + "\"";
+}
+
+// JSON has no NaN or infinity
+static std::string json_number(double value)
+{
+  if (!isfinite(value))
+    return "null";
+  char text[32];
+  snprintf(text, sizeof(text), "%.6g", value);
+  return text;
+}
+
+static std::string json_side(const EntryStats* stats, double steps)
+{
+  if (stats == NULL)
+    return "null";
+  return "{\"count\": " + std::to_string(stats->time_us.count) +
+         ", \"per_step\": " + json_number(stats->time_us.count / steps) +
+         ", \"mean_us\": " + json_number(stats->time_us.mean) +
+         ", \"stddev_us\": " + json_number(sqrt(stats->time_us.Variance())) +
+         ", \"total_us\": " + json_number(stats->total_us) +
+         ", \"bytes\": " + json_number(stats->total_bytes) + "}";
+}
+
+static void print_json(const std::vector<DiffRow>& rows, const RunStats& baseline, const RunStats& candidate,
+                       const DiffOptions& options)
+{
+  printf("{\"alpha\": %s, \"min_change_percent\": %s,\n", json_number(options.alpha).c_str(),
+         json_number(options.min_change).c_str());
+  const RunStats* runs[] = {&baseline, &candidate};
+  const char* names[] = {"baseline", "candidate"};
+  for (int i = 0; i < 2; i++) {
+    printf("\"%s\": {\"events\": %llu, \"files\": [", names[i], (unsigned long long) runs[i]->events);
+    for (size_t j = 0; j < runs[i]->paths.size(); j++)
+      printf("%s%s", j ? ", " : "", json_string(runs[i]->paths[j]).c_str());
+    printf("]},\n");
+  }
+  printf("\"entries\": [");
+  for (size_t i = 0; i < rows.size(); i++) {
+    const DiffRow& row = rows[i];
+    const EntryStats& stats = any(row);
+    std::string significant;
+    if (row.time_significant)
+      significant += "\"time\"";
+    if (row.count_significant)
+      significant += std::string(significant.empty() ? "" : ", ") + "\"count\"";
+    if (row.bytes_significant)
+      significant += std::string(significant.empty() ? "" : ", ") + "\"bytes\"";
+    printf("%s\n{\"kind\": \"%s\", \"phase\": %s, \"name\": %s, \"config\": %s, \"baseline\": %s, \"candidate\": %s, "
+           "\"time_change_percent\": %s, \"p_value\": %s, \"count_change_percent\": %s, "
+           "\"bytes_change_percent\": %s, \"impact_us_per_step\": %s, \"significant\": [%s]}",
+           i ? "," : "", stats.kind.c_str(), json_string(stats.phase).c_str(), json_string(stats.name).c_str(),
+           json_string(stats.config).c_str(), json_side(row.baseline, row.baseline_steps).c_str(),
+           json_side(row.candidate, row.candidate_steps).c_str(), json_number(row.time_change).c_str(),
+           json_number(row.p_value).c_str(), json_number(row.count_change).c_str(),
+           json_number(row.bytes_change).c_str(), json_number(row.impact_us).c_str(), significant.c_str());
+  }
+  printf("\n]}\n");
+}
+
+static std::string percent_text(double change)
+{
+  if (!isfinite(change))
+    return "new";
+  char text[32];
+  snprintf(text, sizeof(text), "%+.1f%%", change);
+  return text;
+}
+
+static void print_text(const std::vector<DiffRow>& rows, const RunStats& baseline, const RunStats& candidate,
+                       const DiffOptions& options)
+{
+  printf("baseline:  %zu files, %llu events\ncandidate: %zu files, %llu events\n", baseline.paths.size(),
+         (unsigned long long) baseline.events, candidate.paths.size(), (unsigned long long) candidate.events);
+  printf("changes of at least %.1f%%, durations with p < %g, by change of the time per step\n", options.min_change,
+         options.alpha);
+  for (const char* kind : {"phase", "kernel", "memcpy", "memset"}) {
+    bool header = false;
+    for (const DiffRow& row : rows) {
+      const EntryStats& stats = any(row);
+      if (stats.kind != kind)
+        continue;
+      if (!header) {
+        printf("\n# %s\n%-12s %-16s %10s %10s %8s %9s %9s %9s %8s %12s  %s\n", kind, "phase", "change", "mean_us",
+               "new_us", "time", "p", "new/step", "count", "bytes", "us_per_step", "name");
+        header = true;
+      }
+      const char* change = row.baseline == NULL ? "added" : row.candidate == NULL ? "removed" : "";
+      std::string flags = std::string(row.time_significant ? "time " : "") + (row.count_significant ? "count " : "") +
+                          (row.bytes_significant ? "bytes" : "");
+      double per_step = (row.candidate ? row.candidate->time_us.count : 0) / row.candidate_steps;
+      printf("%-12s %-16s %10.1f %10.1f %8s %9.2g %9.1f %9s %8s %+12.1f  %s%s%s\n", stats.phase.c_str(),
+             *change ? change : flags.c_str(), row.baseline ? row.baseline->time_us.mean : 0,
+             row.candidate ? row.candidate->time_us.mean : 0, percent_text(row.time_change).c_str(), row.p_value,
+             per_step, percent_text(row.count_change).c_str(),
+             stats.kind == "memcpy" ? percent_text(row.bytes_change).c_str() : "", row.impact_us, stats.name.c_str(),
+             stats.config.empty() ? "" : " ", stats.config.c_str());
+    }
+  }
+}
+
+static void usage(const char* program)
+{
+  fprintf(stderr, "usage: %s [--alpha 0.01] [--min-change 5] [--top 50] [--all] [--json]\n"
+                  "       %*s --baseline <file>... --candidate <file>...\n", program, (int) strlen(program), "");
+}
+
+int main(int argc, char** argv)
+{
+  DiffOptions options;
+  RunStats baseline, candidate;
+  RunStats* side = NULL;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--alpha") == 0 && i + 1 < argc) {
+      options.alpha = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--min-change") == 0 && i + 1 < argc) {
+      options.min_change = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+      options.top = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--all") == 0) {
+      options.all = true;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      options.json = true;
+    } else if (strcmp(argv[i], "--baseline") == 0) {
+      side = &baseline;
+    } else if (strcmp(argv[i], "--candidate") == 0) {
+      side = &candidate;
+    } else if (argv[i][0] == '-' || side == NULL) {
+      usage(argv[0]);
+      return 1;
+    } else {
+      side->paths.push_back(argv[i]);
+    }
+  }
+  if (baseline.paths.empty() || candidate.paths.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!read_run(baseline) || !read_run(candidate))
+    return 1;
+
+  // hash join of the two runs, entries of only one run are kept as well
+  std::vector<DiffRow> rows;
+  for (auto& entry : baseline.entries) {
+    auto found = candidate.entries.find(entry.first);
+    const EntryStats* other = found == candidate.entries.end() ? NULL : &found->second;
+    rows.push_back(compare(&entry.second, other, baseline, candidate, options));
+  }
+  for (auto& entry : candidate.entries) {
+    if (!baseline.entries.count(entry.first))
+      rows.push_back(compare(NULL, &entry.second, baseline, candidate, options));
+  }
+  if (!options.all) {
+    rows.erase(std::remove_if(rows.begin(), rows.end(), [](const DiffRow& row) {
+                 return row.baseline && row.candidate && !row.time_significant && !row.count_significant &&
+                        !row.bytes_significant;
+               }), rows.end());
+  }
+  std::sort(rows.begin(), rows.end(),
+            [](const DiffRow& a, const DiffRow& b) { return fabs(a.impact_us) > fabs(b.impact_us); });
+  if (options.top > 0 && rows.size() > options.top)
+    rows.resize(options.top);
+
+  if (options.json)
+    print_json(rows, baseline, candidate, options);
+  else
+    print_text(rows, baseline, candidate, options);
+  return 0;
+}
@@ -0,0 +1,99 @@
+// Extracts a time window or the events of one phase from timeline files
+// written with SMPROFILER_TIMELINE_INDEX, reading only the blocks of the
+// file that can contain them. Prints a JSON timeline to stdout; files
+// without an index are read from start to end.
+//
+//   smprofiler_query [--start us] [--end us] [--phase name] <timeline file>...
+//   smprofiler_query --list <timeline file>...
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "trace_index.h"
+
+static void usage(const char* program)
+{
+  fprintf(stderr, "usage: %s [--start us] [--end us] [--phase name] <timeline file>...\n"
+                  "       %s --list <timeline file>...\n", program, program);
+}
+
+static void list(const char* path, TraceReader& reader)
+{
+  printf("%s: %s, %zu blocks\n", path, reader.Indexed() ? "indexed" : "not indexed", reader.Blocks().size());
+  for (auto& phase : reader.Phases()) {
+    printf("  phase %d %s\n", phase.first, phase.second.c_str());
+  }
+  for (const TraceIndexBlock& block : reader.Blocks()) {
+    printf("  block at %llu, %llu bytes, ts %lld to %lld%s\n", (unsigned long long) block.offset,
+           (unsigned long long) block.size, (long long) block.min_ts, (long long) block.max_ts,
+           block.metadata ? ", metadata" : "");
+  }
+}
+
+int main(int argc, char** argv)
+{
+  int64_t start = -1;
+  int64_t end = -1;
+  std::string phase;
+  bool list_only = false;
+  std::vector<const char*> paths;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--start") == 0 && i + 1 < argc) {
+      start = strtoll(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--end") == 0 && i + 1 < argc) {
+      end = strtoll(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--phase") == 0 && i + 1 < argc) {
+      phase = argv[++i];
+    } else if (strcmp(argv[i], "--list") == 0) {
+      list_only = true;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.empty()) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  bool first = true;
+  if (!list_only)
+    printf("[\n");
+  for (const char* path : paths) {
+    TraceReader reader;
+    if (!reader.Open(path)) {
+      fprintf(stderr, "could not read %s\n", path);
+      failed++;
+      continue;
+    }
+    if (list_only) {
+      list(path, reader);
+      continue;
+    }
+
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::string> events;
+    int blocks_read = reader.Query(start, end, phase, events);
+    if (blocks_read < 0) {
+      fprintf(stderr, "could not read %s\n", path);
+      failed++;
+      continue;
+    }
+    for (const std::string& event : events) {
+      printf("%s%s", first ? "" : ",\n", event.c_str());
+      first = false;
+    }
+    fprintf(stderr, "%s: %zu events from %d of %zu blocks in %.3f s\n", path, events.size(), blocks_read,
+            reader.Indexed() ? reader.Blocks().size() : (size_t) 1,
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+  }
+  if (!list_only)
+    printf("\n]\n");
+  return failed ? 1 : 0;
+}
@@ -1,4 +1,9 @@
 #include "smprofiler_timeline.h"
+#include "smprofiler_config.h"
+#include "async_trace_file.h"
+#include "compressed_trace_file.h"
+#include "tsc_clock.h"
+#include "profiler_thread.h"
 
 #include <utility>
 #include <sstream>
@@ -7,7 +12,18 @@
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <regex>
+#include <time.h>
+
+// events of forked children the writer takes from the ring per iteration
+#define FORK_RING_BATCH (64)
+
+static inline uint64_t monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
 bool TimelineWriter::open_file_and_init(std::string file_name){
   // Get directory path from file name.
@@ -27,15 +43,24 @@ bool TimelineWriter::open_file_and_init(std::string file_name){
     return false;
   }
 
-  file_.open(file_name, std::fstream::out | std::fstream::trunc);
+  if (trace_file_)
+    trace_file_->Open(file_name);
+  else
+    file_.open(file_name, std::fstream::out | std::fstream::trunc);
 
-  if (file_.is_open()) {
+  if (is_file_open()) {
     // Initialize the timeline file with '[' character.
-    file_ << "[\n";
+    if (perfetto_)
+      perfetto_->Reset();
+    else if (trace_file_)
+      trace_file_->Append("[\n");
+    else
+      file_ << "[\n";
     healthy_ = true;
     tensor_existed_ = false;
     tid_table_.clear();
     tensor_table_.clear();
+    trace_index_.Reset();
     continuous_fail_count_ = 0;
     return true;
   } else {
@@ -68,7 +93,8 @@ std::string TimelineWriter::create_new_file_path(uint64_t timestamp_utc) {
 
   // path for the timeline file.
   cur_file_timestamp_ = timestamp_utc;
-  std::string filepath_ = timeline_folder_name + std::to_string(timestamp_utc) + "_" + pid_node_id_ + "_model_timeline.json";
+  std::string filepath_ = timeline_folder_name + std::to_string(timestamp_utc) + "_" + pid_node_id_ + "_model_timeline" +
+                          (perfetto_ ? ".perfetto-trace" : ".json") + trace_file_suffix_;
   return filepath_;
 }
 
@@ -80,8 +106,8 @@ void TimelineWriter::Initialize(std::string node_id, uint64_t cur_time) {
   max_file_size_ = 100000000000;
   file_close_interval_ = 600000;
   continuous_fail_count_threshold_ = 4;
-  tf_dataloader_start_flag_filepath = base_folder_ +  node_id + "/tf_dataloader_start_flag.tmp";
-  tf_dataloader_end_flag_filepath = base_folder_ + node_id + "/tf_dataloader_end_flag.tmp";
+  tf_dataloader_start_flag_filepath = base_folder_ + FORWARD_SLASH + node_id + "/tf_dataloader_start_flag.tmp";
+  tf_dataloader_end_flag_filepath = base_folder_ + FORWARD_SLASH + node_id + "/tf_dataloader_end_flag.tmp";
   healthy_ = true;
 
   start_time_since_epoch_utc_micros_ = cur_time;
@@ -100,6 +126,48 @@ void TimelineWriter::Initialize(std::string node_id, uint64_t cur_time) {
   // rename it to filename with appropriate timestamp, truncate this file and restart writing to it.
   current_tmp_filename_ = base_folder_ + "/framework/" + std::to_string(getpid()) + SMDEBUG_TEMP_PATH_SUFFIX;
 
+  // "fstream" (default), "async" for io_uring with pwritev fallback, or
+  // "pwritev" to skip io_uring. Compressed, indexed and Perfetto timelines
+  // always go through the append-only file.
+  std::string backend = smprofiler_config_string("SMPROFILER_TIMELINE_WRITER", "fstream");
+  TraceCompression compression = CompressedTraceFile::ParseCodec(
+      smprofiler_config_string("SMPROFILER_TIMELINE_COMPRESSION", "none"));
+  std::string format = smprofiler_config_string("SMPROFILER_TIMELINE_FORMAT", "json");
+  if (format == "perfetto") {
+    perfetto_ = std::make_unique<PerfettoWriter>();
+  } else if (format != "json") {
+    printf("smprofiler: unknown timeline format %s, using json\n", format.c_str());
+  }
+  if (smprofiler_config_flag("SMPROFILER_TIMELINE_INDEX", false)) {
+    // Perfetto traces are read whole, the index only covers JSON
+    if (perfetto_)
+      printf("smprofiler: SMPROFILER_TIMELINE_INDEX is ignored for perfetto timelines\n");
+    else
+      trace_index_block_bytes_ = smprofiler_config_int("SMPROFILER_TIMELINE_INDEX_BLOCK_KB", 1024) * 1024;
+  }
+  if (backend == "async" || backend == "pwritev" || compression != TRACE_COMPRESSION_NONE || trace_index_block_bytes_ > 0 || perfetto_) {
+    std::unique_ptr<AsyncTraceFile> file = std::make_unique<AsyncTraceFile>(
+        smprofiler_config_int("SMPROFILER_TIMELINE_WRITER_BUFFER_KB", 1024) * 1024,
+        smprofiler_config_int("SMPROFILER_TIMELINE_WRITER_BUFFERS", 4), backend == "async");
+    printf("smprofiler: timeline writer uses %s\n",
+           file->GetBackend() == AsyncTraceFile::IO_URING ? "io_uring" : "pwritev");
+    trace_file_ = std::move(file);
+    trace_file_submit_interval_micros_ = smprofiler_config_int("SMPROFILER_TIMELINE_WRITER_SUBMIT_MS", 100) * 1000;
+  }
+  if (compression != TRACE_COMPRESSION_NONE) {
+    int default_level = (compression == TRACE_COMPRESSION_ZSTD) ? 3 : 0;
+    trace_file_ = std::make_unique<CompressedTraceFile>(
+        compression, smprofiler_config_int("SMPROFILER_TIMELINE_COMPRESSION_LEVEL", default_level),
+        smprofiler_config_int("SMPROFILER_TIMELINE_COMPRESSION_BUFFER_KB", 1024) * 1024, std::move(trace_file_));
+    trace_file_suffix_ = CompressedTraceFile::Suffix(compression);
+  }
+
+  // The flags are re-read only when they change, not on every event.
+  dataloader_flag_watcher_ = std::make_unique<FileWatcher>(
+      std::vector<std::string>{tf_dataloader_start_flag_filepath, tf_dataloader_end_flag_filepath},
+      smprofiler_config_int("SMPROFILER_CONTROL_POLL_MS", 1000),
+      [this]() { update_dataloader_collection_status(); });
+
   // Spawn writer thread.
   writer_thread = std::thread(&TimelineWriter::WriterLoop, this);
 }
@@ -107,15 +175,23 @@ void TimelineWriter::Initialize(std::string node_id, uint64_t cur_time) {
 // Destructor for TimelineWriter which will ensure that file fstream object will be closed appropriately.
 TimelineWriter::~TimelineWriter() {
   healthy_ = false;
+  dataloader_flag_watcher_.reset();
 
   if(writer_thread.joinable()) {
     writer_thread.join();
   }
-  if (file_ && file_.is_open()) {
+  if (fork_ring_ && !fork_child_ && fork_ring_->Dropped() > 0)
+    printf("smprofiler: %lu events of forked processes dropped, the fork ring was full\n",
+           (unsigned long) fork_ring_->Dropped());
+  if (is_file_open()) {
 
     // Close the file resource.
-    file_.flush();
-    file_.close();
+    if (trace_file_) {
+      close_trace_file();
+    } else {
+      file_.flush();
+      file_.close();
+    }
 
     //rename tmp file to appropriate filename with timestamp.
     std::rename(current_tmp_filename_.c_str(), create_new_file_path(last_event_end_time_).c_str());
@@ -125,7 +201,10 @@ TimelineWriter::~TimelineWriter() {
 void TimelineWriter::EnqueueWriteEvent(const std::string& tensor_name,
                                        char phase, const std::string& op_name,
                                        const std::string& args,
-                                       long rel_ts_micros, pthread_t threadid, pid_t pid, long duration) {
+                                       long rel_ts_micros, pthread_t threadid, pid_t pid, long duration,
+                                       int32_t device, int32_t stream) {
+  bool measure = measure_overhead_;
+  uint64_t begin = measure ? monotonic_ns() : 0;
   TimelineRecord r;
   r.type = TimelineRecordType::EVENT;
   r.tensor_name = tensor_name;
@@ -137,8 +216,118 @@ void TimelineWriter::EnqueueWriteEvent(const std::string& tensor_name,
   r.duration = duration;
   r.threadid = threadid;
   r.pid = pid;
+  r.device = device;
+  r.stream = stream;
+  if (fork_child_) {
+    PushForkEvent(r);
+    return;
+  }
+  std::lock_guard<std::recursive_mutex> guard(mutex_);
+  record_queue_.push(r);
+  enqueued_++;
+  if (record_queue_.size() > max_queue_depth_)
+    max_queue_depth_ = record_queue_.size();
+  if (measure)
+    enqueue_ns_ += monotonic_ns() - begin;
+}
+
+void TimelineWriter::EnqueueCpuEvent(const std::string& tensor_name, const std::string& op_name,
+                                     const std::string& args, uint64_t start_ticks, uint64_t end_ticks,
+                                     pthread_t threadid, pid_t pid) {
+  bool measure = measure_overhead_;
+  uint64_t begin = measure ? monotonic_ns() : 0;
+  TimelineRecord r;
+  r.type = TimelineRecordType::EVENT;
+  r.tensor_name = tensor_name;
+  r.phase = 'X';
+  r.op_name = op_name;
+  r.args = args;
+  r.threadid = threadid;
+  r.pid = pid;
+  r.ticks = true;
+  r.start_ticks = start_ticks;
+  r.end_ticks = end_ticks;
+  if (fork_child_) {
+    PushForkEvent(r);
+    return;
+  }
   std::lock_guard<std::recursive_mutex> guard(mutex_);
   record_queue_.push(r);
+  enqueued_++;
+  if (record_queue_.size() > max_queue_depth_)
+    max_queue_depth_ = record_queue_.size();
+  if (measure)
+    enqueue_ns_ += monotonic_ns() - begin;
+}
+
+static void copy_truncated(char* dst, size_t size, const std::string& src) {
+  size_t n = std::min(src.size(), size - 1);
+  memcpy(dst, src.data(), n);
+  dst[n] = '\0';
+}
+
+void TimelineWriter::PushForkEvent(const TimelineRecord& r) {
+  if (fork_ring_ == nullptr)
+    return;
+  ForkEvent event;
+  event.phase = r.phase;
+  event.ticks = r.ticks;
+  event.pid = r.pid;
+  // pthread ids repeat across processes, the kernel thread id does not
+  event.threadid = syscall(SYS_gettid);
+  event.start = r.ticks ? r.start_ticks : r.rel_ts_micros;
+  event.end = r.ticks ? r.end_ticks : r.duration;
+  copy_truncated(event.tensor_name, sizeof(event.tensor_name), r.tensor_name);
+  copy_truncated(event.op_name, sizeof(event.op_name), r.op_name);
+  copy_truncated(event.args, sizeof(event.args), r.args);
+  fork_ring_->Push(event);
+}
+
+void TimelineWriter::PopForkEvent(const ForkEvent& event, TimelineRecord& r) {
+  r.type = TimelineRecordType::EVENT;
+  r.tensor_name = event.tensor_name;
+  r.phase = event.phase;
+  r.op_name = event.op_name;
+  r.args = event.args;
+  r.threadid = (pthread_t) event.threadid;
+  r.pid = event.pid;
+  r.ticks = event.ticks;
+  if (r.ticks) {
+    r.start_ticks = event.start;
+    r.end_ticks = event.end;
+  } else {
+    r.rel_ts_micros = event.start;
+    r.duration = event.end;
+    r.event_end_ts_micros_since_epoch_utc = start_time_since_epoch_utc_micros_ + r.rel_ts_micros + r.duration;
+  }
+}
+
+void TimelineWriter::ConvertTicks(TimelineRecord& r) {
+  int64_t start_ns = tsc_clock_to_ns(r.start_ticks);
+  int64_t end_ns = tsc_clock_to_ns(r.end_ticks);
+  r.rel_ts_nanos = start_ns - (int64_t) start_time_since_epoch_utc_micros_ * 1000;
+  r.duration_nanos = end_ns > start_ns ? end_ns - start_ns : 0;
+  r.rel_ts_micros = r.rel_ts_nanos / 1000;
+  r.duration = r.duration_nanos / 1000;
+  r.event_end_ts_micros_since_epoch_utc = (start_ns + r.duration_nanos) / 1000;
+}
+
+size_t TimelineWriter::QueueDepth() {
+  std::lock_guard<std::recursive_mutex> guard(mutex_);
+  return record_queue_.size();
+}
+
+TimelineWriterStats TimelineWriter::Stats(bool reset_max_queue_depth) {
+  TimelineWriterStats stats;
+  std::lock_guard<std::recursive_mutex> guard(mutex_);
+  stats.enqueued = enqueued_;
+  stats.enqueue_ns = enqueue_ns_;
+  stats.written = written_;
+  stats.write_ns = write_ns_;
+  stats.max_queue_depth = max_queue_depth_;
+  if (reset_max_queue_depth)
+    max_queue_depth_ = record_queue_.size();
+  return stats;
 }
 
 // this decides if existing open file should rotate.
@@ -150,10 +339,11 @@ bool TimelineWriter::shouldRotateToNew(uint64_t timestamp_micros_since_utc){
     return true;
   }
 
-  // check size of file.
+  // check size of file, including what the append-only file has not written yet.
   struct stat stat_buf;
   stat(current_tmp_filename_.c_str(), &stat_buf);
-  if (stat_buf.st_size > max_file_size_) {
+  int64_t file_size = trace_file_ ? (int64_t) trace_file_->Size() : (int64_t) stat_buf.st_size;
+  if (file_size > max_file_size_) {
     return true;
   }
 
@@ -166,17 +356,43 @@ bool TimelineWriter::shouldRotateToNew(uint64_t timestamp_micros_since_utc){
 }
 
 void TimelineWriter::close_and_rename_file() {
-  struct timeval tv;
-  gettimeofday(&tv,NULL);
-  uint64_t cur_time = (1000000 * tv.tv_sec) + tv.tv_usec;
-  file_.flush();
-  file_.close();
+  uint64_t cur_time = tsc_clock_epoch_micros();
+  if (trace_file_) {
+    close_trace_file();
+  } else {
+    file_.flush();
+    file_.close();
+  }
 
   //rename tmp file to appropriate filename with timestamp.
   std::rename(current_tmp_filename_.c_str(), create_new_file_path(last_event_end_time_).c_str());
   last_file_close_time_ = cur_time;
 }
 
+void TimelineWriter::close_trace_file() {
+  if (perfetto_) {
+    // a trace is just its packets, there is nothing to close
+    trace_file_->Close();
+    return;
+  }
+  if (trace_index_.BlockBytes() > 0) {
+    trace_file_->EndBlock();
+    trace_index_.EndBlock();
+  }
+  if (trace_index_.Empty()) {
+    trace_file_->Append("\n]\n");
+  } else if (trace_file_suffix_.empty()) {
+    // the index is the last event, so the file stays valid JSON
+    trace_file_->AppendFooter(trace_index_.JsonFooter(trace_file_->BlockEnds(), trace_file_->Size()));
+  } else {
+    // the closing ']' goes into the last frame, the index after it
+    trace_file_->Append("\n]\n");
+    trace_file_->EndBlock();
+    trace_file_->AppendFooter(trace_index_.SkippableFrame(trace_file_->BlockEnds()));
+  }
+  trace_file_->Close();
+}
+
 void TimelineWriter::DoWriteEvent(const TimelineRecord& r) {
   // if existing file is > seconds old or size > MB , close this , create new file with new path interval
   // NOTE: need to save existing metadata strings in new file, so all strings for tensorIdx need to be saved in memory
@@ -191,7 +407,7 @@ void TimelineWriter::DoWriteEvent(const TimelineRecord& r) {
  // }
 
   // If no file is open, create a new file, open and initialize it.
-  if (!file_.is_open()) {
+  if (!is_file_open()) {
 
     if (!open_file_and_init(current_tmp_filename_)){
       // The number of continuous failures crossed the threshold.
@@ -210,120 +426,209 @@ void TimelineWriter::DoWriteEvent(const TimelineRecord& r) {
     last_event_end_time_ = r.event_end_ts_micros_since_epoch_utc;
   }
 
+  if (perfetto_) {
+    WritePerfettoEvent(r);
+    return;
+  }
+
   // if this file has tensors, then we need to go 2 characters back and overwrite with ,\n
   // Note that after every tensor write we make sure that file is valid json so we append
   // \n] , below we are overwriting '\n]' sentinal character written in file as we know that some tensor
   // was already written in the file (tensor_existed_ is True)
+  // the append-only backends get the event as one string
+  std::ostringstream buffered;
+  std::ostream& out = trace_file_ ? static_cast<std::ostream&>(buffered) : static_cast<std::ostream&>(file_);
   if(tensor_existed_){
-    // going to last \n which is 2 character behind from last
-    long pos = file_.tellp();
-    file_.seekp (pos-2);
-    file_ << ",\n";
+    if (trace_file_) {
+      // nothing to overwrite, append-only files leave out the sentinel
+      out << ",\n";
+    } else {
+      // going to last \n which is 2 character behind from last
+      long pos = file_.tellp();
+      file_.seekp (pos-2);
+      file_ << ",\n";
+    }
   }
   auto& tensor_idx = tensor_table_[r.tensor_name];
-  if(tensor_idx == 0  || tid_table_.find(r.threadid) == tid_table_.end()){
+  bool metadata = tensor_idx == 0  || tid_table_.find(r.threadid) == tid_table_.end();
+  if(metadata){
     if(!tensor_existed_){
-      file_ << "{";
-      file_ << "\"name\": \"process_name\"";
+      out << "{";
+      out << "\"name\": \"process_name\"";
       // Note name of process can be given in args{"name:"}
-      file_ << ", \"ph\": \"M\"";
-      file_ << ", \"pid\": " << 0 << "";
-      file_ << ", \"args\": {\"start_time_since_epoch_in_micros\":" << start_time_since_epoch_utc_micros_ << "}";
-      file_ << "}," << std::endl;
-      file_ << "{";
-      file_ << "\"name\": \"process_sort_index\"";
-      file_ << ", \"ph\": \"M\"";
-      file_ << ", \"pid\": " << 0 << "";
-      file_ << ", \"args\": {\"sort_index\": " << 0 << "}";
-      file_ << "}," << std::endl;
+      out << ", \"ph\": \"M\"";
+      out << ", \"pid\": " << 0 << "";
+      out << ", \"args\": {\"start_time_since_epoch_in_micros\":" << start_time_since_epoch_utc_micros_ << "}";
+      out << "}," << std::endl;
+      out << "{";
+      out << "\"name\": \"process_sort_index\"";
+      out << ", \"ph\": \"M\"";
+      out << ", \"pid\": " << 0 << "";
+      out << ", \"args\": {\"sort_index\": " << 0 << "}";
+      out << "}," << std::endl;
     }
     if(tensor_idx == 0){
       tensor_idx = (int)tensor_table_.size();
+      trace_index_.AddPhase(tensor_idx, r.tensor_name);
     // We model tensors as processes. Register metadata for this "pid".
-      file_ << "{";
-      file_ << "\"name\": \"process_name\"";
-      file_ << ", \"ph\": \"M\"";
-      file_ << ", \"pid\": " << tensor_idx << "";
-      file_ << ", \"args\": {\"name\": \"" << r.tensor_name << "\"}";
-      file_ << "}," << std::endl;
-      file_ << "{";
-      file_ << "\"name\": \"process_sort_index\"";
-      file_ << ", \"ph\": \"M\"";
-      file_ << ", \"pid\": " << tensor_idx << "";
-      file_ << ", \"args\": {\"sort_index\": " << tensor_idx << "}";
-      file_ << "}," << std::endl;
+      out << "{";
+      out << "\"name\": \"process_name\"";
+      out << ", \"ph\": \"M\"";
+      out << ", \"pid\": " << tensor_idx << "";
+      out << ", \"args\": {\"name\": \"" << r.tensor_name << "\"}";
+      out << "}," << std::endl;
+      out << "{";
+      out << "\"name\": \"process_sort_index\"";
+      out << ", \"ph\": \"M\"";
+      out << ", \"pid\": " << tensor_idx << "";
+      out << ", \"args\": {\"sort_index\": " << tensor_idx << "}";
+      out << "}," << std::endl;
     }
     // thread id and sort thread index
-    file_ << "{";
-    file_ << "\"name\": \"thread_name\"";
-    file_ << ", \"ph\": \"M\"";
-    file_ << ", \"pid\": " << tensor_idx << "";
-    file_ << ", \"tid\": " << r.threadid << "";
-
-    file_ << ", \"args\": {\"name\":\"tid-" << r.threadid <<"_pid-"<< r.pid << "\"}";
-    file_ << "}," << std::endl;
-    file_ << "{";
-    file_ << "\"name\": \"thread_sort_index\"";
-    file_ << ", \"ph\": \"M\"";
-    file_ << ", \"pid\": " << tensor_idx << "";
-    file_ << ", \"tid\": " << r.threadid << "";
-    file_ << ", \"args\": {\"sort_index\": " << r.threadid << "}";
-    file_ << "}," << std::endl;
+    out << "{";
+    out << "\"name\": \"thread_name\"";
+    out << ", \"ph\": \"M\"";
+    out << ", \"pid\": " << tensor_idx << "";
+    out << ", \"tid\": " << r.threadid << "";
+
+    out << ", \"args\": {\"name\":\"tid-" << r.threadid <<"_pid-"<< r.pid << "\"}";
+    out << "}," << std::endl;
+    out << "{";
+    out << "\"name\": \"thread_sort_index\"";
+    out << ", \"ph\": \"M\"";
+    out << ", \"pid\": " << tensor_idx << "";
+    out << ", \"tid\": " << r.threadid << "";
+    out << ", \"args\": {\"sort_index\": " << r.threadid << "}";
+    out << "}," << std::endl;
 
     tid_table_.insert(r.threadid);
   }
-  file_ << "{";
-  file_ << "\"ph\": \"" << r.phase << "\"";
+  out << "{";
+  out << "\"ph\": \"" << r.phase << "\"";
   if (r.phase != 'E') {
     // Not necessary for ending event.
-    file_ << ", \"name\": \"" << r.op_name << "\"";
+    out << ", \"name\": \"" << r.op_name << "\"";
   }
-  file_ << ", \"ts\": " << r.rel_ts_micros << "";
-  file_ << ", \"pid\": " << tensor_idx << "";
-    file_ << ", \"tid\": " << r.threadid << "";
-
-  if (r.phase == 'X') {
-    file_ << ", \"dur\": " << r.duration << "";
+  if (r.ticks) {
+    // microseconds with nanosecond fractions
+    char ts[64];
+    snprintf(ts, sizeof(ts), ", \"ts\": %.3f", r.rel_ts_nanos / 1000.0);
+    out << ts;
+  } else {
+    out << ", \"ts\": " << r.rel_ts_micros << "";
+  }
+  out << ", \"pid\": " << tensor_idx << "";
+    out << ", \"tid\": " << r.threadid << "";
+
+  if (r.phase == 'X' && r.ticks) {
+    char dur[64];
+    snprintf(dur, sizeof(dur), ", \"dur\": %.3f", r.duration_nanos / 1000.0);
+    out << dur;
+  } else if (r.phase == 'X') {
+    out << ", \"dur\": " << r.duration << "";
   }
   if (r.args != "") {
-    file_ << ", \"args\": {" << r.args << "}";
+    out << ", \"args\": {" << r.args << "}";
+  }
+  out << "}";
+
+  if (trace_file_) {
+    std::string event = buffered.str();
+    trace_file_->Append(event);
+    if (trace_index_block_bytes_ > 0) {
+      trace_index_.AddEvent(r.rel_ts_micros, r.rel_ts_micros + r.duration, tensor_idx, metadata, event.size());
+      if (trace_index_.BlockBytes() >= trace_index_block_bytes_) {
+        trace_file_->EndBlock();
+        trace_index_.EndBlock();
+      }
+    }
+  } else {
+    file_ << std::endl << "]";
+    file_.flush();
   }
-  file_ << "}" << std::endl << "]";
+  tensor_existed_ = true;
+}
 
-  file_.flush();
+// Phases are processes and the threads that recorded events their threads,
+// as in the JSON timeline, with the same phase numbering.
+void TimelineWriter::WritePerfettoEvent(const TimelineRecord& r) {
+  auto& tensor_idx = tensor_table_[r.tensor_name];
+  if (tensor_idx == 0)
+    tensor_idx = (int)tensor_table_.size();
+  int64_t rel_ts_nanos = r.ticks ? r.rel_ts_nanos : (int64_t) r.rel_ts_micros * 1000;
+  uint64_t duration_nanos = r.ticks ? r.duration_nanos : (uint64_t) r.duration * 1000;
+  PerfettoEvent event{r.tensor_name, tensor_idx, (uint64_t) r.threadid, r.pid, r.phase, r.op_name, r.args,
+                      start_time_since_epoch_utc_micros_ * 1000 + rel_ts_nanos, duration_nanos,
+                      r.device, r.stream};
+  std::string packets;
+  perfetto_->AddEvent(event, packets);
+  trace_file_->Append(packets);
   tensor_existed_ = true;
 }
 
+void TimelineWriter::WriteRecord(TimelineRecord& r) {
+  switch (r.type) {
+    case TimelineRecordType::EVENT:
+      if (r.ticks)
+        ConvertTicks(r);
+      if (measure_overhead_) {
+        uint64_t begin = monotonic_ns();
+        DoWriteEvent(r);
+        write_ns_ += monotonic_ns() - begin;
+      } else {
+        DoWriteEvent(r);
+      }
+      written_++;
+      break;
+    default:
+      throw std::logic_error("Unknown event type provided.\n");
+  }
+}
+
 void TimelineWriter::WriterLoop() {
+  profiler_thread_setup("writer");
   while (healthy_) {
-    update_dataloader_collection_status();
-    struct timeval tv;
-    gettimeofday(&tv,NULL);
-    uint64_t cur_time = (1000000 * tv.tv_sec) + tv.tv_usec;
-    if (file_.is_open() && shouldRotateToNew(cur_time)) {
+    uint64_t cur_time = tsc_clock_epoch_micros();
+    if (is_file_open() && shouldRotateToNew(cur_time)) {
       printf("rotate file\n");
       close_and_rename_file();
     }
+    bool wrote = false;
+    // a batch of the children's events every time round, so that a busy
+    // parent does not leave the ring to fill up and drop them. Only this
+    // thread pops, the ring needs no lock.
+    ForkEvent fork_event;
+    for (int i = 0; fork_ring_ && i < FORK_RING_BATCH && fork_ring_->Pop(fork_event); i++) {
+      TimelineRecord fork_record;
+      PopForkEvent(fork_event, fork_record);
+      WriteRecord(fork_record);
+      wrote = true;
+    }
     TimelineRecord r;
+    bool queued = false;
     {
-
       std::lock_guard<std::recursive_mutex> guard(mutex_);
-      if(record_queue_.empty()){
-        std::this_thread::yield();
-        continue;
+      if (!record_queue_.empty()) {
+        r = record_queue_.front();
+        record_queue_.pop();
+        queued = true;
       }
-      r = record_queue_.front();
-      record_queue_.pop();
     }
-    switch (r.type) {
-      case TimelineRecordType::EVENT:
-        DoWriteEvent(r);
-        break;
-      default:
-        throw std::logic_error("Unknown event type provided.\n");
+    if (queued) {
+      WriteRecord(r);
+      wrote = true;
+    }
+    if (!wrote) {
+      // nothing to write, hand the buffered events on towards the disk
+      if (trace_file_ && cur_time - last_trace_file_submit_micros_ > trace_file_submit_interval_micros_) {
+        trace_file_->Submit();
+        last_trace_file_submit_micros_ = cur_time;
+      }
+      std::this_thread::yield();
+      continue;
     }
 
-    if (!file_.good()) {
+    if (!is_file_good()) {
       healthy_ = false;
       record_queue_.empty();
     }
@@ -331,6 +636,14 @@ void TimelineWriter::WriterLoop() {
   }
 }
 
+bool TimelineWriter::is_file_open() {
+  return trace_file_ ? trace_file_->IsOpen() : file_.is_open();
+}
+
+bool TimelineWriter::is_file_good() {
+  return trace_file_ ? trace_file_->Good() : file_.good();
+}
+
 void TimelineWriter::update_dataloader_collection_status() {
   // Check the dataloader flags. If only the start flag is found, collect dataloader metrics.
   // Otherwise, don't collect dataloader metrics.
@@ -355,9 +668,16 @@ void Timeline::Initialize() {
   if (initialized_) {
     return;
   }
-  struct timeval tv;
-  gettimeofday(&tv,NULL);
-  start_time_ = (1000000 * tv.tv_sec) + tv.tv_usec;
+  tsc_clock_init();
+  start_time_ = tsc_clock_epoch_micros();
+
+  // Dataloader workers and other forked children inherit the ring and
+  // hand their events to this process's writer thread.
+  int64_t fork_ring_slots = smprofiler_config_int("SMPROFILER_FORK_RING_SLOTS", 1024);
+  if (fork_ring_slots > 0)
+    fork_ring_ = ForkEventRing::Create(fork_ring_slots);
+  writer_->SetForkRing(fork_ring_, false);
+  pthread_atfork(NULL, NULL, &Timeline::AfterForkChild);
 
   // create the config reader instance.
   node_id = "algo-1";
@@ -410,6 +730,53 @@ void Timeline::SMRecordEvent(const std::string training_phase,
   writer_->EnqueueWriteEvent(training_phase, event_type, op_name, ss, start_ts-start_time_, threadid, pid, duration);
 }
 
+void Timeline::SMRecordDeviceEvent(const std::string training_phase, const std::string op_name, uint64_t start_ts,
+                                   uint64_t duration, int32_t device, int32_t stream, const std::string args) {
+  pthread_t threadid = pthread_self();
+  std::string ss;
+  ss.append("\"pid\":");
+  ss.append(std::to_string(getpid()));
+  ss.append(", \"thread_id\":");
+  ss.append(std::to_string(threadid));
+  if (args.size() > 1)
+    ss.append(args);
+  writer_->EnqueueWriteEvent(training_phase, 'X', op_name, ss, start_ts-start_time_, threadid, getpid(), duration,
+                             device, stream);
+}
+
+void Timeline::SMRecordCpuEvent(const std::string training_phase, const std::string op_name,
+                                uint64_t start_ticks, uint64_t end_ticks, const std::string args) {
+  pthread_t threadid = pthread_self();
+  std::string ss;
+  ss.append("\"pid\":");
+  ss.append(std::to_string(getpid()));
+  ss.append(", \"thread_id\":");
+  ss.append(std::to_string(threadid));
+  if (args.size() > 1)
+    ss.append(args);
+  writer_->EnqueueCpuEvent(training_phase, op_name, ss, start_ticks, end_ticks, threadid, getpid());
+}
+
+// record counter events
+// every series in values becomes its own line in the counter track, so unlike
+// SMRecordEvent no pid/thread_id args are added
+void Timeline::SMRecordCounter(const std::string training_phase, const std::string counter_name,
+                               uint64_t ts, const std::string& values) {
+  writer_->EnqueueWriteEvent(training_phase, 'C', counter_name, values, ts-start_time_, pthread_self(), getpid());
+}
+
+// The writer thread did not survive the fork and its file is the parent's:
+// the child leaves the old writer alone, without destroying it, and records
+// into the ring through a writer without thread or file.
+void Timeline::AfterForkChild() {
+  Timeline& tl = getInstance();
+  (void) tl.writer_.release();
+  tl.writer_ = std::make_unique<TimelineWriter>();
+  tl.writer_->start_time_since_epoch_utc_micros_ = tl.start_time_;
+  tl.writer_->SetForkRing(tl.fork_ring_, true);
+  tl.forked_child_ = true;
+}
+
 Timeline&  Timeline::getInstance() {
     static Timeline instance(std::move([]()->Timeline{
       return Timeline();
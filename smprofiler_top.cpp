@@ -0,0 +1,183 @@
+// Shows the live statistics of all profiled processes on this machine,
+// published with SMPROFILER_LIVE_STATS=1, refreshed like top. Segments are
+// only mapped read-only, so a running job is never slowed down or blocked.
+//
+//   smprofiler_top [--interval s] [--kernels n] [--once] [pid...]
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "live_stats.h"
+
+struct Process {
+  std::string name;
+  const LiveStatsSegment* segment;
+  LiveStatsSnapshot snapshot;
+  bool consistent;
+};
+
+static void usage(const char* program)
+{
+  fprintf(stderr, "usage: %s [--interval s] [--kernels n] [--once] [pid...]\n", program);
+}
+
+static uint64_t now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// maps a segment, NULL if it is not one this version can read
+static const LiveStatsSegment* attach(const std::string& name)
+{
+  int fd = shm_open(("/" + name).c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return NULL;
+  void* mapped = mmap(NULL, sizeof(LiveStatsSegment), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return NULL;
+  const LiveStatsSegment* segment = (const LiveStatsSegment*) mapped;
+  std::atomic_thread_fence(std::memory_order_acquire);
+  if (segment->magic != LIVE_STATS_MAGIC || segment->version != LIVE_STATS_VERSION ||
+      segment->size != sizeof(LiveStatsSegment)) {
+    munmap(mapped, sizeof(LiveStatsSegment));
+    return NULL;
+  }
+  return segment;
+}
+
+// the segments of /dev/shm, of the given pids only if there are any
+static std::vector<Process> attach_all(const std::vector<std::string>& pids)
+{
+  std::vector<Process> processes;
+  DIR* dir = opendir("/dev/shm");
+  if (dir == NULL)
+    return processes;
+  size_t prefix = strlen(LIVE_STATS_SHM_PREFIX);
+  while (struct dirent* entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name.compare(0, prefix, LIVE_STATS_SHM_PREFIX) != 0)
+      continue;
+    if (!pids.empty() && std::find(pids.begin(), pids.end(), name.substr(prefix)) == pids.end())
+      continue;
+    const LiveStatsSegment* segment = attach(name);
+    if (segment != NULL)
+      processes.push_back(Process{name, segment, {}, false});
+  }
+  closedir(dir);
+  std::sort(processes.begin(), processes.end(), [](const Process& a, const Process& b) {
+    return a.segment->rank != b.segment->rank ? a.segment->rank < b.segment->rank : a.segment->pid < b.segment->pid;
+  });
+  return processes;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+static void show(std::vector<Process>& processes, size_t top_kernels)
+{
+  uint64_t now = now_ns();
+  time_t seconds = now / 1000000000ULL;
+  char clock[32];
+  strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&seconds));
+  printf("smprofiler_top - %s - %zu processes\n\n", clock, processes.size());
+  printf("%5s %5s %8s  %-20s %-8s %10s %8s %14s %10s %9s\n", "rank", "local", "pid", "phase", "state",
+         "elapsed", "gpu busy", "records", "dropped", "updated");
+  for (Process& process : processes) {
+    const LiveStatsSegment* segment = process.segment;
+    const LiveStatsSnapshot& s = process.snapshot;
+    bool alive = kill(segment->pid, 0) == 0 || errno != ESRCH;
+    const char* state = !alive ? "exited" : !process.consistent ? "busy" : s.tracing ? "tracing" : "idle";
+    printf("%5d %5d %8u  %-20.20s %-8s %9.1fs %7.1f%% %14llu %10llu %8.1fs\n", segment->rank, segment->local_rank,
+           segment->pid, s.phase, state, s.phase_elapsed_ns / 1e9,
+           s.tracing ? 100.0 * live_stats_busy_ratio(s.phase_gpu_ns, s.phase_elapsed_ns) : 0.0, (unsigned long long) s.records,
+           (unsigned long long) s.dropped_records, s.update_ns ? (now - s.update_ns) / 1e9 : 0.0);
+  }
+
+  for (Process& process : processes) {
+    const LiveStatsSnapshot& s = process.snapshot;
+    if (!process.consistent)
+      continue;
+    printf("\n== rank %d, pid %u\n", process.segment->rank, process.segment->pid);
+    printf("%-20s %8s %12s %12s %9s %12s\n", "phase", "count", "last ms", "avg ms", "gpu busy", "gpu ms");
+    for (uint32_t i = 0; i < s.num_phases; i++) {
+      const LiveStatsPhase& phase = s.phases[i];
+      printf("%-20.20s %8llu %12.3f %12.3f %8.1f%% %12.3f\n", phase.name, (unsigned long long) phase.count,
+             phase.last_wall_ns / 1e6, phase.count ? phase.wall_ns / 1e6 / phase.count : 0.0,
+             100.0 * live_stats_busy_ratio(phase.last_gpu_ns, phase.last_wall_ns), phase.gpu_ns / 1e6);
+    }
+    uint64_t kernel_ns = 0;
+    for (uint32_t i = 0; i < s.num_kernels; i++) {
+      kernel_ns += s.kernels[i].gpu_ns;
+    }
+    printf("%-60s %10s %12s %7s %10s %10s\n", "kernel", "count", "gpu ms", "share", "avg us", "max us");
+    for (uint32_t i = 0; i < s.num_kernels && i < top_kernels; i++) {
+      const LiveStatsKernel& kernel = s.kernels[i];
+      printf("%-60.60s %10llu %12.3f %6.1f%% %10.1f %10.1f\n", kernel.name, (unsigned long long) kernel.count,
+             kernel.gpu_ns / 1e6, percent(kernel.gpu_ns, kernel_ns),
+             kernel.count ? kernel.gpu_ns / 1e3 / kernel.count : 0.0, kernel.max_ns / 1e3);
+    }
+    if (s.kernels_not_listed > 0)
+      printf("(%llu kernel records of names not listed)\n", (unsigned long long) s.kernels_not_listed);
+  }
+  fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+  double interval = 1.0;
+  size_t top_kernels = 10;
+  bool once = false;
+  std::vector<std::string> pids;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+      interval = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--kernels") == 0 && i + 1 < argc) {
+      top_kernels = strtoul(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--once") == 0) {
+      once = true;
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      pids.push_back(argv[i]);
+    }
+  }
+  if (interval <= 0)
+    interval = 1.0;
+
+  while (true) {
+    // processes come and go, look for segments again every time
+    std::vector<Process> processes = attach_all(pids);
+    for (Process& process : processes) {
+      process.consistent = live_stats_read(process.segment, &process.snapshot);
+    }
+    if (!once)
+      printf("\033[H\033[2J");
+    if (processes.empty())
+      printf("no live statistics in /dev/shm, is the job running with SMPROFILER_LIVE_STATS=1?\n");
+    else
+      show(processes, top_kernels);
+    for (Process& process : processes) {
+      munmap((void*) process.segment, sizeof(LiveStatsSegment));
+    }
+    if (once)
+      return processes.empty() ? 1 : 0;
+    struct timespec sleep = {(time_t) interval, (long) ((interval - (time_t) interval) * 1e9)};
+    nanosleep(&sleep, NULL);
+  }
+}
@@ -0,0 +1,57 @@
+#include <string.h>
+#include "stack_table.h"
+
+// FNV-1a over the raw frame words
+static uint64_t hash_frames(const uintptr_t* frames, int depth)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < depth; i++) {
+    hash ^= (uint64_t) frames[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash ^ (uint64_t) depth;
+}
+
+uint32_t StackTable::Intern(const uintptr_t* frames, int depth, bool* inserted)
+{
+  if (depth <= 0)
+    return INVALID_ID;
+
+  uint64_t hash = hash_frames(frames, depth);
+
+  std::lock_guard<std::mutex> guard(mutex_);
+  auto range = index_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    const StackEntry& entry = entries_[it->second];
+    if (entry.depth == (uint32_t) depth &&
+        memcmp(&frame_pool_[entry.offset], frames, depth * sizeof(uintptr_t)) == 0)
+      return it->second;
+  }
+
+  if (entries_.size() >= max_stacks_)
+    return INVALID_ID;
+
+  uint32_t stack_id = (uint32_t) entries_.size();
+  entries_.push_back({(uint32_t) frame_pool_.size(), (uint32_t) depth});
+  frame_pool_.insert(frame_pool_.end(), frames, frames + depth);
+  index_.emplace(hash, stack_id);
+  if (inserted)
+    *inserted = true;
+  return stack_id;
+}
+
+bool StackTable::GetFrames(uint32_t stack_id, std::vector<uintptr_t>& frames)
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+  if (stack_id >= entries_.size())
+    return false;
+  const StackEntry& entry = entries_[stack_id];
+  frames.assign(frame_pool_.begin() + entry.offset, frame_pool_.begin() + entry.offset + entry.depth);
+  return true;
+}
+
+size_t StackTable::Size()
+{
+  std::lock_guard<std::mutex> guard(mutex_);
+  return entries_.size();
+}
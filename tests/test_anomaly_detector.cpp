@@ -0,0 +1,145 @@
+// StepAnomalyDetector judges each step against the steps of its phase before
+// it. Checks that nothing is judged during the warmup except against a fixed
+// threshold, that the relative threshold follows the larger of the EWMA and
+// the quantile, and that QuantileSketch stays within its 1% error bound
+// from microseconds to minutes.
+#include <math.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "anomaly_detector.h"
+#include "test_check.h"
+
+static AnomalyConfig relative_config()
+{
+  AnomalyConfig config;
+  config.warmup = 5;
+  config.quantile = 0.99;
+  config.factor = 1.5;
+  config.threshold_ns = 0;
+  config.ewma_alpha = 0.1;
+  return config;
+}
+
+static void test_warmup()
+{
+  StepAnomalyDetector detector(relative_config());
+  // however slow, the first steps only build the distribution
+  for (int i = 0; i < 5; i++) {
+    AnomalyVerdict verdict = detector.Add("forward", i == 3 ? 1000000000 : 1000000);
+    CHECK(!verdict.anomalous);
+    CHECK_EQ(verdict.threshold_ns, 0);
+    CHECK_EQ(verdict.steps, (uint64_t) i);
+  }
+  AnomalyVerdict verdict = detector.Add("forward", 1000000);
+  CHECK(verdict.threshold_ns > 0);
+  // every phase name warms up on its own
+  CHECK(!detector.Add("backward", 1000000000).anomalous);
+  CHECK_EQ(detector.Phases().at("forward").steps, 6);
+  CHECK_EQ(detector.Phases().at("backward").steps, 1);
+}
+
+static void test_fixed_threshold()
+{
+  AnomalyConfig config = relative_config();
+  config.threshold_ns = 2000000;
+  StepAnomalyDetector detector(config);
+  // judged from the first step on, the threshold itself is not anomalous
+  CHECK(detector.Add("forward", 2000001).anomalous);
+  CHECK(!detector.Add("forward", 2000000).anomalous);
+  // a distribution of much longer steps does not move it
+  for (int i = 0; i < 20; i++) {
+    detector.Add("forward", 10000000);
+  }
+  AnomalyVerdict verdict = detector.Add("forward", 3000000);
+  CHECK(verdict.anomalous);
+  CHECK_EQ(verdict.threshold_ns, 2000000);
+  CHECK_EQ(detector.Phases().at("forward").anomalies, 22);
+}
+
+static void test_relative_threshold()
+{
+  // 1.5 times the EWMA and quantile of steady 10 ms steps, the quantile
+  // within 1% of them
+  for (uint64_t step_ns : {14500000, 15500000}) {
+    StepAnomalyDetector detector(relative_config());
+    for (int i = 0; i < 50; i++) {
+      detector.Add("forward", 10000000);
+    }
+    AnomalyVerdict verdict = detector.Add("forward", step_ns);
+    CHECK(verdict.threshold_ns >= 14850000 && verdict.threshold_ns <= 15150000);
+    CHECK_EQ(verdict.anomalous, step_ns > 15000000);
+  }
+
+  // a few 40 ms outliers raise the p99 above the EWMA, which the steady
+  // steps after them bring back to 10 ms
+  StepAnomalyDetector outliers(relative_config());
+  for (int i = 0; i < 100; i++) {
+    outliers.Add("forward", i % 40 == 0 ? 40000000 : 10000000);
+  }
+  for (int i = 0; i < 50; i++) {
+    outliers.Add("forward", 10000000);
+  }
+  AnomalyVerdict verdict = outliers.Add("forward", 50000000);
+  CHECK(verdict.ewma_ns < 10100000);
+  CHECK(verdict.quantile_ns >= 39600000 && verdict.quantile_ns <= 40400000);
+  CHECK(!verdict.anomalous);
+  CHECK_EQ(verdict.threshold_ns, (uint64_t) (1.5 * verdict.quantile_ns));
+
+  // a lasting slowdown becomes the new normal once the EWMA catches up
+  StepAnomalyDetector slowdown(relative_config());
+  for (int i = 0; i < 20; i++) {
+    slowdown.Add("forward", 10000000);
+  }
+  int anomalous = 0;
+  for (int i = 0; i < 50; i++) {
+    anomalous += slowdown.Add("forward", 20000000).anomalous;
+  }
+  CHECK(anomalous > 0 && anomalous < 10);
+  CHECK(!slowdown.Add("forward", 20000000).anomalous);
+}
+
+static void test_sketch_error_bound()
+{
+  QuantileSketch empty;
+  CHECK_EQ(empty.Quantile(0.5), 0);
+
+  // log-uniform durations from 1 us to 10 min
+  std::vector<uint64_t> durations;
+  QuantileSketch sketch;
+  uint64_t state = 12345;
+  for (int i = 0; i < 20000; i++) {
+    state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+    double fraction = (state >> 11) / (double) (1ULL << 53);
+    uint64_t ns = (uint64_t) (1000.0 * pow(6e8, fraction));
+    durations.push_back(ns);
+    sketch.Add(ns);
+  }
+  std::sort(durations.begin(), durations.end());
+  CHECK_EQ(sketch.Count(), durations.size());
+  const double quantiles[] = {0.0, 0.01, 0.25, 0.5, 0.75, 0.9, 0.99, 0.999, 1.0};
+  for (double q : quantiles) {
+    uint64_t exact = durations[(size_t) (q * (durations.size() - 1))];
+    uint64_t estimate = sketch.Quantile(q);
+    double error = (double) estimate / exact - 1;
+    if (error < -0.01 || error > 0.01)
+      printf("q %.3f: %llu for %llu\n", q, (unsigned long long) estimate, (unsigned long long) exact);
+    CHECK(error >= -0.01 && error <= 0.01);
+  }
+
+  // one value is its own every quantile
+  QuantileSketch single;
+  single.Add(123456789);
+  CHECK(single.Quantile(0.0) == single.Quantile(1.0));
+  CHECK(single.Quantile(0.5) >= 122222222 && single.Quantile(0.5) <= 124691357);
+}
+
+int main()
+{
+  test_warmup();
+  test_fixed_threshold();
+  test_relative_threshold();
+  test_sketch_error_bound();
+  return TEST_EXIT_CODE();
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <stdio.h>
+
+// Checks for the standalone tests in this directory. A failed CHECK prints
+// its location and the test exits with 1 from main via TEST_EXIT_CODE.
+static int test_failures = 0;
+
+#define CHECK(condition)                                                     \
+  do {                                                                       \
+    if (!(condition)) {                                                      \
+      printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition);   \
+      test_failures++;                                                       \
+    }                                                                        \
+  } while (0)
+
+#define CHECK_EQ(actual, expected)                                           \
+  do {                                                                       \
+    long long actual_value = (long long) (actual);                           \
+    long long expected_value = (long long) (expected);                       \
+    if (actual_value != expected_value) {                                    \
+      printf("%s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__,     \
+             __LINE__, #actual, #expected, actual_value, expected_value);    \
+      test_failures++;                                                       \
+    }                                                                        \
+  } while (0)
+
+#define TEST_EXIT_CODE() (printf("%s\n", test_failures ? "FAILED" : "PASSED"), test_failures ? 1 : 0)
@@ -0,0 +1,176 @@
+// Forked children hand their timeline events to the parent through
+// ForkEventRing. Checks that the events of children pushing at the same time
+// are all popped, each child's in order, that events which do not fit are
+// dropped and counted, that a slot claimed by a child stopped before filling
+// it is skipped after FORK_EVENT_STALE_MS and the late fill dropped, and that
+// a child's timeline event is written by the parent with the child's pid and
+// thread id.
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "fork_event_ring.h"
+#include "smprofiler_timeline.h"
+#include "test_check.h"
+#include "tsc_clock.h"
+
+static ForkEvent make_event(int child, int sequence)
+{
+  ForkEvent event = {};
+  event.pid = child;
+  event.start = sequence;
+  snprintf(event.op_name, sizeof(event.op_name), "child%d_event%d", child, sequence);
+  return event;
+}
+
+static bool child_exited_ok(pid_t pid)
+{
+  int status = 0;
+  return waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void test_children_push_in_order()
+{
+  const int children = 4, events = 8;
+  ForkEventRing* ring = ForkEventRing::Create(children * events);
+  CHECK(ring != NULL);
+  std::vector<pid_t> pids;
+  for (int child = 0; child < children; child++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      bool pushed = true;
+      for (int i = 0; i < events; i++) {
+        pushed = ring->Push(make_event(child, i)) && pushed;
+      }
+      _exit(pushed ? 0 : 1);
+    }
+    pids.push_back(pid);
+  }
+  for (pid_t pid : pids) {
+    CHECK(child_exited_ok(pid));
+  }
+
+  // interleaved across children, in order within each
+  std::vector<int> next(children, 0);
+  ForkEvent event;
+  int popped = 0;
+  while (ring->Pop(event)) {
+    CHECK(event.pid >= 0 && event.pid < children);
+    CHECK_EQ(event.start, next[event.pid]);
+    next[event.pid]++;
+    popped++;
+  }
+  CHECK_EQ(popped, children * events);
+  CHECK_EQ(ring->Dropped(), 0);
+}
+
+static void test_full_ring_drops()
+{
+  // rounded up to 4 slots
+  ForkEventRing* ring = ForkEventRing::Create(3);
+  pid_t pid = fork();
+  if (pid == 0) {
+    int pushed = 0;
+    for (int i = 0; i < 6; i++) {
+      pushed += ring->Push(make_event(0, i));
+    }
+    _exit(pushed == 4 ? 0 : 1);
+  }
+  CHECK(child_exited_ok(pid));
+  CHECK_EQ(ring->Dropped(), 2);
+
+  ForkEvent event;
+  for (int i = 0; i < 4; i++) {
+    CHECK(ring->Pop(event));
+    CHECK_EQ(event.start, i);
+  }
+  CHECK(!ring->Pop(event));
+  // the slots are free again
+  CHECK(ring->Push(make_event(0, 4)));
+  CHECK(ring->Pop(event));
+  CHECK_EQ(event.start, 4);
+}
+
+static void test_stale_slot_skipped()
+{
+  ForkEventRing* ring = ForkEventRing::Create(4);
+  pid_t stalled = fork();
+  if (stalled == 0) {
+    uint64_t pos;
+    if (!ring->Claim(pos))
+      _exit(2);
+    raise(SIGSTOP);
+    // given up on while stopped
+    _exit(ring->Fill(pos, make_event(0, 0)) ? 1 : 0);
+  }
+  int status = 0;
+  CHECK(waitpid(stalled, &status, WUNTRACED) == stalled && WIFSTOPPED(status));
+
+  pid_t pusher = fork();
+  if (pusher == 0) {
+    _exit(ring->Push(make_event(1, 0)) ? 0 : 1);
+  }
+  CHECK(child_exited_ok(pusher));
+
+  // the event behind the claimed slot waits for it, then gets through
+  ForkEvent event;
+  CHECK(!ring->Pop(event));
+  usleep(FORK_EVENT_STALE_MS * 1000 / 2);
+  CHECK(!ring->Pop(event));
+  CHECK_EQ(ring->Dropped(), 0);
+  usleep(FORK_EVENT_STALE_MS * 1000 / 2 + 100000);
+  CHECK(ring->Pop(event));
+  CHECK_EQ(event.pid, 1);
+  CHECK_EQ(ring->Dropped(), 1);
+
+  kill(stalled, SIGCONT);
+  CHECK(child_exited_ok(stalled));
+  CHECK_EQ(ring->Dropped(), 2);
+  CHECK(!ring->Pop(event));
+}
+
+static void test_child_timeline_event()
+{
+  Timeline& timeline = Timeline::getInstance();
+  CHECK(timeline.Initialized());
+  pid_t pid = fork();
+  if (pid == 0) {
+    uint64_t ticks = tsc_clock_now();
+    Timeline::getInstance().SMRecordCpuEvent("fork_ring_test", "child_event", ticks, ticks + 1000);
+    _exit(Timeline::getInstance().IsForkedChild() ? 0 : 1);
+  }
+  CHECK(child_exited_ok(pid));
+
+  // the parent's writer thread writes it to the parent's file; the child is
+  // single threaded, its thread id is its pid
+  std::string path = "/tmp/framework/" + std::to_string(getpid()) + ".tmp";
+  std::string child = std::to_string(pid);
+  std::string event;
+  for (int i = 0; i < 100 && event.empty(); i++) {
+    usleep(50000);
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line)) {
+      if (line.find("\"name\": \"child_event\"") != std::string::npos)
+        event = line;
+    }
+  }
+  CHECK(event.find("\"tid\": " + child + ",") != std::string::npos);
+  CHECK(event.find("\"args\": {\"pid\":" + child + ",") != std::string::npos);
+}
+
+int main()
+{
+  test_children_push_in_order();
+  test_full_ring_drops();
+  test_stale_slot_skipped();
+  test_child_timeline_event();
+  return TEST_EXIT_CODE();
+}
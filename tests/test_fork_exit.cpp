@@ -0,0 +1,111 @@
+// Forks after the live statistics, the metrics exporter and the raw activity
+// dump started their threads, and exits the child through exit(), which
+// runs the atexit hooks and static destructors it inherited. The child must
+// exit cleanly, and the parent's segment, socket and dump must be left alone.
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <string>
+
+#include "activity_dump.h"
+#include "activity_dump_writer.h"
+#include "live_stats.h"
+#include "metrics_exporter.h"
+#include "test_check.h"
+
+static std::string socket_path;
+
+static bool scrape_ok()
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path.c_str());
+  std::string response;
+  if (connect(fd, (struct sockaddr*) &address, sizeof(address)) == 0) {
+    const char* request = "GET /metrics HTTP/1.1\r\n\r\n";
+    if (write(fd, request, strlen(request)) == (ssize_t) strlen(request)) {
+      char buffer[4096];
+      ssize_t count;
+      while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        response.append(buffer, count);
+      }
+    }
+  }
+  close(fd);
+  return response.compare(0, 15, "HTTP/1.0 200 OK") == 0;
+}
+
+static bool segment_exists(const std::string& name)
+{
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0)
+    return false;
+  close(fd);
+  return true;
+}
+
+static off_t file_size(const std::string& path)
+{
+  struct stat st;
+  return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+int main()
+{
+  std::string prefix = "/tmp/test_fork_exit_" + std::to_string(getpid());
+  socket_path = prefix + ".sock";
+  std::string dump_path = prefix + ".dump";
+  std::string segment_name = "/" LIVE_STATS_SHM_PREFIX + std::to_string(getpid());
+  setenv("SMPROFILER_LIVE_STATS", "1", 1);
+  setenv("SMPROFILER_LIVE_STATS_INTERVAL_MS", "10", 1);
+  setenv("SMPROFILER_METRICS", "1", 1);
+  setenv("SMPROFILER_METRICS_SOCKET", socket_path.c_str(), 1);
+  setenv("SMPROFILER_RAW_DUMP", "1", 1);
+  setenv("SMPROFILER_RAW_DUMP_FILE", dump_path.c_str(), 1);
+  setenv("SMPROFILER_RAW_DUMP_PREALLOCATE_MB", "0", 1);
+  live_stats_init();
+  metrics_exporter_init();
+  activity_dump_init();
+  CHECK(metrics_exporter_enabled());
+  CHECK(activity_dump_enabled());
+  CHECK(segment_exists(segment_name));
+
+  const uint8_t payload[16] = {1, 2, 3};
+  activity_dump_write(0, 0, 0, payload, sizeof(payload));
+  // let the threads go back to waiting, holding nothing the child needs
+  usleep(50000);
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    // the child's hooks must neither join, stop nor unlink the parent's
+    live_stats_begin_phase("child");
+    activity_dump_write(0, 0, 0, payload, sizeof(payload));
+    exit(0);
+  }
+  int status = 0;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  CHECK(segment_exists(segment_name));
+  CHECK(access(socket_path.c_str(), F_OK) == 0);
+  CHECK(scrape_ok());
+
+  activity_dump_write(0, 0, 0, payload, sizeof(payload));
+  activity_dump_close();
+  metrics_exporter_close();
+  live_stats_close();
+  // the parent's two entries, nothing from the child
+  CHECK_EQ(file_size(dump_path), (off_t) (2 * (sizeof(ActivityDumpHeader) + activity_dump_padded_size(sizeof(payload)))));
+  CHECK(!segment_exists(segment_name));
+  CHECK(access(socket_path.c_str(), F_OK) != 0);
+  unlink(dump_path.c_str());
+  return TEST_EXIT_CODE();
+}
@@ -0,0 +1,99 @@
+// Drives MarkerPairing with synthetic records: ranges pair by id across
+// calls, instant markers complete with their data or at Flush, and data
+// records arriving after their marker completed are ignored instead of
+// taking up room in the table.
+#include "marker_pairing.h"
+#include "test_check.h"
+
+static MarkerRecord marker(MarkerKind kind, uint32_t id, uint64_t timestamp, const char* name = "m")
+{
+  return {kind, id, timestamp, 1, kind == MARKER_END ? NULL : name, NULL};
+}
+
+static MarkerData data(uint32_t id, uint32_t category = 0)
+{
+  return {id, false, 0, category, ""};
+}
+
+static void test_nested_ranges()
+{
+  MarkerPairing pairing;
+  std::vector<MarkerSpan> spans;
+  pairing.AddMarker(marker(MARKER_START, 1, 100, "outer"), spans);
+  pairing.AddMarker(marker(MARKER_START, 2, 200, "inner"), spans);
+  pairing.AddData(data(2, 7), spans);
+  pairing.Flush(spans);
+  CHECK_EQ(spans.size(), 0);
+  CHECK_EQ(pairing.OpenRanges(), 2);
+
+  pairing.AddMarker(marker(MARKER_END, 2, 300), spans);
+  pairing.AddMarker(marker(MARKER_END, 1, 400), spans);
+  CHECK_EQ(spans.size(), 2);
+  CHECK(spans[0].name == "inner");
+  CHECK_EQ(spans[0].depth, 1);
+  CHECK(spans[0].has_data);
+  CHECK_EQ(spans[0].data.category, 7);
+  CHECK(spans[1].name == "outer");
+  CHECK_EQ(spans[1].depth, 0);
+  CHECK_EQ(spans[1].start, 100);
+  CHECK_EQ(spans[1].end, 400);
+  CHECK_EQ(pairing.OpenRanges(), 0);
+
+  pairing.AddMarker(marker(MARKER_END, 3, 500), spans);
+  CHECK_EQ(pairing.UnmatchedEnds(), 1);
+}
+
+static void test_instants()
+{
+  MarkerPairing pairing;
+  std::vector<MarkerSpan> spans;
+  // completed by its data
+  pairing.AddMarker(marker(MARKER_INSTANT, 1, 100), spans);
+  CHECK_EQ(spans.size(), 0);
+  pairing.AddData(data(1, 3), spans);
+  CHECK_EQ(spans.size(), 1);
+  CHECK(spans[0].instant && spans[0].has_data);
+  // completed by the end of the buffer
+  pairing.AddMarker(marker(MARKER_INSTANT, 2, 200), spans);
+  pairing.Flush(spans);
+  CHECK_EQ(spans.size(), 2);
+  CHECK(!spans[1].has_data);
+  CHECK_EQ(pairing.OpenRanges(), 0);
+}
+
+static void test_late_data_does_not_fill_the_table()
+{
+  MarkerPairing pairing(4);
+  std::vector<MarkerSpan> spans;
+  // instants flushed at the end of one buffer, their data in the next
+  for (uint32_t id = 1; id <= 4; id++) {
+    pairing.AddMarker(marker(MARKER_INSTANT, id, id * 100), spans);
+  }
+  pairing.Flush(spans);
+  for (uint32_t id = 1; id <= 4; id++) {
+    pairing.AddData(data(id), spans);
+  }
+  // data of a range that already ended
+  pairing.AddMarker(marker(MARKER_START, 5, 600), spans);
+  pairing.AddMarker(marker(MARKER_END, 5, 700), spans);
+  pairing.AddData(data(5), spans);
+  CHECK_EQ(spans.size(), 5);
+  CHECK_EQ(pairing.UnmatchedData(), 5);
+  CHECK_EQ(pairing.OpenRanges(), 0);
+
+  // the table still has room for a full set of ranges
+  for (uint32_t id = 10; id < 14; id++) {
+    pairing.AddMarker(marker(MARKER_START, id, id * 100), spans);
+  }
+  CHECK_EQ(pairing.Dropped(), 0);
+  pairing.AddMarker(marker(MARKER_START, 14, 1400), spans);
+  CHECK_EQ(pairing.Dropped(), 1);
+}
+
+int main()
+{
+  test_nested_ranges();
+  test_instants();
+  test_late_data_does_not_fill_the_table();
+  return TEST_EXIT_CODE();
+}
@@ -0,0 +1,167 @@
+// MemcpyAnalyzer on hand-written copy sequences. Storm detection is where
+// the edge cases are: the window is inclusive, directions keep separate
+// rings, a storm is counted once however long it lasts, and any large copy
+// in between ends it. The bandwidth histogram is checked at its extremes,
+// and the counter of copies in flight across overlapping copies.
+#include <cupti.h>
+#include <vector>
+
+#include "memcpy_analyzer.h"
+#include "test_check.h"
+
+enum : uint8_t {
+  HTOD = CUPTI_ACTIVITY_MEMCPY_KIND_HTOD,
+  DTOH = CUPTI_ACTIVITY_MEMCPY_KIND_DTOH,
+  PINNED = CUPTI_ACTIVITY_MEMORY_KIND_PINNED,
+  PAGEABLE = CUPTI_ACTIVITY_MEMORY_KIND_PAGEABLE,
+  DEVICE = CUPTI_ACTIVITY_MEMORY_KIND_DEVICE,
+};
+
+struct Step {
+  uint8_t copy_kind;
+  uint64_t start;
+  uint64_t bytes;
+  uint32_t flags;
+};
+
+// async pinned copies of 10 ns, so only the storm flag can be set
+static void run(MemcpyAnalyzer& analyzer, const Step* steps, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    const Step& s = steps[i];
+    uint8_t src = s.copy_kind == HTOD ? PINNED : DEVICE;
+    uint8_t dst = s.copy_kind == HTOD ? DEVICE : PINNED;
+    MemcpyRecord record = {s.copy_kind, src, dst, true, s.bytes, s.start, s.start + 10};
+    uint32_t flags = analyzer.Add(record);
+    if (flags != s.flags)
+      printf("step %zu: flags %u, expected %u\n", i, flags, s.flags);
+    CHECK_EQ(flags, s.flags);
+  }
+}
+
+static void test_storm_window_is_inclusive()
+{
+  // 3 small copies, the limit included, within 100 ns
+  MemcpyAnalyzer analyzer(1024, 3, 100);
+  const Step steps[] = {
+      {HTOD, 0, 1024, 0},
+      {HTOD, 50, 1, 0},
+      // exactly the window after the first
+      {HTOD, 100, 1, MEMCPY_FLAG_SMALL_STORM},
+      // 101 ns after the second, the storm is over
+      {HTOD, 151, 1, 0},
+  };
+  run(analyzer, steps, sizeof(steps) / sizeof(steps[0]));
+  CHECK_EQ(analyzer.Stats(HTOD).storm_count, 1);
+}
+
+static void test_directions_and_interruptions()
+{
+  MemcpyAnalyzer analyzer(1024, 3, 1000);
+  const Step steps[] = {
+      // interleaved directions do not add up to a storm in either
+      {HTOD, 0, 8, 0},
+      {DTOH, 10, 8, 0},
+      {HTOD, 20, 8, 0},
+      {DTOH, 30, 8, 0},
+      {HTOD, 40, 8, MEMCPY_FLAG_SMALL_STORM},
+      {DTOH, 50, 8, MEMCPY_FLAG_SMALL_STORM},
+      // still the same HtoD storm, counted once
+      {HTOD, 60, 8, MEMCPY_FLAG_SMALL_STORM},
+      {HTOD, 70, 8, MEMCPY_FLAG_SMALL_STORM},
+      // a large copy ends it, but the ring still has the small ones before
+      // it, so the next small copy starts a second storm
+      {HTOD, 80, 4096, 0},
+      {HTOD, 90, 8, MEMCPY_FLAG_SMALL_STORM},
+  };
+  run(analyzer, steps, sizeof(steps) / sizeof(steps[0]));
+  CHECK_EQ(analyzer.Stats(HTOD).storm_count, 2);
+  CHECK_EQ(analyzer.Stats(HTOD).small_count, 6);
+  CHECK_EQ(analyzer.Stats(DTOH).storm_count, 1);
+  CHECK_EQ(analyzer.Stats(HTOD).count, 7);
+}
+
+static void test_storm_count_is_clamped()
+{
+  // a storm of 1 or 0 copies would flag every small copy, 2 is the minimum
+  MemcpyAnalyzer analyzer(1024, 0, 1000);
+  const Step steps[] = {{HTOD, 0, 8, 0}, {HTOD, 10, 8, MEMCPY_FLAG_SMALL_STORM}};
+  run(analyzer, steps, 2);
+}
+
+static void test_pageable_and_sync_flags()
+{
+  MemcpyAnalyzer analyzer;
+  MemcpyRecord record = {HTOD, PAGEABLE, DEVICE, false, 1 << 20, 0, 1000};
+  CHECK_EQ(analyzer.Add(record), MEMCPY_FLAG_PAGEABLE | MEMCPY_FLAG_SYNC);
+  // pageable on the destination side counts as well
+  record = {DTOH, DEVICE, PAGEABLE, true, 1 << 20, 0, 1000};
+  CHECK_EQ(analyzer.Add(record), MEMCPY_FLAG_PAGEABLE);
+  CHECK_EQ(analyzer.Stats(HTOD).sync_count, 1);
+  CHECK_EQ(analyzer.Stats(DTOH).pageable_count, 1);
+  CHECK_EQ(analyzer.Stats(DTOH).sync_count, 0);
+}
+
+static void test_bandwidth_extremes()
+{
+  MemcpyAnalyzer analyzer;
+  // a record without a duration has no bandwidth and lands in bucket 0
+  MemcpyRecord instant = {HTOD, PINNED, DEVICE, true, 1 << 20, 500, 500};
+  CHECK(MemcpyAnalyzer::BandwidthGBps(instant) == 0.0);
+  analyzer.Add(instant);
+  CHECK_EQ(analyzer.Stats(HTOD).bandwidth_histogram[0], 1);
+  CHECK_EQ(analyzer.Stats(HTOD).time_ns, 0);
+  // far beyond 2^23 MB/s, kept in the last bucket
+  MemcpyRecord fast = {HTOD, PINNED, DEVICE, true, 1000000000000ULL, 0, 1000};
+  analyzer.Add(fast);
+  CHECK_EQ(analyzer.Stats(HTOD).bandwidth_histogram[MEMCPY_BANDWIDTH_BUCKETS - 1], 1);
+}
+
+static void check_sample(const MemcpyCounterSample& sample, uint64_t timestamp, double gbps, uint32_t in_flight)
+{
+  if (sample.timestamp != timestamp || sample.gbps != gbps || sample.in_flight != in_flight)
+    printf("sample at %llu: %.2f GB/s, %u in flight, expected %llu: %.2f GB/s, %u\n",
+           (unsigned long long) sample.timestamp, sample.gbps, sample.in_flight,
+           (unsigned long long) timestamp, gbps, in_flight);
+  CHECK(sample.timestamp == timestamp && sample.gbps == gbps && sample.in_flight == in_flight);
+}
+
+static void test_overlapping_copies_in_flight()
+{
+  MemcpyAnalyzer analyzer;
+  std::vector<MemcpyCounterSample> samples;
+  // [0, 100) at 2 GB/s and [50, 150) at 4 GB/s overlap; nothing is final
+  // before the second starts
+  analyzer.Track({HTOD, PINNED, DEVICE, true, 200, 0, 100}, samples);
+  analyzer.Track({HTOD, PINNED, DEVICE, true, 400, 50, 150}, samples);
+  CHECK_EQ(samples.size(), 2);
+  check_sample(samples[0], 0, 2.0, 1);
+  check_sample(samples[1], 50, 6.0, 2);
+  // the first ends while the second still runs, the other direction keeps
+  // its own count
+  analyzer.Track({DTOH, DEVICE, PINNED, true, 100, 120, 220}, samples);
+  CHECK_EQ(samples.size(), 3);
+  check_sample(samples[2], 120, 1.0, 1);
+  analyzer.Track({HTOD, PINNED, DEVICE, true, 100, 120, 220}, samples);
+  CHECK_EQ(samples.size(), 5);
+  check_sample(samples[3], 100, 4.0, 1);
+  check_sample(samples[4], 120, 5.0, 2);
+  // the rest end in order of their ends, directions one after the other
+  analyzer.EndInFlight(samples);
+  CHECK_EQ(samples.size(), 8);
+  check_sample(samples[5], 150, 1.0, 1);
+  check_sample(samples[6], 220, 0.0, 0);
+  check_sample(samples[7], 220, 0.0, 0);
+  CHECK_EQ(samples[7].copy_kind, DTOH);
+}
+
+int main()
+{
+  test_storm_window_is_inclusive();
+  test_directions_and_interruptions();
+  test_storm_count_is_clamped();
+  test_pageable_and_sync_flags();
+  test_bandwidth_extremes();
+  test_overlapping_copies_in_flight();
+  return TEST_EXIT_CODE();
+}
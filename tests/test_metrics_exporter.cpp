@@ -0,0 +1,188 @@
+// The metrics exporter answers one HTTP request per connection on its Unix
+// socket. Requests may come in pieces or end in bare newlines, a client
+// that sends nothing must not keep others waiting, and only GET of / and
+// /metrics is served. metrics_format escapes label values, caps the busy
+// ratio at 1 and, whatever the buffer size, ends with "# EOF" after whole
+// lines only.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string>
+
+#include "live_stats.h"
+#include "metrics_exporter.h"
+#include "test_check.h"
+
+static std::string socket_path;
+
+static int connect_exporter()
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, socket_path.c_str());
+  if (connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+    perror("connect");
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// sends the request in the given pieces, 20 ms apart, and reads the answer
+static std::string request(std::initializer_list<const char*> pieces)
+{
+  int fd = connect_exporter();
+  std::string response;
+  if (fd < 0)
+    return response;
+  for (const char* piece : pieces) {
+    if (write(fd, piece, strlen(piece)) != (ssize_t) strlen(piece))
+      perror("write");
+    usleep(20000);
+  }
+  char buffer[4096];
+  ssize_t count;
+  while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+    response.append(buffer, count);
+  }
+  close(fd);
+  return response;
+}
+
+static std::string status_line(const std::string& response)
+{
+  return response.substr(0, response.find("\r\n"));
+}
+
+static std::string body_of(const std::string& response)
+{
+  size_t start = response.find("\r\n\r\n");
+  return start == std::string::npos ? "" : response.substr(start + 4);
+}
+
+static bool ends_with(const std::string& text, const std::string& end)
+{
+  return text.size() >= end.size() && text.compare(text.size() - end.size(), end.size(), end) == 0;
+}
+
+static void test_requests()
+{
+  live_stats_begin_phase("forward");
+  live_stats_add_gpu("gemm", 3000000);
+  live_stats_end_phase("forward", 0, 10000000);
+
+  // the request line and headers in three pieces
+  std::string response = request({"GET /met", "rics HTTP/1.1\r\nHost: x\r\n", "\r\n"});
+  CHECK(status_line(response) == "HTTP/1.0 200 OK");
+  std::string body = body_of(response);
+  CHECK(response.find("Content-Length: " + std::to_string(body.size()) + "\r\n") != std::string::npos);
+  CHECK(body.find("smprofiler_phases_total{phase=\"forward\"} 1\n") != std::string::npos);
+  CHECK(body.find("smprofiler_phase_gpu_busy_ratio{phase=\"forward\"} 0.3\n") != std::string::npos);
+  CHECK(ends_with(body, "\n# EOF\n"));
+
+  // bare newlines, a query string and the root path
+  CHECK(status_line(request({"GET /metrics?name=x HTTP/1.0\n\n"})) == "HTTP/1.0 200 OK");
+  CHECK(status_line(request({"GET / HTTP/1.0\r\n\r\n"})) == "HTTP/1.0 200 OK");
+  CHECK(status_line(request({"GET /metricsz HTTP/1.0\r\n\r\n"})) == "HTTP/1.0 404 Not Found");
+  CHECK(status_line(request({"HEAD /metrics HTTP/1.0\r\n\r\n"})) == "HTTP/1.0 405 Method Not Allowed");
+}
+
+static void test_silent_client()
+{
+  // connects and sends nothing; the exporter gives up on it after its read
+  // timeout and serves the next one
+  int silent = connect_exporter();
+  CHECK(silent >= 0);
+  std::string response = request({"GET /metrics HTTP/1.0\r\n\r\n"});
+  CHECK(status_line(response) == "HTTP/1.0 200 OK");
+  char byte;
+  CHECK(read(silent, &byte, 1) == 0);
+  close(silent);
+}
+
+static void test_label_escaping()
+{
+  LiveStatsSnapshot* snapshot = new LiveStatsSnapshot();
+  snapshot->num_kernels = 1;
+  strcpy(snapshot->kernels[0].name, "void k<\"a\\b\">\n");
+  snapshot->kernels[0].count = 2;
+  MetricsIdentity identity = {1, -1, -1};
+  uint64_t perf_totals[2] = {0, 0};
+  char buffer[16 * 1024];
+  size_t length = metrics_format(buffer, sizeof(buffer), identity, *snapshot, perf_totals);
+  std::string text(buffer, length);
+  CHECK(text.find("smprofiler_kernel_launches_total{kernel=\"void k<\\\"a\\\\b\\\">\\n\"} 2\n") != std::string::npos);
+  CHECK(text.find("smprofiler_info{pid=\"1\",rank=\"-1\",local_rank=\"-1\"} 1\n") != std::string::npos);
+  delete snapshot;
+}
+
+static void test_busy_ratio_is_clamped()
+{
+  // kernels on two streams add up to more GPU time than the phase lasted
+  LiveStatsSnapshot* snapshot = new LiveStatsSnapshot();
+  snapshot->num_phases = 2;
+  snapshot->phases[0] = {"overlapped", 1, 10000000, 25000000, 10000000, 25000000};
+  snapshot->phases[1] = {"empty", 1, 0, 0, 0, 0};
+  MetricsIdentity identity = {1, 0, 0};
+  uint64_t perf_totals[2] = {0, 0};
+  char buffer[16 * 1024];
+  std::string text(buffer, metrics_format(buffer, sizeof(buffer), identity, *snapshot, perf_totals));
+  CHECK(text.find("smprofiler_phase_gpu_busy_ratio{phase=\"overlapped\"} 1\n") != std::string::npos);
+  CHECK(text.find("smprofiler_phase_gpu_busy_ratio{phase=\"empty\"} 0\n") != std::string::npos);
+  CHECK(live_stats_busy_ratio(3, 4) == 0.75);
+  delete snapshot;
+}
+
+static void test_every_buffer_size_ends_with_eof()
+{
+  LiveStatsSnapshot* snapshot = new LiveStatsSnapshot();
+  live_stats_snapshot(snapshot);
+  MetricsIdentity identity = {1, 0, 0};
+  uint64_t perf_totals[2] = {0, 0};
+  static char full[64 * 1024];
+  size_t full_length = metrics_format(full, sizeof(full), identity, *snapshot, perf_totals);
+
+  // too small for the marker, nothing at all
+  char tiny[6];
+  CHECK_EQ(metrics_format(tiny, sizeof(tiny), identity, *snapshot, perf_totals), 0);
+  CHECK_EQ(tiny[0], '\0');
+  // every size from the marker alone to the whole text: whole lines of the
+  // complete text, then the marker, and the terminating NUL in the buffer
+  static char buffer[64 * 1024];
+  for (size_t size = 7; size <= full_length + 1; size++) {
+    size_t length = metrics_format(buffer, size, identity, *snapshot, perf_totals);
+    std::string text(buffer, length);
+    if (length >= size || strlen(buffer) != length || !ends_with(text, "# EOF\n") ||
+        strncmp(full, buffer, length - 6) != 0 || (length > 6 && buffer[length - 7] != '\n')) {
+      printf("size %zu: bad text of %zu bytes\n", size, length);
+      CHECK(false);
+      break;
+    }
+  }
+  CHECK_EQ(metrics_format(buffer, full_length + 1, identity, *snapshot, perf_totals), full_length);
+  delete snapshot;
+}
+
+int main()
+{
+  socket_path = "/tmp/test_metrics_exporter_" + std::to_string(getpid()) + ".sock";
+  setenv("SMPROFILER_METRICS", "1", 1);
+  setenv("SMPROFILER_METRICS_SOCKET", socket_path.c_str(), 1);
+  live_stats_init();
+  metrics_exporter_init();
+  CHECK(metrics_exporter_enabled());
+
+  test_requests();
+  test_silent_client();
+  test_label_escaping();
+  test_busy_ratio_is_clamped();
+  test_every_buffer_size_ends_with_eof();
+
+  metrics_exporter_close();
+  CHECK(access(socket_path.c_str(), F_OK) != 0);
+  return TEST_EXIT_CODE();
+}
@@ -0,0 +1,123 @@
+// PcSamplingAggregator keys its fixed size table by (function, PC, stall
+// reason) while the summary groups by source line. Checks that the table
+// probes correctly when nearly full, that keys which no longer fit are only
+// counted, and that the summary merges PCs of one line, keeps PCs without a
+// line apart and names kernels it never got a FUNCTION record for.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+
+#include "pc_sampling.h"
+#include "test_check.h"
+
+static const char* stall_name(uint32_t reason)
+{
+  static const char* names[] = {"none", "memory", "sync", "branch"};
+  return reason < 4 ? names[reason] : "other";
+}
+
+static std::string summary_of(const PcSamplingAggregator& aggregator, size_t top_lines)
+{
+  char* text = NULL;
+  size_t size = 0;
+  FILE* file = open_memstream(&text, &size);
+  aggregator.Summary(file, top_lines, stall_name);
+  fclose(file);
+  std::string result(text, size);
+  free(text);
+  return result;
+}
+
+// the summary line containing key, empty if there is none
+static std::string line_with(const std::string& text, const std::string& key)
+{
+  size_t pos = text.find(key);
+  if (pos == std::string::npos) {
+    printf("no line with \"%s\" in:\n%s\n", key.c_str(), text.c_str());
+    return "";
+  }
+  size_t begin = text.rfind('\n', pos);
+  size_t end = text.find('\n', pos);
+  begin = begin == std::string::npos ? 0 : begin + 1;
+  return text.substr(begin, end - begin);
+}
+
+static bool has(const std::string& line, const std::string& part)
+{
+  if (line.find(part) != std::string::npos)
+    return true;
+  printf("\"%s\" lacks \"%s\"\n", line.c_str(), part.c_str());
+  return false;
+}
+
+static void test_probing_near_capacity()
+{
+  // 1000 keys in a table of 2048 slots, every key hit twice; stall reasons
+  // and PCs differ in the low bits only, so neighbouring keys collide
+  PcSamplingAggregator aggregator(1000);
+  for (int round = 0; round < 2; round++) {
+    for (uint32_t i = 0; i < 1000; i++)
+      aggregator.AddSample({i % 7, i / 4, 0, i % 4, 1, 0});
+  }
+  CHECK_EQ(aggregator.Size(), 1000);
+  CHECK_EQ(aggregator.Samples(), 2000);
+  CHECK_EQ(aggregator.Dropped(), 0);
+  // one more key does not fit, its samples are counted but not kept
+  aggregator.AddSample({99, 0, 0, 0, 5, 0});
+  CHECK_EQ(aggregator.Size(), 1000);
+  CHECK_EQ(aggregator.Samples(), 2005);
+  CHECK_EQ(aggregator.Dropped(), 5);
+}
+
+static void test_zero_capacity_keeps_one_key()
+{
+  PcSamplingAggregator aggregator(0);
+  aggregator.AddSample({1, 0x10, 0, 1, 3, 0});
+  aggregator.AddSample({1, 0x10, 0, 2, 4, 0});
+  aggregator.AddSample({1, 0x10, 0, 1, 3, 0});
+  CHECK_EQ(aggregator.Size(), 1);
+  CHECK_EQ(aggregator.Dropped(), 4);
+  CHECK(has(summary_of(aggregator, 1), "# 10 samples in 1 PCs, 4 not aggregated (table full)\n"));
+}
+
+static void test_summary_groups_by_line()
+{
+  PcSamplingAggregator aggregator;
+  // two PCs of gemm.cu:42 with different stalls, one PC without line info
+  aggregator.AddSample({1, 0x100, 7, 1, 30, 3});
+  aggregator.AddSample({1, 0x108, 7, 2, 10, 1});
+  aggregator.AddSample({1, 0x200, 0, 1, 10, 0});
+  // a kernel whose FUNCTION record never came
+  aggregator.AddSample({9, 0x40, 0, 3, 60, 0});
+  aggregator.AddFunction(1, "gemm");
+  aggregator.AddSourceLocator(7, "gemm.cu", 42);
+  aggregator.AddRecordInfo(120, 20);
+
+  std::string text = summary_of(aggregator, 5);
+  CHECK(has(text, "# 110 samples in 4 PCs, 0 not aggregated (table full), CUPTI dropped 20 of 120\n"));
+  // kernels ranked by samples
+  CHECK(text.find("function 9") < text.find("gemm"));
+  CHECK(has(line_with(text, "function 9"), " 54.5%"));
+  CHECK(has(line_with(text, "branch 100.0%"), "function 9"));
+  CHECK(has(line_with(text, "  gemm  "), "memory 80.0%, sync 20.0%"));
+  // both PCs of the line together, the PC without a line on its own
+  std::string line = line_with(text, "gemm.cu:42");
+  CHECK(has(line, " 40 ") && has(line, " 80.0%"));
+  CHECK(has(line, "memory 75.0%, sync 25.0%"));
+  line = line_with(text, "pc 0x200");
+  CHECK(has(line, " 10 ") && has(line, " 20.0%"));
+  CHECK(text.find("pc 0x100") == std::string::npos);
+
+  // only the hottest line with top_lines 1
+  text = summary_of(aggregator, 1);
+  CHECK(text.find("gemm.cu:42") != std::string::npos);
+  CHECK(text.find("pc 0x200") == std::string::npos);
+}
+
+int main()
+{
+  test_probing_near_capacity();
+  test_zero_capacity_keeps_one_key();
+  test_summary_groups_by_line();
+  return TEST_EXIT_CODE();
+}
@@ -0,0 +1,116 @@
+// tsc_clock is set up when smprofiler.so is loaded, so each configuration
+// runs in a re-executed copy of this test with its environment: the
+// CLOCK_MONOTONIC fallback forced by SMPROFILER_TSC=0, whose conversion is
+// a fixed offset, and the TSC recalibrated every millisecond, under which
+// successive readings must never convert to earlier times and a reading
+// taken before many recalibrations must still convert to the same time.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "test_check.h"
+#include "tsc_clock.h"
+
+static uint64_t realtime_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_ms(long ms)
+{
+  struct timespec wait = {ms / 1000, (ms % 1000) * 1000000};
+  nanosleep(&wait, NULL);
+}
+
+// converted times are wall clock times
+static void check_anchored()
+{
+  uint64_t before = realtime_ns();
+  uint64_t ns = tsc_clock_to_ns(tsc_clock_now());
+  uint64_t after = realtime_ns();
+  CHECK(ns + 50000000 > before && ns < after + 50000000);
+  CHECK(tsc_clock_epoch_micros() / 1000000 - before / 1000000000 <= 1);
+}
+
+static void fallback()
+{
+  CHECK(!tsc_clock_uses_tsc());
+  check_anchored();
+  // ticks are nanoseconds, the conversion only adds the wall clock offset
+  uint64_t first = tsc_clock_now();
+  sleep_ms(5);
+  uint64_t second = tsc_clock_now();
+  CHECK(second - first >= 5000000);
+  CHECK_EQ(tsc_clock_to_ns(second) - tsc_clock_to_ns(first), second - first);
+}
+
+static void recalibrated()
+{
+  if (!tsc_clock_uses_tsc()) {
+    printf("no invariant TSC, skipped\n");
+    return;
+  }
+  check_anchored();
+  uint64_t early = tsc_clock_now();
+  uint64_t early_ns = tsc_clock_to_ns(early);
+  // every conversion of a later reading may recalibrate, and a new
+  // frequency must not put a reading before the one converted just before
+  uint64_t last_ns = early_ns;
+  int backwards = 0;
+  for (int i = 0; i < 100; i++) {
+    sleep_ms(2);
+    for (int j = 0; j < 100; j++) {
+      uint64_t ns = tsc_clock_to_ns(tsc_clock_now());
+      backwards += ns < last_ns;
+      last_ns = ns;
+    }
+  }
+  CHECK_EQ(backwards, 0);
+  // the early reading is converted backwards from the newest calibration
+  uint64_t again_ns = tsc_clock_to_ns(early);
+  int64_t drift = (int64_t) (again_ns - early_ns);
+  if (drift < -20000 || drift > 20000)
+    printf("early reading moved by %lld ns\n", (long long) drift);
+  CHECK(drift >= -20000 && drift <= 20000);
+  check_anchored();
+}
+
+// runs this test again with one more variable set and the mode as argument
+static void run_with(const char* name, const char* value, char* self, const char* mode)
+{
+  printf("%s=%s:\n", name, value);
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    setenv(name, value, 1);
+    char* args[] = {self, (char*) mode, NULL};
+    execv("/proc/self/exe", args);
+    perror("execv");
+    _exit(2);
+  }
+  int status = 0;
+  CHECK(waitpid(pid, &status, 0) == pid);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+int main(int argc, char** argv)
+{
+  if (argc > 1 && strcmp(argv[1], "fallback") == 0) {
+    fallback();
+    return TEST_EXIT_CODE();
+  }
+  if (argc > 1 && strcmp(argv[1], "recalibrated") == 0) {
+    recalibrated();
+    return TEST_EXIT_CODE();
+  }
+  printf("clock source: %s\n", tsc_clock_uses_tsc() ? "TSC" : "CLOCK_MONOTONIC");
+  check_anchored();
+  run_with("SMPROFILER_TSC", "0", argv[0], "fallback");
+  run_with("SMPROFILER_TSC_CALIBRATE_MS", "1", argv[0], "recalibrated");
+  return TEST_EXIT_CODE();
+}
@@ -0,0 +1,368 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sstream>
+
+#include "trace_index.h"
+#include "compressed_trace_file.h"
+
+#define ZSTD_FRAME_MAGIC (0xFD2FB528)
+#define LZ4_FRAME_MAGIC (0x184D2204)
+// skippable frame magic, 0x184D2A50 to 0x184D2A5F are skipped by zstd and lz4
+#define SKIPPABLE_FRAME_MAGIC (0x184D2A5E)
+// length of the index and TRACE_INDEX_MAGIC
+#define TRACE_INDEX_TRAILER_SIZE (16)
+// the offset event of plain JSON files fits in this
+#define TRACE_INDEX_JSON_TAIL (256)
+
+void TraceIndex::Reset()
+{
+  phases_.clear();
+  blocks_.clear();
+  current_ = TraceIndexBlock();
+  block_bytes_ = 0;
+}
+
+void TraceIndex::AddPhase(int id, const std::string& name)
+{
+  phases_[id] = name;
+}
+
+void TraceIndex::AddEvent(int64_t ts, int64_t end, int phase, bool metadata, size_t bytes)
+{
+  if (block_bytes_ == 0) {
+    current_ = TraceIndexBlock();
+    current_.min_ts = ts;
+    current_.max_ts = end;
+  }
+  current_.min_ts = std::min(current_.min_ts, ts);
+  current_.max_ts = std::max(current_.max_ts, end);
+  current_.metadata |= metadata;
+  current_.phases.insert(phase);
+  block_bytes_ += bytes;
+}
+
+void TraceIndex::EndBlock()
+{
+  if (block_bytes_ == 0)
+    return;
+  blocks_.push_back(current_);
+  block_bytes_ = 0;
+}
+
+std::string TraceIndex::Text(const std::vector<uint64_t>& block_ends) const
+{
+  std::ostringstream text;
+  text << "smprofiler-index 1\n";
+  for (auto& phase : phases_) {
+    // the index is embedded in a JSON string and read line by line
+    std::string name = phase.second;
+    for (char& c : name) {
+      if (c == '"' || c == '\\' || c == '\n')
+        c = '_';
+    }
+    text << "phase " << phase.first << " " << name << "\n";
+  }
+  for (size_t i = 0; i < blocks_.size() && i < block_ends.size(); i++) {
+    const TraceIndexBlock& block = blocks_[i];
+    uint64_t offset = i > 0 ? block_ends[i - 1] : 0;
+    text << "block " << offset << " " << block_ends[i] - offset << " " << block.min_ts << " " << block.max_ts
+         << " " << (block.metadata ? 1 : 0) << " ";
+    const char* separator = "";
+    for (int phase : block.phases) {
+      text << separator << phase;
+      separator = ",";
+    }
+    text << "\n";
+  }
+  return text.str();
+}
+
+std::string TraceIndex::JsonFooter(const std::vector<uint64_t>& block_ends, uint64_t offset) const
+{
+  std::string text = Text(block_ends);
+  std::string escaped;
+  for (char c : text) {
+    if (c == '\n')
+      escaped += "\\n";
+    else
+      escaped += c;
+  }
+  // offset points past the separator, at the index event
+  std::ostringstream footer;
+  footer << ",\n{\"name\": \"smprofiler_index\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"index\": \""
+         << escaped << "\"}}";
+  footer << ",\n{\"name\": \"smprofiler_index_offset\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"offset\": "
+         << offset + 2 << "}}";
+  footer << "\n]\n";
+  return footer.str();
+}
+
+std::string TraceIndex::SkippableFrame(const std::vector<uint64_t>& block_ends) const
+{
+  std::string text = Text(block_ends);
+  uint64_t text_size = text.size();
+  uint32_t magic = SKIPPABLE_FRAME_MAGIC;
+  uint32_t frame_size = text_size + TRACE_INDEX_TRAILER_SIZE;
+  std::string frame;
+  frame.append((const char*) &magic, sizeof(magic));
+  frame.append((const char*) &frame_size, sizeof(frame_size));
+  frame += text;
+  frame.append((const char*) &text_size, sizeof(text_size));
+  frame.append(TRACE_INDEX_MAGIC, 8);
+  return frame;
+}
+
+bool TraceReader::Open(const std::string& path)
+{
+  path_ = path;
+  blocks_.clear();
+  phases_.clear();
+  indexed_ = false;
+  if (file_.is_open())
+    file_.close();
+  file_.open(path, std::ios::binary);
+  if (!file_.is_open())
+    return false;
+  file_.seekg(0, std::ios::end);
+  file_size_ = file_.tellg();
+
+  std::string head;
+  uint32_t magic = 0;
+  if (ReadRange(0, std::min(file_size_, (uint64_t) sizeof(magic)), head) && head.size() == sizeof(magic))
+    memcpy(&magic, head.data(), sizeof(magic));
+  compressed_ = magic == ZSTD_FRAME_MAGIC || magic == LZ4_FRAME_MAGIC;
+  indexed_ = ReadIndex();
+  return true;
+}
+
+bool TraceReader::ReadRange(uint64_t offset, uint64_t size, std::string& data)
+{
+  data.resize(size);
+  file_.clear();
+  file_.seekg(offset);
+  file_.read(&data[0], size);
+  return (uint64_t) file_.gcount() == size;
+}
+
+bool TraceReader::ReadIndex()
+{
+  std::string data;
+  if (compressed_) {
+    if (file_size_ < TRACE_INDEX_TRAILER_SIZE || !ReadRange(file_size_ - TRACE_INDEX_TRAILER_SIZE, TRACE_INDEX_TRAILER_SIZE, data))
+      return false;
+    if (memcmp(data.data() + 8, TRACE_INDEX_MAGIC, 8) != 0)
+      return false;
+    uint64_t text_size;
+    memcpy(&text_size, data.data(), sizeof(text_size));
+    if (text_size > file_size_ - TRACE_INDEX_TRAILER_SIZE)
+      return false;
+    return ReadRange(file_size_ - TRACE_INDEX_TRAILER_SIZE - text_size, text_size, data) && ParseIndex(data);
+  }
+
+  uint64_t tail = std::min(file_size_, (uint64_t) TRACE_INDEX_JSON_TAIL);
+  if (!ReadRange(file_size_ - tail, tail, data))
+    return false;
+  const char* key = "\"smprofiler_index_offset\", \"ph\": \"M\", \"pid\": 0, \"args\": {\"offset\": ";
+  size_t pos = data.rfind(key);
+  if (pos == std::string::npos)
+    return false;
+  uint64_t offset = strtoull(data.c_str() + pos + strlen(key), NULL, 10);
+  uint64_t end = file_size_ - tail + pos;
+  if (offset >= end || !ReadRange(offset, end - offset, data))
+    return false;
+  key = "\"index\": \"";
+  pos = data.find(key);
+  size_t close = data.rfind("\"}}");
+  if (pos == std::string::npos || close == std::string::npos || close < pos)
+    return false;
+  std::string text;
+  for (size_t i = pos + strlen(key); i < close; i++) {
+    if (data[i] == '\\' && i + 1 < close && data[i + 1] == 'n') {
+      text += '\n';
+      i++;
+    } else {
+      text += data[i];
+    }
+  }
+  return ParseIndex(text);
+}
+
+bool TraceReader::ParseIndex(const std::string& text)
+{
+  std::istringstream lines(text);
+  std::string line;
+  if (!std::getline(lines, line) || line != "smprofiler-index 1")
+    return false;
+  while (std::getline(lines, line)) {
+    if (line.compare(0, 6, "phase ") == 0) {
+      char* name;
+      int id = strtol(line.c_str() + 6, &name, 10);
+      phases_[id] = *name == ' ' ? name + 1 : name;
+    } else if (line.compare(0, 6, "block ") == 0) {
+      TraceIndexBlock block;
+      unsigned long long offset, size;
+      long long min_ts, max_ts;
+      int metadata, used;
+      if (sscanf(line.c_str() + 6, "%llu %llu %lld %lld %d %n", &offset, &size, &min_ts, &max_ts, &metadata, &used) < 5)
+        return false;
+      block.offset = offset;
+      block.size = size;
+      block.min_ts = min_ts;
+      block.max_ts = max_ts;
+      block.metadata = metadata != 0;
+      const char* phases = line.c_str() + 6 + used;
+      while (*phases) {
+        char* next;
+        block.phases.insert(strtol(phases, &next, 10));
+        if (next == phases)
+          break;
+        phases = *next == ',' ? next + 1 : next;
+      }
+      blocks_.push_back(block);
+    }
+  }
+  return true;
+}
+
+bool TraceReader::ReadBlock(const TraceIndexBlock& block, std::string& text)
+{
+  std::string data;
+  if (!ReadRange(block.offset, block.size, data))
+    return false;
+  if (!compressed_) {
+    text = std::move(data);
+    return true;
+  }
+  return trace_file_decode(data, text);
+}
+
+// value of the first "key": <number> in an event, which is the top level
+// one as the timeline writer puts args last
+static bool event_field(const std::string& event, const char* key, long long& value)
+{
+  size_t pos = event.find(key);
+  if (pos == std::string::npos)
+    return false;
+  value = strtoll(event.c_str() + pos + strlen(key), NULL, 10);
+  return true;
+}
+
+static bool starts_with(const std::string& event, const char* prefix)
+{
+  return event.compare(0, strlen(prefix), prefix) == 0;
+}
+
+// Keeps the events of text in the window and phase. Events of a phase are
+// recognized by the pid its process_name event gives it, which precedes
+// them in the file.
+static void filter_events(const std::string& text, int64_t start, int64_t end, const std::string& phase,
+                          std::set<long long>& phase_pids, std::vector<std::string>& events)
+{
+  std::istringstream lines(text);
+  std::string line;
+  while (std::getline(lines, line)) {
+    // events are separated by ",\n", "[" and "]" open and close the file
+    size_t first = line.find('{');
+    size_t last = line.rfind('}');
+    if (first == std::string::npos || last == std::string::npos)
+      continue;
+    std::string event = line.substr(first, last - first + 1);
+    if (starts_with(event, "{\"name\": \"smprofiler_index"))
+      continue;
+
+    long long pid = 0;
+    event_field(event, "\"pid\": ", pid);
+    if (event.find("\"ph\": \"M\"") != std::string::npos) {
+      if (!phase.empty() && starts_with(event, "{\"name\": \"process_name\"") &&
+          event.find("\"args\": {\"name\": \"" + phase + "\"}") != std::string::npos)
+        phase_pids.insert(pid);
+      if (phase.empty() || pid == 0 || phase_pids.count(pid))
+        events.push_back(event);
+      continue;
+    }
+
+    if (!phase.empty() && !phase_pids.count(pid))
+      continue;
+    long long ts = 0, dur = 0;
+    event_field(event, "\"ts\": ", ts);
+    event_field(event, "\"dur\": ", dur);
+    if ((start >= 0 && ts + dur < start) || (end >= 0 && ts > end))
+      continue;
+    events.push_back(event);
+  }
+}
+
+// Passes the text of a file without an index to visit in pieces of whole
+// lines, reading TRACE_FILE_CHUNK_SIZE bytes at a time; an event cut by a
+// chunk boundary is held back until the rest of its line is read.
+static bool scan_lines(const std::string& path, const std::function<void(const std::string& text)>& visit)
+{
+  std::string pending;
+  bool ok = trace_file_scan(path, TRACE_FILE_CHUNK_SIZE, [&](const char* data, size_t size) {
+    pending.append(data, size);
+    size_t end = pending.rfind('\n');
+    if (end == std::string::npos)
+      return;
+    visit(pending.substr(0, end + 1));
+    pending.erase(0, end + 1);
+  });
+  if (!pending.empty())
+    visit(pending);
+  return ok;
+}
+
+int TraceReader::Query(int64_t start, int64_t end, const std::string& phase, std::vector<std::string>& events)
+{
+  std::set<long long> phase_pids;
+  if (!indexed_) {
+    return scan_lines(path_, [&](const std::string& text) {
+      filter_events(text, start, end, phase, phase_pids, events);
+    }) ? 1 : -1;
+  }
+
+  int phase_id = -1;
+  for (auto& entry : phases_) {
+    if (entry.second == phase)
+      phase_id = entry.first;
+  }
+  std::string text;
+  int blocks_read = 0;
+  for (const TraceIndexBlock& block : blocks_) {
+    // metadata names the phases and threads of the events, always read it
+    if (!block.metadata) {
+      if ((start >= 0 && block.max_ts < start) || (end >= 0 && block.min_ts > end))
+        continue;
+      if (!phase.empty() && !block.phases.count(phase_id))
+        continue;
+    }
+    if (!ReadBlock(block, text))
+      return -1;
+    filter_events(text, start, end, phase, phase_pids, events);
+    blocks_read++;
+  }
+  return blocks_read;
+}
+
+int TraceReader::Scan(const std::function<void(const std::string& event)>& visit)
+{
+  std::set<long long> phase_pids;
+  std::vector<std::string> events;
+  auto visit_text = [&](const std::string& text) {
+    events.clear();
+    filter_events(text, -1, -1, "", phase_pids, events);
+    for (const std::string& event : events)
+      visit(event);
+  };
+  if (!indexed_)
+    return scan_lines(path_, visit_text) ? 1 : -1;
+
+  std::string text;
+  for (const TraceIndexBlock& block : blocks_) {
+    if (!ReadBlock(block, text))
+      return -1;
+    visit_text(text);
+  }
+  return (int) blocks_.size();
+}
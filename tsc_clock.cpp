@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <time.h>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+#include "smprofiler_config.h"
+#include "tsc_clock.h"
+
+// how long the startup calibration waits, and the frequencies it accepts
+#define TSC_STARTUP_CALIBRATION_NS (2000000)
+#define TSC_MIN_HZ (100000000.0)
+#define TSC_MAX_HZ (10000000000.0)
+
+bool tsc_clock_use_tsc = false;
+
+static std::mutex mutex;
+static bool initialized = false;
+// CLOCK_REALTIME - CLOCK_MONOTONIC at startup
+static int64_t realtime_offset_ns = 0;
+// first calibration point, every recalibration measures from it
+static uint64_t first_ticks;
+static uint64_t first_ns;
+// ns = base_ns + (ticks - base_ticks) * mult >> 32, guarded by mutex
+static uint64_t base_ticks;
+static uint64_t base_ns;
+static uint64_t mult;
+static uint64_t calibrate_interval_ticks;
+static uint64_t next_calibration_ticks;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool invariant_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (edx & (1 << 8)) != 0;
+#else
+  return false;
+#endif
+}
+
+// a TSC reading and the CLOCK_MONOTONIC time it was taken at, from the
+// tightest of a few attempts
+static void read_pair(uint64_t* ticks, uint64_t* ns)
+{
+  uint64_t best_window = UINT64_MAX;
+  for (int i = 0; i < 5; i++) {
+    uint64_t before = clock_ns(CLOCK_MONOTONIC);
+    uint64_t t = tsc_clock_now();
+    uint64_t after = clock_ns(CLOCK_MONOTONIC);
+    if (after - before < best_window) {
+      best_window = after - before;
+      *ticks = t;
+      *ns = before + (after - before) / 2;
+    }
+  }
+}
+
+// mult from the first calibration point to (ticks, ns), 0 if implausible
+static uint64_t calibrate(uint64_t ticks, uint64_t ns)
+{
+  if (ticks <= first_ticks || ns <= first_ns)
+    return 0;
+  double hz = (double) (ticks - first_ticks) * 1e9 / (ns - first_ns);
+  if (hz < TSC_MIN_HZ || hz > TSC_MAX_HZ)
+    return 0;
+  return (uint64_t) (((unsigned __int128) (ns - first_ns) << 32) / (ticks - first_ticks));
+}
+
+void tsc_clock_init()
+{
+  std::lock_guard<std::mutex> guard(mutex);
+  if (initialized)
+    return;
+  initialized = true;
+  realtime_offset_ns = (int64_t) (clock_ns(CLOCK_REALTIME) - clock_ns(CLOCK_MONOTONIC));
+  if (!smprofiler_config_flag("SMPROFILER_TSC", true) || !invariant_tsc())
+    return;
+
+  tsc_clock_use_tsc = true;
+  read_pair(&first_ticks, &first_ns);
+  struct timespec wait = {0, TSC_STARTUP_CALIBRATION_NS};
+  nanosleep(&wait, NULL);
+  read_pair(&base_ticks, &base_ns);
+  mult = calibrate(base_ticks, base_ns);
+  if (mult == 0) {
+    printf("smprofiler: TSC calibration failed, using clock_gettime\n");
+    tsc_clock_use_tsc = false;
+    return;
+  }
+  double hz = (double) (1ULL << 32) * 1e9 / mult;
+  calibrate_interval_ticks = (uint64_t) (hz / 1000 * smprofiler_config_int("SMPROFILER_TSC_CALIBRATE_MS", 1000));
+  next_calibration_ticks = base_ticks + calibrate_interval_ticks;
+  printf("smprofiler: timestamps from TSC at %.3f GHz\n", hz / 1e9);
+}
+
+bool tsc_clock_uses_tsc()
+{
+  return tsc_clock_use_tsc;
+}
+
+// ns of ticks on the current calibration, guarded by mutex; readings taken
+// before the last calibration are converted backwards
+static int64_t convert(uint64_t ticks)
+{
+  __int128 delta = (__int128) ticks - (__int128) base_ticks;
+  return (int64_t) base_ns + (int64_t) ((delta * (__int128) mult) >> 32);
+}
+
+uint64_t tsc_clock_to_ns(uint64_t ticks)
+{
+  if (!tsc_clock_use_tsc)
+    return ticks + realtime_offset_ns;
+  std::lock_guard<std::mutex> guard(mutex);
+  if (ticks >= next_calibration_ticks) {
+    // the longer the window the more precise the frequency
+    uint64_t now_ticks, now_ns;
+    read_pair(&now_ticks, &now_ns);
+    uint64_t refined = calibrate(now_ticks, now_ns);
+    if (refined != 0) {
+      // the new frequency continues from the time the old one gives now
+      // rather than the measured one, which may be earlier and would step
+      // conversions back; the difference is carried on as an offset
+      base_ns = convert(now_ticks);
+      base_ticks = now_ticks;
+      mult = refined;
+    }
+    next_calibration_ticks = now_ticks + calibrate_interval_ticks;
+  }
+  return convert(ticks) + realtime_offset_ns;
+}
+
+uint64_t tsc_clock_epoch_micros()
+{
+  return tsc_clock_to_ns(tsc_clock_now()) / 1000;
+}
@@ -0,0 +1,64 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <string>
+#include <thread>
+
+#include "profiler_thread.h"
+#include "smprofiler_config.h"
+#include "smprofiler_timeline.h"
+#include "tsc_clock.h"
+#include "worker_monitor.h"
+
+static const char* WORKER_TRACK = "dataloader_workers";
+
+static long interval_ms = 0;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sample_loop()
+{
+  profiler_thread_setup("worker");
+  Timeline& tl = Timeline::getInstance();
+  struct timespec wait = {interval_ms / 1000, (interval_ms % 1000) * 1000000};
+  uint64_t last_ticks = tsc_clock_now();
+  uint64_t last_wall_ns = clock_ns(CLOCK_MONOTONIC);
+  uint64_t last_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+  for (;;) {
+    nanosleep(&wait, NULL);
+    uint64_t ticks = tsc_clock_now();
+    uint64_t wall_ns = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    // idle intervals are left out, a worker waiting for work leaves a gap
+    if (cpu_ns > last_cpu_ns && wall_ns > last_wall_ns) {
+      char args[128];
+      snprintf(args, sizeof(args), ", \"cpu_us\":%lu, \"utilization\":%.3f",
+               (unsigned long) ((cpu_ns - last_cpu_ns) / 1000),
+               (double) (cpu_ns - last_cpu_ns) / (wall_ns - last_wall_ns));
+      tl.SMRecordCpuEvent(WORKER_TRACK, "cpu", last_ticks, ticks, args);
+    }
+    last_ticks = ticks;
+    last_wall_ns = wall_ns;
+    last_cpu_ns = cpu_ns;
+  }
+}
+
+// The sampler runs only in the child; the timeline already routes the
+// child's events to the parent.
+static void after_fork_child()
+{
+  std::thread(sample_loop).detach();
+}
+
+void worker_monitor_init()
+{
+  interval_ms = smprofiler_config_int("SMPROFILER_WORKER_CPU_MS", 100);
+  if (interval_ms <= 0)
+    return;
+  pthread_atfork(NULL, NULL, after_fork_child);
+}